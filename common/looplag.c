@@ -0,0 +1,220 @@
+#include "looplag.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(WIN32) || defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define snprintf _snprintf
+#endif
+
+#define SUB_COUNT (1u << LOOPLAG_SUB_BITS)
+
+static unsigned msb(uint64_t v)
+{
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll(v);
+#else
+	unsigned e = 0;
+
+	while (v >>= 1)
+		++e;
+
+	return e;
+#endif
+}
+
+static unsigned bucket_index(uint64_t v)
+{
+	unsigned e;
+
+	if (v < SUB_COUNT)
+		return (unsigned)v;
+
+	e = msb(v);
+
+	return ((e - LOOPLAG_SUB_BITS + 1) << LOOPLAG_SUB_BITS)
+		+ (unsigned)((v >> (e - LOOPLAG_SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/* middle of the bucket */
+static uint64_t bucket_value(unsigned ix)
+{
+	unsigned e;
+	uint64_t lo, width;
+
+	if (ix < SUB_COUNT)
+		return ix;
+
+	e     = (ix >> LOOPLAG_SUB_BITS) + LOOPLAG_SUB_BITS - 1;
+	width = (uint64_t)1 << (e - LOOPLAG_SUB_BITS);
+	lo    = ((uint64_t)1 << e) + (ix & (SUB_COUNT - 1)) * width;
+
+	return lo + width / 2;
+}
+
+static void hist_add(struct looplag_hist *h, uint64_t v)
+{
+	++h->count[bucket_index(v)];
+	++h->n;
+	h->sum += v;
+
+	if (v > h->max)
+		h->max = v;
+}
+
+/* monotonic [ns] */
+uint64_t looplag_now(void)
+{
+#if defined(WIN32) || defined(_WIN32)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER c;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+
+	QueryPerformanceCounter(&c);
+
+	return (uint64_t)(c.QuadPart / freq.QuadPart) * 1000000000ULL
+		+ (uint64_t)(c.QuadPart % freq.QuadPart) * 1000000000ULL
+		/ (uint64_t)freq.QuadPart;
+#else
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+void looplag_reset(struct looplag *ll)
+{
+	if (!ll)
+		return;
+
+	memset(ll, 0, sizeof(*ll));
+}
+
+/* due on the clock of looplag_now(), 0 when the loop may sleep forever */
+void looplag_arm(struct looplag *ll, uint64_t due)
+{
+	if (!ll)
+		return;
+
+	ll->due = due;
+}
+
+void looplag_arm_in(struct looplag *ll, uint64_t delay_ns)
+{
+	looplag_arm(ll, looplag_now() + delay_ns);
+}
+
+/* first thing after the loop is woken */
+void looplag_begin(struct looplag *ll)
+{
+	uint64_t now;
+
+	if (!ll)
+		return;
+
+	now = looplag_now();
+
+	if (ll->due) {
+		if (now >= ll->due)
+			hist_add(&ll->lag, now - ll->due);
+		else
+			++ll->early;
+
+		ll->due = 0;
+	}
+
+	ll->t_wake = now;
+}
+
+/* last thing before the loop blocks again */
+void looplag_end(struct looplag *ll)
+{
+	uint64_t now;
+
+	if (!ll || !ll->t_wake)
+		return;
+
+	now = looplag_now();
+
+	hist_add(&ll->run, now - ll->t_wake);
+	ll->t_wake = 0;
+}
+
+/* pct in [0, 100]; the result is clamped to the recorded max */
+uint64_t looplag_percentile(const struct looplag_hist *h, double pct)
+{
+	uint64_t rank, seen = 0, v;
+	unsigned i;
+
+	if (!h || !h->n)
+		return 0;
+
+	rank = (uint64_t)(pct / 100.0 * h->n + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > h->n)
+		rank = h->n;
+
+	for (i = 0; i < LOOPLAG_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen >= rank)
+			break;
+	}
+
+	v = bucket_value(i);
+
+	return v < h->max ? v : h->max;
+}
+
+static int hist_snprint(char *buf, size_t size, const struct looplag_hist *h)
+{
+	if (!h->n)
+		return snprintf(buf, size, "no samples");
+
+	return snprintf(buf, size, "p50 %.1f us, p99 %.1f us, max %.1f us",
+			looplag_percentile(h, 50) / 1e3,
+			looplag_percentile(h, 99) / 1e3,
+			h->max / 1e3);
+}
+
+/* one line; a result of size or more means it was cut */
+int looplag_snprint(char *buf, size_t size, const struct looplag *ll)
+{
+	size_t len = 0;
+	int n;
+
+	if (!buf || !size || !ll)
+		return -1;
+
+#define APPEND(expr)						\
+	do {							\
+		n = (expr);					\
+		if (n < 0)					\
+			return n;				\
+		len += (size_t)n;				\
+		if (len >= size)				\
+			return (int)len;			\
+	} while (0)
+
+	APPEND(snprintf(buf, size, "wakeup lag "));
+	APPEND(hist_snprint(buf + len, size - len, &ll->lag));
+	APPEND(snprintf(buf + len, size - len,
+			" (%llu timed, %llu by I/O); run ",
+			(unsigned long long)ll->lag.n,
+			(unsigned long long)ll->early));
+	APPEND(hist_snprint(buf + len, size - len, &ll->run));
+
+#undef APPEND
+
+	return (int)len;
+}
@@ -0,0 +1,60 @@
+#ifndef MY_LOOPLAG_H_INCLUIDO
+#define MY_LOOPLAG_H_INCLUIDO
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* sub-buckets per power of two; 2^3 keeps the error below ~6% */
+#define LOOPLAG_SUB_BITS 3
+#define LOOPLAG_BUCKETS ((64 - LOOPLAG_SUB_BITS + 1) << LOOPLAG_SUB_BITS)
+
+/*
+ * Log-linear histogram of nanoseconds, for the programs without one of
+ * their own; tperf records its loop in tperf_hist instead.
+ */
+struct looplag_hist {
+	uint64_t count[LOOPLAG_BUCKETS];
+	uint64_t n;
+	uint64_t sum;
+	uint64_t max;
+};
+
+/*
+ * Event-loop lag monitor. Before the loop blocks, the time it ought to
+ * wake up at is armed; when it wakes, the delay past that time and then
+ * the run time of what the wakeup dispatched are recorded.
+ *
+ * A wakeup before the armed time came from I/O and has no lag; it is
+ * only counted. With a high lag the loop, and not the network, decides
+ * when things happen; with a run time close to the period of the loop
+ * it has no time left to wait.
+ *
+ * Not locked; one loop owns it, a reader from another thread may see a
+ * sample half recorded.
+ */
+struct looplag {
+	struct looplag_hist lag;   /* past the armed time [ns] */
+	struct looplag_hist run;   /* wakeup to blocking again [ns] */
+	uint64_t due;              /* armed wakeup, 0 for none */
+	uint64_t t_wake;           /* 0 outside of a wakeup */
+	uint64_t early;            /* woken by I/O before due */
+};
+
+uint64_t looplag_now(void);
+void     looplag_reset(struct looplag *ll);
+void     looplag_arm(struct looplag *ll, uint64_t due);
+void     looplag_arm_in(struct looplag *ll, uint64_t delay_ns);
+void     looplag_begin(struct looplag *ll);
+void     looplag_end(struct looplag *ll);
+uint64_t looplag_percentile(const struct looplag_hist *h, double pct);
+int      looplag_snprint(char *buf, size_t size, const struct looplag *ll);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
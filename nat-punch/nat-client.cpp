@@ -16,6 +16,7 @@
 #include "nat-reg.h"
 #include "nat-util.h"
 #include "nat-port.h"
+#include "looplag.h"
 
 
 PeerId me;
@@ -27,6 +28,15 @@ usage()
   exit( 1 );
 }
 
+void
+PrintLoopLag( struct looplag const * ll )
+{
+  char buf[ 256 ];
+  if( looplag_snprint( buf, sizeof( buf ), ll ) >= 0 ) {
+    fprintf( stderr, "Loop: %s\n", buf );
+  }
+}
+
 void
 RegisterWithIntroducer( SOCKET sock, struct sockaddr_in const * srv )
 {
@@ -156,9 +166,13 @@ main( int argc, char * argv[] )
 
   // set up the state machine
   time_t then = 0;
+  time_t shown;
   time_t now;
   fd_set rdSet;
   struct timeval tv;
+  // a late select() delays registration and peer replies alike
+  static struct looplag lag;
+  time( &shown );
 
   // enter the state machine
   while( true ) {
@@ -166,7 +180,9 @@ main( int argc, char * argv[] )
     FD_SET( cliSock, &rdSet );
     tv.tv_sec = 1;
     tv.tv_usec = 0;
+    looplag_arm_in( &lag, 1000000000ULL );
     int out = DIE_IF_ERR( select( (int)cliSock+1, &rdSet, NULL, NULL, &tv ) );
+    looplag_begin( &lag );
     if( (out > 0) && FD_ISSET( cliSock, &rdSet ) ) {
       // process an incoming message, which is either a registration reply, or a peer-to-peer message
       ReadAndProcessIncomingMessage( cliSock );
@@ -177,6 +193,11 @@ main( int argc, char * argv[] )
       // try registering with the introducer
       RegisterWithIntroducer( cliSock, &sinServer );
     }
+    if( now-shown >= 60 ) {
+      shown = now;
+      PrintLoopLag( &lag );
+    }
+    looplag_end( &lag );
   }
   return 0;
 }
@@ -5,9 +5,26 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <re.h>
 
 #include "tperf_util.h"
+#include "tperf_verify.h"
+#include "tperf_sweep.h"
+#include "tperf_churn.h"
+#include "tperf_out.h"
+#include "tperf_traffic.h"
+#include "tperf_res.h"
+#include "tperf_srv.h"
+#include "tperf_tcprelay.h"
+#include "tperf_matrix.h"
+#include "tperf_tlsres.h"
+#include "tperf_procs.h"
+#include "tperf_soak.h"
 
 static struct {
 	const char *user, *pass;
@@ -18,8 +35,60 @@ static struct {
 	size_t psize;
 	struct tmr tmr_grace;
 	struct tls *tls;
-	struct stun_dns *dns;
+	struct srvlist servers;
+	bool tcprelay;             /* RFC 6062 TCP allocations */
+	struct tcprelay tr;
+	bool matrix;               /* every transport and framing in turn */
+	struct matrix mx;
+	struct tls *tls_stream;    /* contexts of the TLS and DTLS cells */
+	struct tls *tls_dgram;
+	uint16_t tls_port;         /* TURN server port of those cells */
+	bool no_resume;            /* a full handshake for every allocation */
+	struct tlsres tlsr_stream; /* of the TLS and the DTLS context */
+	struct tlsres tlsr_dgram;
 	bool turn_ind;
+	unsigned burst;
+	unsigned threads;
+	unsigned peer_socks;       /* shared peer sockets, 0 for per-alloc */
+	int maxfds;
+	int fds_base;
+	size_t rss_base;
+	bool res_shown;
+	enum poll_method method;
+	int stop;                  /* 1: stop senders, 2: leave loops */
+	struct tmr tmr_agg;
+	struct tmr tmr_wctl;       /* watches the workers for errors */
+	unsigned nprocs;           /* worker processes, 0 for this one */
+	struct procs procs;
+	struct tmr tmr_procs;      /* publish, or collect and report */
+	unsigned procs_ticks;
+	uint64_t procs_cpu;        /* at the previous report [ns] */
+	struct counters agg;       /* previous aggregate, for rates */
+	bool sweep;
+	struct sweep_conf sweep_conf;
+	struct sweep sw;
+	bool churn;
+	struct churn_conf churn_conf;
+	struct churn ch;
+	bool soak;                 /* hours, across the refreshes */
+	struct soak_conf soak_conf;
+	struct soak sk;
+	const char *out_path;
+	enum out_format out_fmt;
+	struct outsink *out;
+	const char *traffic_model;  /* vbr, keyframe or a pcap file */
+	struct traffic_flow flow;
+	unsigned gop;
+	double keyframe_ratio;
+	struct traffic *traffic;
+	bool upstream;             /* client to peer, through turnc_send */
+	bool tstamp;               /* kernel timestamps */
+	bool batch;                /* TCP batching, with --batch */
+	unsigned batch_us;         /* its window, 0 for one pacing tick */
+	unsigned recv_batch;       /* datagrams per UDP read, 0 for off */
+	bool gso;                  /* UDP_SEGMENT on the peer side */
+	bool gro;                  /* UDP_GRO on the TURN side */
+	struct resmon res;
 } turnperf = {
 	.user    = MY_TURN_USER,
 	.pass    = MY_TURN_PASS,
@@ -27,19 +96,62 @@ static struct {
 	.proto   = IPPROTO_TCP,
 	.bitrate = 64000,
 	.psize   = 160,
-	.turn_ind = true
+	.turn_ind = true,
+	.burst   = 1024,
+	.threads = 1,
+	.sweep_conf = {
+		.bitrate_min = 16000,
+		.bitrate_max = 16000000,
+		.loss_max    = 1.0,
+		.hold_ms     = 3000,
+	},
+	.churn_conf = {
+		.window      = 64,
+		.hold_ms     = 10000,
+	},
+	.flow = {
+		.chan        = -1,
+	},
+	.gop            = TRAFFIC_GOP,
+	.keyframe_ratio = TRAFFIC_KEYFRAME_RATIO,
+	.tls_port       = STUNS_PORT,
 };
 
-#define PACING_INTERVAL_MS 5
+#define PRESZ 48
+#define STATS_INTERVAL_MS 5000
+#define WORKER_CTL_MS 100
+#define THREADS_MAX 256
+#define PSIZE_MAX 65000
+#define MAXFDS_MAX 1048576
+#define HOLD_MS_MAX 3600000        /* one measurement window */
+#define RATE_MAX 1000000           /* setups per second, or at once */
+#define KEEP_MS_MAX 86400000        /* churned allocation kept [ms] */
+#define DURATION_S_MAX 2592000      /* 30 days, in ms it fits 32 bits */
+#define LIFETIME_S_MAX 86400
+#define SOAK_INTERVAL_S_MAX 86400
+#define BATCH_US_MAX 1000000
 
 static struct allocator gallocator = {
 	/* .num_allocations = 100, */
 	.num_allocations = 1,
 };
 
+struct worker {
+	pthread_t tid;
+	unsigned id;
+	struct allocator allocator;
+	struct tmr tmr_ctl;
+	bool stopped;
+	bool done;
+	int err;
+};
+
+static struct worker *workers;
+
 void tmr_grace_handler(void *arg)
 {
 	(void)arg;
+	__atomic_store_n(&turnperf.stop, 2, __ATOMIC_RELAXED);
 	re_cancel();
 }
 
@@ -56,7 +168,37 @@ void signal_handler(int signum)
 	re_fprintf(stderr, "cancelled\n");
 	term = true;
 
-	if (gallocator.num_received > 0) {
+	if (turnperf.procs.n && !turnperf.procs.self) {
+		/* the workers stop on their own and then exit */
+		re_printf("stopping %u worker processes..\n",
+			  turnperf.procs.n);
+		procs_kill(&turnperf.procs, SIGINT);
+	}
+	else if (turnperf.sw.running) {
+		/* prints the curve so far and stops the senders */
+		sweep_abort(&turnperf.sw, 0);
+	}
+	else if (turnperf.ch.running) {
+		churn_stop(&turnperf.ch);
+	}
+	else if (turnperf.tr.running) {
+		tcprelay_stop(&turnperf.tr);
+	}
+	else if (turnperf.mx.running) {
+		/* prints the cells so far and releases the allocations */
+		matrix_abort(&turnperf.mx);
+	}
+	else if (turnperf.sk.running) {
+		/* a last snapshot, then as at the end of the soak */
+		soak_stop(&turnperf.sk);
+	}
+	else if (workers) {
+		__atomic_store_n(&turnperf.stop, 1, __ATOMIC_RELAXED);
+
+		re_printf("wait 1 second for traffic to settle..\n");
+		tmr_start(&turnperf.tmr_grace, 1000, tmr_grace_handler, 0);
+	}
+	else if (gallocator.num_received > 0) {
 		time_t duration = time(NULL) - gallocator.traf_start_time;
 
 		allocator_stop_senders(&gallocator);
@@ -71,9 +213,13 @@ void signal_handler(int signum)
 	}
 }
 
+/*
+ * Stops the loop of the calling thread. From a worker, the main thread
+ * sees the error within WORKER_CTL_MS and stops the other workers.
+ */
 void terminate(int err)
 {
-	turnperf.err = err;
+	__atomic_store_n(&turnperf.err, err, __ATOMIC_RELAXED);
 	re_cancel();
 }
 
@@ -90,6 +236,55 @@ void tmr_ui_handler(void *arg)
 		   fmt_human_time, &duration);
 }
 
+void tmr_stats_handler(void *arg)
+{
+	struct allocator *allocator = arg;
+	struct rxstat st;
+
+	tmr_start(&allocator->tmr_stats, STATS_INTERVAL_MS,
+		  tmr_stats_handler, allocator);
+
+	allocator_rxstat(allocator, &st);
+	resmon_sample(&turnperf.res, allocator->ctr.tx_packets + st.packets);
+
+	re_printf("\rreceiver: %H\n", rxstat_print, &st);
+	re_printf("latency:  %H\n", hist_print_us, &allocator->lat);
+	re_printf("pacing:   %H\n", pacer_print, &allocator->pacer);
+	re_printf("loop:     %H\n", pacer_print_loop, &allocator->pacer);
+	re_printf("process:  %H\n", resmon_print, &turnperf.res);
+
+	if (allocator->batcher.frames)
+		re_printf("tcp:      %H\n", batcher_print, &allocator->batcher);
+
+	if (!turnperf.upstream) {
+		rxbatch_sample(&allocator->rxbatch, st.packets);
+		re_printf("rx path:  %H\n", rxbatch_print, &allocator->rxbatch);
+	}
+
+	if (allocator->gso.on)
+		re_printf("gso:      %H\n", gso_print, &allocator->gso);
+
+	if (allocator->tstamp) {
+		re_printf("kernel:   %H", tstampstat_print,
+			  &allocator->tstat);
+	}
+
+	if (allocator->srvc > 1) {
+		srvstat_collect(allocator->srvstatv, allocator->srvc,
+				allocator);
+		re_printf("servers:\n%H", srvstat_print, &turnperf.servers,
+			  allocator->srvstatv);
+	}
+
+	if (allocator->pool) {
+		re_printf("peers:    %u shared sockets, %llu packets,"
+			  " %llu unknown, %llu other\n",
+			  allocator->pool->n, allocator->pool->rx_packets,
+			  allocator->pool->rx_unknown,
+			  allocator->pool->rx_other);
+	}
+}
+
 int allocation_tx(struct allocation *alloc, struct mbuf *mb)
 {
 	int err;
@@ -97,110 +292,174 @@ int allocation_tx(struct allocation *alloc, struct mbuf *mb)
 	if (!alloc || mbuf_get_left(mb) < 4)
 		return EINVAL;
 
-	err = udp_send(alloc->us_tx, &alloc->relay, mb);
+	if (turnperf.upstream)
+		err = turnc_send(alloc->turnc, &alloc->peer, mb);
+	else if (alloc->allocator->gso.on)
+		err = gso_append(&alloc->allocator->gso,
+				 udp_sock_fd(alloc->us_tx,
+					     sa_af(&alloc->laddr_tx)),
+				 &alloc->relay, mbuf_buf(mb),
+				 mbuf_get_left(mb));
+	else
+		err = udp_send(alloc->us_tx, &alloc->relay, mb);
 
 	return err;
 }
 
-int protocol_encode(struct mbuf *mb,
-		    uint32_t session_cookie, uint32_t alloc_id,
-		    uint32_t seq, size_t payload_len, uint8_t pattern)
+/*
+ * Rewrite sequence number, timestamp, length and the payload pattern,
+ * which depends on the sequence number, of a preformatted packet.
+ */
+static void protocol_stamp(struct mbuf *mb, uint32_t alloc_id,
+			   uint32_t seq, uint64_t ts, size_t payload_len)
 {
-	int err = 0;
+	uint8_t *p = mb->buf + PRESZ;
+	uint32_t v;
+
+	v = htonl(seq);
+	memcpy(p + HDR_SEQ_OFS, &v, 4);
+	v = htonl((uint32_t)(ts >> 32));
+	memcpy(p + HDR_TS_OFS, &v, 4);
+	v = htonl((uint32_t)ts);
+	memcpy(p + HDR_TS_OFS + 4, &v, 4);
+	v = htonl((uint32_t)payload_len);
+	memcpy(p + HDR_LEN_OFS, &v, 4);
+
+	payload_fill(p + HDR_SIZE, payload_len, payload_word(alloc_id, seq));
+}
+
+static int sender_packet_alloc(struct mbuf **mbp, const struct sender *snd)
+{
+	struct mbuf *mb;
+	int err;
+
+	mb = mbuf_alloc(PRESZ + snd->psize);
+	if (!mb)
+		return ENOMEM;
 
-	err |= mbuf_write_u32(mb, htonl(proto_magic));
-	err |= mbuf_write_u32(mb, htonl(session_cookie));
-	err |= mbuf_write_u32(mb, htonl(alloc_id));
-	err |= mbuf_write_u32(mb, htonl(seq));
-	err |= mbuf_write_u32(mb, htonl((uint32_t)payload_len));
-	err |= mbuf_fill(mb, pattern, payload_len);
+	mb->pos = PRESZ;
+
+	err = protocol_encode(mb, snd->session_cookie, snd->alloc_id,
+			      0, 0, snd->psize - HDR_SIZE);
+	if (err)
+		mem_deref(mb);
+	else
+		*mbp = mb;
 
 	return err;
 }
 
 int send_packet(struct sender *snd)
 {
-	struct mbuf *mb = mbuf_alloc(1024);
-#define PRESZ 48
-	size_t payload_len;
+	size_t psize = snd->psize;
+	struct mbuf **slot;
+	struct mbuf *mb;
+	uint64_t ts;
 	int err = 0;
 
-	if (snd->psize < HDR_SIZE)
-		return EINVAL;
+	if (snd->traffic) {
+		psize       = snd->traffic->sizev[snd->traffic_ix];
+		snd->gap_ns = snd->traffic->gapv[snd->traffic_ix];
+
+		if (++snd->traffic_ix == snd->traffic->n)
+			snd->traffic_ix = 0;
+	}
 
-	payload_len = snd->psize - HDR_SIZE;
+	slot = &snd->ring[snd->ring_ix++ % SENDER_RING_SIZE];
 
-	mb->pos = PRESZ;
+	/* still referenced from a previous send, take a fresh one */
+	if (mem_nrefs(*slot) > 1) {
 
-	err = protocol_encode(mb, snd->session_cookie, snd->alloc_id,
-			      ++snd->seq, payload_len, PATTERN);
-	if (err)
-		goto out;
+		err = sender_packet_alloc(&mb, snd);
+		if (err)
+			return err;
+
+		mem_deref(*slot);
+		*slot = mb;
+	}
+
+	mb = *slot;
+
+	ts = tperf_clock_ns();
+
+	protocol_stamp(mb, snd->alloc_id, ++snd->seq, ts, psize - HDR_SIZE);
 
 	mb->pos = PRESZ;
+	mb->end = PRESZ + psize;
 
 	err = allocation_tx(snd->alloc, mb);
 	if (err) {
 		re_fprintf(stderr, "sender: allocation_tx(%zu bytes)"
-			   " failed (%m)\n", snd->psize, err);
-		goto out;
+			   " failed (%m)\n", psize, err);
+		return err;
 	}
 
-	snd->total_bytes   += mbuf_get_left(mb);
-	snd->total_packets += 1;
-
- out:
-	mem_deref(mb);
+	if (snd->alloc->tstx) {
+		struct allocator *allocator = snd->alloc->allocator;
 
-	return err;
-}
+		tstamp_tx_sent(snd->alloc->tstx, snd->alloc_id, snd->seq, ts);
+		tstamp_tx_drain(snd->alloc->tstx, allocator_tstamp_seq,
+				allocator, &allocator->tstat);
+	}
 
-void sender_tick(struct sender *snd, uint64_t now)
-{
-	if (!snd)
-		return;
+	snd->total_bytes   += psize;
+	snd->total_packets += 1;
 
-	if (now >= snd->ts) {
+	COUNTER_ADD(snd->alloc->allocator->ctr.tx_packets, 1);
+	COUNTER_ADD(snd->alloc->allocator->ctr.tx_bytes, psize);
 
-		send_packet(snd);
-		snd->ts += snd->ptime;
-	}
+	return 0;
 }
 
-void check_all_senders(struct allocator *allocator)
+void sender_free(struct sender *snd)
 {
-	uint64_t now = tmr_jiffies();
-	struct le *le;
+	struct allocator *allocator;
+	size_t i;
 
-	for (le = allocator->allocl.head; le; le = le->next) {
-		struct allocation *alloc = le->data;
+	if (!snd)
+		return;
 
-		sender_tick(alloc->sender, now);
-	}
-}
+	allocator = snd->alloc->allocator;
 
-void tmr_pace_handler(void *arg)
-{
-	struct allocator *allocator = arg;
+	pacer_remove(&allocator->pacer, snd);
 
-	check_all_senders(allocator);
+	for (i = 0; i < ARRAY_SIZE(snd->ring); i++)
+		mem_deref(snd->ring[i]);
 
-	tmr_start(&allocator->tmr_pace, PACING_INTERVAL_MS,
-		  tmr_pace_handler, allocator);
+	slab_free(&allocator->sendslab, snd);
 }
 
+/*
+ * With traffic, the packets follow its sequence from a random position
+ * on; bitrate, ptime_ns and psize are then taken from the sequence.
+ */
 int sender_alloc(struct sender **senderp, struct allocation *alloc,
 		 uint32_t session_cookie, uint32_t alloc_id,
-		 unsigned bitrate, unsigned ptime, size_t psize)
+		 unsigned bitrate, uint64_t ptime_ns, size_t psize,
+		 const struct traffic *traffic)
 {
+	struct slab *slab;
 	struct sender *snd;
+	size_t i;
 	int err = 0;
 
-	if (!senderp || !bitrate)
+	if (!senderp || !alloc)
+		return EINVAL;
+
+	if (traffic) {
+		if (!traffic->n)
+			return EINVAL;
+
+		bitrate  = traffic_bitrate(traffic);
+		ptime_ns = traffic_interval(traffic);
+		psize    = TRAFFIC_PSIZE_MAX;
+	}
+
+	if (!bitrate)
 		return EINVAL;
 
-	if (ptime < PACING_INTERVAL_MS) {
-		re_fprintf(stderr, "ptime %u is too low\n", ptime);
+	if (!ptime_ns) {
+		re_fprintf(stderr, "sender: bitrate is too high..\n");
 		return EINVAL;
 	}
 	if (psize < HDR_SIZE) {
@@ -208,7 +467,11 @@ int sender_alloc(struct sender **senderp, struct allocation *alloc,
 		return EINVAL;
 	}
 
-	snd = mem_zalloc(sizeof(*snd), destructor);
+	slab = &alloc->allocator->sendslab;
+	if (!slab->size)
+		slab_init(slab, sizeof(*snd));
+
+	snd = slab_alloc(slab);
 	if (!snd)
 		return ENOMEM;
 
@@ -216,11 +479,24 @@ int sender_alloc(struct sender **senderp, struct allocation *alloc,
 	snd->session_cookie = session_cookie;
 	snd->alloc_id       = alloc_id;
 	snd->bitrate        = bitrate;
-	snd->ptime          = ptime;
+	snd->ptime_ns       = ptime_ns;
+	snd->gap_ns         = ptime_ns;
 	snd->psize          = psize;
+	snd->traffic        = traffic;
+
+	if (traffic)
+		snd->traffic_ix = rand_u32() % traffic->n;
+
+	/* preformat the packets, only seq and ts change per send */
+	for (i = 0; i < ARRAY_SIZE(snd->ring); i++) {
+
+		err = sender_packet_alloc(&snd->ring[i], snd);
+		if (err)
+			break;
+	}
 
 	if (err)
-		mem_deref(snd);
+		sender_free(snd);
 	else
 		*senderp = snd;
 
@@ -233,12 +509,23 @@ int sender_start(struct sender *snd)
 	if (!snd)
 		return EINVAL;
 
-	snd->ts_start = tmr_jiffies();
+	snd->ts_start = tperf_clock_ns();
 
 	/* random component to smoothe traffic */
-	snd->ts       = tmr_jiffies() + rand_u16() % 100;
+	snd->ts       = snd->ts_start + (rand_u16() % 100) * 1000000ULL;
 
-	return 0;
+	return pacer_add(&snd->alloc->allocator->pacer, snd);
+}
+
+/* the next deadline keeps the old interval, the ones after it the new */
+void sender_set_rate(struct sender *snd, unsigned bitrate, uint64_t ptime_ns)
+{
+	if (!snd || !bitrate || !ptime_ns)
+		return;
+
+	snd->bitrate  = bitrate;
+	snd->ptime_ns = ptime_ns;
+	snd->gap_ns   = ptime_ns;
 }
 
 int print_bitrate(struct re_printf *pf, double *val)
@@ -251,25 +538,58 @@ int print_bitrate(struct re_printf *pf, double *val)
 		return re_hprintf(pf, "%.2f bit/s", *val);
 }
 
-unsigned calculate_ptime(unsigned bitrate, size_t psize)
+/* packet interval [ns] */
+uint64_t calculate_ptime(unsigned bitrate, size_t psize)
 {
-	return (8 * 1000) * (unsigned)psize / bitrate;
+	return 8000000000ULL * psize / bitrate;
+}
+
+/* the pacer of the allocator, with the flush of its send batching */
+static void pacer_setup(struct allocator *allocator)
+{
+	pacer_init(&allocator->pacer, turnperf.burst, send_packet);
+
+	if (allocator->gso.on)
+		pacer_set_tickh(&allocator->pacer, gso_tick, &allocator->gso);
+	else
+		pacer_set_tickh(&allocator->pacer, batcher_tick,
+				&allocator->batcher);
 }
 
 int allocator_start_senders(struct allocator *allocator, unsigned bitrate,
 			    size_t psize)
 {
 	struct le *le;
-	double tbps = allocator->num_allocations * bitrate;
-	unsigned ptime;
+	double tbps = (double)allocator->num_allocations * bitrate;
+	uint64_t ptime;
 	int err = 0;
 
 	ptime = calculate_ptime(bitrate, psize);
 
-	re_printf("starting traffic generators:"
-		  " psize=%zu, ptime=%u (total target bitrate is %H)\n",
-		  psize, ptime, print_bitrate, &tbps);
-	tmr_start(&allocator->tmr_ui, 1, tmr_ui_handler, allocator);
+	if (turnperf.traffic) {
+		tbps = (double)allocator->num_allocations
+			* traffic_bitrate(turnperf.traffic);
+
+		re_printf("starting traffic generators: %H"
+			  " (total target bitrate is %H)\n",
+			  traffic_print, turnperf.traffic,
+			  print_bitrate, &tbps);
+	}
+	else {
+		re_printf("starting traffic generators:"
+			  " psize=%zu, ptime=%.3f ms"
+			  " (total target bitrate is %H)\n",
+			  psize, ptime / 1e6, print_bitrate, &tbps);
+	}
+
+	pacer_setup(allocator);
+
+	/* with worker threads, the main thread does the reporting */
+	if (!workers) {
+		tmr_start(&allocator->tmr_ui, 1, tmr_ui_handler, allocator);
+		tmr_start(&allocator->tmr_stats, STATS_INTERVAL_MS,
+			  tmr_stats_handler, allocator);
+	}
 
 	for (le = allocator->allocl.head; le; le = le->next) {
 		struct allocation *alloc = le->data;
@@ -281,7 +601,8 @@ int allocator_start_senders(struct allocator *allocator, unsigned bitrate,
 
 		err = sender_alloc(&alloc->sender, alloc,
 				   allocator->session_cookie,
-				   alloc->ix, bitrate, ptime, psize);
+				   alloc->ix, bitrate, ptime, psize,
+				   turnperf.traffic);
 		if (err)
 			return err;
 
@@ -292,8 +613,7 @@ int allocator_start_senders(struct allocator *allocator, unsigned bitrate,
 		}
 	}
 	/* start sending timer/thread */
-	tmr_start(&allocator->tmr_pace, PACING_INTERVAL_MS,
-		  tmr_pace_handler, allocator);
+	pacer_start(&allocator->pacer);
 
 	return 0;
 }
@@ -303,6 +623,7 @@ void allocator_print_statistics(const struct allocator *allocator)
 	struct le *le;
 	double amin = 99999999, amax = 0, asum = 0, aavg;
 	int ix_min = -1, ix_max = -1;
+	unsigned n = 0;
 
 	/* show allocation summary */
 	if (!allocator || !allocator->num_sent)
@@ -312,6 +633,12 @@ void allocator_print_statistics(const struct allocator *allocator)
 
 		struct allocation *alloc = le->data;
 
+		/* failed or still pending */
+		if (alloc->atime < 0)
+			continue;
+
+		++n;
+
 		if (alloc->atime < amin) {
 			amin = alloc->atime;
 			ix_min = alloc->ix;
@@ -324,12 +651,17 @@ void allocator_print_statistics(const struct allocator *allocator)
 		asum += alloc->atime;
 	}
 
-	aavg = asum / allocator->num_sent;
+	if (!n)
+		return;
+
+	aavg = asum / n;
 
-	re_printf("\nAllocation time statistics:\n");
+	re_printf("\nAllocation time statistics (%u of %u allocations):\n",
+		  n, allocator->num_sent);
 	re_printf("min: %.1f ms (allocation #%d)\n", amin, ix_min);
 	re_printf("avg: %.1f ms\n", aavg);
 	re_printf("max: %.1f ms (allocation #%d)\n", amax, ix_max);
+	re_printf("round trips:\n%H", setupstat_print, &allocator->setup);
 	re_printf("\n");
 }
 
@@ -354,136 +686,1832 @@ void allocator_show_summary(const struct allocator *allocator)
 		re_fprintf(stderr, "duration was too short..\n");
 	}
 
+	if (allocator->setup_window || allocator->setup_rate) {
+		re_printf("setup window %u, rate %u/s (0: none):"
+			  " at most %u in flight, %u failed\n",
+			  allocator->setup_window, allocator->setup_rate,
+			  allocator->inflight_max, allocator->num_failed);
+	}
+
 	if (allocator->num_sent)
 		allocator_print_statistics(allocator);
 }
 
-void allocation_handler(int err, uint16_t scode, const char *reason,
-			       const struct sa *srv,  const struct sa *relay,
-			       void *arg)
+/* process-wide descriptors and memory, relative to startup */
+static void print_resources(unsigned num_allocations)
 {
-	struct allocator *allocator = arg;
-	(void)srv;
-	(void)relay;
+	int fds = proc_fd_count() - turnperf.fds_base;
+	double rss = (double)proc_rss() - (double)turnperf.rss_base;
 
-	if (err || scode) {
-		re_fprintf(stderr, "allocation failed (%m %u %s)\n",
-			   err, scode, reason);
-		terminate(err ? err : EPROTO);
+	if (!num_allocations)
 		return;
+
+	re_printf("resources: %d fds (%.2f per allocation),"
+		  " RSS %.1f MB (%.0f bytes per allocation,"
+		  " sizeof(struct allocation)=%zu)\n",
+		  fds, (double)fds / num_allocations,
+		  rss / 1024 / 1024, rss / num_allocations,
+		  sizeof(struct allocation));
+
+	turnperf.res_shown = true;
+}
+
+/* (re)time all senders to the bitrate of the sweep step */
+static int sweep_senders(struct allocator *allocator, unsigned bitrate)
+{
+	uint64_t ptime = calculate_ptime(bitrate, turnperf.psize);
+	struct le *le;
+	int err;
+
+	if (!allocator->pacer.sendh)
+		pacer_setup(allocator);
+
+	for (le = allocator->allocl.head; le; le = le->next) {
+		struct allocation *alloc = le->data;
+
+		if (alloc->sender) {
+			sender_set_rate(alloc->sender, bitrate, ptime);
+			continue;
+		}
+
+		err = sender_alloc(&alloc->sender, alloc,
+				   allocator->session_cookie,
+				   alloc->ix, bitrate, ptime, turnperf.psize,
+				   NULL);
+		if (err)
+			return err;
+
+		err = sender_start(alloc->sender);
+		if (err)
+			return err;
 	}
 
-	allocator->num_received++;
+	pacer_start(&allocator->pacer);
+	sweep_ready(&turnperf.sw);
+
+	return 0;
+}
+
+/* tperf's own memory per allocation, without the sockets and libre */
+static void print_memory(const struct allocator *allocator)
+{
+	const struct slab *slab = &allocator->sendslab;
+	const struct allocation *alloc = list_ledata(allocator->allocl.head);
+	size_t snd, heap, ring;
+
+	if (!slab->used || !alloc || !alloc->sender)
+		return;
 
-	re_fprintf(stderr, "\r[ allocations: %u ]", allocator->num_received);
+	snd  = slab_bytes(slab) / slab->used;
+	heap = allocator->pacer.size * sizeof(struct pacer_ent)
+		/ slab->used;
+	ring = SENDER_RING_SIZE
+		* (sizeof(struct mbuf) + PRESZ + alloc->sender->psize);
+
+	re_printf("memory: %zu bytes per allocation: allocation %zu,"
+		  " sender %zu (slab of %zu KB), pacer %zu,"
+		  " %u packet buffers %zu\n",
+		  sizeof(struct allocation) + snd + heap + ring,
+		  sizeof(struct allocation), snd, slab_bytes(slab) / 1024,
+		  heap, SENDER_RING_SIZE, ring);
+}
 
-	if (allocator->num_received >= allocator->num_allocations) {
+/* all allocations of the allocator are up, or failed with a window */
+static void setup_done(struct allocator *allocator)
+{
+	int err;
 
+	if (allocator->num_failed) {
+		re_printf("\n%u of %u allocations are ok, %u failed.\n",
+			  allocator->num_received, allocator->num_allocations,
+			  allocator->num_failed);
+	}
+	else {
 		re_printf("\nall allocations are ok.\n");
+	}
 
-		if (allocator->server_info) {
-			re_printf("\nserver:  %s, authentication=%s\n",
-				  allocator->server_software,
-				  allocator->server_auth ? "yes" : "no");
-			re_printf("         lifetime is %u seconds\n",
-				  allocator->lifetime);
-			re_printf("\n");
-			re_printf("public address: %j\n",
-				  &allocator->mapped_addr);
-		}
+	if (allocator->server_info) {
+		re_printf("\nserver:  %s, authentication=%s\n",
+			  allocator->server_software,
+			  allocator->server_auth ? "yes" : "no");
+		re_printf("         lifetime is %u seconds\n",
+			  allocator->lifetime);
+		re_printf("\n");
+		re_printf("public address: %j\n",
+			  &allocator->mapped_addr);
+	}
 
-		allocator->tock = tmr_jiffies();
+	allocator_show_summary(allocator);
 
-		allocator_show_summary(allocator);
+	if (!workers)
+		print_resources(allocator->num_received);
 
-		err = allocator_start_senders(allocator, turnperf.bitrate,
+	if (turnperf.sweep)
+		err = sweep_senders(allocator, turnperf.bitrate);
+	else
+		err = allocator_start_senders(allocator,
+					      turnperf.bitrate,
 					      turnperf.psize);
+	if (err) {
+		re_fprintf(stderr, "failed to start senders (%m)\n",
+			   err);
+		terminate(err);
+	}
+	else if (turnperf.matrix) {
+		matrix_ready(&turnperf.mx);
+	}
+
+	if (!err && !workers)
+		print_memory(allocator);
+
+	if (!err && turnperf.soak) {
+		err = soak_start(&turnperf.sk);
 		if (err) {
-			re_fprintf(stderr, "failed to start senders (%m)\n",
-				   err);
+			re_fprintf(stderr, "soak: start failed (%m)\n", err);
 			terminate(err);
 		}
+	}
 #if 0
-		tmr_debug();
+	tmr_debug();
 #endif
 
+	if (!allocator->traf_start_time)
 		allocator->traf_start_time = time(NULL);
+}
+
+/* the failed setups give their sockets back before traffic starts */
+static void setup_purge_handler(void *arg)
+{
+	struct allocator *allocator = arg;
+	struct le *le = allocator->allocl.head;
+
+	while (le) {
+		struct allocation *alloc = le->data;
+
+		le = le->next;
+
+		if (!alloc->ready)
+			mem_deref(alloc);
 	}
+
+	setup_done(allocator);
 }
 
-void tmr_handler(void *arg)
+static void setup_next(struct allocator *allocator);
+
+void allocation_handler(int err, uint16_t scode, const char *reason,
+			       const struct sa *srv,  const struct sa *relay,
+			       void *arg)
 {
 	struct allocator *allocator = arg;
-	unsigned i;
-	int err;
+	(void)srv;
 
-	if (allocator->num_sent >= allocator->num_allocations) {
+	if (err || scode) {
+		re_fprintf(stderr, "allocation failed (%m %u %s)\n",
+			   err, scode, reason);
+		COUNTER_ADD(allocator->ctr.failed, 1);
+
+		/* a windowed setup goes on without it */
+		if (!relay &&
+		    (allocator->setup_window || allocator->setup_rate) &&
+		    allocator->num_received + allocator->num_failed <
+		    allocator->num_allocations) {
+
+			++allocator->num_failed;
+		}
+		/* a refresh that failed, the soak goes on without it */
+		else if (turnperf.sk.running) {
+			soak_drop(&turnperf.sk);
+			return;
+		}
+		/* the server is out of allocations, that ends the sweep */
+		else if (turnperf.sw.running) {
+			sweep_abort(&turnperf.sw, 0);
+			return;
+		}
+		else if (turnperf.mx.running) {
+			matrix_fail(&turnperf.mx, err ? err : EPROTO);
+			return;
+		}
+		else {
+			terminate(err ? err : EPROTO);
+			return;
+		}
+	}
+	else {
+		allocator->num_received++;
+		COUNTER_ADD(allocator->ctr.allocations, 1);
+
+		re_fprintf(stderr, "\r[ allocations: %u ]",
+			   allocator->num_received);
+	}
+
+	if (allocator->num_received + allocator->num_failed <
+	    allocator->num_allocations) {
+
+		/* closed loop: a setup that is over makes room for one */
+		if (allocator->setup_window)
+			setup_next(allocator);
 		return;
 	}
 
-	i = allocator->num_sent;
+	allocator->tock = tmr_jiffies();
+
+	/* not from inside the handler of a failed one */
+	if (allocator->num_failed)
+		tmr_start(&allocator->tmr, 0, setup_purge_handler, allocator);
+	else
+		setup_done(allocator);
+}
+
+/* counters of TURN server k, when the allocator keeps them */
+static struct srvstat *server_stat(struct allocator *allocator, unsigned k)
+{
+	return k < allocator->srvc ? &allocator->srvstatv[k] : NULL;
+}
+
+/* address of TURN server k for the transport of the allocations */
+static void server_addr(struct sa *srv, unsigned k)
+{
+	*srv = turnperf.servers.srvv[k].addr;
+
+	/* the servers were resolved for the plain transports */
+	if (turnperf.matrix && turnperf.tls)
+		sa_set_port(srv, turnperf.tls_port);
+}
+
+/* starts the next allocation of the allocator */
+static int allocator_launch(struct allocator *allocator)
+{
+	unsigned i = allocator->ix_base + allocator->num_sent;
+	unsigned k = srvlist_pick(&turnperf.servers, i);
+	struct sa srv;
+	int err;
+
+	server_addr(&srv, k);
 
-	err = allocation_create(allocator, i, turnperf.proto, &turnperf.srv,
+	err = allocation_create(NULL, allocator, i, turnperf.proto, &srv,
 				turnperf.user, turnperf.pass,
 				turnperf.tls, turnperf.turn_ind,
+				server_stat(allocator, k),
 				allocation_handler, allocator);
 	if (err) {
 		re_fprintf(stderr, "creating allocation number %u failed"
 			   " (%m)\n", i, err);
-		goto out;
+		return err;
 	}
 
 	allocator->num_sent++;
 
-	tmr_start(&allocator->tmr, rand_u16()&3, tmr_handler, allocator);
-
- out:
-	if (err)
-		terminate(err);
+	return 0;
 }
 
-void allocator_start(struct allocator *allocator)
+/* setups that have neither come up nor failed yet */
+static unsigned setup_inflight(const struct allocator *allocator)
 {
-	if (!allocator)
-		return;
-
-	allocator->tick = tmr_jiffies();
-	tmr_start(&allocator->tmr, 0, tmr_handler, allocator);
+	return allocator->num_sent - allocator->num_received
+		- allocator->num_failed;
 }
 
-void dns_handler(int err, const struct sa *srv, void *arg)
+/*
+ * Windowed setup. Allocations are started as long as fewer than the
+ * window are in flight; with a rate, only as they fall due, and the
+ * ones that do not fit in the window wait for a free slot.
+ */
+static int setup_fill(struct allocator *allocator)
 {
-	(void)arg;
+	unsigned window = allocator->setup_window ? allocator->setup_window
+						  : UINT_MAX;
+	uint64_t due = UINT64_MAX;
+	int err;
 
-	if (err)
-		goto out;
+	if (allocator->setup_rate) {
+		due = allocator->setup_sent0 + 1
+			+ (tperf_clock_ns() - allocator->setup_t0)
+			* allocator->setup_rate / 1000000000ULL;
+	}
+
+	while (allocator->num_sent < allocator->num_allocations &&
+	       allocator->num_sent < due &&
+	       setup_inflight(allocator) < window) {
+
+		err = allocator_launch(allocator);
+		if (err)
+			return err;
+	}
 
-	re_printf("resolved TURN-server: %J\n", srv);
+	allocator->inflight_max = max(allocator->inflight_max,
+				      setup_inflight(allocator));
 
-	turnperf.srv = *srv;
+	return 0;
+}
 
-	/* create a bunch of allocations, with timing */
-	allocator_start(&gallocator);
+static void setup_next(struct allocator *allocator)
+{
+	int err;
 
- out:
-	if (err)
+	err = setup_fill(allocator);
+	if (err && turnperf.mx.running)
+		matrix_fail(&turnperf.mx, err);
+	else if (err)
 		terminate(err);
 }
 
-int main() {
-	// const char *host = MY_TURN_HOST;
-	const char *host = MY_TURN_HOST;
-	struct dnsc *dnsc = NULL;
-	int maxfds = 4096;
-	uint64_t dport = STUN_PORT;
-	uint16_t port = 0;
+void tmr_handler(void *arg)
+{
+	struct allocator *allocator = arg;
+	unsigned rate = allocator->setup_rate;
+	int err;
+
+	if (allocator->num_sent >= allocator->num_allocations) {
+		return;
+	}
+
+	if (allocator->setup_window || rate) {
+
+		/* open loop, the next ones fall due with time */
+		if (rate) {
+			tmr_start(&allocator->tmr, rate >= 1000 ? 1
+					: 1000 / rate, tmr_handler, allocator);
+		}
+
+		setup_next(allocator);
+		return;
+	}
+
+	err = allocator_launch(allocator);
+	if (err)
+		goto out;
+
+	tmr_start(&allocator->tmr, rand_u16()&3, tmr_handler, allocator);
+
+ out:
+	if (err && turnperf.mx.running)
+		matrix_fail(&turnperf.mx, err);
+	else if (err)
+		terminate(err);
+}
+
+/* (re)starts the setup of allocations num_sent..num_allocations */
+static void setup_begin(struct allocator *allocator)
+{
+	allocator->tick        = tmr_jiffies();
+	allocator->setup_t0    = tperf_clock_ns();
+	allocator->setup_sent0 = allocator->num_sent;
+
+	tmr_start(&allocator->tmr, 0, tmr_handler, allocator);
+}
+
+int allocator_start(struct allocator *allocator)
+{
+	int err;
+
+	if (!allocator)
+		return EINVAL;
+
+	err = allocator_init_table(allocator);
+	if (err)
+		return err;
+
+	if (turnperf.peer_socks && !allocator->pool) {
+
+		err = peerpool_alloc(&allocator->pool, allocator,
+				     turnperf.peer_socks,
+				     sa_af(&turnperf.srv));
+		if (err) {
+			re_fprintf(stderr, "could not create %u shared peer"
+				   " sockets (%m)\n", turnperf.peer_socks, err);
+			return err;
+		}
+	}
+
+	setup_begin(allocator);
+
+	return 0;
+}
+
+static int sweep_apply_handler(unsigned allocs, unsigned bitrate, void *arg)
+{
+	struct allocator *allocator = arg;
+	int err;
+
+	turnperf.bitrate = bitrate;
+
+	/* the first step; the table is sized for the largest one */
+	if (!allocator->ht) {
+		err = allocator_init_table(allocator);
+		if (err)
+			return err;
+
+		allocator->num_allocations = allocs;
+
+		return allocator_start(allocator);
+	}
+
+	/* more allocations, allocation_handler starts their senders */
+	if (allocs > allocator->num_allocations) {
+		allocator->num_allocations = allocs;
+		setup_begin(allocator);
+		return 0;
+	}
+
+	return sweep_senders(allocator, bitrate);
+}
+
+static void sweep_done_handler(int err, void *arg)
+{
+	struct allocator *allocator = arg;
+
+	allocator_stop_senders(allocator);
+
+	re_printf("\n%H", sweep_print_curve, &turnperf.sw);
+
+	if (err)
+		terminate(err);
+	else
+		tmr_start(&turnperf.tmr_grace, 1000, tmr_grace_handler, 0);
+}
+
+static int churn_create_handler(struct allocation **allocp, unsigned ix,
+				allocation_h *alloch, void *alloc_arg,
+				void *arg)
+{
+	struct allocator *allocator = arg;
+	unsigned k = srvlist_pick(&turnperf.servers, ix);
+	struct sa srv;
+
+	server_addr(&srv, k);
+
+	return allocation_create(allocp, allocator, ix, turnperf.proto, &srv,
+				 turnperf.user, turnperf.pass,
+				 turnperf.tls, turnperf.turn_ind,
+				 server_stat(allocator, k),
+				 alloch, alloc_arg);
+}
+
+static void churn_done_handler(void *arg)
+{
+	struct allocator *allocator = arg;
+	double secs = (tperf_clock_ns() - turnperf.ch.t_start) / 1e9;
+
+	re_printf("\nchurn summary: %.1f setups/s over %.1f s\n",
+		  turnperf.ch.ok / secs, secs);
+	re_printf("%H\n", churn_print, &turnperf.ch);
+	re_printf("round trips:\n%H", setupstat_print, &allocator->setup);
+
+	re_printf("wait %u ms for the releases..\n", CHURN_LINGER_MS);
+	tmr_start(&turnperf.tmr_grace, CHURN_LINGER_MS, tmr_grace_handler, 0);
+}
+
+static void soak_done_handler(void *arg)
+{
+	struct allocator *allocator = arg;
+	time_t duration = time(NULL) - allocator->traf_start_time;
+
+	allocator_stop_senders(allocator);
+
+	re_printf("\n%H", soak_print, &turnperf.sk);
+	re_printf("round trips:\n%H", setupstat_print, &allocator->setup);
+	re_printf("total duration: %H\n", fmt_human_time, &duration);
+
+	re_printf("wait 1 second for traffic to settle..\n");
+	tmr_start(&turnperf.tmr_grace, 1000, tmr_grace_handler, 0);
+}
+
+static int matrix_apply_handler(const struct matrix_cell *cell, void *arg)
+{
+	struct allocator *allocator = arg;
+	struct tls *tls = NULL;
+
+	if (cell->secure) {
+		tls = cell->proto == IPPROTO_UDP ? turnperf.tls_dgram
+						 : turnperf.tls_stream;
+		if (!tls)
+			return EPROTONOSUPPORT;
+	}
+
+	/* the allocations of the previous cell are released by now */
+	list_flush(&allocator->allocl);
+
+	turnperf.proto    = cell->proto;
+	turnperf.turn_ind = cell->turn_ind;
+	mem_deref(turnperf.tls);
+	turnperf.tls      = mem_ref(tls);
+
+	allocator->num_sent     = 0;
+	allocator->num_received = 0;
+	allocator->num_failed   = 0;
+	allocator->inflight_max = 0;
+
+	return allocator_start(allocator);
+}
+
+static void matrix_release_handler(void *arg)
+{
+	struct allocator *allocator = arg;
+	struct le *le;
+
+	tmr_cancel(&allocator->tmr);
+	allocator_stop_senders(allocator);
+
+	for (le = allocator->allocl.head; le; le = le->next)
+		allocation_release(le->data);
+
+	/* allocator_start_senders() sets it up again for the next cell */
+	pacer_close(&allocator->pacer);
+}
+
+static void matrix_done_handler(void *arg)
+{
+	(void)arg;
+
+	re_printf("\n%H", matrix_print, &turnperf.mx);
+
+	tmr_start(&turnperf.tmr_grace, MATRIX_LINGER_MS, tmr_grace_handler, 0);
+}
+
+static void tcprelay_done_handler(void *arg)
+{
+	(void)arg;
+
+	re_printf("\ntcp relay summary:\n%H", tcprelay_print, &turnperf.tr);
+
+	tmr_start(&turnperf.tmr_grace, 1000, tmr_grace_handler, 0);
+}
+
+static void worker_ctl_handler(void *arg)
+{
+	struct worker *w = arg;
+	int stop = __atomic_load_n(&turnperf.stop, __ATOMIC_RELAXED);
+
+	allocator_publish(&w->allocator);
+
+	if (stop >= 2 || __atomic_load_n(&turnperf.err, __ATOMIC_RELAXED)) {
+		re_cancel();
+		return;
+	}
+
+	if (stop >= 1 && !w->stopped) {
+		allocator_stop_senders(&w->allocator);
+		w->stopped = true;
+	}
+
+	tmr_start(&w->tmr_ctl, WORKER_CTL_MS, worker_ctl_handler, w);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	int err;
+
+	err = re_thread_init();
+	if (err) {
+		re_fprintf(stderr, "worker %u: re_thread_init failed (%m)\n",
+			   w->id, err);
+		goto out;
+	}
+
+	err = fd_setsize(turnperf.maxfds);
+	if (!err)
+		err = poll_method_set(turnperf.method);
+	if (err) {
+		re_fprintf(stderr, "worker %u: poll setup failed (%m)\n",
+			   w->id, err);
+		goto close;
+	}
+
+	tmr_init(&w->tmr_ctl);
+	tmr_start(&w->tmr_ctl, WORKER_CTL_MS, worker_ctl_handler, w);
+
+	err = allocator_start(&w->allocator);
+	if (!err)
+		err = re_main(NULL);
+
+	tmr_cancel(&w->tmr_ctl);
+	allocator_stop_senders(&w->allocator);
+	allocator_publish(&w->allocator);
+	srvstat_collect(w->allocator.srvstatv, w->allocator.srvc,
+			&w->allocator);
+	allocator_close(&w->allocator);
+	rxbatch_close(&w->allocator.rxbatch);
+	gso_close(&w->allocator.gso);
+
+ close:
+	re_thread_close();
+
+ out:
+	w->err = err;
+	__atomic_store_n(&w->done, true, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static void workers_aggregate(struct counters *sum)
+{
+	unsigned i;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for (i = 0; i < turnperf.threads; i++)
+		counters_add(sum, &workers[i].allocator.ctr);
+}
+
+/* results totals, single event loop */
+static void allocator_sum_handler(struct counters *sum, void *arg)
+{
+	struct allocator *allocator = arg;
+
+	allocator_publish(allocator);
+	counters_add(sum, &allocator->ctr);
+
+	/* churned allocations are not counted by the allocator */
+	if (turnperf.churn) {
+		sum->allocations = turnperf.ch.ok;
+		sum->failed      = turnperf.ch.failed;
+	}
+}
+
+static void workers_sum_handler(struct counters *sum, void *arg)
+{
+	(void)arg;
+
+	if (workers)
+		workers_aggregate(sum);
+}
+
+static void tmr_agg_handler(void *arg)
+{
+	struct counters sum;
+	double tx, rx;
+	unsigned i, done = 0;
+	(void)arg;
+
+	tmr_start(&turnperf.tmr_agg, STATS_INTERVAL_MS, tmr_agg_handler, 0);
+
+	workers_aggregate(&sum);
+
+	tx = 8.0 * (sum.tx_bytes - turnperf.agg.tx_bytes)
+		/ (STATS_INTERVAL_MS / 1000.0);
+	rx = 8.0 * (sum.rx.bytes - turnperf.agg.rx.bytes)
+		/ (STATS_INTERVAL_MS / 1000.0);
+	turnperf.agg = sum;
+
+	re_printf("[%u threads] allocations: %llu ok, %llu failed;"
+		  " tx %H, rx %H\n",
+		  turnperf.threads, sum.allocations, sum.failed,
+		  print_bitrate, &tx, print_bitrate, &rx);
+	re_printf("receiver: %H\n", rxstat_print, &sum.rx);
+
+	resmon_sample(&turnperf.res, sum.tx_packets + sum.rx.packets);
+	re_printf("process:  %H\n", resmon_print, &turnperf.res);
+
+	if (!turnperf.res_shown &&
+	    sum.allocations >= gallocator.num_allocations)
+		print_resources((unsigned)sum.allocations);
+
+	for (i = 0; i < turnperf.threads; i++) {
+		if (__atomic_load_n(&workers[i].done, __ATOMIC_ACQUIRE))
+			++done;
+	}
+
+	if (done == turnperf.threads)
+		re_cancel();
+}
+
+/* on the main thread: a fatal error in one worker ends the run */
+static void tmr_wctl_handler(void *arg)
+{
+	(void)arg;
+
+	if (!__atomic_load_n(&turnperf.err, __ATOMIC_RELAXED)) {
+		tmr_start(&turnperf.tmr_wctl, WORKER_CTL_MS,
+			  tmr_wctl_handler, 0);
+		return;
+	}
+
+	re_fprintf(stderr, "a worker failed (%m), stopping all of them\n",
+		   turnperf.err);
+
+	__atomic_store_n(&turnperf.stop, 2, __ATOMIC_RELAXED);
+	tmr_cancel(&turnperf.tmr_agg);
+	re_cancel();
+}
+
+/* part i of a limit that the workers split, at least 1 if it is set */
+static unsigned worker_share(unsigned total, unsigned i)
+{
+	unsigned n = turnperf.threads;
+
+	if (!total)
+		return 0;
+
+	return max((unsigned)((uint64_t)total * (i + 1) / n
+			      - (uint64_t)total * i / n), 1u);
+}
+
+static int workers_start(void)
+{
+	sigset_t set, oset;
+	unsigned i, total = gallocator.num_allocations;
+	int err = 0;
+
+	workers = mem_zalloc(turnperf.threads * sizeof(*workers), NULL);
+	if (!workers)
+		return ENOMEM;
+
+	/* signals are handled by the main thread only */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+
+	for (i = 0; i < turnperf.threads; i++) {
+
+		struct worker *w = &workers[i];
+		unsigned first = (unsigned)((uint64_t)total * i
+					    / turnperf.threads);
+		unsigned last  = (unsigned)((uint64_t)total * (i + 1)
+					    / turnperf.threads);
+
+		w->id = i;
+		w->allocator.ix_base         = first;
+		w->allocator.num_allocations = last - first;
+		w->allocator.session_cookie  = gallocator.session_cookie;
+		w->allocator.lifetime_req    = gallocator.lifetime_req;
+		w->allocator.tstamp          = gallocator.tstamp;
+		w->allocator.setup_window    = worker_share(
+			gallocator.setup_window, i);
+		w->allocator.setup_rate      = worker_share(
+			gallocator.setup_rate, i);
+
+		err = srvstat_alloc(&w->allocator.srvstatv,
+				    turnperf.servers.n);
+		if (err)
+			break;
+
+		w->allocator.srvc = turnperf.servers.n;
+
+		batcher_init(&w->allocator.batcher, gallocator.batcher.on,
+			     gallocator.batcher.window);
+		rxbatch_init(&w->allocator.rxbatch, gallocator.rxbatch.n,
+			     gallocator.rxbatch.gro);
+
+		err = gso_init(&w->allocator.gso, gallocator.gso.on);
+		if (err)
+			break;
+
+		err = pthread_create(&w->tid, NULL, worker_thread, w);
+		if (err) {
+			re_fprintf(stderr, "could not start worker %u (%m)\n",
+				   i, err);
+			turnperf.threads = i;
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	re_printf("started %u worker threads\n", turnperf.threads);
+
+	tmr_start(&turnperf.tmr_agg, STATS_INTERVAL_MS, tmr_agg_handler, 0);
+	tmr_start(&turnperf.tmr_wctl, WORKER_CTL_MS, tmr_wctl_handler, 0);
+
+	return err;
+}
+
+static void workers_join(void)
+{
+	struct counters sum;
+	unsigned i;
+
+	if (!workers)
+		return;
+
+	/* while the workers still have their sockets */
+	workers_aggregate(&sum);
+	resmon_sample_end(&turnperf.res, sum.tx_packets + sum.rx.packets);
+
+	__atomic_store_n(&turnperf.stop, 2, __ATOMIC_RELAXED);
+	tmr_cancel(&turnperf.tmr_agg);
+	tmr_cancel(&turnperf.tmr_wctl);
+
+	for (i = 0; i < turnperf.threads; i++) {
+		pthread_join(workers[i].tid, NULL);
+
+		srvstat_merge(gallocator.srvstatv, workers[i].allocator.srvstatv,
+			      gallocator.srvc);
+	}
+
+	workers_aggregate(&sum);
+	outsink_finish(turnperf.out);
+
+	re_printf("totals over %u threads: %llu allocations,"
+		  " %llu packets sent\n",
+		  turnperf.threads, sum.allocations, sum.tx_packets);
+	re_printf("receiver totals: %H\n", rxstat_print, &sum.rx);
+
+	re_printf("process totals:  %H\n", resmon_print_total,
+		  &turnperf.res);
+
+	if (gallocator.srvc > 1) {
+		re_printf("server totals:\n%H", srvstat_print,
+			  &turnperf.servers, gallocator.srvstatv);
+	}
+
+	for (i = 0; i < turnperf.threads; i++)
+		mem_deref(workers[i].allocator.srvstatv);
+
+	workers = mem_deref(workers);
+}
+
+static void procs_sum_handler(struct counters *sum, void *arg)
+{
+	struct procsum *ps;
+	(void)arg;
+
+	memset(sum, 0, sizeof(*sum));
+
+	ps = mem_alloc(sizeof(*ps), NULL);
+	if (!ps)
+		return;
+
+	procs_collect(&turnperf.procs, ps);
+	*sum = ps->ctr;
+
+	mem_deref(ps);
+}
+
+/* in a worker process */
+static void tmr_publish_handler(void *arg)
+{
+	(void)arg;
+
+	tmr_start(&turnperf.tmr_procs, PROCS_PUBLISH_MS,
+		  tmr_publish_handler, NULL);
+
+	procs_publish(&turnperf.procs, &gallocator);
+}
+
+/* in the coordinator */
+static void tmr_collect_handler(void *arg)
+{
+	const unsigned ticks = STATS_INTERVAL_MS / PROCS_PUBLISH_MS;
+	struct procsum *sum;
+	bool all;
+	double tx, rx, cpu;
+	(void)arg;
+
+	all = procs_reap(&turnperf.procs);
+	if (all) {
+		re_cancel();
+		return;
+	}
+
+	tmr_start(&turnperf.tmr_procs, PROCS_PUBLISH_MS,
+		  tmr_collect_handler, NULL);
+
+	if (++turnperf.procs_ticks % ticks)
+		return;
+
+	sum = mem_alloc(sizeof(*sum), NULL);
+	if (!sum)
+		return;
+
+	procs_collect(&turnperf.procs, sum);
+
+	tx  = 8.0 * (sum->ctr.tx_bytes - turnperf.agg.tx_bytes)
+		/ (STATS_INTERVAL_MS / 1000.0);
+	rx  = 8.0 * (sum->ctr.rx.bytes - turnperf.agg.rx.bytes)
+		/ (STATS_INTERVAL_MS / 1000.0);
+	cpu = 100.0 * (sum->cpu_ns - turnperf.procs_cpu)
+		/ (STATS_INTERVAL_MS * 1e6);
+	turnperf.agg       = sum->ctr;
+	turnperf.procs_cpu = sum->cpu_ns;
+
+	re_printf("[%u processes, %u running] allocations: %llu ok,"
+		  " %llu failed; tx %H, rx %H, cpu %.0f%%\n",
+		  turnperf.procs.n, sum->running,
+		  sum->ctr.allocations, sum->ctr.failed,
+		  print_bitrate, &tx, print_bitrate, &rx, cpu);
+	re_printf("receiver: %H\n", rxstat_print, &sum->ctr.rx);
+	re_printf("latency:  %H\n", hist_print_us, &sum->lat);
+	if (sum->stale)
+		re_printf("stale:    %u workers, not counted\n", sum->stale);
+
+	mem_deref(sum);
+}
+
+/*
+ * The coordinator does no TURN itself: it reports what the workers
+ * publish until the last one has exited.
+ */
+static int procs_coordinate(void)
+{
+	struct procsum *sum = NULL;
+	int err;
+
+	err = libre_init();
+	if (err) {
+		re_fprintf(stderr, "re init failed: %s\n", strerror(err));
+		goto out;
+	}
+
+	re_printf("coordinator: %u worker processes, %u allocations\n",
+		  turnperf.procs.n, gallocator.num_allocations);
+
+	if (turnperf.out_path) {
+		err = outsink_alloc(&turnperf.out, turnperf.out_path,
+				    turnperf.out_fmt, NULL, procs_sum_handler,
+				    NULL);
+		if (err)
+			goto out;
+
+		outsink_start(turnperf.out);
+	}
+
+	tmr_start(&turnperf.tmr_procs, PROCS_PUBLISH_MS,
+		  tmr_collect_handler, NULL);
+
+	re_main(signal_handler);
+
+	tmr_cancel(&turnperf.tmr_procs);
+	outsink_finish(turnperf.out);
+
+	sum = mem_alloc(sizeof(*sum), NULL);
+	if (!sum) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	procs_collect(&turnperf.procs, sum);
+
+	re_printf("totals over %u processes: %llu allocations,"
+		  " %llu packets sent, cpu %.1f s\n",
+		  turnperf.procs.n, sum->ctr.allocations,
+		  sum->ctr.tx_packets, sum->cpu_ns / 1e9);
+	re_printf("receiver totals: %H\n", rxstat_print, &sum->ctr.rx);
+	re_printf("latency totals:  %H\n", hist_print_us, &sum->lat);
+	re_printf("setup totals:    %H\n", hist_print_us, &sum->ready);
+
+	if (sum->stale)
+		re_fprintf(stderr, "%u worker processes died while publishing,"
+			   " their counters are not in the totals\n",
+			   sum->stale);
+
+	if (sum->failed) {
+		re_fprintf(stderr, "%u worker processes failed\n",
+			   sum->failed);
+		err = EPROTO;
+	}
+
+ out:
+	mem_deref(sum);
+	mem_deref(turnperf.out);
+	procs_close(&turnperf.procs);
+	libre_close();
+
+	return err;
+}
+
+void dns_handler(int err, const struct srvlist *sl, void *arg)
+{
+	(void)arg;
+
+	if (err)
+		goto out;
+
+	re_printf("resolved TURN-servers: %H\n", srvlist_print, sl);
+
+	/* the first one sets the address family of the peer side */
+	turnperf.srv = sl->srvv[0].addr;
+
+	err = srvstat_alloc(&gallocator.srvstatv, sl->n);
+	if (err)
+		goto out;
+
+	gallocator.srvc = sl->n;
+
+	outsink_set_servers(turnperf.out, sl, gallocator.srvstatv);
+	outsink_start(turnperf.out);
+
+	/* create a bunch of allocations, with timing */
+	if (turnperf.sweep)
+		err = sweep_start(&turnperf.sw);
+	else if (turnperf.churn)
+		err = churn_start(&turnperf.ch);
+	else if (turnperf.tcprelay)
+		err = tcprelay_start(&turnperf.tr);
+	else if (turnperf.matrix)
+		err = matrix_start(&turnperf.mx);
+	else if (turnperf.threads > 1)
+		err = workers_start();
+	else
+		err = allocator_start(&gallocator);
+
+ out:
+	if (err)
+		terminate(err);
+}
+
+/* raise the soft limit on open files, as far as the hard limit allows */
+static void raise_fd_limit(int maxfds)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl))
+		return;
+
+	if (rl.rlim_cur >= (rlim_t)maxfds)
+		return;
+
+	if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < (rlim_t)maxfds)
+		rl.rlim_cur = rl.rlim_max;
+	else
+		rl.rlim_cur = maxfds;
+
+	if (setrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur < (rlim_t)maxfds) {
+		re_fprintf(stderr, "warning: open file limit is %llu,"
+			   " wanted %d\n",
+			   (unsigned long long)rl.rlim_cur, maxfds);
+	}
+}
+
+enum {
+	OPT_SWEEP = 256,
+	OPT_SWEEP_ALLOCS,
+	OPT_SWEEP_BITRATE,
+	OPT_LOSS,
+	OPT_HOLD,
+	OPT_CHURN,
+	OPT_WINDOW,
+	OPT_CHURN_HOLD,
+	OPT_DURATION,
+	OPT_LIFETIME,
+	OPT_OUT,
+	OPT_FORMAT,
+	OPT_TRAFFIC,
+	OPT_FLOW,
+	OPT_GOP,
+	OPT_KEYFRAME_RATIO,
+	OPT_UPSTREAM,
+	OPT_BATCH,
+	OPT_TSTAMP,
+	OPT_SERVER,
+	OPT_ALL_ADDRS,
+	OPT_TCP_RELAY,
+	OPT_MATRIX,
+	OPT_TLS_PORT,
+	OPT_SECURE,
+	OPT_NO_RESUME,
+	OPT_SETUP_WINDOW,
+	OPT_SETUP_RATE,
+	OPT_PROCS,
+	OPT_SOAK,
+	OPT_SOAK_INTERVAL,
+	OPT_RECV_BATCH,
+	OPT_GSO,
+	OPT_GRO,
+};
+
+/* "<min>:<max>" */
+static int parse_range(const char *str, unsigned *minp, unsigned *maxp)
+{
+	if (2 != sscanf(str, "%u:%u", minp, maxp))
+		return EINVAL;
+
+	return 0;
+}
+
+/* a whole number in [lo, hi], the value of option opt */
+static int parse_uint(const char *opt, const char *str, unsigned lo,
+		      unsigned hi, unsigned *vp)
+{
+	unsigned long v;
+	char *end;
+
+	errno = 0;
+	v = strtoul(str, &end, 10);
+	if (errno || end == str || *end || *str == '-' || v < lo || v > hi) {
+		re_fprintf(stderr, "invalid %s: %s, a number from %u to %u\n",
+			   opt, str, lo, hi);
+		return EINVAL;
+	}
+
+	*vp = (unsigned)v;
+
+	return 0;
+}
+
+/* a number in [lo, hi], the value of option opt */
+static int parse_double(const char *opt, const char *str, double lo,
+			double hi, double *vp)
+{
+	double v;
+	char *end;
+
+	errno = 0;
+	v = strtod(str, &end);
+	if (errno || end == str || *end || !(v >= lo && v <= hi)) {
+		re_fprintf(stderr, "invalid %s: %s, a number from %g to %g\n",
+			   opt, str, lo, hi);
+		return EINVAL;
+	}
+
+	*vp = v;
+
+	return 0;
+}
+
+static void usage(void)
+{
+	(void)re_fprintf(stderr,
+			 "usage: tperf [options]\n"
+			 "options:\n"
+			 "\t-a <allocations>  Number of allocations (%u)\n"
+			 "\t-b <bitrate>      Bitrate per allocation (%u)\n"
+			 "\t-s <psize>        Packet size in bytes (%zu)\n"
+			 "\t-t, --threads <n> Number of event-loop threads"
+			 " (%u)\n"
+			 "\t-P <n>            Share <n> peer sockets per thread"
+			 " (0 = one per allocation)\n"
+			 "\t--procs <n>       Fork <n> worker processes, each"
+			 " with a share of\n"
+			 "\t                  the allocations; they print"
+			 " errors only\n"
+			 "\t-m <maxfds>       Maximum number of descriptors\n"
+			 "\t--sweep           Search the capacity knee, see"
+			 " below\n"
+			 "\t--sweep-allocs <min>:<max>\n"
+			 "\t                  Allocation counts, doubling"
+			 " (1:<allocations>)\n"
+			 "\t--sweep-bitrate <min>:<max>\n"
+			 "\t                  Bitrates per allocation (%u:%u)\n"
+			 "\t--loss <percent>  Loss threshold of the knee"
+			 " (%.2f)\n"
+			 "\t--hold <ms>       Measurement window (%u)\n"
+			 "\t--churn <rate>    Create and delete allocations"
+			 " at <rate>/s\n"
+			 "\t--window <n>      Setups in flight at most (%u)\n"
+			 "\t--churn-hold <ms> Time an allocation is kept (%u)\n"
+			 "\t--duration <s>    Length of the churn run"
+			 " (0 = until stopped),\n"
+			 "\t                  or of the TCP relay transfer\n"
+			 "\t--lifetime <s>    Requested allocation lifetime\n"
+			 "\t--setup-window <n>\n"
+			 "\t                  Allocations in setup at most"
+			 " (0 = one after the other)\n"
+			 "\t--setup-rate <r>  Start <r> allocations/s,"
+			 " open loop\n"
+			 "\t--out <path>      Write results once per second"
+			 " to <path>\n"
+			 "\t--format <fmt>    Results format, jsonl or csv"
+			 " (jsonl)\n"
+			 "\t--traffic <model> Packet sequence instead of"
+			 " constant bitrate:\n"
+			 "\t                  vbr, keyframe or a pcap file\n"
+			 "\t--flow <port>[/<channel>]\n"
+			 "\t                  Stream of the pcap file (the"
+			 " largest)\n"
+			 "\t--gop <frames>    Keyframe interval (%u)\n"
+			 "\t--keyframe-ratio <x>\n"
+			 "\t                  Keyframe to delta frame size"
+			 " (%.1f)\n"
+			 "\t--upstream        Send from the client to the peer\n"
+			 "\t--batch <us>      Coalesce the TCP writes of"
+			 " <us> microseconds,\n"
+			 "\t                  0 for one write per pacing"
+			 " tick\n"
+			 "\t--server <host>[:<port>][/<weight>]\n"
+			 "\t                  TURN server, repeat for a"
+			 " cluster (" MY_TURN_HOST ")\n"
+			 "\t--all-addrs       Every A record of a server"
+			 " name is a server\n"
+			 "\t--tcp-relay       TURN-TCP allocations (RFC 6062),"
+			 " bulk transfer\n"
+			 "\t--recv-batch <n>  Read up to <n> datagrams per"
+			 " wakeup from the\n"
+			 "\t                  TURN UDP sockets, with"
+			 " recvmmsg (max %u)\n"
+			 "\t--gro             Let the kernel merge the"
+			 " datagrams of --recv-batch\n"
+			 "\t--gso             Send the peer-side packets of"
+			 " a pacer wakeup\n"
+			 "\t                  with UDP segmentation"
+			 " offload\n"
+			 "\t--tstamp          Split the latency at kernel"
+			 " software timestamps\n"
+			 "\t--matrix          Compare UDP, TCP, TLS and DTLS,"
+			 " with Send indications\n"
+			 "\t                  and ChannelData, for --hold"
+			 " each\n"
+			 "\t--tls-port <port> TURN server port of TLS and"
+			 " DTLS (%u)\n"
+			 "\t--secure          TLS to the TURN server"
+			 " (DTLS over UDP)\n"
+			 "\t--no-resume       Full TLS/DTLS handshake for"
+			 " every allocation\n"
+			 "\t--soak <s>        Keep the allocations loaded for"
+			 " <s> seconds\n"
+			 "\t                  (0 = until stopped), tracking"
+			 " the refreshes\n"
+			 "\t                  and the memory; see --lifetime\n"
+			 "\t--soak-interval <s>\n"
+			 "\t                  Between soak snapshots (%u)\n"
+			 "\t-h                Show summary of options\n",
+			 gallocator.num_allocations, turnperf.bitrate,
+			 turnperf.psize, turnperf.threads,
+			 turnperf.sweep_conf.bitrate_min,
+			 turnperf.sweep_conf.bitrate_max,
+			 turnperf.sweep_conf.loss_max,
+			 turnperf.sweep_conf.hold_ms,
+			 turnperf.churn_conf.window,
+			 turnperf.churn_conf.hold_ms,
+			 turnperf.gop, turnperf.keyframe_ratio,
+			 RXBATCH_MAX, turnperf.tls_port,
+			 SOAK_INTERVAL_MS / 1000);
+}
+
+int main(int argc, char *argv[]) {
+	// const char *host = MY_TURN_HOST;
+	const char *host = MY_TURN_HOST;
+	struct dnsc *dnsc = NULL;
+	int maxfds = 4096;
+	unsigned u;
+	uint64_t dport = STUN_PORT;
+	uint16_t port = 0;
 	bool secure = false;
-	int err = libre_init();
+	int err = 0;
+
+	static const struct option long_options[] = {
+		{"threads",       required_argument, NULL, 't'},
+		{"sweep",         no_argument,       NULL, OPT_SWEEP},
+		{"sweep-allocs",  required_argument, NULL, OPT_SWEEP_ALLOCS},
+		{"sweep-bitrate", required_argument, NULL, OPT_SWEEP_BITRATE},
+		{"loss",          required_argument, NULL, OPT_LOSS},
+		{"hold",          required_argument, NULL, OPT_HOLD},
+		{"churn",         required_argument, NULL, OPT_CHURN},
+		{"window",        required_argument, NULL, OPT_WINDOW},
+		{"churn-hold",    required_argument, NULL, OPT_CHURN_HOLD},
+		{"duration",      required_argument, NULL, OPT_DURATION},
+		{"lifetime",      required_argument, NULL, OPT_LIFETIME},
+		{"out",           required_argument, NULL, OPT_OUT},
+		{"format",        required_argument, NULL, OPT_FORMAT},
+		{"traffic",       required_argument, NULL, OPT_TRAFFIC},
+		{"flow",          required_argument, NULL, OPT_FLOW},
+		{"gop",           required_argument, NULL, OPT_GOP},
+		{"keyframe-ratio", required_argument, NULL, OPT_KEYFRAME_RATIO},
+		{"upstream",      no_argument,       NULL, OPT_UPSTREAM},
+		{"batch",         required_argument, NULL, OPT_BATCH},
+		{"tstamp",        no_argument,       NULL, OPT_TSTAMP},
+		{"server",        required_argument, NULL, OPT_SERVER},
+		{"all-addrs",     no_argument,       NULL, OPT_ALL_ADDRS},
+		{"tcp-relay",     no_argument,       NULL, OPT_TCP_RELAY},
+		{"matrix",        no_argument,       NULL, OPT_MATRIX},
+		{"tls-port",      required_argument, NULL, OPT_TLS_PORT},
+		{"secure",        no_argument,       NULL, OPT_SECURE},
+		{"no-resume",     no_argument,       NULL, OPT_NO_RESUME},
+		{"setup-window",  required_argument, NULL, OPT_SETUP_WINDOW},
+		{"setup-rate",    required_argument, NULL, OPT_SETUP_RATE},
+		{"procs",         required_argument, NULL, OPT_PROCS},
+		{"soak",          required_argument, NULL, OPT_SOAK},
+		{"soak-interval", required_argument, NULL, OPT_SOAK_INTERVAL},
+		{"recv-batch",    required_argument, NULL, OPT_RECV_BATCH},
+		{"gso",           no_argument,       NULL, OPT_GSO},
+		{"gro",           no_argument,       NULL, OPT_GRO},
+		{"help",          no_argument,       NULL, 'h'},
+		{NULL,            0,                 NULL, 0}
+	};
+
+	for (;;) {
+		const int c = getopt_long(argc, argv, "a:b:s:t:P:m:h",
+					  long_options, NULL);
+		if (0 > c)
+			break;
+
+		switch (c) {
+
+		case 'a':
+			err = parse_uint("-a", optarg, 1, UINT_MAX,
+					 &gallocator.num_allocations);
+			break;
+
+		case 'b':
+			err = parse_uint("-b", optarg, 1, UINT_MAX,
+					 &turnperf.bitrate);
+			break;
+
+		case 's':
+			err = parse_uint("-s", optarg, HDR_SIZE, PSIZE_MAX, &u);
+			if (!err)
+				turnperf.psize = u;
+			break;
+
+		case 't':
+			err = parse_uint("--threads", optarg, 1, THREADS_MAX,
+					 &turnperf.threads);
+			break;
+
+		case 'P':
+			err = parse_uint("-P", optarg, 0, UINT16_MAX,
+					 &turnperf.peer_socks);
+			break;
+
+		case 'm':
+			err = parse_uint("-m", optarg, 1, MAXFDS_MAX, &u);
+			if (!err)
+				turnperf.maxfds = (int)u;
+			break;
+
+		case OPT_SWEEP:
+			turnperf.sweep = true;
+			break;
+
+		case OPT_SWEEP_ALLOCS:
+			turnperf.sweep = true;
+			err = parse_range(optarg,
+					  &turnperf.sweep_conf.alloc_min,
+					  &turnperf.sweep_conf.alloc_max);
+			break;
+
+		case OPT_SWEEP_BITRATE:
+			turnperf.sweep = true;
+			err = parse_range(optarg,
+					  &turnperf.sweep_conf.bitrate_min,
+					  &turnperf.sweep_conf.bitrate_max);
+			break;
+
+		case OPT_LOSS:
+			err = parse_double("--loss", optarg, 0, 100,
+					   &turnperf.sweep_conf.loss_max);
+			break;
+
+		case OPT_HOLD:
+			err = parse_uint("--hold", optarg, 1, HOLD_MS_MAX,
+					 &turnperf.sweep_conf.hold_ms);
+			break;
+
+		case OPT_CHURN:
+			turnperf.churn = true;
+			err = parse_uint("--churn", optarg, 1, RATE_MAX,
+					 &turnperf.churn_conf.rate);
+			break;
+
+		case OPT_WINDOW:
+			err = parse_uint("--window", optarg, 1, RATE_MAX,
+					 &turnperf.churn_conf.window);
+			break;
+
+		case OPT_CHURN_HOLD:
+			err = parse_uint("--churn-hold", optarg, 0, KEEP_MS_MAX,
+					 &turnperf.churn_conf.hold_ms);
+			break;
+
+		case OPT_DURATION:
+			err = parse_uint("--duration", optarg, 0,
+					 DURATION_S_MAX, &u);
+			if (!err)
+				turnperf.churn_conf.duration_ms =
+					(unsigned)(u * 1000ULL);
+			break;
+
+		case OPT_LIFETIME:
+			err = parse_uint("--lifetime", optarg, 0,
+					 LIFETIME_S_MAX, &u);
+			if (!err)
+				gallocator.lifetime_req = u;
+			break;
+
+		case OPT_OUT:
+			turnperf.out_path = optarg;
+			break;
+
+		case OPT_FORMAT:
+			err = out_format_parse(&turnperf.out_fmt, optarg);
+			break;
+
+		case OPT_TRAFFIC:
+			turnperf.traffic_model = optarg;
+			break;
+
+		case OPT_FLOW:
+			err = traffic_flow_parse(&turnperf.flow, optarg);
+			break;
+
+		case OPT_GOP:
+			/* a GOP fits in the loop of the model */
+			err = parse_uint("--gop", optarg, 1,
+					 TRAFFIC_LOOP_S * TRAFFIC_FPS,
+					 &turnperf.gop);
+			break;
+
+		case OPT_KEYFRAME_RATIO:
+			err = parse_double("--keyframe-ratio", optarg, 1, 100,
+					   &turnperf.keyframe_ratio);
+			break;
+
+		case OPT_UPSTREAM:
+			turnperf.upstream = true;
+			break;
+
+		case OPT_BATCH:
+			turnperf.batch = true;
+			err = parse_uint("--batch", optarg, 0, BATCH_US_MAX,
+					 &turnperf.batch_us);
+			break;
+
+		case OPT_TSTAMP:
+			turnperf.tstamp = true;
+			break;
+
+		case OPT_SERVER:
+			err = srvlist_add(&turnperf.servers, optarg);
+			if (err) {
+				re_fprintf(stderr, "invalid server: %s\n",
+					   optarg);
+				return err;
+			}
+			break;
+
+		case OPT_ALL_ADDRS:
+			turnperf.servers.all_addrs = true;
+			break;
+
+		case OPT_TCP_RELAY:
+			turnperf.tcprelay = true;
+			break;
+
+		case OPT_MATRIX:
+			turnperf.matrix = true;
+			break;
+
+		case OPT_TLS_PORT:
+			err = parse_uint("--tls-port", optarg, 1, UINT16_MAX,
+					 &u);
+			if (!err)
+				turnperf.tls_port = (uint16_t)u;
+			break;
+
+		case OPT_SECURE:
+			secure = true;
+			break;
+
+		case OPT_NO_RESUME:
+			turnperf.no_resume = true;
+			break;
+
+		case OPT_SETUP_WINDOW:
+			err = parse_uint("--setup-window", optarg, 0, RATE_MAX,
+					 &gallocator.setup_window);
+			break;
+
+		case OPT_SETUP_RATE:
+			err = parse_uint("--setup-rate", optarg, 0, RATE_MAX,
+					 &gallocator.setup_rate);
+			break;
+
+		case OPT_PROCS:
+			err = parse_uint("--procs", optarg, 1, PROCS_MAX,
+					 &turnperf.nprocs);
+			break;
+
+		case OPT_SOAK:
+			turnperf.soak = true;
+			err = parse_uint("--soak", optarg, 0, DURATION_S_MAX,
+					 &u);
+			if (!err)
+				turnperf.soak_conf.duration_ms =
+					(unsigned)(u * 1000ULL);
+			break;
+
+		case OPT_SOAK_INTERVAL:
+			err = parse_uint("--soak-interval", optarg, 1,
+					 SOAK_INTERVAL_S_MAX, &u);
+			if (!err)
+				turnperf.soak_conf.interval_ms =
+					(unsigned)(u * 1000ULL);
+			break;
+
+		case OPT_RECV_BATCH:
+			err = parse_uint("--recv-batch", optarg, 1,
+					 RXBATCH_MAX, &turnperf.recv_batch);
+			break;
+
+		case OPT_GSO:
+			turnperf.gso = true;
+			break;
+
+		case OPT_GRO:
+			turnperf.gro = true;
+			break;
+
+		case '?':
+			err = EINVAL;
+			/*@fallthrough@*/
+		case 'h':
+		default:
+			usage();
+			return err;
+		}
+
+		/* a bad value, the rest of the line is not looked at */
+		if (err)
+			break;
+	}
+
+	if (err || !gallocator.num_allocations || !turnperf.bitrate ||
+	    !turnperf.threads) {
+		usage();
+		return EINVAL;
+	}
+
+	if (turnperf.batch &&
+	    (!turnperf.upstream || turnperf.proto != IPPROTO_TCP)) {
+		re_fprintf(stderr, "--batch needs --upstream over TCP\n");
+		return EINVAL;
+	}
+
+	batcher_init(&gallocator.batcher, turnperf.batch,
+		     turnperf.batch_us * 1000ULL);
+
+	if (turnperf.recv_batch &&
+	    (turnperf.proto != IPPROTO_UDP || secure || turnperf.upstream ||
+	     turnperf.tstamp || turnperf.matrix)) {
+		re_fprintf(stderr, "--recv-batch needs plain UDP downstream,"
+			   " without --tstamp\n");
+		return EINVAL;
+	}
+
+	if (turnperf.gro && !turnperf.recv_batch) {
+		re_fprintf(stderr, "--gro needs --recv-batch\n");
+		return EINVAL;
+	}
+
+	rxbatch_init(&gallocator.rxbatch, turnperf.recv_batch, turnperf.gro);
+
+	if (turnperf.gso && (turnperf.upstream || turnperf.tstamp)) {
+		re_fprintf(stderr, "--gso is for the peer-side sends,"
+			   " without --tstamp\n");
+		return EINVAL;
+	}
+
+	err = gso_init(&gallocator.gso, turnperf.gso);
+	if (err)
+		return err;
+
+	if (turnperf.tstamp) {
+		gallocator.tstamp = turnperf.upstream ? TSTAMP_UPSTREAM
+						      : TSTAMP_DOWNSTREAM;
+	}
+
+	if (turnperf.sweep) {
+		struct sweep_conf *conf = &turnperf.sweep_conf;
+
+		if (!conf->alloc_max) {
+			conf->alloc_min = 1;
+			conf->alloc_max = gallocator.num_allocations;
+		}
+
+		if (turnperf.threads > 1) {
+			re_fprintf(stderr, "--sweep runs in one thread\n");
+			return EINVAL;
+		}
+
+		if (turnperf.traffic_model) {
+			re_fprintf(stderr, "--sweep needs constant bitrate"
+				   " traffic\n");
+			return EINVAL;
+		}
+
+		err = sweep_init(&turnperf.sw, conf, &gallocator,
+				 sweep_apply_handler, sweep_done_handler,
+				 &gallocator);
+		if (err) {
+			usage();
+			return err;
+		}
+
+		/* descriptors and the hash table are sized for the maximum */
+		gallocator.num_allocations = conf->alloc_max;
+	}
+
+	if (turnperf.churn) {
+		struct churn_conf *conf = &turnperf.churn_conf;
+		uint64_t n;
+
+		if (turnperf.sweep || turnperf.threads > 1) {
+			re_fprintf(stderr, "--churn runs alone, in one"
+				   " thread\n");
+			return EINVAL;
+		}
+
+		err = churn_init(&turnperf.ch, conf, &gallocator,
+				 churn_create_handler, churn_done_handler,
+				 &gallocator);
+		if (err) {
+			usage();
+			return err;
+		}
+
+		/* allocations that are up, or lingering, at the same time */
+		n = (uint64_t)conf->rate
+			* ((uint64_t)conf->hold_ms + CHURN_LINGER_MS) / 1000
+			+ conf->window;
+		if (n > MAXFDS_MAX) {
+			re_fprintf(stderr, "--churn %u with --churn-hold %u"
+				   " keeps %llu allocations, at most %u\n",
+				   conf->rate, conf->hold_ms, n, MAXFDS_MAX);
+			return EINVAL;
+		}
+
+		gallocator.num_allocations = (unsigned)n;
+	}
+
+	if (turnperf.tcprelay) {
+		struct tcprelay_conf conf = {
+			.num         = gallocator.num_allocations,
+			.duration_ms = turnperf.churn_conf.duration_ms,
+			.lifetime    = gallocator.lifetime_req,
+			.user        = turnperf.user,
+			.pass        = turnperf.pass,
+		};
+
+		if (turnperf.sweep || turnperf.churn ||
+		    turnperf.threads > 1 || turnperf.upstream ||
+		    turnperf.traffic_model || turnperf.proto != IPPROTO_TCP) {
+			re_fprintf(stderr, "--tcp-relay runs alone, in one"
+				   " thread, over TCP\n");
+			return EINVAL;
+		}
+
+		err = tcprelay_init(&turnperf.tr, &conf, &turnperf.servers,
+				    tcprelay_done_handler, NULL);
+		if (err) {
+			usage();
+			return err;
+		}
+	}
+
+	if (secure && (turnperf.matrix || turnperf.tcprelay)) {
+		re_fprintf(stderr, "--secure does not go with --matrix"
+			   " or --tcp-relay\n");
+		return EINVAL;
+	}
+
+	if (turnperf.matrix) {
+
+		if (turnperf.sweep || turnperf.churn || turnperf.tcprelay ||
+		    turnperf.threads > 1) {
+			re_fprintf(stderr, "--matrix runs alone, in one"
+				   " thread\n");
+			return EINVAL;
+		}
+
+		err = matrix_init(&turnperf.mx, turnperf.sweep_conf.hold_ms,
+				  &gallocator, matrix_apply_handler,
+				  matrix_release_handler, matrix_done_handler,
+				  &gallocator);
+		if (err) {
+			usage();
+			return err;
+		}
+	}
+
+	if (turnperf.soak) {
+
+		if (turnperf.sweep || turnperf.churn || turnperf.tcprelay ||
+		    turnperf.matrix || turnperf.threads > 1 ||
+		    turnperf.nprocs > 1) {
+			re_fprintf(stderr, "--soak runs alone, in one"
+				   " thread\n");
+			return EINVAL;
+		}
+
+		err = soak_init(&turnperf.sk, &turnperf.soak_conf,
+				&gallocator, soak_done_handler, &gallocator);
+		if (err) {
+			usage();
+			return err;
+		}
+	}
+
+	if (turnperf.nprocs > 1) {
+		unsigned n = turnperf.nprocs, i;
+		unsigned total = gallocator.num_allocations;
+
+		if (turnperf.threads > 1 || turnperf.sweep ||
+		    turnperf.churn || turnperf.tcprelay || turnperf.matrix ||
+		    n > PROCS_MAX || total < n) {
+			re_fprintf(stderr, "--procs runs up to %u plain"
+				   " single-threaded workers, with at least"
+				   " one allocation each\n", PROCS_MAX);
+			return EINVAL;
+		}
+
+		/* one session for all workers */
+		if (!gallocator.session_cookie)
+			gallocator.session_cookie = rand_u32();
+
+		err = procs_fork(&turnperf.procs, n);
+		if (err)
+			return err;
+
+		if (!turnperf.procs.self)
+			return procs_coordinate();
+
+		/* a worker, with its slice of the allocation-IDs */
+		i = turnperf.procs.id;
+		gallocator.ix_base         = (unsigned)((uint64_t)total * i
+							/ n);
+		gallocator.num_allocations = (unsigned)((uint64_t)total
+							* (i + 1) / n)
+					     - gallocator.ix_base;
+
+		/* the coordinator writes the results and the reports */
+		turnperf.out_path = NULL;
+		if (!freopen("/dev/null", "w", stdout))
+			return errno;
+	}
+
+	err = libre_init();
 	if(err) {
 		re_fprintf(stderr, "re init failed: %s\n", strerror(err));
 		goto out;
 	}
 
+	if (turnperf.procs.self) {
+		tmr_start(&turnperf.tmr_procs, PROCS_PUBLISH_MS,
+			  tmr_publish_handler, NULL);
+	}
+
+	if (turnperf.matrix) {
+
+		/* without a context, the cells of that transport fail */
+		err = tls_alloc(&turnperf.tls_stream, TLS_METHOD_SSLV23,
+				NULL, NULL);
+		if (!err)
+			err = tlsres_attach(&turnperf.tlsr_stream,
+					    turnperf.tls_stream,
+					    !turnperf.no_resume);
+		if (err)
+			re_fprintf(stderr, "matrix: no TLS context (%m)\n",
+				   err);
+
+		err = tls_alloc(&turnperf.tls_dgram, TLS_METHOD_DTLS,
+				NULL, NULL);
+		if (!err)
+			err = tlsres_attach(&turnperf.tlsr_dgram,
+					    turnperf.tls_dgram,
+					    !turnperf.no_resume);
+		if (err)
+			re_fprintf(stderr, "matrix: no DTLS context (%m)\n",
+				   err);
+
+		err = 0;
+	}
+	else if (secure) {
+		bool dgram = turnperf.proto == IPPROTO_UDP;
+
+		err = tls_alloc(&turnperf.tls,
+				dgram ? TLS_METHOD_DTLS : TLS_METHOD_SSLV23,
+				NULL, NULL);
+		if (err) {
+			re_fprintf(stderr, "could not create the %s context"
+				   " (%m)\n", protocol_name(turnperf.proto,
+							     true), err);
+			goto out;
+		}
+
+		err = tlsres_attach(dgram ? &turnperf.tlsr_dgram
+					  : &turnperf.tlsr_stream,
+				    turnperf.tls, !turnperf.no_resume);
+		if (err)
+			goto out;
+	}
+
+	if (turnperf.traffic_model) {
+		const char *model = turnperf.traffic_model;
+
+		if (0 == str_casecmp(model, "vbr"))
+			err = traffic_vbr(&turnperf.traffic, turnperf.bitrate);
+		else if (0 == str_casecmp(model, "keyframe"))
+			err = traffic_keyframe(&turnperf.traffic,
+					       turnperf.bitrate, turnperf.gop,
+					       turnperf.keyframe_ratio);
+		else
+			err = traffic_pcap(&turnperf.traffic, model,
+					   &turnperf.flow);
+		if (err) {
+			re_fprintf(stderr, "traffic model %s failed (%m)\n",
+				   model, err);
+			goto out;
+		}
+
+		re_printf("traffic: %H\n", traffic_print, turnperf.traffic);
+	}
+
+	/* before the worker threads, the counters are inherited */
+	(void)resmon_init(&turnperf.res);
+
 	enum poll_method method = poll_method_best();
 	switch (method) {
 		case METHOD_SELECT:
@@ -493,6 +2521,20 @@ int main() {
 			maxfds = 32768;
 			break;
 	}
+
+	if (method != METHOD_SELECT) {
+		/* one TURN socket per allocation, plus the peer side */
+		uint64_t need = (uint64_t)gallocator.num_allocations
+			* (turnperf.tcprelay ? 3 : turnperf.peer_socks ? 1 : 2)
+			+ turnperf.peer_socks * turnperf.threads + 1024;
+
+		if (turnperf.maxfds)
+			maxfds = turnperf.maxfds;
+		else if (need > (uint64_t)maxfds)
+			maxfds = (int)need;
+
+		raise_fd_limit(maxfds);
+	}
 	err = fd_setsize(maxfds);
 	if (err) {
 		re_fprintf(stderr, "cannot set maxfds to %d: %m\n",
@@ -510,6 +2552,25 @@ int main() {
 	re_printf("using async polling method '%s' with maxfds=%d\n",
 		  poll_method_name(method), maxfds);
 
+	turnperf.maxfds = maxfds;
+	turnperf.method = method;
+
+	if (turnperf.out_path) {
+		bool single = turnperf.threads == 1;
+
+		err = outsink_alloc(&turnperf.out, turnperf.out_path,
+				    turnperf.out_fmt,
+				    single ? &gallocator : NULL,
+				    single ? allocator_sum_handler
+					   : workers_sum_handler,
+				    &gallocator);
+		if (err)
+			goto out;
+	}
+
+	turnperf.fds_base = proc_fd_count();
+	turnperf.rss_base = proc_rss();
+
 	err = dns_init(&dnsc);
 	if (err) {
 		(void)re_fprintf(stderr, "dnsinit: %m\n", err);
@@ -517,9 +2578,21 @@ int main() {
 	}
 
 	re_printf("bitrate: %u bits/second (per allocation)\n",  turnperf.bitrate);
+	re_printf("payload verification: %s\n", payload_verify_name());
 
-	re_printf("server: %s protocol=%s\n",
-			  host, protocol_name(turnperf.proto, secure));
+	/* the built-in server, unless there were --server options */
+	if (!turnperf.servers.nspec) {
+		err = srvlist_add(&turnperf.servers, host);
+		if (err)
+			goto out;
+
+		turnperf.servers.specv[0].port = port;
+	}
+
+	re_printf("server: %s%s protocol=%s\n",
+		  turnperf.servers.specv[0].host,
+		  turnperf.servers.nspec > 1 ? " and more," : "",
+		  protocol_name(turnperf.proto, secure));
 
 	const char *stun_proto, *stun_usage;
 	stun_usage = secure ? stuns_usage_relay : stun_usage_relay;
@@ -539,10 +2612,9 @@ int main() {
 		goto out;
 	}
 
-	err = stun_server_discover(&turnperf.dns, dnsc,
-										stun_usage, stun_proto,
-										AF_INET, host, port,
-										dns_handler, NULL);
+	err = srvlist_resolve(&turnperf.servers, dnsc, stun_usage, stun_proto,
+			      AF_INET, secure ? STUNS_PORT : (uint16_t)dport,
+			      dns_handler, NULL);
 	if (err) {
 		re_fprintf(stderr, "stun discover failed (%m)\n",
 				err);
@@ -551,6 +2623,49 @@ int main() {
 	
 	re_main(signal_handler);
 
+	tmr_cancel(&turnperf.tmr_procs);
+	procs_publish(&turnperf.procs, &gallocator);
+
+	workers_join();
+
+	if (turnperf.threads == 1) {
+		srvstat_collect(gallocator.srvstatv, gallocator.srvc,
+				&gallocator);
+	}
+
+	outsink_finish(turnperf.out);
+
+	if (gallocator.traf_start_time) {
+		struct rxstat st;
+
+		allocator_rxstat(&gallocator, &st);
+		resmon_sample_end(&turnperf.res,
+				  gallocator.ctr.tx_packets + st.packets);
+
+		re_printf("receiver totals: %H\n", rxstat_print, &st);
+		re_printf("pacing totals:   %H\n", pacer_print,
+			  &gallocator.pacer);
+		re_printf("loop totals:     %H\n", pacer_print_loop,
+			  &gallocator.pacer);
+		re_printf("process totals:  %H\n", resmon_print_total,
+			  &turnperf.res);
+
+		if (gallocator.batcher.frames)
+			re_printf("tcp totals:      %H\n", batcher_print,
+				  &gallocator.batcher);
+
+		if (gallocator.srvc > 1)
+			re_printf("server totals:\n%H", srvstat_print,
+				  &turnperf.servers, gallocator.srvstatv);
+	}
+
+	if (turnperf.tlsr_stream.tls)
+		re_printf("tls handshakes:\n%H", tlsres_print,
+			  &turnperf.tlsr_stream);
+	if (turnperf.tlsr_dgram.tls)
+		re_printf("dtls handshakes:\n%H", tlsres_print,
+			  &turnperf.tlsr_dgram);
+
 	if (turnperf.err) {
 		re_fprintf(stderr, "turn performance failed (%m)\n",
 			   turnperf.err);
@@ -558,9 +2673,26 @@ int main() {
 	}
 
  out:
+	procs_done(&turnperf.procs, err);
 	re_printf("van los mem_deref\n");
+	sweep_close(&turnperf.sw);
+	churn_close(&turnperf.ch);
+	tcprelay_close(&turnperf.tr);
+	matrix_close(&turnperf.mx);
+	soak_close(&turnperf.sk);
+	allocator_close(&gallocator);
+	rxbatch_close(&gallocator.rxbatch);
+	gso_close(&gallocator.gso);
+	mem_deref(turnperf.out);
+	mem_deref(turnperf.traffic);
+	resmon_close(&turnperf.res);
+	tlsres_detach(&turnperf.tlsr_stream);
+	tlsres_detach(&turnperf.tlsr_dgram);
 	mem_deref(turnperf.tls);
-	mem_deref(turnperf.dns);
+	mem_deref(turnperf.tls_stream);
+	mem_deref(turnperf.tls_dgram);
+	srvlist_close(&turnperf.servers);
+	mem_deref(gallocator.srvstatv);
 	mem_deref(dnsc);
 	libre_close();
 
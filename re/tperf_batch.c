@@ -0,0 +1,261 @@
+#include "tperf_batch.h"
+#include "tperf_util.h"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/tcp.h>
+
+#define STUN_SEND_INDICATION 0x0016
+
+/* segments sent on the connection, 0 if unknown */
+static uint32_t tcp_segs_out(const struct tcp_conn *tc)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	memset(&ti, 0, sizeof(ti));
+
+	if (getsockopt(tcp_conn_fd(tc), IPPROTO_TCP, TCP_INFO, &ti, &len))
+		return 0;
+
+	return ti.tcpi_segs_out;
+}
+
+static uint32_t segs_since(const struct tcpbatch *tb)
+{
+	uint32_t segs = tcp_segs_out(tb->tc);
+
+	return segs > tb->segs_base ? segs - tb->segs_base : 0;
+}
+
+static bool is_data_frame(const struct mbuf *mb)
+{
+	const uint8_t *p = mbuf_buf(mb);
+
+	if (mbuf_get_left(mb) < 4)
+		return false;
+
+	/* ChannelData */
+	if ((p[0] & 0xc0) == 0x40)
+		return true;
+
+	return (p[0] << 8 | p[1]) == STUN_SEND_INDICATION;
+}
+
+static int tcpbatch_flush(struct tcpbatch *tb)
+{
+	struct mbuf *mb = tb->mb;
+	int err;
+
+	list_unlink(&tb->le);
+
+	if (!mb || !mb->end)
+		return 0;
+
+	mb->pos = 0;
+
+	err = tcp_send_helper(tb->tc, mb, tb->th);
+
+	++tb->bt->writes;
+
+	mbuf_rewind(mb);
+
+	return err;
+}
+
+static bool send_handler(int *err, struct mbuf *mb, void *arg)
+{
+	struct tcpbatch *tb = arg;
+	struct batcher *bt = tb->bt;
+	size_t n = mbuf_get_left(mb);
+
+	if (!is_data_frame(mb)) {
+
+		/* keep the order on the connection */
+		if (bt->on)
+			*err = tcpbatch_flush(tb);
+
+		return *err != 0;
+	}
+
+	if (!tb->started) {
+		tb->started   = true;
+		tb->segs_base = tcp_segs_out(tb->tc);
+	}
+
+	++bt->frames;
+	bt->bytes += n;
+
+	if (!bt->on) {
+		++bt->writes;
+		return false;
+	}
+
+	if (tb->mb->end + n > BATCH_SIZE_MAX) {
+		++bt->full;
+		*err = tcpbatch_flush(tb);
+		if (*err)
+			return true;
+	}
+
+	*err = mbuf_write_mem(tb->mb, mbuf_buf(mb), n);
+	if (*err)
+		return true;
+
+	if (!list_ledata(&tb->le)) {
+		tb->t_first = tperf_clock_ns();
+		list_append(&bt->pendl, &tb->le, tb);
+	}
+
+	return true;
+}
+
+static void tcpbatch_destructor(void *arg)
+{
+	struct tcpbatch *tb = arg;
+
+	if (tb->started)
+		tb->bt->segs_gone += segs_since(tb);
+
+	list_unlink(&tb->le);
+	list_unlink(&tb->le_all);
+	mem_deref(tb->th);
+	mem_deref(tb->mb);
+}
+
+/* the helper must be above TLS, that then sees one write per batch */
+int tcpbatch_attach(struct tcpbatch **tbp, struct batcher *bt,
+		    struct tcp_conn *tc, int layer)
+{
+	struct tcpbatch *tb;
+	int err;
+
+	if (!tbp || !bt || !tc)
+		return EINVAL;
+
+	tb = mem_zalloc(sizeof(*tb), tcpbatch_destructor);
+	if (!tb)
+		return ENOMEM;
+
+	tb->bt = bt;
+	tb->tc = tc;
+
+	if (bt->on) {
+		tb->mb = mbuf_alloc(BATCH_SIZE_MAX);
+		if (!tb->mb) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
+	err = tcp_register_helper(&tb->th, tc, layer, NULL, send_handler,
+				  NULL, tb);
+	if (err)
+		goto out;
+
+	list_append(&bt->tbl, &tb->le_all, tb);
+
+ out:
+	if (err)
+		mem_deref(tb);
+	else
+		*tbp = tb;
+
+	return err;
+}
+
+void batcher_init(struct batcher *bt, bool on, uint64_t window_ns)
+{
+	if (!bt)
+		return;
+
+	memset(bt, 0, sizeof(*bt));
+
+	bt->on     = on;
+	bt->window = window_ns;
+	tmr_init(&bt->tmr);
+}
+
+/* writes what is buffered */
+void batcher_close(struct batcher *bt)
+{
+	struct tcpbatch *tb;
+
+	if (!bt)
+		return;
+
+	tmr_cancel(&bt->tmr);
+
+	while ((tb = list_ledata(bt->pendl.head)))
+		(void)tcpbatch_flush(tb);
+}
+
+static void tmr_handler(void *arg);
+
+/* flushes the batches that are due, oldest first */
+static void batcher_flush(struct batcher *bt)
+{
+	uint64_t now = tperf_clock_ns();
+	struct tcpbatch *tb;
+
+	while ((tb = list_ledata(bt->pendl.head))) {
+
+		if (now - tb->t_first < bt->window)
+			break;
+
+		(void)tcpbatch_flush(tb);
+	}
+
+	if (tb) {
+		uint64_t due = tb->t_first + bt->window - now;
+
+		tmr_start(&bt->tmr, (due + 999999) / 1000000,
+			  tmr_handler, bt);
+	}
+	else {
+		tmr_cancel(&bt->tmr);
+	}
+}
+
+static void tmr_handler(void *arg)
+{
+	batcher_flush(arg);
+}
+
+/* pacer tick handler */
+void batcher_tick(void *arg)
+{
+	struct batcher *bt = arg;
+
+	if (!bt->on || !bt->pendl.head)
+		return;
+
+	batcher_flush(bt);
+}
+
+int batcher_print(struct re_printf *pf, const struct batcher *bt)
+{
+	uint64_t segs = bt->segs_gone;
+	struct le *le;
+
+	if (!bt)
+		return 0;
+
+	for (le = bt->tbl.head; le; le = le->next) {
+
+		const struct tcpbatch *tb = le->data;
+
+		if (tb->started)
+			segs += segs_since(tb);
+	}
+
+	return re_hprintf(pf, "%s, %llu frames in %llu writes"
+			  " (%.2f per write, %llu full), %llu segments"
+			  " (%.2f frames, %.0f bytes per segment)",
+			  bt->on ? "batched" : "per-frame writes",
+			  bt->frames, bt->writes,
+			  bt->writes ? (double)bt->frames / bt->writes : 0.0,
+			  bt->full, segs,
+			  segs ? (double)bt->frames / segs : 0.0,
+			  segs ? (double)bt->bytes / segs : 0.0);
+}
@@ -0,0 +1,54 @@
+#ifndef MY_TPERF_BATCH_H_INCLUIDO
+#define MY_TPERF_BATCH_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+/* a batch this large is written at once [bytes] */
+#define BATCH_SIZE_MAX 65536
+
+/*
+ * Write batching for TURN-over-TCP. A helper on each connection takes
+ * the data frames (ChannelData and Send indications) the TURN client
+ * sends and appends them to a per-connection buffer. The pacer flushes
+ * the buffers at the end of every tick, each with one write; with a
+ * window, a buffer is kept until its oldest frame is that old. Other
+ * STUN messages flush the buffer and go out as they are.
+ *
+ * When batching is off, the helpers only count, so that the writes and
+ * TCP segments per frame can be compared.
+ */
+struct batcher {
+	bool on;
+	uint64_t window;           /* [ns], 0 for the pacing tick */
+	struct list pendl;         /* connections with frames buffered */
+	struct list tbl;           /* all connections */
+	struct tmr tmr;
+
+	uint64_t frames;           /* data frames */
+	uint64_t bytes;
+	uint64_t writes;           /* of data frames */
+	uint64_t full;             /* writes because of BATCH_SIZE_MAX */
+	uint64_t segs_gone;        /* of connections that were closed */
+};
+
+struct tcpbatch {
+	struct le le;              /* batcher pending list */
+	struct le le_all;
+	struct batcher *bt;
+	struct tcp_conn *tc;
+	struct tcp_helper *th;
+	struct mbuf *mb;
+	uint64_t t_first;          /* oldest frame buffered [ns] */
+	uint32_t segs_base;        /* TCP segments before the first frame */
+	bool started;
+};
+
+void batcher_init(struct batcher *bt, bool on, uint64_t window_ns);
+void batcher_close(struct batcher *bt);
+void batcher_tick(void *arg);
+int  batcher_print(struct re_printf *pf, const struct batcher *bt);
+int  tcpbatch_attach(struct tcpbatch **tbp, struct batcher *bt,
+		     struct tcp_conn *tc, int layer);
+
+#endif
@@ -0,0 +1,261 @@
+#include "tperf_churn.h"
+
+#include <string.h>
+
+#define CHURN_STATS_MS 5000
+
+struct churn_ent {
+	struct le le;
+	struct churn *ch;
+	struct allocation *alloc;
+	struct tmr tmr;            /* hold, linger or deferred free */
+	bool ready;
+	bool released;
+};
+
+static void ent_destructor(void *arg)
+{
+	struct churn_ent *ent = arg;
+
+	tmr_cancel(&ent->tmr);
+	list_unlink(&ent->le);
+	mem_deref(ent->alloc);
+}
+
+static void ent_free_handler(void *arg)
+{
+	struct churn_ent *ent = arg;
+
+	mem_deref(ent);
+}
+
+static void ent_hold_handler(void *arg)
+{
+	struct churn_ent *ent = arg;
+	struct churn *ch = ent->ch;
+
+	allocation_release(ent->alloc);
+
+	ent->released = true;
+	++ch->released;
+	--ch->live;
+
+	tmr_start(&ent->tmr, CHURN_LINGER_MS, ent_free_handler, ent);
+}
+
+static void ent_alloc_handler(int err, uint16_t scode, const char *reason,
+			      const struct sa *srv, const struct sa *relay,
+			      void *arg)
+{
+	struct churn_ent *ent = arg;
+	struct churn *ch = ent->ch;
+	bool failed = err || scode;
+	(void)reason;
+	(void)srv;
+	(void)relay;
+
+	if (ent->released)
+		return;
+
+	if (!ent->ready) {
+
+		--ch->inflight;
+
+		if (failed) {
+			++ch->failed;
+
+			/* not from inside the TURN client's handler */
+			tmr_start(&ent->tmr, 0, ent_free_handler, ent);
+			return;
+		}
+
+		ent->ready = true;
+		++ch->ok;
+		++ch->live;
+
+		tmr_start(&ent->tmr, ch->conf.hold_ms, ent_hold_handler, ent);
+	}
+	else if (failed) {
+		++ch->dropped;
+		--ch->live;
+
+		ent->released = true;
+		tmr_start(&ent->tmr, 0, ent_free_handler, ent);
+	}
+}
+
+static int churn_launch(struct churn *ch)
+{
+	struct churn_ent *ent;
+	int err;
+
+	ent = mem_zalloc(sizeof(*ent), ent_destructor);
+	if (!ent)
+		return ENOMEM;
+
+	ent->ch = ch;
+	tmr_init(&ent->tmr);
+	list_append(&ch->entl, &ent->le, ent);
+
+	++ch->launched;
+
+	err = ch->createh(&ent->alloc, ch->next_ix++, ent_alloc_handler, ent,
+			  ch->arg);
+	if (err) {
+		++ch->failed;
+		mem_deref(ent);
+		return err;
+	}
+
+	++ch->started;
+	++ch->inflight;
+
+	return 0;
+}
+
+static void tmr_handler(void *arg)
+{
+	struct churn *ch = arg;
+	uint64_t now = tperf_clock_ns();
+	uint64_t due, owed;
+
+	if (ch->conf.duration_ms &&
+	    now - ch->t_start >= ch->conf.duration_ms * 1000000ULL) {
+		churn_stop(ch);
+		return;
+	}
+
+	tmr_start(&ch->tmr, ch->conf.rate >= 1000 ? 1 : 1000 / ch->conf.rate,
+		  tmr_handler, ch);
+
+	due  = (now - ch->t_start) * ch->conf.rate / 1000000000ULL;
+	owed = due - ch->launched - ch->skipped;
+
+	/* at most one second of debt */
+	if (owed > ch->conf.rate) {
+		ch->skipped += owed - ch->conf.rate;
+		owed = ch->conf.rate;
+	}
+
+	while (owed && ch->inflight < ch->conf.window) {
+
+		int err = churn_launch(ch);
+		if (err) {
+			re_fprintf(stderr, "churn: could not create allocation"
+				   " (%m)\n", err);
+		}
+
+		--owed;
+	}
+
+	ch->backlog = (unsigned)owed;
+}
+
+static void tmr_stats_handler(void *arg)
+{
+	struct churn *ch = arg;
+	uint64_t now = tperf_clock_ns();
+	double rate;
+
+	tmr_start(&ch->tmr_stats, CHURN_STATS_MS, tmr_stats_handler, ch);
+
+	rate = (ch->ok - ch->ok_prev) * 1e9 / (double)(now - ch->t_prev);
+	ch->ok_prev = ch->ok;
+	ch->t_prev  = now;
+
+	re_printf("churn: %.1f setups/s (target %u), %H\n", rate,
+		  ch->conf.rate, churn_print, ch);
+	re_printf("ready:   %H\n", hist_print_us,
+		  &ch->allocator->setup.ready);
+}
+
+int churn_init(struct churn *ch, const struct churn_conf *conf,
+	       struct allocator *allocator, churn_create_h *createh,
+	       churn_done_h *doneh, void *arg)
+{
+	if (!ch || !conf || !allocator || !createh)
+		return EINVAL;
+
+	if (!conf->rate || !conf->window)
+		return EINVAL;
+
+	memset(ch, 0, sizeof(*ch));
+
+	ch->conf      = *conf;
+	ch->allocator = allocator;
+	ch->createh   = createh;
+	ch->doneh     = doneh;
+	ch->arg       = arg;
+
+	list_init(&ch->entl);
+	tmr_init(&ch->tmr);
+	tmr_init(&ch->tmr_stats);
+
+	return 0;
+}
+
+int churn_start(struct churn *ch)
+{
+	int err;
+
+	if (!ch)
+		return EINVAL;
+
+	if (ch->running)
+		return EALREADY;
+
+	err = allocator_init_table(ch->allocator);
+	if (err)
+		return err;
+
+	re_printf("churn: %u allocations/s, %u in flight at most,"
+		  " held for %u ms\n",
+		  ch->conf.rate, ch->conf.window, ch->conf.hold_ms);
+
+	ch->running = true;
+	ch->t_start = ch->t_prev = tperf_clock_ns();
+
+	tmr_start(&ch->tmr, 0, tmr_handler, ch);
+	tmr_start(&ch->tmr_stats, CHURN_STATS_MS, tmr_stats_handler, ch);
+
+	return 0;
+}
+
+/* no new allocations; the ones that are up stay until churn_close() */
+void churn_stop(struct churn *ch)
+{
+	if (!ch || !ch->running)
+		return;
+
+	ch->running = false;
+	tmr_cancel(&ch->tmr);
+	tmr_cancel(&ch->tmr_stats);
+
+	if (ch->doneh)
+		ch->doneh(ch->arg);
+}
+
+void churn_close(struct churn *ch)
+{
+	if (!ch)
+		return;
+
+	tmr_cancel(&ch->tmr);
+	tmr_cancel(&ch->tmr_stats);
+	ch->running = false;
+
+	list_flush(&ch->entl);
+}
+
+int churn_print(struct re_printf *pf, const struct churn *ch)
+{
+	if (!ch)
+		return 0;
+
+	return re_hprintf(pf, "%llu started, %llu ok, %llu failed,"
+			  " %llu dropped, %llu released; %u in flight,"
+			  " %u live, %u waiting; %llu skipped",
+			  ch->started, ch->ok, ch->failed, ch->dropped,
+			  ch->released, ch->inflight, ch->live,
+			  ch->backlog, ch->skipped);
+}
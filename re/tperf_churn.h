@@ -0,0 +1,68 @@
+#ifndef MY_TPERF_CHURN_H_INCLUIDO
+#define MY_TPERF_CHURN_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+#include "tperf_util.h"
+
+/* how long a released allocation waits for the delete response */
+#define CHURN_LINGER_MS 2000
+
+struct churn_conf {
+	unsigned rate;             /* new allocations per second */
+	unsigned window;           /* setups in flight, at most */
+	unsigned hold_ms;          /* time an allocation is kept */
+	unsigned duration_ms;      /* 0: until stopped */
+};
+
+/* creates allocation number ix, reporting to alloch/alloc_arg */
+typedef int  (churn_create_h)(struct allocation **allocp, unsigned ix,
+			      allocation_h *alloch, void *alloc_arg,
+			      void *arg);
+typedef void (churn_done_h)(void *arg);
+
+/*
+ * Allocation churn. New allocations are started at a fixed rate, as
+ * long as fewer than `window' are being set up, and every allocation
+ * that came up is deleted again after `hold_ms'. Setups that do not
+ * fit in the window wait, and are given up after a second of debt.
+ */
+struct churn {
+	struct churn_conf conf;
+	struct allocator *allocator;
+	churn_create_h *createh;
+	churn_done_h *doneh;
+	void *arg;
+
+	struct list entl;
+	struct tmr tmr;
+	struct tmr tmr_stats;
+	bool running;
+
+	uint64_t t_start;
+	unsigned next_ix;
+	unsigned inflight;
+	unsigned live;
+	unsigned backlog;          /* setups waiting for the window */
+
+	uint64_t launched;         /* attempts, for the schedule */
+	uint64_t started;
+	uint64_t ok;
+	uint64_t failed;
+	uint64_t dropped;          /* lost after they were up */
+	uint64_t released;
+	uint64_t skipped;          /* setups given up on */
+	uint64_t ok_prev;
+	uint64_t t_prev;
+};
+
+int  churn_init(struct churn *ch, const struct churn_conf *conf,
+		struct allocator *allocator, churn_create_h *createh,
+		churn_done_h *doneh, void *arg);
+int  churn_start(struct churn *ch);
+void churn_stop(struct churn *ch);
+void churn_close(struct churn *ch);
+int  churn_print(struct re_printf *pf, const struct churn *ch);
+
+#endif
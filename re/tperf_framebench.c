@@ -0,0 +1,382 @@
+/*
+ * Microbenchmark for the TURN-over-TCP framer. A stream of ChannelData
+ * and STUN frames is cut into randomly sized segments and fed to the
+ * framer, and to the old append-and-reparse reassembly for comparison.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <re.h>
+
+#include "tperf_framer.h"
+
+struct bench {
+	uint64_t frames;
+	uint64_t bytes;
+	uint32_t sum;
+};
+
+struct segment {
+	const uint8_t *p;
+	size_t len;
+};
+
+static struct {
+	unsigned frames;
+	unsigned rounds;
+	size_t seg_max;
+	unsigned seed;
+} conf = {
+	.frames  = 100000,
+	.rounds  = 20,
+	.seg_max = 4096,
+	.seed    = 1,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int frame_handler(struct mbuf *mb, void *arg)
+{
+	struct bench *b = arg;
+	size_t n = mbuf_get_left(mb);
+
+	b->frames += 1;
+	b->bytes  += n;
+	b->sum    += mbuf_buf(mb)[n - 1];
+
+	return 0;
+}
+
+/*
+ * The re-assembly that tcp_recv_handler used to do, except that it
+ * waits for the padding too; the original lost sync when the padding
+ * of a frame arrived in the next segment.
+ */
+static int legacy_input(struct mbuf **mbp, struct mbuf *mb_pkt,
+			framer_frame_h *frameh, void *arg)
+{
+	int err = 0;
+
+	if (*mbp) {
+		size_t pos = (*mbp)->pos;
+
+		(*mbp)->pos = (*mbp)->end;
+
+		err = mbuf_write_mem(*mbp, mbuf_buf(mb_pkt),
+				     mbuf_get_left(mb_pkt));
+		if (err)
+			return err;
+
+		(*mbp)->pos = pos;
+	}
+	else {
+		*mbp = mem_ref(mb_pkt);
+	}
+
+	for (;;) {
+		struct mbuf *mb = *mbp;
+		size_t len, pos, end;
+		uint16_t typ, l;
+
+		if (mbuf_get_left(mb) < 4)
+			break;
+
+		typ = ntohs(mbuf_read_u16(mb));
+		l   = ntohs(mbuf_read_u16(mb));
+
+		err = framer_frame_len(typ, l, &len);
+		if (err)
+			return err;
+
+		mb->pos -= 4;
+
+		if (mbuf_get_left(mb) < ((len + 3) & ~(size_t)3))
+			break;
+
+		pos = mb->pos;
+		end = mb->end;
+
+		mb->end = pos + len;
+
+		err = frameh(mb, arg);
+		if (err)
+			return err;
+
+		while (len & 0x03)
+			++len;
+
+		mb->pos = pos + len;
+		mb->end = end;
+
+		if (mb->pos >= mb->end) {
+			*mbp = mem_deref(*mbp);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int stream_build(struct mbuf **mbp, uint32_t *sum)
+{
+	struct mbuf *mb;
+	unsigned i;
+	int err = 0;
+
+	mb = mbuf_alloc(conf.frames * 800);
+	if (!mb)
+		return ENOMEM;
+
+	*sum = 0;
+
+	for (i = 0; i < conf.frames && !err; i++) {
+
+		uint8_t mark = (uint8_t)i;
+		size_t len;
+
+		if (rand() % 5 == 0) {
+			/* Data indication */
+			len = 4 * (2 + rand() % 100);
+
+			err |= mbuf_write_u16(mb, htons(0x0017));
+			err |= mbuf_write_u16(mb, htons((uint16_t)len));
+			err |= mbuf_write_u32(mb, htonl(0x2112a442));
+			err |= mbuf_fill(mb, 0x11, 12);
+			err |= mbuf_fill(mb, 0x22, len - 1);
+			err |= mbuf_write_u8(mb, mark);
+		}
+		else {
+			/* ChannelData, padded to 4 bytes */
+			len = 20 + rand() % 1380;
+
+			err |= mbuf_write_u16(mb, htons(0x4000 + rand() % 256));
+			err |= mbuf_write_u16(mb, htons((uint16_t)len));
+			err |= mbuf_fill(mb, 0x33, len - 1);
+			err |= mbuf_write_u8(mb, mark);
+
+			while (len++ & 0x03)
+				err |= mbuf_write_u8(mb, 0);
+		}
+
+		*sum += mark;
+	}
+
+	mb->pos = 0;
+
+	if (err)
+		mem_deref(mb);
+	else
+		*mbp = mb;
+
+	return err;
+}
+
+static size_t segments_cut(struct segment *segv, size_t segc,
+			   const struct mbuf *stream)
+{
+	size_t n = 0, pos = 0;
+
+	while (pos < stream->end && n < segc) {
+
+		size_t len = 1 + rand() % conf.seg_max;
+
+		if (len > stream->end - pos)
+			len = stream->end - pos;
+
+		segv[n].p   = stream->buf + pos;
+		segv[n].len = len;
+
+		pos += len;
+		++n;
+	}
+
+	return n;
+}
+
+/*
+ * Simulates the socket read: every segment is copied into the receive
+ * mbuf, which is reused unless the handler kept a reference to it.
+ */
+static int run(bool legacy, const struct segment *segv, size_t segc,
+	       struct bench *b, struct framer *fr, double *secs)
+{
+	struct mbuf *rx = NULL, *reasm = NULL;
+	uint64_t t0;
+	unsigned r;
+	size_t i;
+	int err = 0;
+
+	memset(b, 0, sizeof(*b));
+
+	t0 = now_ns();
+
+	for (r = 0; r < conf.rounds && !err; r++) {
+
+		for (i = 0; i < segc; i++) {
+
+			if (!rx || mem_nrefs(rx) > 1) {
+				mem_deref(rx);
+				rx = mbuf_alloc(conf.seg_max);
+				if (!rx)
+					return ENOMEM;
+			}
+
+			rx->pos = rx->end = 0;
+			err = mbuf_write_mem(rx, segv[i].p, segv[i].len);
+			if (err)
+				break;
+			rx->pos = 0;
+
+			if (legacy)
+				err = legacy_input(&reasm, rx,
+						   frame_handler, b);
+			else
+				err = framer_input(fr, rx, frame_handler, b);
+			if (err)
+				break;
+		}
+	}
+
+	*secs = (now_ns() - t0) / 1e9;
+
+	mem_deref(reasm);
+	mem_deref(rx);
+
+	return err;
+}
+
+/* false if the frames seen do not match the stream that was fed */
+static bool report(const char *name, const struct bench *b, double secs,
+		   uint32_t sum)
+{
+	uint32_t exp = sum * conf.rounds;
+	bool ok = b->sum == exp &&
+		b->frames == (uint64_t)conf.frames * conf.rounds;
+
+	re_printf("%-8s %10.0f frames/s  %8.1f MB/s  %7.3f s  %s\n",
+		  name, b->frames / secs, b->bytes / secs / 1e6, secs,
+		  ok ? "ok" : "MISMATCH");
+
+	return ok;
+}
+
+static void usage(void)
+{
+	(void)re_fprintf(stderr,
+			 "usage: tperf_framebench [options]\n"
+			 "\t-n <frames>   Frames in the stream (%u)\n"
+			 "\t-r <rounds>   Times the stream is fed (%u)\n"
+			 "\t-f <bytes>    Maximum segment size (%zu)\n"
+			 "\t-s <seed>     Random seed (%u)\n",
+			 conf.frames, conf.rounds, conf.seg_max, conf.seed);
+}
+
+int main(int argc, char *argv[])
+{
+	struct mbuf *stream = NULL;
+	struct segment *segv = NULL;
+	struct framer *fr = NULL;
+	struct bench b;
+	size_t segc;
+	uint32_t sum;
+	double secs;
+	bool ok;
+	int err;
+
+	for (;;) {
+		const int c = getopt(argc, argv, "n:r:f:s:h");
+		if (0 > c)
+			break;
+
+		switch (c) {
+
+		case 'n':
+			conf.frames = atoi(optarg);
+			break;
+
+		case 'r':
+			conf.rounds = atoi(optarg);
+			break;
+
+		case 'f':
+			conf.seg_max = atoi(optarg);
+			break;
+
+		case 's':
+			conf.seed = atoi(optarg);
+			break;
+
+		default:
+			usage();
+			return EINVAL;
+		}
+	}
+
+	if (!conf.frames || !conf.rounds || !conf.seg_max) {
+		usage();
+		return EINVAL;
+	}
+
+	err = libre_init();
+	if (err)
+		return err;
+
+	srand(conf.seed);
+
+	err = stream_build(&stream, &sum);
+	if (err)
+		goto out;
+
+	segv = mem_zalloc(stream->end * sizeof(*segv), NULL);
+	if (!segv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	segc = segments_cut(segv, stream->end, stream);
+
+	re_printf("%u frames, %zu bytes, %zu segments of 1..%zu bytes,"
+		  " %u rounds\n", conf.frames, stream->end, segc,
+		  conf.seg_max, conf.rounds);
+
+	err = framer_alloc(&fr);
+	if (err)
+		goto out;
+
+	err = run(false, segv, segc, &b, fr, &secs);
+	if (err)
+		goto out;
+
+	ok = report("framer", &b, secs, sum);
+	re_printf("         %H\n", framer_print, fr);
+
+	err = run(true, segv, segc, &b, NULL, &secs);
+	if (err)
+		goto out;
+
+	ok &= report("legacy", &b, secs, sum);
+	if (!ok)
+		err = EPROTO;
+
+ out:
+	if (err)
+		re_fprintf(stderr, "framebench failed (%m)\n", err);
+
+	mem_deref(fr);
+	mem_deref(segv);
+	mem_deref(stream);
+	libre_close();
+
+	return err;
+}
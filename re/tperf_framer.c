@@ -0,0 +1,218 @@
+#include "tperf_framer.h"
+
+#include <string.h>
+
+#define RING_MASK (FRAMER_SIZE - 1)
+
+static void framer_destructor(void *arg)
+{
+	struct framer *fr = arg;
+
+	mem_deref(fr->view);
+	mem_deref(fr->lin);
+	mem_deref(fr->ring);
+}
+
+int framer_alloc(struct framer **frp)
+{
+	struct framer *fr;
+	int err = 0;
+
+	if (!frp)
+		return EINVAL;
+
+	fr = mem_zalloc(sizeof(*fr), framer_destructor);
+	if (!fr)
+		return ENOMEM;
+
+	fr->ring = mem_alloc(FRAMER_SIZE, NULL);
+	fr->lin  = mem_alloc(FRAMER_FRAME_MAX, NULL);
+
+	/* an mbuf header only, its buffer is the ring or lin */
+	fr->view = mem_zalloc(sizeof(*fr->view), NULL);
+
+	if (!fr->ring || !fr->lin || !fr->view)
+		err = ENOMEM;
+
+	if (err)
+		mem_deref(fr);
+	else
+		*frp = fr;
+
+	return err;
+}
+
+void framer_reset(struct framer *fr)
+{
+	if (!fr)
+		return;
+
+	fr->rd = fr->wr = 0;
+}
+
+/* total length of a frame, without the TCP padding */
+int framer_frame_len(uint16_t typ, uint16_t len, size_t *frame_len)
+{
+	if (typ < 0x4000)
+		*frame_len = len + STUN_HEADER_SIZE;
+	else if (typ < 0x8000)
+		*frame_len = len + 4;
+	else
+		return EBADMSG;
+
+	return 0;
+}
+
+static inline size_t pad4(size_t len)
+{
+	return (len + 3) & ~(size_t)3;
+}
+
+static void ring_write(struct framer *fr, const uint8_t *p, size_t n)
+{
+	size_t off = fr->wr & RING_MASK;
+	size_t n1 = min(n, FRAMER_SIZE - off);
+
+	memcpy(fr->ring + off, p, n1);
+	memcpy(fr->ring, p + n1, n - n1);
+
+	fr->wr     += n;
+	fr->copied += n;
+}
+
+static uint8_t ring_at(const struct framer *fr, uint64_t ofs)
+{
+	return fr->ring[ofs & RING_MASK];
+}
+
+static int ring_deliver(struct framer *fr, size_t len,
+			framer_frame_h *frameh, void *arg)
+{
+	size_t off = fr->rd & RING_MASK;
+	struct mbuf *mb = fr->view;
+
+	if (off + len <= FRAMER_SIZE) {
+		mb->buf  = fr->ring;
+		mb->size = FRAMER_SIZE;
+		mb->pos  = off;
+		mb->end  = off + len;
+	}
+	else {
+		size_t n1 = FRAMER_SIZE - off;
+
+		memcpy(fr->lin, fr->ring + off, n1);
+		memcpy(fr->lin + n1, fr->ring, len - n1);
+
+		mb->buf  = fr->lin;
+		mb->size = FRAMER_FRAME_MAX;
+		mb->pos  = 0;
+		mb->end  = len;
+
+		++fr->wrapped;
+	}
+
+	++fr->frames;
+	++fr->buffered;
+
+	return frameh(mb, arg);
+}
+
+int framer_input(struct framer *fr, struct mbuf *mb,
+		 framer_frame_h *frameh, void *arg)
+{
+	size_t end;
+	int err = 0;
+
+	if (!fr || !mb || !frameh)
+		return EINVAL;
+
+	/* complete the frame that straddles the previous segment */
+	while (fr->wr > fr->rd) {
+
+		size_t pending = (size_t)(fr->wr - fr->rd);
+		size_t len, need, n;
+		uint16_t typ, l;
+
+		if (pending < 4) {
+			n = min(4 - pending, mbuf_get_left(mb));
+			ring_write(fr, mbuf_buf(mb), n);
+			mbuf_advance(mb, n);
+
+			if (fr->wr - fr->rd < 4)
+				return 0;
+
+			pending = 4;
+		}
+
+		typ = ring_at(fr, fr->rd) << 8 | ring_at(fr, fr->rd + 1);
+		l   = ring_at(fr, fr->rd + 2) << 8 | ring_at(fr, fr->rd + 3);
+
+		err = framer_frame_len(typ, l, &len);
+		if (err)
+			return err;
+
+		need = pad4(len) - pending;
+		n = min(need, mbuf_get_left(mb));
+		ring_write(fr, mbuf_buf(mb), n);
+		mbuf_advance(mb, n);
+
+		if (n < need)
+			return 0;
+
+		err = ring_deliver(fr, len, frameh, arg);
+
+		fr->rd += pad4(len);
+
+		if (err)
+			return err;
+	}
+
+	/* frames inside this segment, handed out in place */
+	end = mb->end;
+
+	while (mbuf_get_left(mb) >= 4) {
+
+		const uint8_t *p = mbuf_buf(mb);
+		size_t start = mb->pos, len;
+
+		err = framer_frame_len(p[0] << 8 | p[1], p[2] << 8 | p[3],
+				       &len);
+		if (err)
+			return err;
+
+		if (end - start < pad4(len))
+			break;
+
+		mb->end = start + len;
+
+		++fr->frames;
+		++fr->inplace;
+
+		err = frameh(mb, arg);
+
+		mb->pos = start + pad4(len);
+		mb->end = end;
+
+		if (err)
+			return err;
+	}
+
+	/* keep the tail, the ring is empty at this point */
+	if (mbuf_get_left(mb)) {
+		ring_write(fr, mbuf_buf(mb), mbuf_get_left(mb));
+		mb->pos = mb->end;
+	}
+
+	return 0;
+}
+
+int framer_print(struct re_printf *pf, const struct framer *fr)
+{
+	if (!fr)
+		return 0;
+
+	return re_hprintf(pf, "%llu frames (%llu in place, %llu buffered,"
+			  " %llu wrapped), %llu bytes copied",
+			  fr->frames, fr->inplace, fr->buffered,
+			  fr->wrapped, fr->copied);
+}
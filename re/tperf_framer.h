@@ -0,0 +1,41 @@
+#ifndef MY_TPERF_FRAMER_H_INCLUIDO
+#define MY_TPERF_FRAMER_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+/* ring size, power of two and larger than the biggest TURN frame */
+#define FRAMER_SIZE 131072
+#define FRAMER_FRAME_MAX (65535 + STUN_HEADER_SIZE + 3)
+
+/*
+ * TURN-over-TCP framer. Frames that are complete inside one segment
+ * are handed out in place. Only the bytes of a frame that straddles a
+ * segment boundary are kept in the ring, and such a frame is copied
+ * once more only if it wraps around the end of the ring.
+ */
+struct framer {
+	uint8_t *ring;
+	uint8_t *lin;              /* linear copy of a wrapping frame */
+	struct mbuf *view;         /* frame view into ring or lin */
+	uint64_t rd;               /* absolute stream offsets */
+	uint64_t wr;
+
+	uint64_t frames;
+	uint64_t inplace;          /* frames handed out from the segment */
+	uint64_t buffered;         /* frames completed in the ring */
+	uint64_t wrapped;          /* frames copied because they wrapped */
+	uint64_t copied;           /* bytes written into the ring */
+};
+
+/* the frame is mbuf_buf(mb) .. mb->end; pos/end are restored after */
+typedef int (framer_frame_h)(struct mbuf *mb, void *arg);
+
+int  framer_alloc(struct framer **frp);
+void framer_reset(struct framer *fr);
+int  framer_input(struct framer *fr, struct mbuf *mb,
+		  framer_frame_h *frameh, void *arg);
+int  framer_frame_len(uint16_t typ, uint16_t len, size_t *frame_len);
+int  framer_print(struct re_printf *pf, const struct framer *fr);
+
+#endif
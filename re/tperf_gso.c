@@ -0,0 +1,187 @@
+#include "tperf_gso.h"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+int gso_init(struct gso *g, bool on)
+{
+	if (!g)
+		return EINVAL;
+
+	memset(g, 0, sizeof(*g));
+
+	g->on = on;
+	g->fd = -1;
+
+	if (!on)
+		return 0;
+
+	g->buf = mem_alloc(GSO_BYTES_MAX, NULL);
+	if (!g->buf)
+		return ENOMEM;
+
+	return 0;
+}
+
+void gso_close(struct gso *g)
+{
+	if (!g)
+		return;
+
+	g->buf  = mem_deref(g->buf);
+	g->nseg = 0;
+	g->len  = 0;
+}
+
+/* one datagram per system call, as without GSO */
+static int gso_send_each(struct gso *g)
+{
+	size_t pos;
+	int err = 0;
+
+	for (pos = 0; pos < g->len; pos += g->segsz) {
+
+		size_t n = min(g->segsz, g->len - pos);
+
+		++g->sends;
+
+		if (sendto(g->fd, g->buf + pos, n, 0, &g->dst.u.sa,
+			   g->dst.len) < 0) {
+			err = errno;
+			++g->errors;
+			continue;
+		}
+
+		++g->segs;
+	}
+
+	return err;
+}
+
+int gso_flush(struct gso *g)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+		struct cmsghdr align;
+	} ctl;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	uint16_t segsz;
+	int err = 0;
+
+	if (!g || !g->nseg)
+		return 0;
+
+	if (g->fallback || g->nseg == 1) {
+		err = gso_send_each(g);
+		goto out;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&ctl, 0, sizeof(ctl));
+
+	iov.iov_base = g->buf;
+	iov.iov_len  = g->len;
+
+	msg.msg_name       = &g->dst.u.sa;
+	msg.msg_namelen    = g->dst.len;
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	segsz = (uint16_t)g->segsz;
+
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type  = UDP_SEGMENT;
+	cm->cmsg_len   = CMSG_LEN(sizeof(segsz));
+	memcpy(CMSG_DATA(cm), &segsz, sizeof(segsz));
+
+	++g->sends;
+
+	if (sendmsg(g->fd, &msg, 0) < 0) {
+		err = errno;
+
+		/* no GSO in this kernel, or not for this device */
+		if (err == EINVAL || err == EIO || err == ENOPROTOOPT ||
+		    err == EOPNOTSUPP) {
+			re_fprintf(stderr, "gso: UDP_SEGMENT refused (%m),"
+				   " one datagram per send\n", err);
+			g->fallback = true;
+			--g->sends;
+			err = gso_send_each(g);
+			goto out;
+		}
+
+		g->errors += g->nseg;
+		goto out;
+	}
+
+	g->segs += g->nseg;
+
+ out:
+	g->nseg = 0;
+	g->len  = 0;
+
+	return err;
+}
+
+/*
+ * The packet goes out with a later flush, together with others; a
+ * failed send is counted in errors, and not returned to the caller
+ * whose packet happened to trigger it.
+ */
+int gso_append(struct gso *g, int fd, const struct sa *dst,
+	       const uint8_t *p, size_t len)
+{
+	if (!g || !g->buf || !dst || !p || !len || len > GSO_BYTES_MAX)
+		return EINVAL;
+
+	/* segments of one size, only the last one may be shorter */
+	if (g->nseg && (fd != g->fd || len > g->segsz ||
+			!sa_cmp(dst, &g->dst, SA_ALL) ||
+			g->len + len > GSO_BYTES_MAX))
+		(void)gso_flush(g);
+
+	if (!g->nseg) {
+		g->fd    = fd;
+		g->dst   = *dst;
+		g->segsz = len;
+	}
+
+	memcpy(g->buf + g->len, p, len);
+	g->len += len;
+
+	if (++g->nseg >= GSO_SEGS_MAX || len < g->segsz)
+		(void)gso_flush(g);
+
+	return 0;
+}
+
+/* pacer tick, at the end of every wakeup */
+void gso_tick(void *arg)
+{
+	(void)gso_flush(arg);
+}
+
+int gso_print(struct re_printf *pf, const struct gso *g)
+{
+	if (!g)
+		return 0;
+
+	return re_hprintf(pf, "%llu datagrams in %llu sends, %.1f per send%s,"
+			  " %llu errors", g->segs, g->sends,
+			  g->sends ? (double)g->segs / g->sends : 0.0,
+			  g->fallback ? " (no GSO)" : "", g->errors);
+}
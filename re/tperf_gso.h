@@ -0,0 +1,47 @@
+#ifndef MY_TPERF_GSO_H_INCLUIDO
+#define MY_TPERF_GSO_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+/* UDP_MAX_SEGMENTS of the kernel */
+#define GSO_SEGS_MAX 64
+/* one UDP payload, the segments together */
+#define GSO_BYTES_MAX 65000
+
+/*
+ * UDP segmentation offload for the peer-side sends of an allocator.
+ * Packets of the same size to the same relay address are gathered in
+ * one buffer and go out with one sendmsg(2) and a UDP_SEGMENT control
+ * message; the kernel cuts them into datagrams again. The buffer is
+ * flushed when the destination changes, when a larger packet comes,
+ * after a shorter one (which the kernel takes only as the last
+ * segment), when it is full, and at the end of every pacer wakeup.
+ *
+ * If the kernel refuses GSO, the buffer is sent one datagram at a time
+ * from then on.
+ */
+struct gso {
+	bool on;
+	uint8_t *buf;
+	size_t len;
+	size_t segsz;
+	unsigned nseg;
+	int fd;
+	struct sa dst;
+	bool fallback;             /* the kernel refused UDP_SEGMENT */
+
+	uint64_t sends;            /* system calls */
+	uint64_t segs;             /* datagrams */
+	uint64_t errors;           /* datagrams that did not go out */
+};
+
+int  gso_init(struct gso *g, bool on);
+void gso_close(struct gso *g);
+int  gso_append(struct gso *g, int fd, const struct sa *dst,
+		const uint8_t *p, size_t len);
+int  gso_flush(struct gso *g);
+void gso_tick(void *arg);
+int  gso_print(struct re_printf *pf, const struct gso *g);
+
+#endif
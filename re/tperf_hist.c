@@ -0,0 +1,158 @@
+#include "tperf_hist.h"
+
+#include <string.h>
+
+#define SUB_COUNT (1u << HIST_SUB_BITS)
+
+static inline unsigned bucket_index(uint64_t v)
+{
+	unsigned e;
+
+	if (v < SUB_COUNT)
+		return (unsigned)v;
+
+	e = 63 - __builtin_clzll(v);
+
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+		+ (unsigned)((v >> (e - HIST_SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/* middle of the bucket */
+static uint64_t bucket_value(unsigned ix)
+{
+	unsigned e;
+	uint64_t lo, width;
+
+	if (ix < SUB_COUNT)
+		return ix;
+
+	e     = (ix >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	width = 1ULL << (e - HIST_SUB_BITS);
+	lo    = (1ULL << e) + (ix & (SUB_COUNT - 1)) * width;
+
+	return lo + width / 2;
+}
+
+void hist_reset(struct hist *h)
+{
+	if (!h)
+		return;
+
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void hist_record(struct hist *h, uint64_t v)
+{
+	if (!h)
+		return;
+
+	++h->count[bucket_index(v)];
+	++h->n;
+	h->sum += v;
+
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+	unsigned i;
+
+	if (!dst || !src || !src->n)
+		return;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->count[i] += src->count[i];
+
+	dst->n   += src->n;
+	dst->sum += src->sum;
+
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/*
+ * Removes an earlier snapshot of the same histogram, leaving what was
+ * recorded since. min/max of the difference are only known to the
+ * precision of the buckets.
+ */
+void hist_sub(struct hist *dst, const struct hist *src)
+{
+	unsigned i, lo = HIST_BUCKETS, hi = 0;
+
+	if (!dst || !src)
+		return;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+
+		dst->count[i] -= src->count[i];
+
+		if (dst->count[i]) {
+			if (lo == HIST_BUCKETS)
+				lo = i;
+			hi = i;
+		}
+	}
+
+	dst->n   -= src->n;
+	dst->sum -= src->sum;
+
+	if (lo == HIST_BUCKETS) {
+		dst->min = UINT64_MAX;
+		dst->max = 0;
+	}
+	else {
+		dst->min = max(dst->min, bucket_value(lo));
+		dst->max = min(dst->max, bucket_value(hi));
+	}
+}
+
+/* pct in [0, 100]; the result is clamped to the recorded min/max */
+uint64_t hist_percentile(const struct hist *h, double pct)
+{
+	uint64_t rank, seen = 0, v;
+	unsigned i;
+
+	if (!h || !h->n)
+		return 0;
+
+	rank = (uint64_t)(pct / 100.0 * h->n + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > h->n)
+		rank = h->n;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen >= rank)
+			break;
+	}
+
+	v = bucket_value(i);
+
+	if (v < h->min)
+		v = h->min;
+	if (v > h->max)
+		v = h->max;
+
+	return v;
+}
+
+/* for a histogram of nanoseconds */
+int hist_print_us(struct re_printf *pf, const struct hist *h)
+{
+	if (!h || !h->n)
+		return re_hprintf(pf, "no samples");
+
+	return re_hprintf(pf, "p50 %.1f us, p99 %.1f us, p99.9 %.1f us,"
+			  " max %.1f us",
+			  hist_percentile(h, 50) / 1e3,
+			  hist_percentile(h, 99) / 1e3,
+			  hist_percentile(h, 99.9) / 1e3,
+			  h->max / 1e3);
+}
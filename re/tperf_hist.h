@@ -0,0 +1,31 @@
+#ifndef MY_TPERF_HIST_H_INCLUIDO
+#define MY_TPERF_HIST_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+/* sub-buckets per power of two; 2^5 keeps the error below ~3% */
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/*
+ * Log-linear histogram of 64-bit values, in the manner of HdrHistogram:
+ * values below 2^HIST_SUB_BITS are exact, larger ones are kept with a
+ * fixed relative precision. Recording is a couple of shifts.
+ */
+struct hist {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t n;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+void     hist_reset(struct hist *h);
+void     hist_record(struct hist *h, uint64_t v);
+void     hist_merge(struct hist *dst, const struct hist *src);
+void     hist_sub(struct hist *dst, const struct hist *src);
+uint64_t hist_percentile(const struct hist *h, double pct);
+int      hist_print_us(struct re_printf *pf, const struct hist *h);
+
+#endif
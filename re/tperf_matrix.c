@@ -0,0 +1,293 @@
+#include "tperf_matrix.h"
+#include "tperf_util.h"
+
+#include <string.h>
+
+static const struct matrix_cell cellv[MATRIX_CELLS] = {
+	{IPPROTO_UDP, false, true },
+	{IPPROTO_UDP, false, false},
+	{IPPROTO_TCP, false, true },
+	{IPPROTO_TCP, false, false},
+	{IPPROTO_TCP, true,  true },
+	{IPPROTO_TCP, true,  false},
+	{IPPROTO_UDP, true,  true },
+	{IPPROTO_UDP, true,  false},
+};
+
+static const char *framing_name(bool turn_ind)
+{
+	return turn_ind ? "send-ind" : "channel";
+}
+
+static void cell_apply(struct matrix *mx);
+static void window_handler(void *arg);
+
+static void matrix_finish(struct matrix *mx)
+{
+	mx->running = false;
+	tmr_cancel(&mx->tmr);
+
+	if (mx->doneh)
+		mx->doneh(mx->arg);
+}
+
+static void linger_handler(void *arg)
+{
+	struct matrix *mx = arg;
+
+	if (++mx->cur >= MATRIX_CELLS) {
+		matrix_finish(mx);
+		return;
+	}
+
+	cell_apply(mx);
+}
+
+/* the cell is over; its releases go out before the next one starts */
+static void cell_end(struct matrix *mx)
+{
+	mx->state = MATRIX_LINGER;
+	mx->releaseh(mx->arg);
+
+	tmr_start(&mx->tmr, MATRIX_LINGER_MS, linger_handler, mx);
+}
+
+static void setup_timeout_handler(void *arg)
+{
+	struct matrix *mx = arg;
+
+	re_fprintf(stderr, "matrix: allocations not up after %u ms\n",
+		   MATRIX_SETUP_MS);
+
+	matrix_fail(mx, ETIMEDOUT);
+}
+
+static void cell_apply(struct matrix *mx)
+{
+	const struct matrix_cell *cell = &cellv[mx->cur];
+	int err;
+
+	re_printf("\nmatrix cell %u/%u: %s, %s\n",
+		  mx->cur + 1, MATRIX_CELLS,
+		  protocol_name(cell->proto, cell->secure),
+		  framing_name(cell->turn_ind));
+
+	setupstat_reset(&mx->allocator->setup);
+
+	mx->state = MATRIX_SETUP;
+	tmr_start(&mx->tmr, MATRIX_SETUP_MS, setup_timeout_handler, mx);
+
+	err = mx->applyh(cell, mx->arg);
+	if (err)
+		matrix_fail(mx, err);
+}
+
+static void window_begin(struct matrix *mx)
+{
+	struct allocator *allocator = mx->allocator;
+	struct rxstat st;
+
+	allocator_rxstat(allocator, &st);
+
+	mx->t0        = tperf_clock_ns();
+	mx->cpu0      = tperf_cpu_ns();
+	mx->tx_bytes0 = COUNTER_GET(allocator->ctr.tx_bytes);
+	mx->rx_bytes0 = st.bytes;
+	mx->received0 = st.received;
+	mx->lost0     = st.lost;
+
+	hist_reset(&allocator->lat);
+
+	tmr_start(&mx->tmr, mx->hold_ms, window_handler, mx);
+}
+
+static void window_sample(const struct matrix *mx, struct matrix_result *r)
+{
+	const struct allocator *allocator = mx->allocator;
+	uint64_t cpu = tperf_cpu_ns() - mx->cpu0;
+	uint64_t received, lost;
+	double rx_mbit;
+	struct rxstat st;
+
+	allocator_rxstat(allocator, &st);
+
+	received = st.received - mx->received0;
+	lost     = rxstat_delta(st.lost, mx->lost0);
+	rx_mbit  = 8.0 * (st.bytes - mx->rx_bytes0) / 1e6;
+
+	r->done   = true;
+	r->secs   = (tperf_clock_ns() - mx->t0) / 1e9;
+	r->tx_bps = 8.0 * (COUNTER_GET(allocator->ctr.tx_bytes)
+			   - mx->tx_bytes0) / r->secs;
+	r->rx_bps = rx_mbit * 1e6 / r->secs;
+	r->cpu    = 100.0 * cpu / 1e9 / r->secs;
+
+	if (received + lost)
+		r->loss = 100.0 * lost / (received + lost);
+
+	if (rx_mbit > 0)
+		r->cpu_mbit = cpu / 1e6 / rx_mbit;
+
+	r->lat_p50 = hist_percentile(&allocator->lat, 50);
+	r->lat_p99 = hist_percentile(&allocator->lat, 99);
+}
+
+static void window_handler(void *arg)
+{
+	struct matrix *mx = arg;
+	struct matrix_result *r = &mx->resv[mx->cur];
+
+	/* the first window of a cell is only warmup */
+	if (mx->state == MATRIX_WARMUP) {
+		mx->state = MATRIX_MEASURE;
+		window_begin(mx);
+		return;
+	}
+
+	window_sample(mx, r);
+
+	re_printf("matrix cell %u: rx %.2f Mbit/s, loss %.3f%%, latency p50"
+		  " %.2f ms p99 %.2f ms, cpu %.0f%% (%.2f ms/Mbit)\n",
+		  mx->cur + 1, r->rx_bps / 1e6, r->loss,
+		  r->lat_p50 / 1e6, r->lat_p99 / 1e6, r->cpu, r->cpu_mbit);
+
+	cell_end(mx);
+}
+
+int matrix_init(struct matrix *mx, unsigned hold_ms,
+		struct allocator *allocator, matrix_apply_h *applyh,
+		matrix_release_h *releaseh, matrix_done_h *doneh,
+		void *arg)
+{
+	if (!mx || !hold_ms || !allocator || !applyh || !releaseh)
+		return EINVAL;
+
+	memset(mx, 0, sizeof(*mx));
+
+	mx->hold_ms   = hold_ms;
+	mx->allocator = allocator;
+	mx->applyh    = applyh;
+	mx->releaseh  = releaseh;
+	mx->doneh     = doneh;
+	mx->arg       = arg;
+	tmr_init(&mx->tmr);
+
+	return 0;
+}
+
+int matrix_start(struct matrix *mx)
+{
+	if (!mx || !mx->applyh)
+		return EINVAL;
+
+	if (mx->running)
+		return EALREADY;
+
+	mx->running = true;
+	mx->cur     = 0;
+	memset(mx->resv, 0, sizeof(mx->resv));
+
+	re_printf("matrix: %u cells, %u ms warmup and %u ms measurement"
+		  " each\n", MATRIX_CELLS, mx->hold_ms, mx->hold_ms);
+
+	cell_apply(mx);
+
+	return 0;
+}
+
+/* all allocations of the current cell are up and sending */
+void matrix_ready(struct matrix *mx)
+{
+	if (!mx || !mx->running || mx->state != MATRIX_SETUP)
+		return;
+
+	mx->resv[mx->cur].setup_p50 =
+		hist_percentile(&mx->allocator->setup.ready, 50);
+
+	mx->state = MATRIX_WARMUP;
+	tmr_start(&mx->tmr, mx->hold_ms, window_handler, mx);
+}
+
+/* the current cell cannot run, the matrix goes on with the next one */
+void matrix_fail(struct matrix *mx, int err)
+{
+	const struct matrix_cell *cell;
+
+	if (!mx || !mx->running || mx->state == MATRIX_LINGER)
+		return;
+
+	cell = &cellv[mx->cur];
+
+	re_fprintf(stderr, "matrix: %s %s failed (%m)\n",
+		   protocol_name(cell->proto, cell->secure),
+		   framing_name(cell->turn_ind), err);
+
+	mx->resv[mx->cur].done = true;
+	mx->resv[mx->cur].err  = err ? err : EPROTO;
+
+	cell_end(mx);
+}
+
+/* ends the matrix early, keeping the cells that were measured */
+void matrix_abort(struct matrix *mx)
+{
+	if (!mx || !mx->running)
+		return;
+
+	if (mx->state != MATRIX_LINGER)
+		mx->releaseh(mx->arg);
+
+	matrix_finish(mx);
+}
+
+void matrix_close(struct matrix *mx)
+{
+	if (!mx)
+		return;
+
+	tmr_cancel(&mx->tmr);
+	mx->running = false;
+}
+
+int matrix_print(struct re_printf *pf, const struct matrix *mx)
+{
+	unsigned i;
+	int err;
+
+	if (!mx)
+		return 0;
+
+	err = re_hprintf(pf, "transport matrix (%u ms windows):\n"
+			 "  transport  framing   rx Mbit/s  tx Mbit/s"
+			 "    loss %%   p50 ms   p99 ms  setup ms"
+			 "  cpu %%  cpu ms/Mbit\n", mx->hold_ms);
+
+	for (i = 0; i < MATRIX_CELLS && !err; i++) {
+
+		const struct matrix_cell *cell = &cellv[i];
+		const struct matrix_result *r = &mx->resv[i];
+		const char *proto = protocol_name(cell->proto, cell->secure);
+		const char *framing = framing_name(cell->turn_ind);
+
+		if (!r->done) {
+			err = re_hprintf(pf, "  %-9s  %-8s  not run\n",
+					 proto, framing);
+			continue;
+		}
+
+		if (r->err) {
+			err = re_hprintf(pf, "  %-9s  %-8s  failed (%m)\n",
+					 proto, framing, r->err);
+			continue;
+		}
+
+		err = re_hprintf(pf, "  %-9s  %-8s  %9.2f  %9.2f  %8.3f"
+				 "  %7.2f  %7.2f  %8.2f  %5.0f  %11.2f\n",
+				 proto, framing,
+				 r->rx_bps / 1e6, r->tx_bps / 1e6, r->loss,
+				 r->lat_p50 / 1e6, r->lat_p99 / 1e6,
+				 r->setup_p50 / 1e6, r->cpu, r->cpu_mbit);
+	}
+
+	return err;
+}
@@ -0,0 +1,91 @@
+#ifndef MY_TPERF_MATRIX_H_INCLUIDO
+#define MY_TPERF_MATRIX_H_INCLUIDO
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <re.h>
+
+struct allocator;
+
+/* UDP, TCP, TLS and DTLS, each with Send indications and ChannelData */
+#define MATRIX_CELLS 8
+/* a cell whose allocations are not all up by then has failed */
+#define MATRIX_SETUP_MS 30000
+/* between cells, for the releases of the previous one */
+#define MATRIX_LINGER_MS 2000
+
+enum matrix_state {
+	MATRIX_SETUP,              /* creating the allocations */
+	MATRIX_WARMUP,
+	MATRIX_MEASURE,
+	MATRIX_LINGER,             /* released, waiting for the next cell */
+};
+
+struct matrix_cell {
+	int proto;
+	bool secure;
+	bool turn_ind;             /* Send indications, else ChannelData */
+};
+
+struct matrix_result {
+	bool done;
+	int err;                   /* the cell could not run */
+	double secs;
+	double tx_bps;
+	double rx_bps;
+	double loss;               /* percent */
+	double cpu;                /* percent of one core */
+	double cpu_mbit;           /* CPU time per received Mbit [ms] */
+	uint64_t lat_p50;          /* one-way latency [ns] */
+	uint64_t lat_p99;
+	uint64_t setup_p50;        /* allocation until usable [ns] */
+};
+
+/* set up the allocations of a cell; the owner calls matrix_ready() */
+typedef int  (matrix_apply_h)(const struct matrix_cell *cell, void *arg);
+/* stop the senders and release the allocations of the cell */
+typedef void (matrix_release_h)(void *arg);
+typedef void (matrix_done_h)(void *arg);
+
+/*
+ * Transport comparison. The same allocations and load are run over
+ * each cell in turn: a warmup window, then one measurement window of
+ * throughput, loss, latency and CPU. All allocations of a cell are
+ * released before the next cell starts, so the cells do not overlap.
+ */
+struct matrix {
+	unsigned hold_ms;          /* length of one window */
+	struct allocator *allocator;
+	matrix_apply_h *applyh;
+	matrix_release_h *releaseh;
+	matrix_done_h *doneh;
+	void *arg;
+	struct tmr tmr;
+
+	bool running;
+	enum matrix_state state;
+	unsigned cur;
+
+	/* snapshot at the start of the window */
+	uint64_t t0;
+	uint64_t cpu0;
+	uint64_t tx_bytes0;
+	uint64_t rx_bytes0;
+	uint64_t received0;
+	uint64_t lost0;
+
+	struct matrix_result resv[MATRIX_CELLS];
+};
+
+int  matrix_init(struct matrix *mx, unsigned hold_ms,
+		 struct allocator *allocator, matrix_apply_h *applyh,
+		 matrix_release_h *releaseh, matrix_done_h *doneh,
+		 void *arg);
+int  matrix_start(struct matrix *mx);
+void matrix_ready(struct matrix *mx);
+void matrix_fail(struct matrix *mx, int err);
+void matrix_abort(struct matrix *mx);
+void matrix_close(struct matrix *mx);
+int  matrix_print(struct re_printf *pf, const struct matrix *mx);
+
+#endif
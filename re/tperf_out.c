@@ -0,0 +1,395 @@
+#include "tperf_out.h"
+
+#include <string.h>
+
+struct outrec {
+	const char *type;
+	double t;
+	bool alloc;                /* per-allocation record */
+	bool server;               /* per-server record */
+	const struct sa *addr;
+	unsigned id;
+	uint64_t allocs;
+	uint64_t failed;
+	double tx_bps;
+	double rx_bps;
+	double tx_pps;
+	double rx_pps;
+	uint64_t received;
+	uint64_t lost;
+	double loss;               /* percent */
+	uint64_t reordered;
+	uint64_t duplicate;
+	uint64_t late;
+	uint64_t corrupt;
+	const struct hist *lat;    /* optional [ns] */
+};
+
+static const char csv_header[] =
+	"t,type,id,allocs,failed,tx_bps,rx_bps,tx_pps,rx_pps,"
+	"received,lost,loss_pct,reordered,duplicate,late,corrupt,"
+	"lat_p50_us,lat_p90_us,lat_p99_us,lat_p999_us,lat_max_us\n";
+
+static double loss_pct(uint64_t received, uint64_t lost)
+{
+	uint64_t expected = received + lost;
+
+	return expected ? 100.0 * lost / expected : 0;
+}
+
+static void jsonl_write(FILE *f, const struct outrec *r)
+{
+	re_fprintf(f, "{\"t\":%.3f,\"type\":\"%s\"", r->t, r->type);
+
+	if (r->alloc || r->server)
+		re_fprintf(f, ",\"id\":%u", r->id);
+	if (r->server)
+		re_fprintf(f, ",\"server\":\"%J\"", r->addr);
+	if (!r->alloc)
+		re_fprintf(f, ",\"allocs\":%llu,\"failed\":%llu",
+			   r->allocs, r->failed);
+
+	re_fprintf(f, ",\"tx_bps\":%.1f,\"rx_bps\":%.1f"
+		   ",\"tx_pps\":%.1f,\"rx_pps\":%.1f"
+		   ",\"received\":%llu,\"lost\":%llu,\"loss_pct\":%.4f",
+		   r->tx_bps, r->rx_bps, r->tx_pps, r->rx_pps,
+		   r->received, r->lost, r->loss);
+
+	if (!r->alloc)
+		re_fprintf(f, ",\"reordered\":%llu,\"duplicate\":%llu"
+			   ",\"late\":%llu,\"corrupt\":%llu",
+			   r->reordered, r->duplicate, r->late, r->corrupt);
+
+	if (r->lat && r->lat->n)
+		re_fprintf(f, ",\"lat_p50_us\":%.1f,\"lat_p90_us\":%.1f"
+			   ",\"lat_p99_us\":%.1f,\"lat_p999_us\":%.1f"
+			   ",\"lat_max_us\":%.1f",
+			   hist_percentile(r->lat, 50) / 1e3,
+			   hist_percentile(r->lat, 90) / 1e3,
+			   hist_percentile(r->lat, 99) / 1e3,
+			   hist_percentile(r->lat, 99.9) / 1e3,
+			   r->lat->max / 1e3);
+
+	re_fprintf(f, "}\n");
+}
+
+/* fields that a record does not have are left empty */
+static void csv_write(FILE *f, const struct outrec *r)
+{
+	re_fprintf(f, "%.3f,%s,", r->t, r->type);
+
+	if (r->alloc)
+		re_fprintf(f, "%u,,,", r->id);
+	else if (r->server)
+		re_fprintf(f, "%u,%llu,%llu,", r->id, r->allocs, r->failed);
+	else
+		re_fprintf(f, ",%llu,%llu,", r->allocs, r->failed);
+
+	re_fprintf(f, "%.1f,%.1f,%.1f,%.1f,%llu,%llu,%.4f,",
+		   r->tx_bps, r->rx_bps, r->tx_pps, r->rx_pps,
+		   r->received, r->lost, r->loss);
+
+	if (r->alloc)
+		re_fprintf(f, ",,,,");
+	else
+		re_fprintf(f, "%llu,%llu,%llu,%llu,", r->reordered,
+			   r->duplicate, r->late, r->corrupt);
+
+	if (r->lat && r->lat->n)
+		re_fprintf(f, "%.1f,%.1f,%.1f,%.1f,%.1f\n",
+			   hist_percentile(r->lat, 50) / 1e3,
+			   hist_percentile(r->lat, 90) / 1e3,
+			   hist_percentile(r->lat, 99) / 1e3,
+			   hist_percentile(r->lat, 99.9) / 1e3,
+			   r->lat->max / 1e3);
+	else
+		re_fprintf(f, ",,,,\n");
+}
+
+static void outrec_write(const struct outsink *os, const struct outrec *r)
+{
+	if (os->fmt == OUT_CSV)
+		csv_write(os->f, r);
+	else
+		jsonl_write(os->f, r);
+}
+
+/* aggregate record from two totals, dt == 0 for the whole run */
+static void outrec_totals(struct outrec *r, const struct counters *cur,
+			  const struct counters *prev, double secs)
+{
+	r->allocs    = cur->allocations;
+	r->failed    = cur->failed;
+	r->tx_bps    = 8.0 * (cur->tx_bytes - prev->tx_bytes) / secs;
+	r->rx_bps    = 8.0 * (cur->rx.bytes - prev->rx.bytes) / secs;
+	r->tx_pps    = (cur->tx_packets - prev->tx_packets) / secs;
+	r->rx_pps    = (cur->rx.packets - prev->rx.packets) / secs;
+	r->received  = cur->rx.received  - prev->rx.received;
+	r->lost      = rxstat_delta(cur->rx.lost, prev->rx.lost);
+	r->reordered = cur->rx.reordered - prev->rx.reordered;
+	r->duplicate = cur->rx.duplicate - prev->rx.duplicate;
+	r->late      = cur->rx.late      - prev->rx.late;
+	r->corrupt   = cur->rx.corrupt   - prev->rx.corrupt;
+	r->loss      = loss_pct(r->received, r->lost);
+}
+
+static void write_allocations(struct outsink *os, double t, double secs)
+{
+	struct le *le;
+
+	for (le = os->allocator->allocl.head; le; le = le->next) {
+
+		struct allocation *alloc = le->data;
+		const struct receiver *recvr = &alloc->recv;
+		struct trafsnap cur;
+		struct outrec r;
+
+		memset(&cur, 0, sizeof(cur));
+
+		if (alloc->sender) {
+			cur.tx_bytes   = alloc->sender->total_bytes;
+			cur.tx_packets = alloc->sender->total_packets;
+		}
+
+		cur.rx_bytes   = recvr->total_bytes;
+		cur.rx_packets = recvr->total_packets;
+		cur.received   = recvr->win.received;
+		cur.lost       = recvr->win.lost + seqwin_pending(&recvr->win);
+
+		memset(&r, 0, sizeof(r));
+		r.type     = "alloc";
+		r.t        = t;
+		r.alloc    = true;
+		r.id       = alloc->ix;
+		r.tx_bps   = 8.0 * (cur.tx_bytes - alloc->snap.tx_bytes) / secs;
+		r.rx_bps   = 8.0 * (cur.rx_bytes - alloc->snap.rx_bytes) / secs;
+		r.tx_pps   = (cur.tx_packets - alloc->snap.tx_packets) / secs;
+		r.rx_pps   = (cur.rx_packets - alloc->snap.rx_packets) / secs;
+		r.received = cur.received - alloc->snap.received;
+		r.lost     = rxstat_delta(cur.lost, alloc->snap.lost);
+		r.loss     = loss_pct(r.received, r.lost);
+		r.lat      = recvr->lat_own;
+
+		outrec_write(os, &r);
+
+		alloc->snap = cur;
+
+		/* from the next interval on, and for that interval only */
+		if (!recvr->lat_own)
+			alloc->recv.lat_own = mem_alloc(sizeof(struct hist),
+							NULL);
+		hist_reset(alloc->recv.lat_own);
+	}
+}
+
+static void tmr_handler(void *arg)
+{
+	struct outsink *os = arg;
+	uint64_t now = tperf_clock_ns();
+	double secs = (now - os->t_prev) / 1e9;
+	struct counters sum;
+	struct outrec r;
+
+	tmr_start(&os->tmr, OUT_INTERVAL_MS, tmr_handler, os);
+
+	if (secs <= 0)
+		return;
+
+	memset(&sum, 0, sizeof(sum));
+	os->sumh(&sum, os->arg);
+
+	memset(&r, 0, sizeof(r));
+	r.type = "interval";
+	r.t    = (now - os->t0) / 1e9;
+	outrec_totals(&r, &sum, &os->prev, secs);
+
+	if (os->allocator) {
+		const struct hist *lat = &os->allocator->lat;
+
+		*os->lat_int = *lat;
+
+		/* the sweep resets the histogram between its windows */
+		if (lat->n >= os->lat_prev->n)
+			hist_sub(os->lat_int, os->lat_prev);
+
+		*os->lat_prev = *lat;
+		r.lat = os->lat_int;
+	}
+
+	outrec_write(os, &r);
+
+	if (os->allocator)
+		write_allocations(os, r.t, secs);
+
+	(void)fflush(os->f);
+
+	os->prev   = sum;
+	os->t_prev = now;
+}
+
+static void outsink_destructor(void *arg)
+{
+	struct outsink *os = arg;
+
+	tmr_cancel(&os->tmr);
+
+	if (os->f)
+		(void)fclose(os->f);
+
+	mem_deref(os->lat_prev);
+	mem_deref(os->lat_int);
+}
+
+int outsink_alloc(struct outsink **osp, const char *path,
+		  enum out_format fmt, struct allocator *allocator,
+		  outsink_sum_h *sumh, void *arg)
+{
+	struct outsink *os;
+	int err = 0;
+
+	if (!osp || !path || !sumh)
+		return EINVAL;
+
+	os = mem_zalloc(sizeof(*os), outsink_destructor);
+	if (!os)
+		return ENOMEM;
+
+	os->fmt       = fmt;
+	os->allocator = allocator;
+	os->sumh      = sumh;
+	os->arg       = arg;
+	tmr_init(&os->tmr);
+
+	os->lat_prev = mem_zalloc(sizeof(*os->lat_prev), NULL);
+	os->lat_int  = mem_zalloc(sizeof(*os->lat_int), NULL);
+	if (!os->lat_prev || !os->lat_int) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	hist_reset(os->lat_prev);
+
+	os->f = fopen(path, "w");
+	if (!os->f) {
+		err = errno;
+		re_fprintf(stderr, "results: cannot open %s (%m)\n",
+			   path, err);
+		goto out;
+	}
+
+	if (fmt == OUT_CSV)
+		(void)fputs(csv_header, os->f);
+
+ out:
+	if (err)
+		mem_deref(os);
+	else
+		*osp = os;
+
+	return err;
+}
+
+void outsink_start(struct outsink *os)
+{
+	if (!os)
+		return;
+
+	os->t0 = os->t_prev = tperf_clock_ns();
+
+	tmr_start(&os->tmr, OUT_INTERVAL_MS, tmr_handler, os);
+}
+
+void outsink_set_servers(struct outsink *os, const struct srvlist *sl,
+			 const struct srvstat *statv)
+{
+	if (!os)
+		return;
+
+	os->servers  = sl;
+	os->srvstatv = statv;
+}
+
+/* the TURN servers over the whole run; no transmit side, by server */
+static void write_servers(struct outsink *os, double secs)
+{
+	unsigned i;
+
+	for (i = 0; i < os->servers->n; i++) {
+
+		const struct srvstat *st = &os->srvstatv[i];
+		struct outrec r;
+
+		memset(&r, 0, sizeof(r));
+		r.type      = "server";
+		r.t         = secs;
+		r.server    = true;
+		r.id        = i;
+		r.addr      = &os->servers->srvv[i].addr;
+		r.allocs    = st->allocations;
+		r.failed    = st->failed + st->dropped;
+		r.rx_bps    = 8.0 * st->rx.bytes / secs;
+		r.rx_pps    = st->rx.packets / secs;
+		r.received  = st->rx.received;
+		r.lost      = st->rx.lost;
+		r.reordered = st->rx.reordered;
+		r.duplicate = st->rx.duplicate;
+		r.late      = st->rx.late;
+		r.corrupt   = st->rx.corrupt;
+		r.loss      = loss_pct(r.received, r.lost);
+		r.lat       = &st->lat;
+
+		outrec_write(os, &r);
+	}
+}
+
+/* writes the summary record, once */
+void outsink_finish(struct outsink *os)
+{
+	struct counters sum, zero;
+	struct outrec r;
+	double secs;
+
+	if (!os || os->finished || !os->t0)
+		return;
+
+	os->finished = true;
+	tmr_cancel(&os->tmr);
+
+	secs = (tperf_clock_ns() - os->t0) / 1e9;
+	if (secs <= 0)
+		return;
+
+	memset(&sum, 0, sizeof(sum));
+	memset(&zero, 0, sizeof(zero));
+	os->sumh(&sum, os->arg);
+
+	memset(&r, 0, sizeof(r));
+	r.type = "summary";
+	r.t    = secs;
+	outrec_totals(&r, &sum, &zero, secs);
+
+	if (os->allocator)
+		r.lat = &os->allocator->lat;
+
+	outrec_write(os, &r);
+
+	if (os->servers && os->srvstatv && os->servers->n > 1)
+		write_servers(os, secs);
+
+	(void)fflush(os->f);
+}
+
+int out_format_parse(enum out_format *fmtp, const char *name)
+{
+	if (!fmtp || !name)
+		return EINVAL;
+
+	if (0 == str_casecmp(name, "jsonl") || 0 == str_casecmp(name, "json"))
+		*fmtp = OUT_JSONL;
+	else if (0 == str_casecmp(name, "csv"))
+		*fmtp = OUT_CSV;
+	else
+		return EINVAL;
+
+	return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef MY_TPERF_OUT_H_INCLUIDO
+#define MY_TPERF_OUT_H_INCLUIDO
+
+#include <stdio.h>
+#include <stdint.h>
+#include <re.h>
+
+#include "tperf_util.h"
+#include "tperf_srv.h"
+
+#define OUT_INTERVAL_MS 1000
+
+enum out_format {
+	OUT_JSONL,
+	OUT_CSV,
+};
+
+/* fills sum with the totals of the run so far */
+typedef void (outsink_sum_h)(struct counters *sum, void *arg);
+
+/*
+ * Results sink. Once per interval it writes an aggregate record, and
+ * with an allocator one record per allocation; at the end a summary.
+ * Rates, loss and latency percentiles in the interval records cover
+ * that interval only. Latency and per-allocation records need the
+ * allocator, so runs with worker threads get aggregates only. The
+ * latency of one allocation takes a histogram of its own, about 15 KB
+ * per allocation, from its second record on. With
+ * more than one TURN server the summary is followed by one record
+ * per server.
+ */
+struct outsink {
+	FILE *f;
+	enum out_format fmt;
+	struct allocator *allocator;   /* optional */
+	outsink_sum_h *sumh;
+	void *arg;
+	struct tmr tmr;
+
+	uint64_t t0;
+	uint64_t t_prev;
+	struct counters prev;
+	struct hist *lat_prev;
+	struct hist *lat_int;
+	const struct srvlist *servers;     /* optional */
+	const struct srvstat *srvstatv;
+	bool finished;
+};
+
+int  outsink_alloc(struct outsink **osp, const char *path,
+		   enum out_format fmt, struct allocator *allocator,
+		   outsink_sum_h *sumh, void *arg);
+void outsink_start(struct outsink *os);
+void outsink_set_servers(struct outsink *os, const struct srvlist *sl,
+			 const struct srvstat *statv);
+void outsink_finish(struct outsink *os);
+int  out_format_parse(enum out_format *fmtp, const char *name);
+
+#endif
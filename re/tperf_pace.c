@@ -0,0 +1,276 @@
+#include "tperf_pace.h"
+#include "tperf_util.h"
+
+#include <string.h>
+
+static inline void heap_put(struct pacer *pc, unsigned i,
+			    struct pacer_ent ent)
+{
+	pc->heap[i] = ent;
+	ent.snd->heap_pos = i + 1;
+}
+
+static void sift_up(struct pacer *pc, unsigned i)
+{
+	struct pacer_ent ent = pc->heap[i];
+
+	while (i > 0) {
+		unsigned parent = (i - 1) / 2;
+
+		if (ent.due >= pc->heap[parent].due)
+			break;
+
+		heap_put(pc, i, pc->heap[parent]);
+		i = parent;
+	}
+
+	heap_put(pc, i, ent);
+}
+
+static void sift_down(struct pacer *pc, unsigned i)
+{
+	struct pacer_ent ent = pc->heap[i];
+
+	for (;;) {
+		unsigned child = 2 * i + 1;
+
+		if (child >= pc->n)
+			break;
+
+		if (child + 1 < pc->n &&
+		    pc->heap[child + 1].due < pc->heap[child].due)
+			++child;
+
+		if (pc->heap[child].due >= ent.due)
+			break;
+
+		heap_put(pc, i, pc->heap[child]);
+		i = child;
+	}
+
+	heap_put(pc, i, ent);
+}
+
+static void pacer_schedule(struct pacer *pc, uint64_t now);
+
+static void tmr_handler(void *arg)
+{
+	struct pacer *pc = arg;
+	uint64_t now;
+
+	now = tperf_clock_ns();
+	++pc->wakeups;
+
+	if (pc->loop_due) {
+		hist_record(&pc->loop_lag,
+			    now > pc->loop_due ? now - pc->loop_due : 0);
+		pc->loop_due = 0;
+	}
+
+	while (pc->n && pc->heap[0].due <= now) {
+
+		struct sender *snd = pc->heap[0].snd;
+		unsigned burst = 0;
+
+		if (now - snd->ts > PACE_DEBT_MAX_NS) {
+			uint64_t debt = (now - snd->ts) / snd->ptime_ns;
+
+			pc->skipped += debt;
+			snd->ts     += debt * snd->ptime_ns;
+		}
+
+		while (snd->ts <= now && burst < pc->burst_max) {
+
+			uint64_t late = now - snd->ts;
+
+			pc->late_sum += late;
+			if (late > pc->late_max)
+				pc->late_max = late;
+
+			pc->sendh(snd);
+			snd->ts += snd->gap_ns;
+
+			++pc->packets;
+			++burst;
+		}
+
+		/* still behind, continue after everybody else */
+		if (snd->ts <= now) {
+			++pc->capped;
+			pc->heap[0].due = now + 1;
+		}
+		else {
+			pc->heap[0].due = snd->ts;
+		}
+
+		sift_down(pc, 0);
+	}
+
+	if (pc->tickh)
+		pc->tickh(pc->arg);
+
+	pacer_schedule(pc, now);
+
+	hist_record(&pc->loop_run, tperf_clock_ns() - now);
+}
+
+static void pacer_schedule(struct pacer *pc, uint64_t now)
+{
+	uint64_t due, delay = 0;
+
+	if (!pc->n) {
+		tmr_cancel(&pc->tmr);
+		pc->loop_due = 0;
+		return;
+	}
+
+	due = pc->heap[0].due;
+
+	/* round up, catch-up bursts cover the timer granularity */
+	if (due > now)
+		delay = (due - now + 999999) / 1000000;
+
+	tmr_start(&pc->tmr, delay, tmr_handler, pc);
+	pc->loop_due = tperf_clock_ns() + delay * 1000000ULL;
+}
+
+void pacer_init(struct pacer *pc, unsigned burst_max, pacer_send_h *sendh)
+{
+	if (!pc)
+		return;
+
+	memset(pc, 0, sizeof(*pc));
+
+	tmr_init(&pc->tmr);
+	hist_reset(&pc->loop_lag);
+	hist_reset(&pc->loop_run);
+	pc->burst_max = burst_max ? burst_max : 1;
+	pc->sendh     = sendh;
+}
+
+void pacer_set_tickh(struct pacer *pc, pacer_tick_h *tickh, void *arg)
+{
+	if (!pc)
+		return;
+
+	pc->tickh = tickh;
+	pc->arg   = arg;
+}
+
+void pacer_close(struct pacer *pc)
+{
+	unsigned i;
+
+	if (!pc)
+		return;
+
+	tmr_cancel(&pc->tmr);
+
+	for (i = 0; i < pc->n; i++)
+		pc->heap[i].snd->heap_pos = 0;
+
+	pc->heap = mem_deref(pc->heap);
+	pc->n    = 0;
+	pc->size = 0;
+}
+
+int pacer_add(struct pacer *pc, struct sender *snd)
+{
+	if (!pc || !snd || !snd->ptime_ns)
+		return EINVAL;
+
+	if (snd->heap_pos)
+		return EALREADY;
+
+	if (pc->n == pc->size) {
+		unsigned size = pc->size ? pc->size * 2 : 64;
+		struct pacer_ent *heap;
+
+		heap = mem_realloc(pc->heap, size * sizeof(*heap));
+		if (!heap)
+			return ENOMEM;
+
+		pc->heap = heap;
+		pc->size = size;
+	}
+
+	pc->heap[pc->n].due = snd->ts;
+	pc->heap[pc->n].snd = snd;
+	++pc->n;
+	sift_up(pc, pc->n - 1);
+
+	if (tmr_isrunning(&pc->tmr) && pc->heap[0].snd == snd)
+		pacer_schedule(pc, tperf_clock_ns());
+
+	return 0;
+}
+
+void pacer_remove(struct pacer *pc, struct sender *snd)
+{
+	unsigned i;
+
+	if (!pc || !snd || !snd->heap_pos)
+		return;
+
+	i = snd->heap_pos - 1;
+	snd->heap_pos = 0;
+
+	if (--pc->n == i)
+		return;
+
+	heap_put(pc, i, pc->heap[pc->n]);
+
+	if (i > 0 && pc->heap[i].due < pc->heap[(i - 1) / 2].due)
+		sift_up(pc, i);
+	else
+		sift_down(pc, i);
+}
+
+void pacer_start(struct pacer *pc)
+{
+	if (!pc)
+		return;
+
+	pacer_schedule(pc, tperf_clock_ns());
+}
+
+void pacer_stop(struct pacer *pc)
+{
+	if (!pc)
+		return;
+
+	tmr_cancel(&pc->tmr);
+	pc->loop_due = 0;
+}
+
+int pacer_print(struct re_printf *pf, const struct pacer *pc)
+{
+	double late_avg = 0;
+
+	if (!pc)
+		return 0;
+
+	if (pc->packets)
+		late_avg = (double)pc->late_sum / pc->packets / 1000;
+
+	return re_hprintf(pf, "%llu packets in %llu wakeups,"
+			  " lateness avg %.1f us max %.1f us,"
+			  " %llu capped bursts, %llu skipped",
+			  pc->packets, pc->wakeups, late_avg,
+			  (double)pc->late_max / 1000,
+			  pc->capped, pc->skipped);
+}
+
+/* lateness of the libre timer itself, and the time spent in a wakeup */
+int pacer_print_loop(struct re_printf *pf, const struct pacer *pc)
+{
+	int err = 0;
+
+	if (!pc)
+		return 0;
+
+	err |= re_hprintf(pf, "wakeup lag %H", hist_print_us, &pc->loop_lag);
+	err |= re_hprintf(pf, "; run %H", hist_print_us, &pc->loop_run);
+
+	return err;
+}
@@ -0,0 +1,59 @@
+#ifndef MY_TPERF_PACE_H_INCLUIDO
+#define MY_TPERF_PACE_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+#include "tperf_hist.h"
+
+/* maximum catch-up debt before a sender skips ahead [ns] */
+#define PACE_DEBT_MAX_NS 50000000ULL
+
+struct sender;
+
+typedef int (pacer_send_h)(struct sender *snd);
+typedef void (pacer_tick_h)(void *arg);
+
+/* the deadline is kept next to the sender, sifting does not touch it */
+struct pacer_ent {
+	uint64_t due;              /* [ns] */
+	struct sender *snd;
+};
+
+/*
+ * Min-heap of senders keyed by their next deadline. One timer is armed
+ * for the earliest deadline; when it fires, every sender that is due
+ * sends all packets it owes, up to burst_max per wakeup.
+ */
+struct pacer {
+	struct pacer_ent *heap;
+	unsigned n;
+	unsigned size;
+	struct tmr tmr;
+	unsigned burst_max;
+	pacer_send_h *sendh;
+	pacer_tick_h *tickh;       /* optional, after every wakeup */
+	void *arg;
+
+	uint64_t wakeups;
+	uint64_t packets;
+	uint64_t late_sum;         /* sum of send lateness [ns] */
+	uint64_t late_max;         /* [ns] */
+	uint64_t capped;           /* bursts cut at burst_max */
+	uint64_t skipped;          /* packets dropped from the debt */
+	struct hist loop_lag;      /* timer wakeup past its due time [ns] */
+	struct hist loop_run;      /* wakeup to the timer armed again [ns] */
+	uint64_t loop_due;         /* armed wakeup [ns], 0 for none */
+};
+
+void pacer_init(struct pacer *pc, unsigned burst_max, pacer_send_h *sendh);
+void pacer_set_tickh(struct pacer *pc, pacer_tick_h *tickh, void *arg);
+void pacer_close(struct pacer *pc);
+int  pacer_add(struct pacer *pc, struct sender *snd);
+void pacer_remove(struct pacer *pc, struct sender *snd);
+void pacer_start(struct pacer *pc);
+void pacer_stop(struct pacer *pc);
+int  pacer_print(struct re_printf *pf, const struct pacer *pc);
+int  pacer_print_loop(struct re_printf *pf, const struct pacer *pc);
+
+#endif
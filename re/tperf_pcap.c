@@ -0,0 +1,305 @@
+#include "tperf_pcap.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PCAP_MAGIC      0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_HDR_SIZE   24
+#define PCAP_REC_SIZE   16
+
+enum {
+	LINK_NULL     = 0,
+	LINK_ETHERNET = 1,
+	LINK_RAW      = 101,
+	LINK_SLL      = 113,
+};
+
+static uint32_t rd32(const struct pcap_file *pf, const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+
+	return pf->swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t be16(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static uint32_t be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void pcap_destructor(void *arg)
+{
+	struct pcap_file *pf = arg;
+
+	if (pf->base)
+		(void)munmap((void *)pf->base, pf->size);
+
+	if (pf->fd >= 0)
+		(void)close(pf->fd);
+}
+
+int pcap_open(struct pcap_file **pfp, const char *path)
+{
+	struct pcap_file *pf;
+	struct stat st;
+	uint32_t magic;
+	void *p;
+	int err = 0;
+
+	if (!pfp || !path)
+		return EINVAL;
+
+	pf = mem_zalloc(sizeof(*pf), pcap_destructor);
+	if (!pf)
+		return ENOMEM;
+
+	pf->fd = open(path, O_RDONLY);
+	if (pf->fd < 0) {
+		err = errno;
+		goto out;
+	}
+
+	if (fstat(pf->fd, &st)) {
+		err = errno;
+		goto out;
+	}
+
+	if (st.st_size < PCAP_HDR_SIZE) {
+		err = EBADMSG;
+		goto out;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, pf->fd, 0);
+	if (p == MAP_FAILED) {
+		err = errno;
+		goto out;
+	}
+
+	pf->base = p;
+	pf->size = st.st_size;
+
+	(void)madvise(p, pf->size, MADV_SEQUENTIAL);
+
+	memcpy(&magic, pf->base, 4);
+
+	switch (magic) {
+
+	case PCAP_MAGIC:
+		break;
+
+	case PCAP_MAGIC_NSEC:
+		pf->nsec = true;
+		break;
+
+	case __builtin_bswap32(PCAP_MAGIC):
+		pf->swap = true;
+		break;
+
+	case __builtin_bswap32(PCAP_MAGIC_NSEC):
+		pf->swap = true;
+		pf->nsec = true;
+		break;
+
+	default:
+		err = EBADMSG;
+		goto out;
+	}
+
+	pf->linktype = rd32(pf, pf->base + 20) & 0xffff;
+	pf->off      = PCAP_HDR_SIZE;
+
+	switch (pf->linktype) {
+
+	case LINK_NULL:
+	case LINK_ETHERNET:
+	case LINK_RAW:
+	case LINK_SLL:
+		break;
+
+	default:
+		err = ENOTSUP;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(pf);
+	else
+		*pfp = pf;
+
+	return err;
+}
+
+bool pcap_next(struct pcap_file *pf, struct pcap_pkt *pkt)
+{
+	const uint8_t *rec;
+	uint32_t sec, frac, caplen;
+
+	if (!pf || !pkt)
+		return false;
+
+	if (pf->size - pf->off < PCAP_REC_SIZE)
+		return false;
+
+	rec    = pf->base + pf->off;
+	sec    = rd32(pf, rec);
+	frac   = rd32(pf, rec + 4);
+	caplen = rd32(pf, rec + 8);
+
+	if (caplen > pf->size - pf->off - PCAP_REC_SIZE) {
+		++pf->truncated;
+		pf->off = pf->size;
+		return false;
+	}
+
+	pkt->ts     = sec * 1000000000ULL + (pf->nsec ? frac : frac * 1000ULL);
+	pkt->data   = rec + PCAP_REC_SIZE;
+	pkt->caplen = caplen;
+	pkt->len    = rd32(pf, rec + 12);
+
+	pf->off += PCAP_REC_SIZE + caplen;
+
+	return true;
+}
+
+/* offset of the IP header, or -1 */
+static int link_skip(const struct pcap_file *pf, const uint8_t *p, size_t n)
+{
+	uint16_t type;
+	size_t ofs;
+
+	switch (pf->linktype) {
+
+	case LINK_NULL:
+		return n >= 4 ? 4 : -1;
+
+	case LINK_RAW:
+		return 0;
+
+	case LINK_SLL:
+		if (n < 16)
+			return -1;
+		type = be16(p + 14);
+		ofs  = 16;
+		break;
+
+	default:
+		if (n < 14)
+			return -1;
+		type = be16(p + 12);
+		ofs  = 14;
+
+		/* VLAN tags */
+		while ((type == 0x8100 || type == 0x88a8) && n >= ofs + 4) {
+			type = be16(p + ofs + 2);
+			ofs += 4;
+		}
+		break;
+	}
+
+	if (type != 0x0800 && type != 0x86dd)
+		return -1;
+
+	return (int)ofs;
+}
+
+int pcap_decode(const struct pcap_file *pf, const struct pcap_pkt *pkt,
+		struct pcap_l4 *l4)
+{
+	const uint8_t *p = pkt->data, *th;
+	size_t n = pkt->caplen, ihl, iplen, thl;
+	int ofs;
+
+	if (!pf || !pkt || !l4)
+		return EINVAL;
+
+	ofs = link_skip(pf, p, n);
+	if (ofs < 0)
+		return EPROTONOSUPPORT;
+
+	p += ofs;
+	n -= ofs;
+
+	if (n < 20)
+		return EBADMSG;
+
+	switch (p[0] >> 4) {
+
+	case 4:
+		ihl = (p[0] & 0x0f) * 4;
+		if (ihl < 20 || n < ihl)
+			return EBADMSG;
+
+		/* not the first fragment */
+		if (be16(p + 6) & 0x1fff)
+			return EPROTONOSUPPORT;
+
+		iplen     = be16(p + 2);
+		l4->proto = p[9];
+		sa_set_in(&l4->src, be32(p + 12), 0);
+		sa_set_in(&l4->dst, be32(p + 16), 0);
+		break;
+
+	case 6:
+		/* extension headers are not followed */
+		ihl = 40;
+		if (n < ihl)
+			return EBADMSG;
+
+		iplen     = ihl + be16(p + 4);
+		l4->proto = p[6];
+		sa_set_in6(&l4->src, p + 8, 0);
+		sa_set_in6(&l4->dst, p + 24, 0);
+		break;
+
+	default:
+		return EBADMSG;
+	}
+
+	/* TSO captures report 0 */
+	if (iplen < ihl)
+		iplen = pkt->len - ofs;
+
+	th = p + ihl;
+	n -= ihl;
+	iplen -= ihl;
+
+	switch (l4->proto) {
+
+	case IPPROTO_UDP:
+		thl = 8;
+		break;
+
+	case IPPROTO_TCP:
+		if (n < 20)
+			return EBADMSG;
+		thl     = (th[12] >> 4) * 4;
+		l4->seq = be32(th + 4);
+		break;
+
+	default:
+		return EPROTONOSUPPORT;
+	}
+
+	if (n < thl || iplen < thl)
+		return EBADMSG;
+
+	sa_set_port(&l4->src, be16(th));
+	sa_set_port(&l4->dst, be16(th + 2));
+
+	l4->payload = th + thl;
+	l4->len     = iplen - thl;
+	l4->caplen  = min(n - thl, l4->len);
+
+	return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef MY_TPERF_PCAP_H_INCLUIDO
+#define MY_TPERF_PCAP_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+/*
+ * Reader for libpcap capture files. The file is memory-mapped and
+ * packets point into the mapping, nothing is copied.
+ */
+struct pcap_file {
+	int fd;
+	const uint8_t *base;
+	size_t size;
+	size_t off;                /* next record */
+	bool swap;                 /* written on the other endianness */
+	bool nsec;                 /* nanosecond timestamps */
+	uint32_t linktype;
+	uint64_t truncated;        /* records cut at the end of the file */
+};
+
+struct pcap_pkt {
+	uint64_t ts;               /* [ns] */
+	const uint8_t *data;
+	size_t caplen;
+	size_t len;                /* length on the wire */
+};
+
+/* UDP or TCP view of a captured packet */
+struct pcap_l4 {
+	int proto;
+	struct sa src;
+	struct sa dst;
+	uint32_t seq;              /* TCP only */
+	const uint8_t *payload;
+	size_t len;                /* payload length on the wire */
+	size_t caplen;             /* captured part of the payload */
+};
+
+int  pcap_open(struct pcap_file **pfp, const char *path);
+bool pcap_next(struct pcap_file *pf, struct pcap_pkt *pkt);
+int  pcap_decode(const struct pcap_file *pf, const struct pcap_pkt *pkt,
+		 struct pcap_l4 *l4);
+
+#endif
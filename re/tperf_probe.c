@@ -0,0 +1,404 @@
+#include "tperf_probe.h"
+#include "tperf_util.h"
+
+#include <string.h>
+
+static void probe_destructor(void *arg)
+{
+	struct stunprobe *probe = arg;
+
+	mem_deref(probe->uh);
+	mem_deref(probe->th);
+}
+
+int stunprobe_alloc(struct stunprobe **probep, struct setupstat *st)
+{
+	struct stunprobe *probe;
+
+	if (!probep || !st)
+		return EINVAL;
+
+	probe = mem_zalloc(sizeof(*probe), probe_destructor);
+	if (!probe)
+		return ENOMEM;
+
+	probe->st = st;
+
+	*probep = probe;
+
+	return 0;
+}
+
+/* method and class of a STUN message, false for anything else */
+static bool stun_peek(const struct mbuf *mb, uint16_t *method,
+		      unsigned *cls)
+{
+	const uint8_t *p = mbuf_buf(mb);
+	uint32_t magic;
+	uint16_t type;
+
+	if (mbuf_get_left(mb) < STUN_HEADER_SIZE || (p[0] & 0xc0))
+		return false;
+
+	magic = (uint32_t)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+	if (magic != STUN_MAGIC_COOKIE)
+		return false;
+
+	type    = p[0] << 8 | p[1];
+	*cls    = (type >> 7 & 0x2) | (type >> 4 & 0x1);
+	*method = (type & 0x000f) | (type >> 1 & 0x0070)
+		| (type >> 2 & 0x0f80);
+
+	return true;
+}
+
+/* code of the ERROR-CODE attribute, 0 if there is none */
+static uint16_t stun_peek_code(const struct mbuf *mb)
+{
+	const uint8_t *p = mbuf_buf(mb);
+	size_t left = mbuf_get_left(mb), len, pos;
+
+	len = (size_t)(p[2] << 8 | p[3]);
+	if (len > left - STUN_HEADER_SIZE)
+		return 0;
+
+	for (pos = STUN_HEADER_SIZE; pos + 4 <= STUN_HEADER_SIZE + len;) {
+
+		uint16_t type  = p[pos] << 8 | p[pos + 1];
+		uint16_t alen  = p[pos + 2] << 8 | p[pos + 3];
+
+		pos += 4;
+
+		if (pos + alen > STUN_HEADER_SIZE + len)
+			return 0;
+
+		if (type == STUN_ATTR_ERR_CODE && alen >= 4)
+			return (p[pos + 2] & 0x7) * 100 + p[pos + 3];
+
+		pos += (alen + 3) & ~3u;
+	}
+
+	return 0;
+}
+
+static bool is_maint(uint16_t method)
+{
+	return method == STUN_METHOD_REFRESH ||
+		method == STUN_METHOD_CREATEPERM ||
+		method == STUN_METHOD_CHANBIND;
+}
+
+/* packets of the allocation lost so far, counted or still in the window */
+static uint64_t probe_holes(const struct stunprobe *probe)
+{
+	const struct seqwin *win = probe->win;
+
+	return win ? win->lost + seqwin_pending(win) : 0;
+}
+
+/* a maintenance transaction is over, with or without a response */
+static void maint_end(struct stunprobe *probe, unsigned i, bool ok)
+{
+	struct setupstat *st = probe->st;
+	uint64_t holes = probe_holes(probe);
+	uint64_t drops;
+
+	/* a reordered packet can fill a hole again */
+	drops = holes > probe->pendv[i].holes0
+		? holes - probe->pendv[i].holes0 : 0;
+
+	++st->maint;
+	if (drops) {
+		++st->maint_lossy;
+		st->maint_drops += drops;
+	}
+
+	if (ok)
+		return;
+
+	switch (probe->pendv[i].method) {
+
+	case STUN_METHOD_REFRESH:    ++st->refresh_failed; break;
+	case STUN_METHOD_CREATEPERM: ++st->perm_failed;    break;
+	case STUN_METHOD_CHANBIND:   ++st->chan_failed;    break;
+	}
+}
+
+void stunprobe_send(struct stunprobe *probe, const struct mbuf *mb)
+{
+	const uint8_t *tid;
+	uint16_t method;
+	unsigned cls, i;
+
+	if (!probe || !mb || !stun_peek(mb, &method, &cls))
+		return;
+
+	if (cls != STUN_CLASS_REQUEST)
+		return;
+
+	tid = mbuf_buf(mb) + 8;
+
+	/* a retransmission keeps the time of the first try */
+	for (i = 0; i < PROBE_PENDING; i++) {
+		if (probe->pendv[i].used &&
+		    !memcmp(probe->pendv[i].tid, tid, 12))
+			return;
+	}
+
+	/* the retry of a challenged one carries on with its transaction */
+	for (i = 0; i < PROBE_PENDING; i++) {
+		if (probe->pendv[i].used && probe->pendv[i].challenged &&
+		    probe->pendv[i].method == method) {
+
+			memcpy(probe->pendv[i].tid, tid, 12);
+			probe->pendv[i].challenged = false;
+			probe->pendv[i].t0         = tperf_clock_ns();
+			return;
+		}
+	}
+
+	i = probe->ix++ % PROBE_PENDING;
+
+	/* pushed out without a response */
+	if (probe->pendv[i].used && probe->pendv[i].maint)
+		maint_end(probe, i, false);
+
+	memcpy(probe->pendv[i].tid, tid, 12);
+	probe->pendv[i].method  = method;
+	probe->pendv[i].release = probe->releasing
+		&& method == STUN_METHOD_REFRESH;
+	probe->pendv[i].maint   = probe->ready && !probe->releasing
+		&& is_maint(method);
+	probe->pendv[i].used    = true;
+	probe->pendv[i].challenged = false;
+	probe->pendv[i].t0      = tperf_clock_ns();
+	probe->pendv[i].holes0  = probe->pendv[i].maint
+		? probe_holes(probe) : 0;
+}
+
+/* returns true for a response to a request that was seen going out */
+bool stunprobe_recv(struct stunprobe *probe, const struct mbuf *mb)
+{
+	struct setupstat *st;
+	struct hist *h = NULL;
+	const uint8_t *tid;
+	uint16_t method;
+	unsigned cls, i;
+	uint64_t rtt;
+
+	if (!probe || !mb || !stun_peek(mb, &method, &cls))
+		return false;
+
+	if (cls != STUN_CLASS_SUCCESS_RESP && cls != STUN_CLASS_ERROR_RESP)
+		return false;
+
+	tid = mbuf_buf(mb) + 8;
+
+	for (i = 0; i < PROBE_PENDING; i++) {
+		if (probe->pendv[i].used &&
+		    !memcmp(probe->pendv[i].tid, tid, 12))
+			break;
+	}
+
+	if (i == PROBE_PENDING)
+		return false;
+
+	rtt = tperf_clock_ns() - probe->pendv[i].t0;
+	st  = probe->st;
+
+	switch (probe->pendv[i].method) {
+
+	case STUN_METHOD_ALLOCATE:   h = &st->allocate; break;
+	case STUN_METHOD_CREATEPERM: h = &st->perm;     break;
+	case STUN_METHOD_CHANBIND:   h = &st->chan;     break;
+	case STUN_METHOD_REFRESH:
+		h = probe->pendv[i].release ? &st->release : &st->refresh;
+		break;
+	}
+
+	if (probe->pendv[i].maint) {
+		if (probe->pendv[i].method == STUN_METHOD_CREATEPERM)
+			h = &st->perm_refresh;
+		else if (probe->pendv[i].method == STUN_METHOD_CHANBIND)
+			h = &st->chan_refresh;
+
+		if (cls == STUN_CLASS_ERROR_RESP) {
+
+			switch (stun_peek_code(mb)) {
+
+			case 401:
+			case 438:
+				probe->pendv[i].challenged = true;
+				break;
+			}
+		}
+
+		if (!probe->pendv[i].challenged)
+			maint_end(probe, i, cls == STUN_CLASS_SUCCESS_RESP);
+	}
+
+	/* open until its retry is answered, or pushed out without one */
+	if (probe->pendv[i].challenged)
+		return true;
+
+	hist_record(h, rtt);
+
+	if (cls == STUN_CLASS_ERROR_RESP)
+		++st->errors;
+
+	probe->pendv[i].used = false;
+
+	return true;
+}
+
+static bool udp_send_handler(int *err, struct sa *dst, struct mbuf *mb,
+			     void *arg)
+{
+	(void)err;
+	(void)dst;
+
+	stunprobe_send(arg, mb);
+
+	return false;
+}
+
+static bool udp_recv_handler(struct sa *src, struct mbuf *mb, void *arg)
+{
+	struct stunprobe *probe = arg;
+	(void)src;
+
+	/* nobody is left to take the response to the release */
+	return stunprobe_recv(probe, mb) && probe->releasing;
+}
+
+static bool tcp_send_handler(int *err, struct mbuf *mb, void *arg)
+{
+	(void)err;
+
+	stunprobe_send(arg, mb);
+
+	return false;
+}
+
+int stunprobe_attach_udp(struct stunprobe *probe, struct udp_sock *us,
+			 int layer)
+{
+	if (!probe || !us)
+		return EINVAL;
+
+	probe->uh = mem_deref(probe->uh);
+
+	return udp_register_helper(&probe->uh, us, layer, udp_send_handler,
+				   udp_recv_handler, probe);
+}
+
+/* responses come in through stunprobe_recv() from the framer */
+int stunprobe_attach_tcp(struct stunprobe *probe, struct tcp_conn *tc,
+			 int layer)
+{
+	if (!probe || !tc)
+		return EINVAL;
+
+	probe->th = mem_deref(probe->th);
+
+	return tcp_register_helper(&probe->th, tc, layer, NULL,
+				   tcp_send_handler, NULL, probe);
+}
+
+/* must be called before the socket goes away */
+void stunprobe_detach(struct stunprobe *probe)
+{
+	if (!probe)
+		return;
+
+	probe->uh = mem_deref(probe->uh);
+	probe->th = mem_deref(probe->th);
+}
+
+/* maintenance requests that were not answered in time have failed */
+void stunprobe_expire(struct stunprobe *probe, uint64_t now)
+{
+	unsigned i;
+
+	if (!probe)
+		return;
+
+	for (i = 0; i < PROBE_PENDING; i++) {
+
+		if (!probe->pendv[i].used ||
+		    now - probe->pendv[i].t0 < PROBE_TIMEOUT_MS * 1000000ULL)
+			continue;
+
+		if (probe->pendv[i].maint)
+			maint_end(probe, i, false);
+
+		probe->pendv[i].used = false;
+	}
+}
+
+void setupstat_reset(struct setupstat *st)
+{
+	if (!st)
+		return;
+
+	hist_reset(&st->allocated);
+	hist_reset(&st->ready);
+	hist_reset(&st->allocate);
+	hist_reset(&st->perm);
+	hist_reset(&st->chan);
+	hist_reset(&st->refresh);
+	hist_reset(&st->release);
+	st->errors = 0;
+
+	hist_reset(&st->perm_refresh);
+	hist_reset(&st->chan_refresh);
+	st->refresh_failed = 0;
+	st->perm_failed    = 0;
+	st->chan_failed    = 0;
+	st->maint          = 0;
+	st->maint_lossy    = 0;
+	st->maint_drops    = 0;
+}
+
+static int hist_line(struct re_printf *pf, const char *name,
+		     const struct hist *h)
+{
+	if (!h->n)
+		return 0;
+
+	return re_hprintf(pf, "  %-17s %8llu  %H\n", name, h->n,
+			  hist_print_us, h);
+}
+
+int setupstat_print(struct re_printf *pf, const struct setupstat *st)
+{
+	int err = 0;
+
+	if (!st)
+		return 0;
+
+	err |= hist_line(pf, "allocated",        &st->allocated);
+	err |= hist_line(pf, "ready",            &st->ready);
+	err |= hist_line(pf, "Allocate",         &st->allocate);
+	err |= hist_line(pf, "CreatePermission", &st->perm);
+	err |= hist_line(pf, "ChannelBind",      &st->chan);
+	err |= hist_line(pf, "Refresh",          &st->refresh);
+	err |= hist_line(pf, "Refresh (delete)", &st->release);
+	err |= hist_line(pf, "CreatePerm (ref.)", &st->perm_refresh);
+	err |= hist_line(pf, "ChanBind (ref.)",   &st->chan_refresh);
+
+	if (st->errors)
+		err |= re_hprintf(pf, "  %llu error responses\n", st->errors);
+
+	if (st->maint) {
+		err |= re_hprintf(pf, "  maintenance: %llu transactions,"
+				  " failed %llu Refresh, %llu"
+				  " CreatePermission, %llu ChannelBind;"
+				  " %llu packets lost during %llu of them\n",
+				  st->maint, st->refresh_failed,
+				  st->perm_failed, st->chan_failed,
+				  st->maint_drops, st->maint_lossy);
+	}
+
+	return err;
+}
@@ -0,0 +1,85 @@
+#ifndef MY_TPERF_PROBE_H_INCLUIDO
+#define MY_TPERF_PROBE_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+#include "tperf_hist.h"
+
+/* outstanding transactions per allocation; turnc has at most a few */
+#define PROBE_PENDING 4
+/* past the last STUN retransmission, the transaction has failed */
+#define PROBE_TIMEOUT_MS 40000
+
+struct seqwin;
+
+/* allocation setup and maintenance timing of an allocator [ns] */
+struct setupstat {
+	struct hist allocated;     /* Allocate, with the auth round trip */
+	struct hist ready;         /* until the permission/channel is up */
+	struct hist allocate;      /* single transactions */
+	struct hist perm;
+	struct hist chan;
+	struct hist refresh;
+	struct hist release;       /* Refresh with lifetime 0 */
+	uint64_t errors;           /* error responses */
+
+	/* maintenance, once the permission or channel is up */
+	struct hist perm_refresh;
+	struct hist chan_refresh;
+	uint64_t refresh_failed;   /* error responses and timeouts */
+	uint64_t perm_failed;
+	uint64_t chan_failed;
+	uint64_t maint;            /* maintenance transactions that ended */
+	uint64_t maint_lossy;      /* of those, with packets lost meanwhile */
+	uint64_t maint_drops;      /* packets lost while one was open */
+};
+
+/*
+ * Watches the STUN transactions of one allocation on the wire and
+ * times them by transaction-ID, per method. On UDP it is a socket
+ * helper below the TURN client; on TCP it is a send helper above TLS,
+ * and the receive side is fed from the TCP framer.
+ *
+ * Once the allocation is ready, its Refresh, CreatePermission and
+ * ChannelBind transactions are maintenance: their failures are
+ * counted, and so are the packets of the allocation that went missing
+ * while one was open. A 401 or 438 that the TURN client answers with a
+ * new request keeps the transaction open, the new request takes it
+ * over.
+ */
+struct stunprobe {
+	struct setupstat *st;
+	struct udp_helper *uh;
+	struct tcp_helper *th;
+	bool releasing;            /* Refresh requests delete the allocation */
+	bool ready;                /* the permission or channel is up */
+	const struct seqwin *win;  /* optional, of the receiver */
+	unsigned ix;
+
+	struct {
+		uint8_t tid[12];
+		uint16_t method;
+		bool release;
+		bool maint;
+		bool used;
+		bool challenged;   /* 401 or 438, turnc sends it again */
+		uint64_t t0;
+		uint64_t holes0;   /* lost packets when it went out */
+	} pendv[PROBE_PENDING];
+};
+
+int  stunprobe_alloc(struct stunprobe **probep, struct setupstat *st);
+int  stunprobe_attach_udp(struct stunprobe *probe, struct udp_sock *us,
+			  int layer);
+int  stunprobe_attach_tcp(struct stunprobe *probe, struct tcp_conn *tc,
+			  int layer);
+void stunprobe_detach(struct stunprobe *probe);
+void stunprobe_expire(struct stunprobe *probe, uint64_t now);
+void stunprobe_send(struct stunprobe *probe, const struct mbuf *mb);
+bool stunprobe_recv(struct stunprobe *probe, const struct mbuf *mb);
+
+void setupstat_reset(struct setupstat *st);
+int  setupstat_print(struct re_printf *pf, const struct setupstat *st);
+
+#endif
@@ -0,0 +1,238 @@
+#include "tperf_procs.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+/* reads of a slot before a writer stuck in an update is given up on */
+#define SLOT_READ_TRIES 10000
+
+/*
+ * false for a slot that stays half written: its worker died, or was
+ * stopped, in the middle of an update.
+ */
+static bool slot_read(const struct procslot *slot, struct procslot *copy)
+{
+	uint32_t seq;
+	unsigned i;
+
+	for (i = 0; i < SLOT_READ_TRIES; i++) {
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			/* reaped, nobody is left to finish it */
+			if (!slot->pid)
+				return false;
+
+			continue;
+		}
+
+		memcpy(copy, slot, sizeof(*copy));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Forks n workers. Returns in the coordinator with ps->self NULL, and
+ * in every worker with ps->self and ps->id set to its slot.
+ */
+int procs_fork(struct procs *ps, unsigned n)
+{
+	unsigned i;
+	int err = 0;
+
+	if (!ps || !n || n > PROCS_MAX)
+		return EINVAL;
+
+	memset(ps, 0, sizeof(*ps));
+
+	ps->size  = n * sizeof(*ps->slotv);
+	ps->slotv = mmap(NULL, ps->size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ps->slotv == MAP_FAILED) {
+		ps->slotv = NULL;
+		return errno;
+	}
+
+	ps->n = n;
+
+	/* the workers are not to inherit the coordinator's buffered output */
+	fflush(stdout);
+	fflush(stderr);
+
+	for (i = 0; i < n; i++) {
+
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			err = errno;
+			re_fprintf(stderr, "could not fork worker %u (%m)\n",
+				   i, err);
+			break;
+		}
+
+		if (pid == 0) {
+			/* ^C goes to the coordinator, which passes it on */
+			(void)setpgid(0, 0);
+			(void)prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+			ps->self = &ps->slotv[i];
+			ps->id   = i;
+			ps->self->pid = getpid();
+
+			return 0;
+		}
+
+		ps->slotv[i].pid = pid;
+	}
+
+	if (err) {
+		ps->n = i;
+		procs_kill(ps, SIGTERM);
+		while (!procs_reap(ps))
+			(void)usleep(10000);
+		procs_close(ps);
+	}
+
+	return err;
+}
+
+/* from a worker, with the allocator it runs */
+void procs_publish(struct procs *ps, struct allocator *allocator)
+{
+	struct procslot *slot;
+
+	if (!ps || !ps->self || !allocator)
+		return;
+
+	slot = ps->self;
+
+	allocator_publish(allocator);
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->cpu_ns = tperf_cpu_ns();
+	slot->ctr    = allocator->ctr;
+	slot->lat    = allocator->lat;
+	slot->ready  = allocator->setup.ready;
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+void procs_done(struct procs *ps, int err)
+{
+	if (!ps || !ps->self)
+		return;
+
+	ps->self->err = err;
+	__atomic_store_n(&ps->self->done, true, __ATOMIC_RELEASE);
+}
+
+void procs_collect(const struct procs *ps, struct procsum *sum)
+{
+	struct procslot *copy;
+	unsigned i;
+
+	if (!ps || !sum)
+		return;
+
+	memset(sum, 0, sizeof(*sum));
+
+	copy = mem_alloc(sizeof(*copy), NULL);
+	if (!copy)
+		return;
+
+	for (i = 0; i < ps->n; i++) {
+
+		const struct procslot *slot = &ps->slotv[i];
+
+		if (slot_read(slot, copy)) {
+			counters_add(&sum->ctr, &copy->ctr);
+			hist_merge(&sum->lat, &copy->lat);
+			hist_merge(&sum->ready, &copy->ready);
+			sum->cpu_ns += copy->cpu_ns;
+		}
+		else {
+			++sum->stale;
+		}
+
+		/* outside of seq, and set by procs_reap() for a dead one */
+		if (!__atomic_load_n(&slot->done, __ATOMIC_ACQUIRE))
+			++sum->running;
+		else if (slot->err)
+			++sum->failed;
+	}
+
+	mem_deref(copy);
+}
+
+/* collects the workers that exited; true once all of them did */
+bool procs_reap(struct procs *ps)
+{
+	int status;
+	pid_t pid;
+	unsigned i;
+
+	if (!ps)
+		return true;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+
+		for (i = 0; i < ps->n; i++) {
+
+			struct procslot *slot = &ps->slotv[i];
+
+			if (slot->pid != pid)
+				continue;
+
+			/* it died without saying goodbye */
+			if (!__atomic_load_n(&slot->done, __ATOMIC_ACQUIRE)) {
+				slot->err  = WIFSIGNALED(status) ? EINTR
+								 : EPROTO;
+				slot->done = true;
+			}
+
+			slot->pid = 0;
+			++ps->reaped;
+			break;
+		}
+	}
+
+	return ps->reaped >= ps->n;
+}
+
+void procs_kill(struct procs *ps, int sig)
+{
+	unsigned i;
+
+	if (!ps)
+		return;
+
+	for (i = 0; i < ps->n; i++) {
+		if (ps->slotv[i].pid > 0)
+			(void)kill(ps->slotv[i].pid, sig);
+	}
+}
+
+void procs_close(struct procs *ps)
+{
+	if (!ps || !ps->slotv)
+		return;
+
+	(void)munmap(ps->slotv, ps->size);
+
+	ps->slotv = NULL;
+	ps->self  = NULL;
+	ps->n     = 0;
+}
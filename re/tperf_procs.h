@@ -0,0 +1,63 @@
+#ifndef MY_TPERF_PROCS_H_INCLUIDO
+#define MY_TPERF_PROCS_H_INCLUIDO
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <re.h>
+
+#include "tperf_util.h"
+
+#define PROCS_MAX 256
+#define PROCS_PUBLISH_MS 1000
+
+/*
+ * What one worker process publishes. The worker is the only writer;
+ * seq is odd while it writes, and a reader retries until it sees the
+ * same even seq before and after its copy. A worker that dies while
+ * writing leaves seq odd; the reader then gives up on the slot.
+ */
+struct procslot {
+	uint32_t seq;
+	pid_t pid;
+	bool done;
+	int err;
+	uint64_t cpu_ns;           /* user and system time of the worker */
+	struct counters ctr;
+	struct hist lat;           /* one-way latency [ns] */
+	struct hist ready;         /* allocation setup [ns] */
+};
+
+/* the merged view of all slots */
+struct procsum {
+	struct counters ctr;
+	struct hist lat;
+	struct hist ready;
+	uint64_t cpu_ns;
+	unsigned running;
+	unsigned failed;           /* workers that ended with an error */
+	unsigned stale;            /* slots left half written, not summed */
+};
+
+/*
+ * Worker processes of one coordinator. The slots are one shared
+ * anonymous mapping made before the fork, so the coordinator reads
+ * them without any message passing.
+ */
+struct procs {
+	unsigned n;
+	struct procslot *slotv;    /* MAP_SHARED */
+	size_t size;
+	struct procslot *self;     /* in a worker, its slot */
+	unsigned id;
+	unsigned reaped;
+};
+
+int  procs_fork(struct procs *ps, unsigned n);
+void procs_publish(struct procs *ps, struct allocator *allocator);
+void procs_done(struct procs *ps, int err);
+void procs_collect(const struct procs *ps, struct procsum *sum);
+bool procs_reap(struct procs *ps);
+void procs_kill(struct procs *ps, int sig);
+void procs_close(struct procs *ps);
+
+#endif
@@ -0,0 +1,91 @@
+#include "tperf_proto.h"
+#include "tperf_verify.h"
+
+#include <string.h>
+
+const uint32_t proto_magic = 'T'<<24 | 'P'<<16 | 'R'<<8 | 'F';
+
+int protocol_encode(struct mbuf *mb,
+		    uint32_t session_cookie, uint32_t alloc_id,
+		    uint32_t seq, uint64_t ts, size_t payload_len)
+{
+	int err = 0;
+
+	err |= mbuf_write_u32(mb, htonl(proto_magic));
+	err |= mbuf_write_u32(mb, htonl(session_cookie));
+	err |= mbuf_write_u32(mb, htonl(alloc_id));
+	err |= mbuf_write_u32(mb, htonl(seq));
+	err |= mbuf_write_u32(mb, htonl((uint32_t)(ts >> 32)));
+	err |= mbuf_write_u32(mb, htonl((uint32_t)ts));
+	err |= mbuf_write_u32(mb, htonl((uint32_t)payload_len));
+	err |= mbuf_fill(mb, 0, payload_len);
+	if (err)
+		return err;
+
+	payload_fill(mb->buf + mb->pos - payload_len, payload_len,
+		     payload_word(alloc_id, seq));
+
+	return 0;
+}
+
+int protocol_decode(struct hdr *hdr, struct mbuf *mb)
+{
+	uint32_t magic;
+	size_t start;
+	int err = 0;
+
+	if (!hdr || !mb)
+		return EINVAL;
+
+	start = mb->pos;
+
+	if (mbuf_get_left(mb) < HDR_SIZE)
+		return EBADMSG;
+
+	magic = ntohl(mbuf_read_u32(mb));
+	if (magic != proto_magic) {
+		err = EBADMSG;
+		goto out;
+	}
+
+	hdr->session_cookie = ntohl(mbuf_read_u32(mb));
+	hdr->alloc_id       = ntohl(mbuf_read_u32(mb));
+	hdr->seq            = ntohl(mbuf_read_u32(mb));
+	hdr->ts             = (uint64_t)ntohl(mbuf_read_u32(mb)) << 32;
+	hdr->ts            |= ntohl(mbuf_read_u32(mb));
+	hdr->payload_len    = ntohl(mbuf_read_u32(mb));
+
+	if (mbuf_get_left(mb) < hdr->payload_len) {
+		re_fprintf(stderr, "receiver: header said %u bytes,"
+			   " but payload is only %zu bytes\n",
+			   hdr->payload_len, mbuf_get_left(mb));
+		err = EPROTO;
+		goto out;
+	}
+
+	hdr->payload = mbuf_buf(mb);
+
+	/* important, so that the TURN TCP-framing works */
+	mbuf_advance(mb, hdr->payload_len);
+
+ out:
+	if (err)
+		mb->pos = start;
+
+	return err;
+}
+
+void protocol_packet_dump(const struct hdr *hdr) {
+	if (!hdr) {
+		return;
+	}
+	re_fprintf(stderr, "--- protocol packet: ---\n");
+	re_fprintf(stderr, "session_cookie: 0x%08x\n", hdr->session_cookie);
+	re_fprintf(stderr, "alloc_id:       %u\n", hdr->alloc_id);
+	re_fprintf(stderr, "seq:            %u\n", hdr->seq);
+	re_fprintf(stderr, "ts:             %llu\n", hdr->ts);
+	re_fprintf(stderr, "payload_len:    %u\n", hdr->payload_len);
+	re_fprintf(stderr, "payload:        %w\n",
+		   hdr->payload, hdr->payload_len);
+	re_fprintf(stderr, "\n");
+}
@@ -0,0 +1,37 @@
+#ifndef MY_TPERF_PROTO_H_INCLUIDO
+#define MY_TPERF_PROTO_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+#define HDR_SIZE 28
+#define HDR_ALLOCID_OFS 8
+#define HDR_SEQ_OFS 12
+#define HDR_TS_OFS 16
+#define HDR_LEN_OFS 24
+#define PATTERN 0xa5
+
+/*
+ * Header of a tperf packet, in network byte order: magic, session
+ * cookie, allocation-ID, sequence number, 64-bit send time and payload
+ * length, followed by the payload pattern (see tperf_verify.h).
+ */
+struct hdr {
+	uint32_t session_cookie;
+	uint32_t alloc_id;
+	uint32_t seq;
+	uint64_t ts;               /* sender clock [ns] */
+	uint32_t payload_len;
+
+	const uint8_t *payload;    /* points into the received mbuf */
+};
+
+extern const uint32_t proto_magic;
+
+int  protocol_encode(struct mbuf *mb,
+		     uint32_t session_cookie, uint32_t alloc_id,
+		     uint32_t seq, uint64_t ts, size_t payload_len);
+int  protocol_decode(struct hdr *hdr, struct mbuf *mb);
+void protocol_packet_dump(const struct hdr *hdr);
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * Checks of the tperf packet decoder: a packet is decoded whole, and a
+ * packet that is not ours or that is cut short is refused and left
+ * unread. Then of the payload check: a payload changed anywhere, or
+ * one of another packet, fails, and every kernel finds the same first
+ * bad byte as the scalar one.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <re.h>
+
+#include "tperf_proto.h"
+#include "tperf_verify.h"
+
+#define COOKIE   0x5e55107eu
+#define ALLOC_ID 7
+#define SEQ      42
+#define TS       0x0123456789abcdefULL
+#define PAYLOAD  100
+
+/* both loops of the AVX2 kernel, and a tail */
+#define VERIFY_LEN_MAX (2 * 32 + 3)
+
+static unsigned failed;
+
+static const char *kernelv[] = {"scalar", "sse2", "avx2"};
+
+#define CHECK(expr)							\
+	do {								\
+		if (!(expr)) {						\
+			re_fprintf(stderr, "%s:%d: %s\n", __FILE__,	\
+				   __LINE__, #expr);			\
+			++failed;					\
+		}							\
+	} while (0)
+
+static struct mbuf *packet(size_t payload_len)
+{
+	struct mbuf *mb = mbuf_alloc(HDR_SIZE + payload_len);
+
+	if (!mb)
+		return NULL;
+
+	if (protocol_encode(mb, COOKIE, ALLOC_ID, SEQ, TS, payload_len)) {
+		mem_deref(mb);
+		return NULL;
+	}
+
+	mb->pos = 0;
+
+	return mb;
+}
+
+static void test_decode(void)
+{
+	struct mbuf *mb = packet(PAYLOAD);
+	struct hdr hdr;
+
+	CHECK(mb != NULL);
+	if (!mb)
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	CHECK(0 == protocol_decode(&hdr, mb));
+	CHECK(hdr.session_cookie == COOKIE);
+	CHECK(hdr.alloc_id == ALLOC_ID);
+	CHECK(hdr.seq == SEQ);
+	CHECK(hdr.ts == TS);
+	CHECK(hdr.payload_len == PAYLOAD);
+	CHECK(hdr.payload == mb->buf + HDR_SIZE);
+	CHECK(payload_verify(hdr.payload, hdr.payload_len,
+			     payload_word(ALLOC_ID, SEQ)) == PAYLOAD);
+	CHECK(mbuf_get_left(mb) == 0);
+
+	mem_deref(mb);
+}
+
+/* 28 bytes or more, but somebody else's */
+static void test_wrong_magic(void)
+{
+	struct mbuf *mb = packet(PAYLOAD);
+	struct hdr hdr;
+
+	CHECK(mb != NULL);
+	if (!mb)
+		return;
+
+	mb->buf[0] ^= 0xff;
+
+	memset(&hdr, 0, sizeof(hdr));
+	CHECK(EBADMSG == protocol_decode(&hdr, mb));
+	CHECK(hdr.payload == NULL);
+	CHECK(mb->pos == 0);
+
+	mem_deref(mb);
+}
+
+static void test_short_header(void)
+{
+	struct mbuf *mb = packet(0);
+	struct hdr hdr;
+
+	CHECK(mb != NULL);
+	if (!mb)
+		return;
+
+	mb->end = HDR_SIZE - 1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	CHECK(EBADMSG == protocol_decode(&hdr, mb));
+	CHECK(mb->pos == 0);
+
+	mem_deref(mb);
+}
+
+/* the header promises more payload than there is */
+static void test_short_payload(void)
+{
+	struct mbuf *mb = packet(PAYLOAD);
+	struct hdr hdr;
+
+	CHECK(mb != NULL);
+	if (!mb)
+		return;
+
+	mb->end = HDR_SIZE + PAYLOAD / 2;
+
+	memset(&hdr, 0, sizeof(hdr));
+	CHECK(EPROTO == protocol_decode(&hdr, mb));
+	CHECK(hdr.payload == NULL);
+	CHECK(mb->pos == 0);
+
+	mem_deref(mb);
+}
+
+static void test_verify_corrupt(void)
+{
+	const uint32_t word = payload_word(ALLOC_ID, SEQ);
+	const size_t posv[] = {0, PAYLOAD / 2, PAYLOAD - 1};
+	uint8_t buf[PAYLOAD];
+	size_t i, k;
+
+	for (k = 0; k < ARRAY_SIZE(kernelv); k++) {
+
+		if (payload_verify_use(kernelv[k]))
+			continue;
+
+		payload_fill(buf, sizeof(buf), word);
+		CHECK(payload_verify(buf, sizeof(buf), word) == PAYLOAD);
+
+		/* one byte at the start, in the middle and at the end */
+		for (i = 0; i < ARRAY_SIZE(posv); i++) {
+
+			payload_fill(buf, sizeof(buf), word);
+			buf[posv[i]] ^= 0x01;
+			CHECK(payload_verify(buf, sizeof(buf), word) == posv[i]);
+		}
+
+		/* the bytes after the last whole vector */
+		payload_fill(buf, sizeof(buf), word);
+		memset(buf + PAYLOAD - 3, 0, 3);
+		CHECK(payload_verify(buf, sizeof(buf), word) == PAYLOAD - 3);
+
+		/* an older packet of the same allocation */
+		payload_fill(buf, sizeof(buf), payload_word(ALLOC_ID, SEQ - 1));
+		CHECK(payload_verify(buf, sizeof(buf), word) < PAYLOAD);
+
+		/* the same seq of another allocation */
+		payload_fill(buf, sizeof(buf), payload_word(ALLOC_ID + 1, SEQ));
+		CHECK(payload_verify(buf, sizeof(buf), word) < PAYLOAD);
+	}
+}
+
+/* every length up to VERIFY_LEN_MAX, every bad byte, an odd address */
+static void test_verify_kernels(void)
+{
+	const uint32_t word = payload_word(ALLOC_ID, SEQ);
+	uint8_t buf[VERIFY_LEN_MAX + 1];
+	uint8_t *p = buf + 1;
+	size_t n, bad, k;
+
+	for (n = 0; n <= VERIFY_LEN_MAX; n++) {
+
+		for (bad = 0; bad <= n; bad++) {
+
+			size_t exp;
+
+			payload_fill(p, n, word);
+			if (bad < n)
+				p[bad] ^= 0x80;
+
+			(void)payload_verify_use("scalar");
+			exp = payload_verify(p, n, word);
+			CHECK(exp == bad);
+
+			for (k = 1; k < ARRAY_SIZE(kernelv); k++) {
+
+				if (payload_verify_use(kernelv[k]))
+					continue;
+
+				CHECK(payload_verify(p, n, word) == exp);
+			}
+		}
+	}
+}
+
+int main(void)
+{
+	int err;
+
+	err = libre_init();
+	if (err)
+		return err;
+
+	test_decode();
+	test_wrong_magic();
+	test_short_header();
+	test_short_payload();
+	test_verify_corrupt();
+	test_verify_kernels();
+
+	libre_close();
+
+	if (failed) {
+		re_fprintf(stderr, "tperf_prototest: %u checks failed\n",
+			   failed);
+		return 1;
+	}
+
+	re_printf("tperf_prototest: ok\n");
+
+	return 0;
+}
@@ -0,0 +1,424 @@
+#include "tperf_res.h"
+#include "tperf_util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+static const char * const tracefsv[] = {
+	"/sys/kernel/tracing",
+	"/sys/kernel/debug/tracing",
+};
+
+static int perf_open(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+
+	attr.size           = sizeof(attr);
+	attr.type           = type;
+	attr.config         = config;
+	attr.inherit        = 1;   /* threads started later */
+	attr.exclude_hv     = 1;
+
+	fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd >= 0)
+		return fd;
+
+	/* perf_event_paranoid may allow user space only */
+	attr.exclude_kernel = 1;
+
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int tracepoint_id(const char *event)
+{
+	char path[256];
+	size_t i;
+	int id = -1;
+
+	for (i = 0; i < ARRAY_SIZE(tracefsv) && id < 0; i++) {
+
+		FILE *f;
+
+		re_snprintf(path, sizeof(path), "%s/events/%s/id",
+			    tracefsv[i], event);
+
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+
+		if (fscanf(f, "%d", &id) != 1)
+			id = -1;
+
+		(void)fclose(f);
+	}
+
+	return id;
+}
+
+static void read_rusage(struct ressnap *s)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return;
+
+	s->utime  = ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec;
+	s->stime  = ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec;
+	s->nvcsw  = ru.ru_nvcsw;
+	s->nivcsw = ru.ru_nivcsw;
+	s->majflt = ru.ru_majflt;
+}
+
+static void read_io(struct ressnap *s)
+{
+	char line[128];
+	FILE *f;
+
+	f = fopen("/proc/self/io", "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+
+		unsigned long long v;
+
+		if (1 == sscanf(line, "syscr: %llu", &v))
+			s->syscr = v;
+		else if (1 == sscanf(line, "syscw: %llu", &v))
+			s->syscw = v;
+	}
+
+	(void)fclose(f);
+}
+
+static int ino_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* inodes of the sockets of this process, sorted */
+static uint64_t *socket_inodes(size_t *np)
+{
+	uint64_t *v = NULL;
+	size_t n = 0, size = 0;
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir("/proc/self/fd");
+	if (!dir)
+		return NULL;
+
+	while ((de = readdir(dir))) {
+
+		char path[64], link[64];
+		unsigned long long ino;
+		ssize_t len;
+
+		if (de->d_name[0] == '.')
+			continue;
+
+		re_snprintf(path, sizeof(path), "/proc/self/fd/%s",
+			    de->d_name);
+
+		len = readlink(path, link, sizeof(link) - 1);
+		if (len <= 0)
+			continue;
+		link[len] = '\0';
+
+		if (1 != sscanf(link, "socket:[%llu]", &ino))
+			continue;
+
+		if (n == size) {
+			uint64_t *p;
+
+			size = size ? size * 2 : 256;
+			p = mem_realloc(v, size * sizeof(*v));
+			if (!p)
+				break;
+			v = p;
+		}
+
+		v[n++] = ino;
+	}
+
+	(void)closedir(dir);
+
+	if (v)
+		qsort(v, n, sizeof(*v), ino_cmp);
+
+	*np = n;
+
+	return v;
+}
+
+/*
+ * The drops column is sk_drops, the counter that SO_RXQ_OVFL hands out
+ * with every datagram; libre reads with recvfrom(2), so it is taken
+ * from here instead.
+ */
+static uint64_t udp_drops(const char *file, const uint64_t *inov, size_t n)
+{
+	uint64_t drops = 0;
+	char line[512];
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f)
+		return 0;
+
+	/* header */
+	if (!fgets(line, sizeof(line), f))
+		goto out;
+
+	while (fgets(line, sizeof(line), f)) {
+
+		unsigned long long ino, d;
+		uint64_t key;
+
+		if (2 != sscanf(line, "%*s %*s %*s %*s %*s %*s %*s %*s %*s"
+				" %llu %*s %*s %llu", &ino, &d))
+			continue;
+
+		key = ino;
+
+		if (d && bsearch(&key, inov, n, sizeof(*inov), ino_cmp))
+			drops += d;
+	}
+
+ out:
+	(void)fclose(f);
+
+	return drops;
+}
+
+static void read_udp_drops(struct ressnap *s)
+{
+	uint64_t *inov;
+	size_t n = 0;
+
+	s->udp_scanned = true;
+
+	inov = socket_inodes(&n);
+	if (!inov)
+		return;
+
+	s->udp_drops = udp_drops("/proc/net/udp", inov, n)
+		+ udp_drops("/proc/net/udp6", inov, n);
+
+	mem_deref(inov);
+}
+
+static void read_udp(struct ressnap *s)
+{
+	char line[512];
+	FILE *f;
+
+	f = fopen("/proc/net/snmp", "r");
+	if (!f)
+		return;
+
+	/* the second "Udp:" line has the values */
+	while (fgets(line, sizeof(line), f)) {
+
+		unsigned long long v;
+
+		if (1 == sscanf(line, "Udp: %*u %*u %*u %*u %llu", &v)) {
+			s->udp_rcvbuf_err = v;
+			break;
+		}
+	}
+
+	(void)fclose(f);
+}
+
+static void read_snap(const struct resmon *rm, struct ressnap *s,
+		      uint64_t packets, bool drops)
+{
+	int i;
+
+	memset(s, 0, sizeof(*s));
+
+	s->t       = tperf_clock_ns();
+	s->packets = packets;
+
+	read_rusage(s);
+	read_io(s);
+	read_udp(s);
+	if (drops)
+		read_udp_drops(s);
+
+	for (i = 0; i < RES_PERF_MAX; i++) {
+
+		uint64_t v;
+
+		if (rm->fdv[i] < 0)
+			continue;
+
+		if (read(rm->fdv[i], &v, sizeof(v)) == sizeof(v))
+			s->perf[i] = v;
+	}
+}
+
+/* before any worker thread is started */
+int resmon_init(struct resmon *rm)
+{
+	int id;
+
+	if (!rm)
+		return EINVAL;
+
+	memset(rm, 0, sizeof(*rm));
+
+	rm->fdv[RES_CYCLES]       = perf_open(PERF_TYPE_HARDWARE,
+					      PERF_COUNT_HW_CPU_CYCLES);
+	rm->fdv[RES_INSTRUCTIONS] = perf_open(PERF_TYPE_HARDWARE,
+					      PERF_COUNT_HW_INSTRUCTIONS);
+	rm->fdv[RES_CTXSW]        = perf_open(PERF_TYPE_SOFTWARE,
+					      PERF_COUNT_SW_CONTEXT_SWITCHES);
+
+	id = tracepoint_id("raw_syscalls/sys_enter");
+	rm->fdv[RES_SYSCALLS] = id < 0 ? -1
+		: perf_open(PERF_TYPE_TRACEPOINT, id);
+
+	read_snap(rm, &rm->start, 0, true);
+	rm->prev = rm->cur = rm->start;
+
+	return 0;
+}
+
+void resmon_close(struct resmon *rm)
+{
+	int i;
+
+	/* not initialized */
+	if (!rm || !rm->start.t)
+		return;
+
+	for (i = 0; i < RES_PERF_MAX; i++) {
+		if (rm->fdv[i] >= 0)
+			(void)close(rm->fdv[i]);
+		rm->fdv[i] = -1;
+	}
+}
+
+/* packets: sent and received so far */
+void resmon_sample(struct resmon *rm, uint64_t packets)
+{
+	if (!rm)
+		return;
+
+	rm->prev = rm->cur;
+	read_snap(rm, &rm->cur, packets, false);
+}
+
+/* the last one, with the UDP drops, while the sockets are still open */
+void resmon_sample_end(struct resmon *rm, uint64_t packets)
+{
+	if (!rm)
+		return;
+
+	rm->prev = rm->cur;
+	read_snap(rm, &rm->cur, packets, true);
+}
+
+static int print_delta(struct re_printf *pf, const struct resmon *rm,
+		       const struct ressnap *a, const struct ressnap *b)
+{
+	double secs = (b->t - a->t) / 1e9;
+	uint64_t pkts = b->packets - a->packets;
+	uint64_t cpu = (b->utime - a->utime) + (b->stime - a->stime);
+	uint64_t sys, ctxsw, cycles, instr;
+	int err;
+
+	if (secs <= 0)
+		return 0;
+
+	err = re_hprintf(pf, "cpu %.1f%% (sys %.1f%%)",
+			 cpu / secs / 1e4,
+			 (b->stime - a->stime) / secs / 1e4);
+
+	if (pkts)
+		err |= re_hprintf(pf, ", %.2f us/packet", (double)cpu / pkts);
+
+	ctxsw = rm->fdv[RES_CTXSW] >= 0
+		? b->perf[RES_CTXSW] - a->perf[RES_CTXSW]
+		: (b->nvcsw - a->nvcsw) + (b->nivcsw - a->nivcsw);
+
+	err |= re_hprintf(pf, ", %.0f ctxsw/s (%llu involuntary)",
+			  ctxsw / secs, b->nivcsw - a->nivcsw);
+
+	if (rm->fdv[RES_SYSCALLS] >= 0) {
+		sys = b->perf[RES_SYSCALLS] - a->perf[RES_SYSCALLS];
+
+		err |= re_hprintf(pf, ", %.0f syscalls/s", sys / secs);
+		if (pkts)
+			err |= re_hprintf(pf, " (%.2f/packet)",
+					  (double)sys / pkts);
+	}
+	else {
+		sys = (b->syscr - a->syscr) + (b->syscw - a->syscw);
+
+		err |= re_hprintf(pf, ", %.0f read/write calls/s",
+				  sys / secs);
+	}
+
+	if (rm->fdv[RES_CYCLES] >= 0 && pkts) {
+		cycles = b->perf[RES_CYCLES] - a->perf[RES_CYCLES];
+
+		err |= re_hprintf(pf, ", %.0f cycles/packet",
+				  (double)cycles / pkts);
+
+		if (rm->fdv[RES_INSTRUCTIONS] >= 0 && cycles) {
+			instr = b->perf[RES_INSTRUCTIONS]
+				- a->perf[RES_INSTRUCTIONS];
+
+			err |= re_hprintf(pf, " (IPC %.2f)",
+					  (double)instr / cycles);
+		}
+	}
+
+	if (b->majflt != a->majflt)
+		err |= re_hprintf(pf, ", %llu major faults",
+				  b->majflt - a->majflt);
+
+	/* the drops of sockets closed meanwhile are gone */
+	if (a->udp_scanned && b->udp_scanned)
+		err |= re_hprintf(pf, ", udp drops %llu",
+				  b->udp_drops > a->udp_drops
+				  ? b->udp_drops - a->udp_drops : 0);
+
+	err |= re_hprintf(pf, ", host rcvbuf errors %llu",
+			  b->udp_rcvbuf_err - a->udp_rcvbuf_err);
+
+	return err;
+}
+
+/* since the previous sample */
+int resmon_print(struct re_printf *pf, const struct resmon *rm)
+{
+	if (!rm)
+		return 0;
+
+	return print_delta(pf, rm, &rm->prev, &rm->cur);
+}
+
+/* since resmon_init() */
+int resmon_print_total(struct re_printf *pf, const struct resmon *rm)
+{
+	if (!rm)
+		return 0;
+
+	return print_delta(pf, rm, &rm->start, &rm->cur);
+}
@@ -0,0 +1,57 @@
+#ifndef MY_TPERF_RES_H_INCLUIDO
+#define MY_TPERF_RES_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+enum res_perf {
+	RES_CYCLES = 0,
+	RES_INSTRUCTIONS,
+	RES_CTXSW,
+	RES_SYSCALLS,
+
+	RES_PERF_MAX
+};
+
+/* process resources at one point in time, cumulative */
+struct ressnap {
+	uint64_t t;                /* [ns] */
+	uint64_t packets;          /* sent and received, from the caller */
+	uint64_t utime;            /* [us] */
+	uint64_t stime;            /* [us] */
+	uint64_t nvcsw;
+	uint64_t nivcsw;
+	uint64_t majflt;
+	uint64_t syscr;            /* read and write calls, /proc/self/io */
+	uint64_t syscw;
+	uint64_t perf[RES_PERF_MAX];
+	uint64_t udp_drops;        /* of our sockets, /proc/net/udp */
+	bool udp_scanned;          /* udp_drops read, first and last only */
+	uint64_t udp_rcvbuf_err;   /* whole host, /proc/net/snmp */
+};
+
+/*
+ * Resource accounting for the whole process, all threads included.
+ * Hardware and scheduler counters come from perf_event_open(2) where
+ * the kernel allows it; missing counters are left out of the report.
+ *
+ * The drops of our sockets take a readlink(2) per descriptor and the
+ * whole /proc/net/udp of the host, too slow for the loop that paces
+ * the traffic; they are read by resmon_init() and resmon_sample_end()
+ * only, and are in the totals.
+ */
+struct resmon {
+	int fdv[RES_PERF_MAX];     /* -1 if not available */
+	struct ressnap start;
+	struct ressnap prev;
+	struct ressnap cur;
+};
+
+int  resmon_init(struct resmon *rm);
+void resmon_close(struct resmon *rm);
+void resmon_sample(struct resmon *rm, uint64_t packets);
+void resmon_sample_end(struct resmon *rm, uint64_t packets);
+int  resmon_print(struct re_printf *pf, const struct resmon *rm);
+int  resmon_print_total(struct re_printf *pf, const struct resmon *rm);
+
+#endif
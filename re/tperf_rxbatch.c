@@ -0,0 +1,343 @@
+#define _GNU_SOURCE 1
+#include "tperf_rxbatch.h"
+#include "tperf_util.h"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* room for the UDP_GRO segment size */
+#define RXBATCH_CTLSIZE CMSG_SPACE(sizeof(int))
+
+struct rxsock {
+	struct rxbatch *rb;
+	struct udp_sock *us;       /* keeps fd open while we listen on it */
+	int fd;
+	rxbatch_h *recvh;
+	void *arg;
+};
+
+static uint64_t thread_cpu_ns(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_THREAD, &ru))
+		return 0;
+
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)
+		* 1000000000ULL
+		+ (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec)
+		* 1000ULL;
+}
+
+static void rxsock_destructor(void *arg)
+{
+	struct rxsock *rxs = arg;
+
+	/* the socket may outlive us, it must not call us any more */
+	if (rxs->fd >= 0)
+		fd_close(rxs->fd);
+
+	mem_deref(rxs->us);
+}
+
+static int rxbatch_buffers(struct rxbatch *rb)
+{
+	unsigned i;
+
+	if (rb->msgv)
+		return 0;
+
+	rb->msgv  = mem_zalloc(rb->n * sizeof(*rb->msgv), NULL);
+	rb->iov   = mem_zalloc(rb->n * sizeof(*rb->iov), NULL);
+	rb->addrv = mem_zalloc(rb->n * sizeof(*rb->addrv), NULL);
+	rb->buf   = mem_alloc(rb->n * rb->bufsize, NULL);
+	rb->view  = mem_zalloc(sizeof(*rb->view), NULL);
+	if (rb->gro)
+		rb->ctlv = mem_zalloc(rb->n * RXBATCH_CTLSIZE, NULL);
+	if (!rb->msgv || !rb->iov || !rb->addrv || !rb->buf || !rb->view ||
+	    (rb->gro && !rb->ctlv)) {
+		rxbatch_close(rb);
+		return ENOMEM;
+	}
+
+	for (i = 0; i < rb->n; i++) {
+		rb->iov[i].iov_base = rb->buf + i * rb->bufsize;
+		rb->iov[i].iov_len  = rb->bufsize;
+	}
+
+	return 0;
+}
+
+/* segment size of a merged datagram, or its length if it is just one */
+static size_t gro_segsize(struct msghdr *hdr, size_t len)
+{
+	struct cmsghdr *cm;
+	int segsz;
+
+	for (cm = CMSG_FIRSTHDR(hdr); cm; cm = CMSG_NXTHDR(hdr, cm)) {
+
+		if (cm->cmsg_level != SOL_UDP || cm->cmsg_type != UDP_GRO)
+			continue;
+
+		memcpy(&segsz, CMSG_DATA(cm), sizeof(segsz));
+
+		if (segsz > 0 && (size_t)segsz < len)
+			return (size_t)segsz;
+	}
+
+	return len;
+}
+
+/* one recvmmsg(2), returns the number of datagrams */
+static int rxbatch_read(struct rxsock *rxs)
+{
+	struct rxbatch *rb = rxs->rb;
+	unsigned i;
+	int n;
+
+	for (i = 0; i < rb->n; i++) {
+		struct msghdr *hdr = &rb->msgv[i].msg_hdr;
+
+		hdr->msg_name       = &rb->addrv[i];
+		hdr->msg_namelen    = sizeof(rb->addrv[i]);
+		hdr->msg_iov        = &rb->iov[i];
+		hdr->msg_iovlen     = 1;
+		hdr->msg_control    = rb->gro ? rb->ctlv + i * RXBATCH_CTLSIZE
+					      : NULL;
+		hdr->msg_controllen = rb->gro ? RXBATCH_CTLSIZE : 0;
+		hdr->msg_flags      = 0;
+	}
+
+	n = recvmmsg(rxs->fd, rb->msgv, rb->n, MSG_DONTWAIT, NULL);
+	if (n <= 0)
+		return 0;
+
+	++rb->calls;
+	rb->datagrams += n;
+	if ((unsigned)n == rb->n)
+		++rb->full;
+
+	for (i = 0; i < (unsigned)n; i++) {
+
+		struct msghdr *hdr = &rb->msgv[i].msg_hdr;
+		size_t len = rb->msgv[i].msg_len, segsz, pos;
+		uint8_t *p = rb->iov[i].iov_base;
+		struct sa src;
+
+		/* the owner let go of the socket */
+		if (mem_nrefs(rxs) == 1)
+			break;
+
+		if (hdr->msg_flags & MSG_TRUNC) {
+			++rb->truncated;
+			continue;
+		}
+
+		if (sa_set_sa(&src, (struct sockaddr *)hdr->msg_name))
+			continue;
+
+		segsz = rb->gro ? gro_segsize(hdr, len) : len;
+
+		for (pos = 0; pos < len; pos += segsz) {
+
+			struct mbuf *mb;
+
+			if (pos && mem_nrefs(rxs) == 1)
+				break;
+
+			/*
+			 * libre may mem_ref() what it is given, the STUN
+			 * decoder does; one that is still held is left to
+			 * its holder. Without memory the rest is dropped.
+			 */
+			if (!rb->view || mem_nrefs(rb->view) > 1) {
+				mem_deref(rb->view);
+				rb->view = mem_zalloc(sizeof(*rb->view), NULL);
+				if (!rb->view)
+					return n;
+			}
+
+			mb = rb->view;
+			mb->buf  = p + pos;
+			mb->size = min(segsz, len - pos);
+			mb->pos  = 0;
+			mb->end  = mb->size;
+
+			++rb->segments;
+			rxs->recvh(&src, mb, rxs->arg);
+		}
+	}
+
+	return n;
+}
+
+static void fd_read_handler(int flags, void *arg)
+{
+	struct rxsock *rxs = arg;
+	unsigned i;
+
+	if (!(flags & FD_READ))
+		return;
+
+	++rxs->rb->wakeups;
+
+	/* a handler may close the allocation, and with it this reader */
+	mem_ref(rxs);
+
+	for (i = 0; i < RXBATCH_CALLS; i++) {
+
+		if ((unsigned)rxbatch_read(rxs) < rxs->rb->n ||
+		    mem_nrefs(rxs) == 1)
+			break;
+	}
+
+	mem_deref(rxs);
+}
+
+void rxbatch_init(struct rxbatch *rb, unsigned n, bool gro)
+{
+	if (!rb)
+		return;
+
+	memset(rb, 0, sizeof(*rb));
+
+	rb->n       = min(n, RXBATCH_MAX);
+	rb->gro     = gro;
+	rb->bufsize = gro ? RXBATCH_GRO_BUFSIZE : RXBATCH_BUFSIZE;
+}
+
+/* after the event loop of the allocator is over */
+void rxbatch_close(struct rxbatch *rb)
+{
+	if (!rb)
+		return;
+
+	rb->msgv  = mem_deref(rb->msgv);
+	rb->iov   = mem_deref(rb->iov);
+	rb->addrv = mem_deref(rb->addrv);
+	rb->buf   = mem_deref(rb->buf);
+	rb->ctlv  = mem_deref(rb->ctlv);
+	rb->view  = mem_deref(rb->view);
+}
+
+/*
+ * Takes the reads of the socket over from libre. The UDP helpers of
+ * the socket are not called for received datagrams any more, recvh
+ * has to feed the TURN client.
+ */
+int rxbatch_attach(struct rxsock **rxsp, struct rxbatch *rb,
+		   struct udp_sock *us, int af, rxbatch_h *recvh, void *arg)
+{
+	struct rxsock *rxs;
+	int err;
+
+	if (!rxsp || !rb || !rb->n || !us || !recvh)
+		return EINVAL;
+
+	err = rxbatch_buffers(rb);
+	if (err)
+		return err;
+
+	rxs = mem_zalloc(sizeof(*rxs), rxsock_destructor);
+	if (!rxs)
+		return ENOMEM;
+
+	rxs->rb    = rb;
+	rxs->us    = mem_ref(us);
+	rxs->fd    = udp_sock_fd(us, af);
+	rxs->recvh = recvh;
+	rxs->arg   = arg;
+
+	if (rxs->fd < 0) {
+		err = EBADF;
+		goto out;
+	}
+
+	if (rb->gro) {
+		int on = 1;
+
+		if (setsockopt(rxs->fd, SOL_UDP, UDP_GRO, &on, sizeof(on))) {
+			err = errno;
+			re_fprintf(stderr, "rxbatch: UDP_GRO (%m)\n", err);
+			goto out;
+		}
+	}
+
+	err = fd_listen(rxs->fd, FD_READ, fd_read_handler, rxs);
+
+ out:
+	if (err) {
+		rxs->fd = -1;
+		mem_deref(rxs);
+	}
+	else {
+		*rxsp = rxs;
+	}
+
+	return err;
+}
+
+/* from the thread of the allocator, packets is its receive total */
+void rxbatch_sample(struct rxbatch *rb, uint64_t packets)
+{
+	uint64_t now = tperf_clock_ns();
+	uint64_t cpu = thread_cpu_ns();
+	double secs;
+
+	if (!rb)
+		return;
+
+	if (rb->t_prev && now > rb->t_prev) {
+		secs    = (now - rb->t_prev) / 1e9;
+		rb->pps = (packets - rb->packets_prev) / secs;
+		rb->cpu = 100.0 * (cpu - rb->cpu_prev) / 1e9 / secs;
+	}
+
+	rb->t_prev       = now;
+	rb->cpu_prev     = cpu;
+	rb->packets_prev = packets;
+}
+
+int rxbatch_print(struct re_printf *pf, const struct rxbatch *rb)
+{
+	int err;
+
+	if (!rb)
+		return 0;
+
+	err = re_hprintf(pf, "%.0f packets/s, thread at %.0f%% of a core",
+			 rb->pps, rb->cpu);
+
+	if (rb->cpu > 0)
+		err |= re_hprintf(pf, " (%.0f packets/s per core)",
+				  rb->pps * 100.0 / rb->cpu);
+
+	if (!rb->n)
+		return err | re_hprintf(pf, ", one datagram per dispatch");
+
+	err |= re_hprintf(pf, ", recvmmsg: %.1f datagrams per call,"
+			  " %.1f calls per wakeup, %llu full",
+			  rb->calls ? (double)rb->datagrams / rb->calls : 0.0,
+			  rb->wakeups ? (double)rb->calls / rb->wakeups : 0.0,
+			  rb->full);
+
+	if (rb->gro)
+		err |= re_hprintf(pf, ", GRO %.1f segments per datagram",
+				  rb->datagrams ? (double)rb->segments
+				  / rb->datagrams : 0.0);
+
+	if (rb->truncated)
+		err |= re_hprintf(pf, ", %llu truncated", rb->truncated);
+
+	return err;
+}
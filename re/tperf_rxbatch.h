@@ -0,0 +1,72 @@
+#ifndef MY_TPERF_RXBATCH_H_INCLUIDO
+#define MY_TPERF_RXBATCH_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+/* datagrams per recvmmsg(2) call, at most */
+#define RXBATCH_MAX 64
+/* a larger datagram is cut and counted [bytes] */
+#define RXBATCH_BUFSIZE 2048
+/* calls per wakeup, so one busy socket does not starve the others */
+#define RXBATCH_CALLS 8
+/* with GRO, a buffer holds the datagrams the kernel merged [bytes] */
+#define RXBATCH_GRO_BUFSIZE 65536
+
+struct mmsghdr;
+struct iovec;
+struct sockaddr_storage;
+
+/* one datagram; mb points into the batch buffer */
+typedef void (rxbatch_h)(const struct sa *src, struct mbuf *mb, void *arg);
+
+/*
+ * Batched receive for the TURN UDP sockets of an allocator. The read
+ * handler of the socket is taken over from libre, and each wakeup
+ * drains the socket with recvmmsg(2) into buffers shared by all the
+ * sockets of the allocator (and so of one thread). The datagrams are
+ * handed on one by one, still without a copy.
+ *
+ * With GRO the kernel merges datagrams of the same size from the same
+ * source, and every buffer is cut into its segments here again.
+ *
+ * The receive rate per core is sampled either way, so that it can be
+ * compared with one datagram per dispatch.
+ */
+struct rxbatch {
+	unsigned n;                /* datagrams per call, 0 for off */
+	bool gro;                  /* UDP_GRO on the sockets */
+	size_t bufsize;            /* per datagram */
+	struct mmsghdr *msgv;
+	struct iovec *iov;
+	struct sockaddr_storage *addrv;
+	uint8_t *buf;
+	uint8_t *ctlv;             /* control messages, with GRO */
+	struct mbuf *view;         /* a datagram in buf, as a libre object */
+
+	uint64_t wakeups;
+	uint64_t calls;
+	uint64_t datagrams;
+	uint64_t full;             /* calls that filled the vector */
+	uint64_t truncated;
+	uint64_t segments;         /* handed on, more than datagrams with GRO */
+
+	/* at the last sample */
+	uint64_t t_prev;
+	uint64_t cpu_prev;         /* of the thread [ns] */
+	uint64_t packets_prev;
+	double pps;
+	double cpu;                /* percent of one core */
+};
+
+struct rxsock;
+
+void rxbatch_init(struct rxbatch *rb, unsigned n, bool gro);
+void rxbatch_close(struct rxbatch *rb);
+int  rxbatch_attach(struct rxsock **rxsp, struct rxbatch *rb,
+		    struct udp_sock *us, int af, rxbatch_h *recvh,
+		    void *arg);
+void rxbatch_sample(struct rxbatch *rb, uint64_t packets);
+int  rxbatch_print(struct re_printf *pf, const struct rxbatch *rb);
+
+#endif
@@ -0,0 +1,104 @@
+#include "tperf_slab.h"
+
+#include <string.h>
+
+struct slab_block {
+	struct le le;
+	uint8_t objv[];
+};
+
+static void block_destructor(void *arg)
+{
+	struct slab_block *blk = arg;
+
+	list_unlink(&blk->le);
+}
+
+void slab_init(struct slab *sl, size_t size)
+{
+	if (!sl)
+		return;
+
+	memset(sl, 0, sizeof(*sl));
+
+	sl->size = (max(size, sizeof(void *)) + 7) & ~(size_t)7;
+	list_init(&sl->blockl);
+}
+
+static int slab_grow(struct slab *sl)
+{
+	struct slab_block *blk;
+	unsigned i;
+
+	blk = mem_alloc(sizeof(*blk) + SLAB_BLOCK * sl->size,
+			block_destructor);
+	if (!blk)
+		return ENOMEM;
+
+	memset(&blk->le, 0, sizeof(blk->le));
+	list_append(&sl->blockl, &blk->le, blk);
+
+	/* the first object of the block is handed out first */
+	for (i = SLAB_BLOCK; i-- > 0;) {
+		void **obj = (void **)&blk->objv[i * sl->size];
+
+		*obj = sl->freel;
+		sl->freel = obj;
+	}
+
+	return 0;
+}
+
+/* a zeroed object, or NULL */
+void *slab_alloc(struct slab *sl)
+{
+	void **obj;
+
+	if (!sl || !sl->size)
+		return NULL;
+
+	if (!sl->freel && slab_grow(sl))
+		return NULL;
+
+	obj = sl->freel;
+	sl->freel = *obj;
+
+	memset(obj, 0, sl->size);
+
+	if (++sl->used > sl->used_max)
+		sl->used_max = sl->used;
+
+	return obj;
+}
+
+void slab_free(struct slab *sl, void *obj)
+{
+	if (!sl || !obj)
+		return;
+
+	*(void **)obj = sl->freel;
+	sl->freel = obj;
+
+	--sl->used;
+}
+
+/* every object of the slab must be freed, or not be used again */
+void slab_close(struct slab *sl)
+{
+	if (!sl)
+		return;
+
+	list_flush(&sl->blockl);
+	sl->freel = NULL;
+	sl->used  = 0;
+}
+
+/* bytes held in blocks */
+size_t slab_bytes(const struct slab *sl)
+{
+	if (!sl)
+		return 0;
+
+	return list_count(&sl->blockl)
+		* (sizeof(struct slab_block) + SLAB_BLOCK * sl->size);
+}
@@ -0,0 +1,32 @@
+#ifndef MY_TPERF_SLAB_H_INCLUIDO
+#define MY_TPERF_SLAB_H_INCLUIDO
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <re.h>
+
+/* objects per block */
+#define SLAB_BLOCK 1024
+
+/*
+ * Fixed-size objects carved from blocks of SLAB_BLOCK. A block is one
+ * heap allocation, so the objects sit next to each other, without a
+ * heap header each. Freed objects go on a free list and are handed
+ * out again, most recently freed first; the blocks are only given
+ * back by slab_close(). One slab belongs to one thread.
+ */
+struct slab {
+	size_t size;               /* object size, rounded up to 8 */
+	struct list blockl;
+	void *freel;               /* link in the first word of the object */
+	unsigned used;
+	unsigned used_max;
+};
+
+void   slab_init(struct slab *sl, size_t size);
+void  *slab_alloc(struct slab *sl);
+void   slab_free(struct slab *sl, void *obj);
+void   slab_close(struct slab *sl);
+size_t slab_bytes(const struct slab *sl);
+
+#endif
@@ -0,0 +1,305 @@
+#include "tperf_soak.h"
+
+#include <string.h>
+
+static void soak_finish(struct soak *sk)
+{
+	sk->running = false;
+	tmr_cancel(&sk->tmr);
+
+	if (sk->doneh)
+		sk->doneh(sk->arg);
+}
+
+static void snap_take(struct soak *sk, struct soaksnap *snap)
+{
+	struct allocator *allocator = sk->allocator;
+	const struct setupstat *st = &allocator->setup;
+	uint64_t now = tperf_clock_ns();
+	struct memstat mstat;
+	struct rxstat rx;
+	struct le *le;
+
+	memset(snap, 0, sizeof(*snap));
+
+	/* first the requests that will not be answered any more */
+	for (le = allocator->allocl.head; le; le = le->next) {
+
+		struct allocation *alloc = le->data;
+
+		stunprobe_expire(alloc->probe, now);
+
+		if (alloc->ready && !alloc->err)
+			++snap->live;
+	}
+
+	allocator_rxstat(allocator, &rx);
+
+	snap->t   = now;
+	snap->rss = proc_rss();
+	snap->fds = proc_fd_count();
+
+	if (0 == mem_get_stat(&mstat)) {
+		snap->mem        = mstat.bytes_cur;
+		snap->mem_blocks = mstat.blocks_cur;
+	}
+
+	snap->refreshes      = st->refresh.n;
+	snap->refresh_failed = st->refresh_failed;
+	snap->perms          = st->perm_refresh.n + st->chan_refresh.n;
+	snap->perm_failed    = st->perm_failed + st->chan_failed;
+	snap->maint          = st->maint;
+	snap->maint_lossy    = st->maint_lossy;
+	snap->maint_drops    = st->maint_drops;
+	snap->received       = rx.received;
+	snap->lost           = rx.lost;
+
+	sk->rss_max = max(sk->rss_max, snap->rss);
+}
+
+static double loss_pct(uint64_t received, uint64_t lost)
+{
+	return received + lost ? 100.0 * lost / (received + lost) : 0.0;
+}
+
+/* [MB per hour] since the first snapshot */
+static double growth_rate(const struct soaksnap *first,
+			  const struct soaksnap *cur, size_t v0, size_t v)
+{
+	double hours = (cur->t - first->t) / 3.6e12;
+
+	if (hours <= 0)
+		return 0.0;
+
+	return ((double)v - (double)v0) / (1024 * 1024) / hours;
+}
+
+static void snap_handler(void *arg)
+{
+	struct soak *sk = arg;
+	const struct soaksnap *first = &sk->first, *prev = &sk->prev;
+	struct soaksnap *cur = &sk->cur;
+	uint32_t secs;
+	uint64_t lost, drops;
+
+	tmr_start(&sk->tmr, sk->conf.interval_ms, snap_handler, sk);
+
+	snap_take(sk, cur);
+	++sk->n;
+
+	secs  = (uint32_t)((cur->t - first->t) / 1000000000ULL);
+	lost  = rxstat_delta(cur->lost, prev->lost);
+	drops = cur->maint_drops - prev->maint_drops;
+
+	/* Refresh times of this interval only */
+	*sk->refresh_int = sk->allocator->setup.refresh;
+	hist_sub(sk->refresh_int, sk->refresh_prev);
+	*sk->refresh_prev = sk->allocator->setup.refresh;
+
+	re_printf("\nsoak %H: %u of %u allocations up, %u dropped\n",
+		  fmt_human_time, &secs, cur->live,
+		  sk->allocator->num_received, sk->dropped);
+
+	re_printf("  maint:    %llu Refresh, %llu failed; %llu permission"
+		  " and channel, %llu failed\n",
+		  cur->refreshes - prev->refreshes,
+		  cur->refresh_failed - prev->refresh_failed,
+		  cur->perms - prev->perms,
+		  cur->perm_failed - prev->perm_failed);
+
+	if (sk->refresh_int->n)
+		re_printf("  Refresh:  %H\n", hist_print_us, sk->refresh_int);
+
+	re_printf("  drops:    %llu of %llu lost during %llu of %llu"
+		  " maintenance transactions, loss %.3f%% overall\n",
+		  drops, lost, cur->maint_lossy - prev->maint_lossy,
+		  cur->maint - prev->maint,
+		  loss_pct(cur->received - prev->received, lost));
+
+	re_printf("  memory:   rss %.1f MB (%+.1f MB, %+.2f MB/h),"
+		  " %d fds (%+d)",
+		  cur->rss / 1048576.0,
+		  ((double)cur->rss - (double)first->rss) / 1048576.0,
+		  growth_rate(first, cur, first->rss, cur->rss),
+		  cur->fds, cur->fds - first->fds);
+
+	if (cur->mem_blocks) {
+		re_printf(", libre %zu blocks (%+ld), %.1f MB",
+			  cur->mem_blocks,
+			  (long)cur->mem_blocks - (long)first->mem_blocks,
+			  cur->mem / 1048576.0);
+	}
+
+	re_printf("\n");
+
+	sk->prev = *cur;
+
+	if (sk->conf.duration_ms &&
+	    cur->t - first->t >= sk->conf.duration_ms * 1000000ULL)
+		soak_finish(sk);
+}
+
+static void end_handler(void *arg)
+{
+	struct soak *sk = arg;
+
+	/* the last snapshot, then the end */
+	snap_handler(sk);
+	if (sk->running)
+		soak_finish(sk);
+}
+
+int soak_init(struct soak *sk, const struct soak_conf *conf,
+	      struct allocator *allocator, soak_done_h *doneh, void *arg)
+{
+	if (!sk || !conf || !allocator)
+		return EINVAL;
+
+	memset(sk, 0, sizeof(*sk));
+
+	sk->conf      = *conf;
+	sk->allocator = allocator;
+	sk->doneh     = doneh;
+	sk->arg       = arg;
+	tmr_init(&sk->tmr);
+
+	if (!sk->conf.interval_ms)
+		sk->conf.interval_ms = SOAK_INTERVAL_MS;
+
+	return 0;
+}
+
+/* with the senders running */
+int soak_start(struct soak *sk)
+{
+	unsigned ms;
+
+	if (!sk || !sk->allocator)
+		return EINVAL;
+
+	if (sk->running)
+		return EALREADY;
+
+	if (!sk->refresh_prev) {
+		sk->refresh_prev = mem_zalloc(sizeof(*sk->refresh_prev),
+					      NULL);
+		sk->refresh_int  = mem_zalloc(sizeof(*sk->refresh_int),
+					      NULL);
+		if (!sk->refresh_prev || !sk->refresh_int)
+			return ENOMEM;
+	}
+
+	sk->running = true;
+	sk->n       = 0;
+	sk->dropped = 0;
+	sk->rss_max = 0;
+
+	snap_take(sk, &sk->first);
+	sk->prev = sk->first;
+	*sk->refresh_prev = sk->allocator->setup.refresh;
+
+	ms = sk->conf.interval_ms;
+	if (sk->conf.duration_ms && sk->conf.duration_ms < ms)
+		ms = sk->conf.duration_ms;
+
+	re_printf("soak: %u allocations, snapshot every %u s, %s;"
+		  " rss %.1f MB, %d fds\n",
+		  sk->first.live, sk->conf.interval_ms / 1000,
+		  sk->conf.duration_ms ? "until the duration is over"
+				       : "until stopped",
+		  sk->first.rss / 1048576.0, sk->first.fds);
+
+	tmr_start(&sk->tmr, ms, snap_handler, sk);
+
+	return 0;
+}
+
+/* an allocation that was up has failed */
+void soak_drop(struct soak *sk)
+{
+	if (!sk || !sk->running)
+		return;
+
+	++sk->dropped;
+}
+
+/* ends the soak early, with a last snapshot */
+void soak_stop(struct soak *sk)
+{
+	if (!sk || !sk->running)
+		return;
+
+	tmr_start(&sk->tmr, 0, end_handler, sk);
+}
+
+void soak_close(struct soak *sk)
+{
+	if (!sk)
+		return;
+
+	tmr_cancel(&sk->tmr);
+	sk->running = false;
+
+	sk->refresh_prev = mem_deref(sk->refresh_prev);
+	sk->refresh_int  = mem_deref(sk->refresh_int);
+}
+
+int soak_print(struct re_printf *pf, const struct soak *sk)
+{
+	const struct soaksnap *first, *cur;
+	const struct setupstat *st;
+	uint32_t secs;
+	int err = 0;
+
+	if (!sk || !sk->n)
+		return 0;
+
+	first = &sk->first;
+	cur   = &sk->cur;
+	st    = &sk->allocator->setup;
+	secs  = (uint32_t)((cur->t - first->t) / 1000000000ULL);
+
+	err |= re_hprintf(pf, "soak of %H, %u snapshots: %u allocations"
+			  " dropped\n", fmt_human_time, &secs, sk->n,
+			  sk->dropped);
+
+	err |= re_hprintf(pf, "  Refresh           %8llu  %H\n",
+			  st->refresh.n, hist_print_us, &st->refresh);
+	if (st->perm_refresh.n)
+		err |= re_hprintf(pf, "  CreatePermission  %8llu  %H\n",
+				  st->perm_refresh.n, hist_print_us,
+				  &st->perm_refresh);
+	if (st->chan_refresh.n)
+		err |= re_hprintf(pf, "  ChannelBind       %8llu  %H\n",
+				  st->chan_refresh.n, hist_print_us,
+				  &st->chan_refresh);
+
+	err |= re_hprintf(pf, "  failed: %llu Refresh, %llu CreatePermission,"
+			  " %llu ChannelBind\n", st->refresh_failed,
+			  st->perm_failed, st->chan_failed);
+
+	err |= re_hprintf(pf, "  drops: %llu of %llu lost during %llu of"
+			  " %llu maintenance transactions\n",
+			  cur->maint_drops - first->maint_drops,
+			  rxstat_delta(cur->lost, first->lost),
+			  cur->maint_lossy - first->maint_lossy,
+			  cur->maint - first->maint);
+
+	err |= re_hprintf(pf, "  memory: rss %.1f MB to %.1f MB, peak %.1f MB"
+			  " (%+.2f MB/h); %d to %d fds\n",
+			  first->rss / 1048576.0, cur->rss / 1048576.0,
+			  sk->rss_max / 1048576.0,
+			  growth_rate(first, cur, first->rss, cur->rss),
+			  first->fds, cur->fds);
+
+	if (cur->mem_blocks) {
+		err |= re_hprintf(pf, "  libre: %zu to %zu blocks,"
+				  " %.1f MB to %.1f MB (%+.2f MB/h)\n",
+				  first->mem_blocks, cur->mem_blocks,
+				  first->mem / 1048576.0, cur->mem / 1048576.0,
+				  growth_rate(first, cur, first->mem,
+					      cur->mem));
+	}
+
+	return err;
+}
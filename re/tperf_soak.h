@@ -0,0 +1,72 @@
+#ifndef MY_TPERF_SOAK_H_INCLUIDO
+#define MY_TPERF_SOAK_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+#include "tperf_util.h"
+
+/* between two snapshots, unless configured */
+#define SOAK_INTERVAL_MS 60000
+
+struct soak_conf {
+	unsigned duration_ms;      /* 0: until stopped */
+	unsigned interval_ms;      /* between snapshots */
+};
+
+typedef void (soak_done_h)(void *arg);
+
+/* the process and the allocations at one point in time, cumulative */
+struct soaksnap {
+	uint64_t t;                /* [ns] */
+	size_t rss;                /* [bytes] */
+	int fds;
+	size_t mem;                /* held by libre, with MEM_DEBUG only */
+	size_t mem_blocks;
+	unsigned live;             /* allocations that are ready */
+	uint64_t refreshes;
+	uint64_t refresh_failed;
+	uint64_t perms;            /* CreatePermission and ChannelBind */
+	uint64_t perm_failed;
+	uint64_t maint;
+	uint64_t maint_lossy;
+	uint64_t maint_drops;
+	uint64_t received;
+	uint64_t lost;
+};
+
+/*
+ * Soak run. The allocations of one allocator are kept up and loaded
+ * for hours, across the Refreshes of the TURN client and the refreshes
+ * of their permissions and channels. A snapshot every interval shows
+ * the maintenance round trips and failures, the packets lost while a
+ * maintenance transaction was open, and the growth of the process.
+ * Allocations that fail after the setup are counted, not fatal.
+ */
+struct soak {
+	struct soak_conf conf;
+	struct allocator *allocator;
+	soak_done_h *doneh;
+	void *arg;
+	struct tmr tmr;
+	bool running;
+
+	unsigned n;                /* snapshots */
+	unsigned dropped;          /* allocations lost after the setup */
+	size_t rss_max;
+	struct soaksnap first;
+	struct soaksnap prev;
+	struct soaksnap cur;
+	struct hist *refresh_prev; /* Refresh times at the last snapshot */
+	struct hist *refresh_int;  /* and since then */
+};
+
+int  soak_init(struct soak *sk, const struct soak_conf *conf,
+	       struct allocator *allocator, soak_done_h *doneh, void *arg);
+int  soak_start(struct soak *sk);
+void soak_drop(struct soak *sk);
+void soak_stop(struct soak *sk);
+void soak_close(struct soak *sk);
+int  soak_print(struct re_printf *pf, const struct soak *sk);
+
+#endif
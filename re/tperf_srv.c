@@ -0,0 +1,469 @@
+#include "tperf_srv.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct srvquery {
+	struct srvlist *sl;
+	unsigned spec;
+	struct stun_dns *dns;
+	struct dns_query *q;
+};
+
+static void query_destructor(void *arg)
+{
+	struct srvquery *sq = arg;
+
+	mem_deref(sq->dns);
+	mem_deref(sq->q);
+}
+
+/* "<host>[:<port>][/<weight>]", IPv6 literals in brackets with a port */
+int srvlist_add(struct srvlist *sl, const char *str)
+{
+	struct srvspec *spec;
+	const char *host, *end, *slash, *colon;
+	size_t len;
+
+	if (!sl || !str || !*str)
+		return EINVAL;
+
+	if (sl->nspec >= SRV_MAX)
+		return EOVERFLOW;
+
+	spec = &sl->specv[sl->nspec];
+	memset(spec, 0, sizeof(*spec));
+	spec->weight = 1;
+
+	slash = strrchr(str, '/');
+	if (slash) {
+		spec->weight = atoi(slash + 1);
+		if (!spec->weight || spec->weight > SRV_WEIGHT_MAX)
+			return EINVAL;
+	}
+
+	end  = slash ? slash : str + strlen(str);
+	host = str;
+
+	if (*host == '[') {
+		const char *rb = memchr(host, ']', end - host);
+
+		if (!rb)
+			return EINVAL;
+
+		colon = rb + 1 < end && rb[1] == ':' ? rb + 1 : NULL;
+		++host;
+		len = rb - host;
+	}
+	else {
+		colon = memchr(host, ':', end - host);
+
+		/* IPv6 literal without a port */
+		if (colon && memchr(colon + 1, ':', end - colon - 1))
+			colon = NULL;
+
+		len = (colon ? colon : end) - host;
+	}
+
+	if (!len || len >= sizeof(spec->host))
+		return EINVAL;
+
+	if (colon) {
+		int port = atoi(colon + 1);
+
+		if (port <= 0 || port > 65535)
+			return EINVAL;
+
+		spec->port = (uint16_t)port;
+	}
+
+	memcpy(spec->host, host, len);
+	spec->host[len] = '\0';
+
+	++sl->nspec;
+
+	return 0;
+}
+
+static void server_add(struct srvlist *sl, unsigned spec, const struct sa *sa)
+{
+	if (sl->n >= SRV_MAX) {
+		re_fprintf(stderr, "servers: more than %u, ignoring %J\n",
+			   SRV_MAX, sa);
+		return;
+	}
+
+	sl->srvv[sl->n].addr   = *sa;
+	sl->srvv[sl->n].spec   = spec;
+	sl->srvv[sl->n].weight = sl->specv[spec].weight;
+	++sl->n;
+}
+
+/*
+ * Smooth weighted round-robin, laid out once: allocation ix goes to
+ * schedv[ix % nsched], so the worker threads need no shared state and
+ * every window of the schedule is spread by weight.
+ */
+static int schedule_build(struct srvlist *sl)
+{
+	int cur[SRV_MAX] = {0};
+	unsigned i, k, total = 0;
+
+	for (i = 0; i < sl->n; i++)
+		total += sl->srvv[i].weight;
+
+	sl->schedv = mem_zalloc(total * sizeof(*sl->schedv), NULL);
+	if (!sl->schedv)
+		return ENOMEM;
+
+	for (k = 0; k < total; k++) {
+
+		unsigned best = 0;
+
+		for (i = 0; i < sl->n; i++) {
+			cur[i] += (int)sl->srvv[i].weight;
+			if (cur[i] > cur[best])
+				best = i;
+		}
+
+		cur[best] -= (int)total;
+		sl->schedv[k] = best;
+	}
+
+	sl->nsched = total;
+
+	return 0;
+}
+
+/* servers in the order of the command line, whatever answered first */
+static void servers_sort(struct srvlist *sl)
+{
+	unsigned i, j;
+
+	for (i = 1; i < sl->n; i++) {
+
+		struct server s = sl->srvv[i];
+
+		for (j = i; j > 0 && sl->srvv[j - 1].spec > s.spec; j--)
+			sl->srvv[j] = sl->srvv[j - 1];
+
+		sl->srvv[j] = s;
+	}
+}
+
+static void query_done(struct srvlist *sl)
+{
+	int err = 0;
+
+	if (--sl->pending)
+		return;
+
+	if (!sl->n) {
+		err = ENOENT;
+		goto out;
+	}
+
+	servers_sort(sl);
+
+	err = schedule_build(sl);
+
+ out:
+	if (sl->resolvedh)
+		sl->resolvedh(err, sl, sl->arg);
+}
+
+static void stun_dns_handler(int err, const struct sa *srv, void *arg)
+{
+	struct srvquery *sq = arg;
+
+	if (err) {
+		re_fprintf(stderr, "servers: %s not resolved (%m)\n",
+			   sq->sl->specv[sq->spec].host, err);
+	}
+	else {
+		server_add(sq->sl, sq->spec, srv);
+	}
+
+	query_done(sq->sl);
+}
+
+static bool rr_handler(struct dnsrr *rr, void *arg)
+{
+	struct srvquery *sq = arg;
+	struct srvlist *sl = sq->sl;
+	const struct srvspec *spec = &sl->specv[sq->spec];
+	struct sa sa;
+
+	sa_set_in(&sa, rr->rdata.a.addr, spec->port ? spec->port : sl->dport);
+	server_add(sl, sq->spec, &sa);
+
+	return false;
+}
+
+static void a_query_handler(int err, const struct dnshdr *hdr,
+			    struct list *ansl, struct list *authl,
+			    struct list *addl, void *arg)
+{
+	struct srvquery *sq = arg;
+	unsigned n = sq->sl->n;
+	(void)hdr;
+	(void)authl;
+	(void)addl;
+
+	if (!err) {
+		(void)dns_rrlist_apply(ansl, NULL, DNS_TYPE_A, DNS_CLASS_IN,
+				       false, rr_handler, sq);
+	}
+
+	if (err || n == sq->sl->n) {
+		re_fprintf(stderr, "servers: no A records for %s (%m)\n",
+			   sq->sl->specv[sq->spec].host, err);
+	}
+
+	query_done(sq->sl);
+}
+
+/*
+ * Literal addresses are taken as they are. A host name becomes one
+ * server through the STUN/TURN SRV and A lookup, or, with all_addrs,
+ * one server for each of its A records.
+ */
+int srvlist_resolve(struct srvlist *sl, struct dnsc *dnsc,
+		    const char *service, const char *proto, int af,
+		    uint16_t dport, srvlist_h *resolvedh, void *arg)
+{
+	unsigned i;
+	int err = 0;
+
+	if (!sl || !dnsc || !sl->nspec)
+		return EINVAL;
+
+	sl->dport     = dport;
+	sl->resolvedh = resolvedh;
+	sl->arg       = arg;
+	sl->n         = 0;
+
+	/* until all queries are out */
+	sl->pending = 1;
+
+	for (i = 0; i < sl->nspec; i++) {
+
+		const struct srvspec *spec = &sl->specv[i];
+		struct srvquery *sq;
+		struct sa sa;
+
+		if (0 == sa_set_str(&sa, spec->host,
+				    spec->port ? spec->port : dport)) {
+			server_add(sl, i, &sa);
+			continue;
+		}
+
+		sq = mem_zalloc(sizeof(*sq), query_destructor);
+		if (!sq)
+			return ENOMEM;
+
+		sq->sl   = sl;
+		sq->spec = i;
+		sl->queryv[i] = sq;
+
+		++sl->pending;
+
+		if (sl->all_addrs) {
+			err = dnsc_query(&sq->q, dnsc, spec->host, DNS_TYPE_A,
+					 DNS_CLASS_IN, true, a_query_handler,
+					 sq);
+		}
+		else {
+			err = stun_server_discover(&sq->dns, dnsc, service,
+						   proto, af, spec->host,
+						   spec->port,
+						   stun_dns_handler, sq);
+		}
+		if (err) {
+			re_fprintf(stderr, "servers: cannot resolve %s (%m)\n",
+				   spec->host, err);
+			--sl->pending;
+			return err;
+		}
+	}
+
+	query_done(sl);
+
+	return 0;
+}
+
+void srvlist_close(struct srvlist *sl)
+{
+	unsigned i;
+
+	if (!sl)
+		return;
+
+	for (i = 0; i < SRV_MAX; i++)
+		sl->queryv[i] = mem_deref(sl->queryv[i]);
+
+	sl->schedv  = mem_deref(sl->schedv);
+	sl->nsched  = 0;
+	sl->pending = 0;
+}
+
+unsigned srvlist_pick(const struct srvlist *sl, unsigned ix)
+{
+	if (!sl || !sl->nsched)
+		return 0;
+
+	return sl->schedv[ix % sl->nsched];
+}
+
+int srvlist_print(struct re_printf *pf, const struct srvlist *sl)
+{
+	unsigned i;
+	int err = 0;
+
+	if (!sl)
+		return 0;
+
+	for (i = 0; i < sl->n; i++) {
+		err |= re_hprintf(pf, "%s%J (%s, weight %u)",
+				  i ? ", " : "", &sl->srvv[i].addr,
+				  sl->specv[sl->srvv[i].spec].host,
+				  sl->srvv[i].weight);
+	}
+
+	return err;
+}
+
+int srvstat_alloc(struct srvstat **statvp, unsigned n)
+{
+	struct srvstat *statv;
+	unsigned i;
+
+	if (!statvp || !n)
+		return EINVAL;
+
+	statv = mem_zalloc(n * sizeof(*statv), NULL);
+	if (!statv)
+		return ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		hist_reset(&statv[i].setup);
+		hist_reset(&statv[i].lat);
+	}
+
+	*statvp = statv;
+
+	return 0;
+}
+
+/* from the owning thread, like allocator_rxstat() */
+void srvstat_collect(struct srvstat *statv, unsigned n,
+		     const struct allocator *allocator)
+{
+	struct le *le;
+	unsigned i;
+
+	if (!statv || !allocator)
+		return;
+
+	for (i = 0; i < n; i++)
+		memset(&statv[i].rx, 0, sizeof(statv[i].rx));
+
+	for (le = allocator->allocl.head; le; le = le->next) {
+
+		const struct allocation *alloc = le->data;
+		const struct receiver *recvr = &alloc->recv;
+		struct rxstat *st;
+
+		if (!alloc->srvstat || alloc->srvstat < statv ||
+		    alloc->srvstat >= statv + n)
+			continue;
+
+		st = &alloc->srvstat->rx;
+
+		st->packets   += recvr->total_packets;
+		st->bytes     += recvr->total_bytes;
+		st->received  += recvr->win.received;
+		st->lost      += recvr->win.lost + seqwin_pending(&recvr->win);
+		st->reordered += recvr->win.reordered;
+		st->duplicate += recvr->win.duplicate;
+		st->late      += recvr->win.late;
+		st->corrupt   += recvr->corrupt;
+	}
+}
+
+void srvstat_merge(struct srvstat *dst, const struct srvstat *src,
+		   unsigned n)
+{
+	unsigned i;
+
+	if (!dst || !src)
+		return;
+
+	for (i = 0; i < n; i++) {
+		dst[i].allocations  += src[i].allocations;
+		dst[i].failed       += src[i].failed;
+		dst[i].dropped      += src[i].dropped;
+		dst[i].rx.packets   += src[i].rx.packets;
+		dst[i].rx.bytes     += src[i].rx.bytes;
+		dst[i].rx.received  += src[i].rx.received;
+		dst[i].rx.lost      += src[i].rx.lost;
+		dst[i].rx.reordered += src[i].rx.reordered;
+		dst[i].rx.duplicate += src[i].rx.duplicate;
+		dst[i].rx.late      += src[i].rx.late;
+		dst[i].rx.corrupt   += src[i].rx.corrupt;
+
+		hist_merge(&dst[i].setup, &src[i].setup);
+		hist_merge(&dst[i].lat, &src[i].lat);
+	}
+}
+
+/* one line per server; the share of allocations is set against the weight */
+int srvstat_print(struct re_printf *pf, const struct srvlist *sl,
+		  const struct srvstat *statv)
+{
+	uint64_t total = 0;
+	unsigned i, wsum = 0;
+	int err = 0;
+
+	if (!sl || !statv)
+		return 0;
+
+	for (i = 0; i < sl->n; i++) {
+		total += statv[i].allocations;
+		wsum  += sl->srvv[i].weight;
+	}
+
+	for (i = 0; i < sl->n; i++) {
+
+		const struct srvstat *s = &statv[i];
+		double share = total ? 100.0 * s->allocations / total : 0;
+		double loss = s->rx.received + s->rx.lost
+			? 100.0 * s->rx.lost / (s->rx.received + s->rx.lost)
+			: 0;
+
+		err |= re_hprintf(pf, "  %J  %5.1f%% (weight %4.1f%%):"
+				  " %llu ok, %llu failed, %llu dropped",
+				  &sl->srvv[i].addr, share,
+				  100.0 * sl->srvv[i].weight / wsum,
+				  s->allocations, s->failed, s->dropped);
+
+		if (s->setup.n) {
+			err |= re_hprintf(pf, "; setup p50 %.1f p99 %.1f ms",
+					  hist_percentile(&s->setup, 50) / 1e6,
+					  hist_percentile(&s->setup, 99) / 1e6);
+		}
+
+		err |= re_hprintf(pf, "; rx %llu packets, %.3f%% lost",
+				  s->rx.packets, loss);
+
+		if (s->lat.n) {
+			err |= re_hprintf(pf, "; latency p50 %.3f p99 %.3f ms",
+					  hist_percentile(&s->lat, 50) / 1e6,
+					  hist_percentile(&s->lat, 99) / 1e6);
+		}
+
+		err |= re_hprintf(pf, "\n");
+	}
+
+	return err;
+}
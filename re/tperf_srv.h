@@ -0,0 +1,73 @@
+#ifndef MY_TPERF_SRV_H_INCLUIDO
+#define MY_TPERF_SRV_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+#include "tperf_util.h"
+
+/* TURN servers of one run, after resolving */
+#define SRV_MAX 64
+#define SRV_WEIGHT_MAX 1000
+
+/* "<host>[:<port>][/<weight>]" from the command line */
+struct srvspec {
+	char host[256];
+	uint16_t port;             /* 0 for SRV or the default */
+	unsigned weight;
+};
+
+struct server {
+	struct sa addr;
+	unsigned spec;             /* index of the spec it came from */
+	unsigned weight;
+};
+
+struct srvquery;
+struct srvlist;
+
+typedef void (srvlist_h)(int err, const struct srvlist *sl, void *arg);
+
+struct srvlist {
+	struct srvspec specv[SRV_MAX];
+	unsigned nspec;
+	struct server srvv[SRV_MAX];
+	unsigned n;
+	unsigned *schedv;          /* server by allocation-ID, weighted */
+	unsigned nsched;
+
+	bool all_addrs;            /* every A record of a host */
+	uint16_t dport;            /* port for A records */
+	struct srvquery *queryv[SRV_MAX];
+	unsigned pending;
+	srvlist_h *resolvedh;
+	void *arg;
+};
+
+/* per server, owned by one allocator */
+struct srvstat {
+	uint64_t allocations;
+	uint64_t failed;           /* before the allocation was ready */
+	uint64_t dropped;          /* after */
+	struct hist setup;         /* until ready [ns] */
+	struct hist lat;           /* one-way latency [ns] */
+	struct rxstat rx;          /* from srvstat_collect() */
+};
+
+int  srvlist_add(struct srvlist *sl, const char *str);
+int  srvlist_resolve(struct srvlist *sl, struct dnsc *dnsc,
+		     const char *service, const char *proto, int af,
+		     uint16_t dport, srvlist_h *resolvedh, void *arg);
+void srvlist_close(struct srvlist *sl);
+unsigned srvlist_pick(const struct srvlist *sl, unsigned ix);
+int  srvlist_print(struct re_printf *pf, const struct srvlist *sl);
+
+int  srvstat_alloc(struct srvstat **statvp, unsigned n);
+void srvstat_collect(struct srvstat *statv, unsigned n,
+		     const struct allocator *allocator);
+void srvstat_merge(struct srvstat *dst, const struct srvstat *src,
+		   unsigned n);
+int  srvstat_print(struct re_printf *pf, const struct srvlist *sl,
+		   const struct srvstat *statv);
+
+#endif
@@ -0,0 +1,322 @@
+#include "tperf_stunmsg.h"
+
+#include <string.h>
+
+enum {
+	ATTR_USERNAME       = 0x0006,
+	ATTR_MSG_INTEGRITY  = 0x0008,
+	ATTR_ERR_CODE       = 0x0009,
+	ATTR_LIFETIME       = 0x000d,
+	ATTR_XOR_PEER_ADDR  = 0x0012,
+	ATTR_REALM          = 0x0014,
+	ATTR_NONCE          = 0x0015,
+	ATTR_XOR_RELAY_ADDR = 0x0016,
+	ATTR_REQ_TRANSPORT  = 0x0019,
+	ATTR_XOR_MAPPED_ADDR = 0x0020,
+};
+
+#define MI_SIZE 20
+
+static uint16_t msg_type(uint16_t method, enum stunmsg_class cls)
+{
+	return (method & 0x000f) | (method & 0x0070) << 1
+		| (method & 0x0f80) << 2
+		| (cls & 1) << 4 | (cls & 2) << 7;
+}
+
+static int attr_begin(struct mbuf *mb, uint16_t type, uint16_t len)
+{
+	int err = 0;
+
+	err |= mbuf_write_u16(mb, htons(type));
+	err |= mbuf_write_u16(mb, htons(len));
+
+	return err;
+}
+
+static int attr_str(struct mbuf *mb, uint16_t type, const char *str)
+{
+	size_t len = strlen(str);
+	int err;
+
+	err  = attr_begin(mb, type, (uint16_t)len);
+	err |= mbuf_write_mem(mb, (const uint8_t *)str, len);
+	err |= mbuf_fill(mb, 0, (4 - (len & 3)) & 3);
+
+	return err;
+}
+
+static int attr_xaddr(struct mbuf *mb, uint16_t type, const struct sa *sa,
+		      const uint8_t *tid)
+{
+	uint16_t port = sa_port(sa) ^ (STUN_MAGIC_COOKIE >> 16);
+	int err = 0;
+
+	switch (sa_af(sa)) {
+
+	case AF_INET:
+		err |= attr_begin(mb, type, 8);
+		err |= mbuf_write_u16(mb, htons(0x0001));
+		err |= mbuf_write_u16(mb, htons(port));
+		err |= mbuf_write_u32(mb, htonl(sa_in(sa) ^ STUN_MAGIC_COOKIE));
+		break;
+
+	case AF_INET6: {
+		uint8_t addr[16], x[16];
+		uint32_t magic = htonl(STUN_MAGIC_COOKIE);
+		unsigned i;
+
+		sa_in6(sa, addr);
+		memcpy(x, &magic, 4);
+		memcpy(x + 4, tid, STUN_TID_SIZE);
+
+		for (i = 0; i < 16; i++)
+			addr[i] ^= x[i];
+
+		err |= attr_begin(mb, type, 20);
+		err |= mbuf_write_u16(mb, htons(0x0002));
+		err |= mbuf_write_u16(mb, htons(port));
+		err |= mbuf_write_mem(mb, addr, 16);
+		break;
+	}
+
+	default:
+		return EAFNOSUPPORT;
+	}
+
+	return err;
+}
+
+/*
+ * One request, with MESSAGE-INTEGRITY once the server has sent its
+ * realm and nonce. No FINGERPRINT, it is optional for TURN.
+ */
+int stunmsg_encode(struct mbuf *mb, const uint8_t *tid,
+		   const struct stunmsg_req *req,
+		   const struct stunmsg_auth *auth)
+{
+	size_t start, len;
+	int err = 0;
+
+	if (!mb || !tid || !req)
+		return EINVAL;
+
+	start = mb->pos;
+
+	err |= mbuf_write_u16(mb, htons(msg_type(req->method,
+						 STUNMSG_REQUEST)));
+	err |= mbuf_write_u16(mb, 0);
+	err |= mbuf_write_u32(mb, htonl(STUN_MAGIC_COOKIE));
+	err |= mbuf_write_mem(mb, tid, STUN_TID_SIZE);
+
+	if (req->transport) {
+		err |= attr_begin(mb, ATTR_REQ_TRANSPORT, 4);
+		err |= mbuf_write_u8(mb, req->transport);
+		err |= mbuf_fill(mb, 0, 3);
+	}
+
+	if (req->lifetime >= 0) {
+		err |= attr_begin(mb, ATTR_LIFETIME, 4);
+		err |= mbuf_write_u32(mb, htonl((uint32_t)req->lifetime));
+	}
+
+	if (req->peer)
+		err |= attr_xaddr(mb, ATTR_XOR_PEER_ADDR, req->peer, tid);
+
+	if (req->conn_id) {
+		err |= attr_begin(mb, STUNMSG_ATTR_CONNECTION_ID, 4);
+		err |= mbuf_write_u32(mb, htonl(req->conn_id));
+	}
+
+	if (auth && auth->on) {
+		err |= attr_str(mb, ATTR_USERNAME, auth->user);
+		err |= attr_str(mb, ATTR_REALM, auth->realm);
+		err |= attr_str(mb, ATTR_NONCE, auth->nonce);
+	}
+
+	if (err)
+		return err;
+
+	/* the length covers MESSAGE-INTEGRITY while it is computed */
+	len = mb->pos - start - STUN_HEADER_SIZE;
+	if (auth && auth->on)
+		len += 4 + MI_SIZE;
+
+	mb->buf[start + 2] = (uint8_t)(len >> 8);
+	mb->buf[start + 3] = (uint8_t)len;
+
+	if (auth && auth->on) {
+		uint8_t mi[MI_SIZE];
+
+		hmac_sha1(auth->key, sizeof(auth->key), mb->buf + start,
+			  mb->pos - start, mi, sizeof(mi));
+
+		err |= attr_begin(mb, ATTR_MSG_INTEGRITY, MI_SIZE);
+		err |= mbuf_write_mem(mb, mi, sizeof(mi));
+	}
+
+	return err;
+}
+
+static void xaddr_decode(struct sa *sa, const uint8_t *v, size_t len,
+			 const uint8_t *tid)
+{
+	uint16_t port;
+	uint32_t a;
+
+	if (len < 8)
+		return;
+
+	port = (uint16_t)(v[2] << 8 | v[3]) ^ (STUN_MAGIC_COOKIE >> 16);
+
+	if (v[1] == 0x01) {
+		memcpy(&a, v + 4, 4);
+		sa_set_in(sa, ntohl(a) ^ STUN_MAGIC_COOKIE, port);
+	}
+	else if (v[1] == 0x02 && len >= 20) {
+		uint8_t addr[16], x[16];
+		uint32_t magic = htonl(STUN_MAGIC_COOKIE);
+		unsigned i;
+
+		memcpy(x, &magic, 4);
+		memcpy(x + 4, tid, STUN_TID_SIZE);
+
+		for (i = 0; i < 16; i++)
+			addr[i] = v[4 + i] ^ x[i];
+
+		sa_set_in6(sa, addr, port);
+	}
+}
+
+static void str_decode(char *dst, size_t sz, const uint8_t *v, size_t len)
+{
+	if (len >= sz)
+		len = sz - 1;
+
+	memcpy(dst, v, len);
+	dst[len] = '\0';
+}
+
+static uint32_t u32_decode(const uint8_t *v, size_t len)
+{
+	uint32_t x;
+
+	if (len < 4)
+		return 0;
+
+	memcpy(&x, v, 4);
+
+	return ntohl(x);
+}
+
+/* one whole message from mbuf_buf(mb); MESSAGE-INTEGRITY is not checked */
+int stunmsg_decode(struct stunmsg *msg, const struct mbuf *mb)
+{
+	const uint8_t *p, *end;
+	uint16_t type, len;
+	uint32_t magic;
+
+	if (!msg || !mb)
+		return EINVAL;
+
+	if (mbuf_get_left(mb) < STUN_HEADER_SIZE)
+		return EBADMSG;
+
+	p = mbuf_buf(mb);
+
+	type = p[0] << 8 | p[1];
+	len  = p[2] << 8 | p[3];
+	memcpy(&magic, p + 4, 4);
+
+	if (type & 0xc000 || len & 3 || ntohl(magic) != STUN_MAGIC_COOKIE)
+		return EBADMSG;
+
+	if (mbuf_get_left(mb) < STUN_HEADER_SIZE + (size_t)len)
+		return ENODATA;
+
+	memset(msg, 0, sizeof(*msg));
+
+	msg->method = (type & 0x000f) | (type & 0x00e0) >> 1
+		| (type & 0x3e00) >> 2;
+	msg->cls    = (type >> 4 & 1) | (type >> 7 & 2);
+	memcpy(msg->tid, p + 8, STUN_TID_SIZE);
+
+	end = p + STUN_HEADER_SIZE + len;
+	p  += STUN_HEADER_SIZE;
+
+	while (end - p >= 4) {
+
+		uint16_t atype = p[0] << 8 | p[1];
+		uint16_t alen  = p[2] << 8 | p[3];
+		const uint8_t *v = p + 4;
+
+		if (alen > end - v)
+			return EBADMSG;
+
+		switch (atype) {
+
+		case ATTR_ERR_CODE:
+			if (alen >= 4)
+				msg->scode = (v[2] & 0x07) * 100 + v[3];
+			break;
+
+		case ATTR_REALM:
+			str_decode(msg->realm, sizeof(msg->realm), v, alen);
+			break;
+
+		case ATTR_NONCE:
+			str_decode(msg->nonce, sizeof(msg->nonce), v, alen);
+			break;
+
+		case ATTR_LIFETIME:
+			msg->lifetime = u32_decode(v, alen);
+			break;
+
+		case ATTR_XOR_RELAY_ADDR:
+			xaddr_decode(&msg->relay, v, alen, msg->tid);
+			break;
+
+		case ATTR_XOR_MAPPED_ADDR:
+			xaddr_decode(&msg->mapped, v, alen, msg->tid);
+			break;
+
+		case ATTR_XOR_PEER_ADDR:
+			xaddr_decode(&msg->peer, v, alen, msg->tid);
+			break;
+
+		case STUNMSG_ATTR_CONNECTION_ID:
+			msg->conn_id = u32_decode(v, alen);
+			break;
+
+		default:
+			break;
+		}
+
+		p = v + ((alen + 3) & ~3);
+	}
+
+	return 0;
+}
+
+void stunmsg_auth_set(struct stunmsg_auth *auth, const char *user,
+		      const char *pass, const struct stunmsg *msg)
+{
+	char buf[512];
+	int n;
+
+	if (!auth || !user || !pass || !msg)
+		return;
+
+	str_ncpy(auth->user, user, sizeof(auth->user));
+	str_ncpy(auth->realm, msg->realm, sizeof(auth->realm));
+	str_ncpy(auth->nonce, msg->nonce, sizeof(auth->nonce));
+
+	n = re_snprintf(buf, sizeof(buf), "%s:%s:%s",
+			auth->user, auth->realm, pass);
+	if (n < 0)
+		return;
+
+	md5((const uint8_t *)buf, (size_t)n, auth->key);
+
+	auth->on = true;
+}
@@ -0,0 +1,62 @@
+#ifndef MY_TPERF_STUNMSG_H_INCLUIDO
+#define MY_TPERF_STUNMSG_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+/* RFC 6062 methods and attribute, which the STUN stack of libre lacks */
+enum {
+	STUNMSG_CONNECT            = 0x000a,
+	STUNMSG_CONNECTION_BIND    = 0x000b,
+	STUNMSG_CONNECTION_ATTEMPT = 0x000c,
+	STUNMSG_ATTR_CONNECTION_ID = 0x002a,
+};
+
+enum stunmsg_class {
+	STUNMSG_REQUEST = 0,
+	STUNMSG_INDICATION,
+	STUNMSG_SUCCESS,
+	STUNMSG_ERROR,
+};
+
+/* long-term credentials, from the 401 of the server */
+struct stunmsg_auth {
+	bool on;
+	char user[128];
+	char realm[128];
+	char nonce[256];
+	uint8_t key[16];           /* MD5(user:realm:password) */
+};
+
+/* the attributes of a request */
+struct stunmsg_req {
+	uint16_t method;
+	uint8_t transport;         /* REQUESTED-TRANSPORT, 0 for none */
+	const struct sa *peer;     /* XOR-PEER-ADDRESS, optional */
+	uint32_t conn_id;          /* CONNECTION-ID, 0 for none */
+	int64_t lifetime;          /* LIFETIME [s], -1 for none */
+};
+
+/* the attributes tperf looks at in a response or indication */
+struct stunmsg {
+	uint16_t method;
+	enum stunmsg_class cls;
+	uint8_t tid[STUN_TID_SIZE];
+	uint16_t scode;
+	char realm[128];
+	char nonce[256];
+	struct sa relay;
+	struct sa mapped;
+	struct sa peer;
+	uint32_t lifetime;
+	uint32_t conn_id;
+};
+
+int  stunmsg_encode(struct mbuf *mb, const uint8_t *tid,
+		    const struct stunmsg_req *req,
+		    const struct stunmsg_auth *auth);
+int  stunmsg_decode(struct stunmsg *msg, const struct mbuf *mb);
+void stunmsg_auth_set(struct stunmsg_auth *auth, const char *user,
+		      const char *pass, const struct stunmsg *msg);
+
+#endif
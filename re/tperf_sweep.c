@@ -0,0 +1,329 @@
+#include "tperf_sweep.h"
+#include "tperf_util.h"
+
+#include <string.h>
+
+static void window_handler(void *arg);
+
+static void window_begin(struct sweep *sw)
+{
+	struct allocator *allocator = sw->allocator;
+	struct rxstat st;
+
+	allocator_rxstat(allocator, &st);
+
+	sw->t0        = tperf_clock_ns();
+	sw->cpu0      = tperf_cpu_ns();
+	sw->tx_bytes0 = COUNTER_GET(allocator->ctr.tx_bytes);
+	sw->rx_bytes0 = st.bytes;
+	sw->received0 = st.received;
+	sw->lost0     = st.lost;
+
+	hist_reset(&allocator->lat);
+
+	tmr_start(&sw->tmr, sw->conf.hold_ms, window_handler, sw);
+}
+
+static void window_sample(const struct sweep *sw, struct sweep_sample *s)
+{
+	const struct allocator *allocator = sw->allocator;
+	double target = (double)sw->allocs * sw->bitrate;
+	uint64_t expected;
+	struct rxstat st;
+
+	allocator_rxstat(allocator, &st);
+
+	memset(s, 0, sizeof(*s));
+
+	s->secs     = (tperf_clock_ns() - sw->t0) / 1e9;
+	s->tx_bps   = 8.0 * (COUNTER_GET(allocator->ctr.tx_bytes)
+			     - sw->tx_bytes0) / s->secs;
+	s->rx_bps   = 8.0 * (st.bytes - sw->rx_bytes0) / s->secs;
+	s->received = st.received - sw->received0;
+	s->lost     = rxstat_delta(st.lost, sw->lost0);
+	s->cpu      = 100.0 * (tperf_cpu_ns() - sw->cpu0) / 1e9 / s->secs;
+
+	expected = s->received + s->lost;
+	if (expected)
+		s->loss = 100.0 * s->lost / expected;
+
+	s->lat_p50 = hist_percentile(&allocator->lat, 50);
+	s->lat_p99 = hist_percentile(&allocator->lat, 99);
+	s->lat_max = allocator->lat.max;
+
+	s->tx_short = s->tx_bps < target * (100 - SWEEP_TX_SHORT_PCT) / 100;
+}
+
+static void sweep_finish(struct sweep *sw, int err)
+{
+	sw->running = false;
+	tmr_cancel(&sw->tmr);
+
+	if (sw->doneh)
+		sw->doneh(err, sw->arg);
+}
+
+static void sweep_apply(struct sweep *sw)
+{
+	int err;
+
+	++sw->steps;
+
+	err = sw->applyh(sw->allocs, sw->bitrate, sw->arg);
+	if (err) {
+		re_fprintf(stderr, "sweep: could not apply %u allocations"
+			   " at %u bit/s (%m)\n", sw->allocs, sw->bitrate, err);
+		sweep_finish(sw, err);
+	}
+}
+
+static int sweep_record(struct sweep *sw)
+{
+	struct sweep_point *curve, *pt;
+
+	curve = mem_realloc(sw->curve, (sw->n + 1) * sizeof(*curve));
+	if (!curve)
+		return ENOMEM;
+
+	sw->curve = curve;
+	pt = &curve[sw->n++];
+
+	memset(pt, 0, sizeof(*pt));
+	pt->allocs  = sw->allocs;
+	pt->bitrate = sw->good;
+	pt->capped  = !sw->bad && sw->good >= sw->conf.bitrate_max;
+	pt->s       = sw->good_s;
+
+	return 0;
+}
+
+/* the knee for this allocation count is known, go to the next count */
+static void sweep_next_count(struct sweep *sw)
+{
+	int err;
+
+	err = sweep_record(sw);
+	if (err) {
+		sweep_finish(sw, err);
+		return;
+	}
+
+	if (!sw->good || sw->allocs >= sw->conf.alloc_max) {
+		sweep_finish(sw, 0);
+		return;
+	}
+
+	/* the knee per allocation can only go down from here */
+	sw->allocs  = sw->allocs > sw->conf.alloc_max / 2
+		? sw->conf.alloc_max : sw->allocs * 2;
+	sw->bitrate = sw->good;
+	sw->good    = 0;
+	sw->bad     = 0;
+
+	sweep_apply(sw);
+}
+
+static void sweep_step_done(struct sweep *sw, const struct sweep_sample *s)
+{
+	const struct sweep_conf *conf = &sw->conf;
+	bool ok = !s->tx_short && s->received && s->loss <= conf->loss_max;
+
+	re_printf("sweep step %u: %u allocs x %u bit/s: tx %.2f Mbit/s,"
+		  " rx %.2f Mbit/s, loss %.3f%%, latency p50 %.2f ms"
+		  " p99 %.2f ms, cpu %.0f%% -> %s\n",
+		  sw->steps, sw->allocs, sw->bitrate,
+		  s->tx_bps / 1e6, s->rx_bps / 1e6, s->loss,
+		  s->lat_p50 / 1e6, s->lat_p99 / 1e6, s->cpu,
+		  ok ? "ok" : s->tx_short ? "tx-bound" : "over");
+
+	if (ok) {
+		sw->good   = sw->bitrate;
+		sw->good_s = *s;
+	}
+	else {
+		sw->bad = sw->bitrate;
+	}
+
+	if (!sw->bad) {
+		/* ramp up */
+		if (sw->bitrate >= conf->bitrate_max) {
+			sweep_next_count(sw);
+			return;
+		}
+
+		sw->bitrate = sw->bitrate > conf->bitrate_max / 2
+			? conf->bitrate_max : sw->bitrate * 2;
+	}
+	else if (!sw->good) {
+		/* ramp down until a step is clean */
+		if (sw->bitrate <= conf->bitrate_min) {
+			sweep_next_count(sw);
+			return;
+		}
+
+		sw->bitrate = max(sw->bitrate / 2, conf->bitrate_min);
+	}
+	else {
+		/* bisect between the good and the bad step */
+		if (sw->bad - sw->good <=
+		    (uint64_t)sw->good * SWEEP_RESOLUTION_PCT / 100) {
+			sweep_next_count(sw);
+			return;
+		}
+
+		sw->bitrate = sw->good + (sw->bad - sw->good) / 2;
+	}
+
+	sweep_apply(sw);
+}
+
+static void window_handler(void *arg)
+{
+	struct sweep *sw = arg;
+	struct sweep_sample s;
+	double diff;
+	bool stable;
+
+	/* the first window after a change is only warmup */
+	if (!sw->measuring) {
+		sw->measuring = true;
+		window_begin(sw);
+		return;
+	}
+
+	window_sample(sw, &s);
+
+	diff = s.rx_bps - sw->rx_prev;
+	if (diff < 0)
+		diff = -diff;
+
+	++sw->windows;
+	stable = sw->windows >= 2
+		&& diff <= sw->rx_prev * SWEEP_STABLE_PCT / 100;
+	sw->rx_prev = s.rx_bps;
+
+	if (!stable && sw->windows < SWEEP_WINDOWS_MAX) {
+		window_begin(sw);
+		return;
+	}
+
+	sweep_step_done(sw, &s);
+}
+
+int sweep_init(struct sweep *sw, const struct sweep_conf *conf,
+	       struct allocator *allocator, sweep_apply_h *applyh,
+	       sweep_done_h *doneh, void *arg)
+{
+	if (!sw || !conf || !allocator || !applyh)
+		return EINVAL;
+
+	if (!conf->alloc_min || conf->alloc_min > conf->alloc_max ||
+	    !conf->bitrate_min || conf->bitrate_min > conf->bitrate_max ||
+	    !conf->hold_ms)
+		return EINVAL;
+
+	memset(sw, 0, sizeof(*sw));
+
+	sw->conf      = *conf;
+	sw->allocator = allocator;
+	sw->applyh    = applyh;
+	sw->doneh     = doneh;
+	sw->arg       = arg;
+	tmr_init(&sw->tmr);
+
+	return 0;
+}
+
+int sweep_start(struct sweep *sw)
+{
+	if (!sw || !sw->applyh)
+		return EINVAL;
+
+	if (sw->running)
+		return EALREADY;
+
+	sw->running = true;
+	sw->allocs  = sw->conf.alloc_min;
+	sw->bitrate = sw->conf.bitrate_min;
+
+	re_printf("sweep: %u..%u allocations, %u..%u bit/s per allocation,"
+		  " loss threshold %.3f%%, %u ms windows\n",
+		  sw->conf.alloc_min, sw->conf.alloc_max,
+		  sw->conf.bitrate_min, sw->conf.bitrate_max,
+		  sw->conf.loss_max, sw->conf.hold_ms);
+
+	sweep_apply(sw);
+
+	return 0;
+}
+
+/* the step that was applied last is up and running */
+void sweep_ready(struct sweep *sw)
+{
+	if (!sw || !sw->running)
+		return;
+
+	sw->measuring = false;
+	sw->windows   = 0;
+	sw->rx_prev   = 0;
+
+	window_begin(sw);
+}
+
+/* ends the sweep early, keeping what was found for this count so far */
+void sweep_abort(struct sweep *sw, int err)
+{
+	if (!sw || !sw->running)
+		return;
+
+	if (sw->good)
+		(void)sweep_record(sw);
+
+	sweep_finish(sw, err);
+}
+
+void sweep_close(struct sweep *sw)
+{
+	if (!sw)
+		return;
+
+	tmr_cancel(&sw->tmr);
+	sw->running = false;
+	sw->curve   = mem_deref(sw->curve);
+	sw->n       = 0;
+}
+
+int sweep_print_curve(struct re_printf *pf, const struct sweep *sw)
+{
+	unsigned i;
+	int err;
+
+	if (!sw)
+		return 0;
+
+	err = re_hprintf(pf, "capacity curve (loss threshold %.3f%%):\n"
+			 "  allocs  kbit/s/alloc  total Mbit/s    loss %%"
+			 "   p50 ms   p99 ms   max ms  cpu %%\n",
+			 sw->conf.loss_max);
+
+	for (i = 0; i < sw->n && !err; i++) {
+
+		const struct sweep_point *pt = &sw->curve[i];
+
+		if (!pt->bitrate) {
+			err = re_hprintf(pf, "  %6u  below %u bit/s\n",
+					 pt->allocs, sw->conf.bitrate_min);
+			continue;
+		}
+
+		err = re_hprintf(pf, "  %6u  %12.1f  %12.2f  %8.3f"
+				 "  %7.2f  %7.2f  %7.2f  %5.0f%s\n",
+				 pt->allocs, pt->bitrate / 1e3,
+				 pt->s.rx_bps / 1e6, pt->s.loss,
+				 pt->s.lat_p50 / 1e6, pt->s.lat_p99 / 1e6,
+				 pt->s.lat_max / 1e6, pt->s.cpu,
+				 pt->capped ? "  (bitrate max)" : "");
+	}
+
+	return err;
+}
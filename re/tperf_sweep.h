@@ -0,0 +1,100 @@
+#ifndef MY_TPERF_SWEEP_H_INCLUIDO
+#define MY_TPERF_SWEEP_H_INCLUIDO
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <re.h>
+
+struct allocator;
+
+/* relative change of the rx rate between windows that counts as stable */
+#define SWEEP_STABLE_PCT 5
+#define SWEEP_WINDOWS_MAX 5
+/* the bisection stops when the bracket is this close [percent] */
+#define SWEEP_RESOLUTION_PCT 5
+/* a step is saturated when the senders fall this far behind [percent] */
+#define SWEEP_TX_SHORT_PCT 10
+
+struct sweep_conf {
+	unsigned alloc_min;
+	unsigned alloc_max;
+	unsigned bitrate_min;      /* per allocation [bit/s] */
+	unsigned bitrate_max;
+	double loss_max;           /* knee threshold [percent] */
+	unsigned hold_ms;          /* length of one measurement window */
+};
+
+struct sweep_sample {
+	double secs;
+	double tx_bps;
+	double rx_bps;
+	uint64_t received;
+	uint64_t lost;
+	double loss;               /* percent */
+	uint64_t lat_p50;          /* one-way latency [ns] */
+	uint64_t lat_p99;
+	uint64_t lat_max;
+	double cpu;                /* percent of one core */
+	bool tx_short;             /* senders could not keep the rate */
+};
+
+struct sweep_point {
+	unsigned allocs;
+	unsigned bitrate;          /* knee, 0 if even bitrate_min failed */
+	bool capped;               /* bitrate_max was reached without loss */
+	struct sweep_sample s;
+};
+
+/* apply a new step; the owner calls sweep_ready() once it is running */
+typedef int  (sweep_apply_h)(unsigned allocs, unsigned bitrate, void *arg);
+typedef void (sweep_done_h)(int err, void *arg);
+
+/*
+ * Capacity sweep. For each allocation count (doubling from alloc_min
+ * to alloc_max) the per-allocation bitrate is ramped geometrically
+ * until a step exceeds the loss threshold, and the knee is then
+ * bisected. Every step is held until the receive rate is stable, and
+ * loss, latency and CPU are taken from the last window.
+ */
+struct sweep {
+	struct sweep_conf conf;
+	struct allocator *allocator;
+	sweep_apply_h *applyh;
+	sweep_done_h *doneh;
+	void *arg;
+	struct tmr tmr;
+
+	bool running;
+	bool measuring;            /* false during the warmup window */
+	unsigned windows;
+	double rx_prev;
+
+	unsigned allocs;
+	unsigned bitrate;
+	unsigned good;             /* highest bitrate without loss */
+	unsigned bad;              /* lowest bitrate with loss, 0: none */
+	struct sweep_sample good_s;
+	unsigned steps;
+
+	/* snapshot at the start of the window */
+	uint64_t t0;
+	uint64_t cpu0;
+	uint64_t tx_bytes0;
+	uint64_t rx_bytes0;
+	uint64_t received0;
+	uint64_t lost0;
+
+	struct sweep_point *curve;
+	unsigned n;
+};
+
+int  sweep_init(struct sweep *sw, const struct sweep_conf *conf,
+		struct allocator *allocator, sweep_apply_h *applyh,
+		sweep_done_h *doneh, void *arg);
+int  sweep_start(struct sweep *sw);
+void sweep_ready(struct sweep *sw);
+void sweep_abort(struct sweep *sw, int err);
+void sweep_close(struct sweep *sw);
+int  sweep_print_curve(struct re_printf *pf, const struct sweep *sw);
+
+#endif
@@ -0,0 +1,797 @@
+#include "tperf_tcprelay.h"
+#include "tperf_stunmsg.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TCPRELAY_STATS_MS 5000
+#define AUTH_TRIES 2
+
+enum tastate {
+	TA_ALLOCATE,
+	TA_PERM,
+	TA_CONNECT,
+	TA_BIND,
+	TA_READY,
+	TA_FAILED,
+};
+
+/* one TURN-TCP allocation with a single peer connection */
+struct tcpalloc {
+	struct le le;
+	struct tcprelay *tr;
+	unsigned ix;
+	struct sa srv;
+	struct tcp_conn *ctrl;
+	struct tcp_conn *data;
+	struct framer *fr_ctrl;
+	struct framer *fr_data;
+	struct tmr tmr;            /* refresh, or the deferred close */
+	enum tastate state;
+
+	struct stunmsg_auth auth;
+	struct stunmsg_req req;    /* outstanding, sent again after a 401 */
+	uint8_t tid[STUN_TID_SIZE];
+	unsigned tries;
+	bool refreshing;
+
+	struct sa mapped;
+	struct sa relay;
+	struct sa peer;
+	uint32_t conn_id;
+	uint32_t lifetime;
+
+	uint64_t t_start;
+	uint64_t t_req;
+	uint64_t t_bind;           /* Connect answered */
+	uint64_t tx_bytes;
+};
+
+/* the far end of one relayed connection */
+struct tcppeer {
+	struct le le;
+	struct tcprelay *tr;
+	struct tcp_conn *tc;
+	uint64_t bytes;
+	uint64_t t_first;
+	uint64_t t_last;
+};
+
+static void data_send_handler(void *arg);
+static void data_recv_handler(struct mbuf *mb, void *arg);
+static void conn_close_handler(int err, void *arg);
+static void send_start(struct tcprelay *tr);
+
+/* every setup has an outcome */
+static void setup_check(struct tcprelay *tr)
+{
+	if (!tr->running || tr->sending || tr->started < tr->conf.num ||
+	    tr->ready + tr->failed + tr->dropped < tr->started)
+		return;
+
+	if (tr->ready)
+		send_start(tr);
+	else
+		tcprelay_stop(tr);
+}
+
+static void mem_sample(struct tcprelay_mem *m)
+{
+	char line[256];
+	FILE *f;
+
+	m->fds = proc_fd_count();
+	m->rss = proc_rss();
+	m->tcp_pages = 0;
+
+	f = fopen("/proc/net/sockstat", "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+
+		const char *p = strstr(line, " mem ");
+
+		if (!strncmp(line, "TCP:", 4) && p)
+			m->tcp_pages = atol(p + 5);
+	}
+
+	(void)fclose(f);
+}
+
+static void alloc_destructor(void *arg)
+{
+	struct tcpalloc *ta = arg;
+
+	tmr_cancel(&ta->tmr);
+	list_unlink(&ta->le);
+
+	mem_deref(ta->data);
+	mem_deref(ta->ctrl);
+	mem_deref(ta->fr_data);
+	mem_deref(ta->fr_ctrl);
+}
+
+static void peer_destructor(void *arg)
+{
+	struct tcppeer *tp = arg;
+
+	list_unlink(&tp->le);
+	mem_deref(tp->tc);
+}
+
+static void close_handler(void *arg)
+{
+	struct tcpalloc *ta = arg;
+
+	ta->data = mem_deref(ta->data);
+	ta->ctrl = mem_deref(ta->ctrl);
+}
+
+/* not from inside the handlers of the connections */
+static void alloc_fail(struct tcpalloc *ta, int err, uint16_t scode)
+{
+	struct tcprelay *tr = ta->tr;
+
+	if (ta->state == TA_FAILED)
+		return;
+
+	if (ta->state == TA_READY) {
+		++tr->dropped;
+		--tr->ready;
+	}
+	else {
+		++tr->failed;
+		re_fprintf(stderr, "tcp relay [%u]: %s failed (%m %u)\n",
+			   ta->ix, ta->state == TA_ALLOCATE ? "allocate"
+			   : ta->state == TA_PERM ? "permission"
+			   : ta->state == TA_CONNECT ? "connect" : "bind",
+			   err, scode);
+	}
+
+	ta->state = TA_FAILED;
+	tmr_start(&ta->tmr, 0, close_handler, ta);
+
+	setup_check(tr);
+}
+
+static int request_send(struct tcpalloc *ta, struct tcp_conn *tc)
+{
+	struct mbuf *mb;
+	int err;
+
+	mb = mbuf_alloc(512);
+	if (!mb)
+		return ENOMEM;
+
+	rand_bytes(ta->tid, sizeof(ta->tid));
+
+	err = stunmsg_encode(mb, ta->tid, &ta->req, &ta->auth);
+	if (err)
+		goto out;
+
+	mb->pos = 0;
+
+	err = tcp_send(tc, mb);
+
+ out:
+	mem_deref(mb);
+
+	return err;
+}
+
+static int request(struct tcpalloc *ta, struct tcp_conn *tc, uint16_t method)
+{
+	const struct tcprelay_conf *conf = &ta->tr->conf;
+
+	memset(&ta->req, 0, sizeof(ta->req));
+	ta->req.method   = method;
+	ta->req.lifetime = -1;
+
+	switch (method) {
+
+	case STUN_METHOD_ALLOCATE:
+		ta->req.transport = IPPROTO_TCP;
+		/*@fallthrough@*/
+	case STUN_METHOD_REFRESH:
+		if (conf->lifetime)
+			ta->req.lifetime = conf->lifetime;
+		break;
+
+	case STUN_METHOD_CREATEPERM:
+	case STUNMSG_CONNECT:
+		ta->req.peer = &ta->peer;
+		break;
+
+	case STUNMSG_CONNECTION_BIND:
+		ta->req.conn_id = ta->conn_id;
+		break;
+	}
+
+	ta->tries = 0;
+	ta->t_req = tperf_clock_ns();
+
+	return request_send(ta, tc);
+}
+
+static void refresh_handler(void *arg)
+{
+	struct tcpalloc *ta = arg;
+	int err;
+
+	ta->refreshing = true;
+
+	err = request(ta, ta->ctrl, STUN_METHOD_REFRESH);
+	if (err)
+		alloc_fail(ta, err, 0);
+}
+
+static void refresh_start(struct tcpalloc *ta)
+{
+	uint32_t lifetime = ta->lifetime ? ta->lifetime : 600;
+
+	tmr_start(&ta->tmr, lifetime * 1000 / 2, refresh_handler, ta);
+}
+
+static void data_estab_handler(void *arg)
+{
+	struct tcpalloc *ta = arg;
+	int err;
+
+	err = request(ta, ta->data, STUNMSG_CONNECTION_BIND);
+	if (err)
+		alloc_fail(ta, err, 0);
+}
+
+static void alloc_ready(struct tcpalloc *ta)
+{
+	struct tcprelay *tr = ta->tr;
+	uint64_t now = tperf_clock_ns();
+
+	hist_record(&tr->setup.bind, now - ta->t_bind);
+	hist_record(&tr->setup.ready, now - ta->t_start);
+
+	ta->state = TA_READY;
+	++tr->ready;
+
+	tcp_set_send(ta->data, data_send_handler);
+	refresh_start(ta);
+
+	if (tr->sending)
+		data_send_handler(ta);
+	else
+		setup_check(tr);
+}
+
+static void success_handler(struct tcpalloc *ta, const struct stunmsg *msg)
+{
+	struct tcprelay *tr = ta->tr;
+	uint64_t now = tperf_clock_ns();
+	int err = 0;
+
+	if (ta->refreshing) {
+		ta->refreshing = false;
+
+		if (msg->lifetime)
+			ta->lifetime = msg->lifetime;
+
+		refresh_start(ta);
+		return;
+	}
+
+	switch (ta->state) {
+
+	case TA_ALLOCATE:
+		hist_record(&tr->setup.allocate, now - ta->t_start);
+
+		if (!sa_isset(&msg->relay, SA_ALL) ||
+		    !sa_isset(&msg->mapped, SA_ADDR)) {
+			err = EPROTO;
+			break;
+		}
+
+		ta->relay    = msg->relay;
+		ta->mapped   = msg->mapped;
+		ta->lifetime = msg->lifetime;
+
+		/* the server reaches the listener at our public address */
+		ta->peer = ta->mapped;
+		sa_set_port(&ta->peer, tr->peer_port);
+
+		ta->state = TA_PERM;
+		err = request(ta, ta->ctrl, STUN_METHOD_CREATEPERM);
+		break;
+
+	case TA_PERM:
+		hist_record(&tr->setup.perm, now - ta->t_req);
+
+		ta->state = TA_CONNECT;
+		err = request(ta, ta->ctrl, STUNMSG_CONNECT);
+		break;
+
+	case TA_CONNECT:
+		hist_record(&tr->setup.connect, now - ta->t_req);
+
+		if (!msg->conn_id) {
+			err = EPROTO;
+			break;
+		}
+
+		ta->conn_id = msg->conn_id;
+		ta->state   = TA_BIND;
+		ta->t_bind  = now;
+
+		/* a new connection to the server, bound to the peer */
+		err = tcp_connect(&ta->data, &ta->srv, data_estab_handler,
+				  data_recv_handler, conn_close_handler, ta);
+		break;
+
+	case TA_BIND:
+		alloc_ready(ta);
+		break;
+
+	default:
+		break;
+	}
+
+	if (err)
+		alloc_fail(ta, err, 0);
+}
+
+static int frame_handler(struct tcpalloc *ta, struct tcp_conn *tc,
+			 struct mbuf *mb)
+{
+	struct stunmsg msg;
+	int err;
+
+	err = stunmsg_decode(&msg, mb);
+	if (err)
+		return 0;
+
+	/* ConnectionAttempt indications, for peers that dial in */
+	if (msg.cls == STUNMSG_INDICATION ||
+	    memcmp(msg.tid, ta->tid, sizeof(ta->tid)))
+		return 0;
+
+	if (msg.cls == STUNMSG_SUCCESS) {
+		success_handler(ta, &msg);
+		return 0;
+	}
+
+	if ((msg.scode == 401 || msg.scode == 438) &&
+	    ta->tries++ < AUTH_TRIES) {
+
+		if (!msg.realm[0])
+			str_ncpy(msg.realm, ta->auth.realm,
+				 sizeof(msg.realm));
+
+		stunmsg_auth_set(&ta->auth, ta->tr->conf.user,
+				 ta->tr->conf.pass, &msg);
+
+		err = request_send(ta, tc);
+		if (err)
+			alloc_fail(ta, err, 0);
+
+		return 0;
+	}
+
+	alloc_fail(ta, EPROTO, msg.scode);
+
+	return 0;
+}
+
+static int ctrl_frame_handler(struct mbuf *mb, void *arg)
+{
+	struct tcpalloc *ta = arg;
+
+	return frame_handler(ta, ta->ctrl, mb);
+}
+
+static int data_frame_handler(struct mbuf *mb, void *arg)
+{
+	struct tcpalloc *ta = arg;
+
+	return frame_handler(ta, ta->data, mb);
+}
+
+static void ctrl_recv_handler(struct mbuf *mb, void *arg)
+{
+	struct tcpalloc *ta = arg;
+
+	if (framer_input(ta->fr_ctrl, mb, ctrl_frame_handler, ta))
+		alloc_fail(ta, EBADMSG, 0);
+}
+
+static void data_recv_handler(struct mbuf *mb, void *arg)
+{
+	struct tcpalloc *ta = arg;
+
+	/* the peer connection carries no STUN once bound */
+	if (ta->state == TA_READY)
+		return;
+
+	if (framer_input(ta->fr_data, mb, data_frame_handler, ta))
+		alloc_fail(ta, EBADMSG, 0);
+}
+
+static void conn_close_handler(int err, void *arg)
+{
+	struct tcpalloc *ta = arg;
+
+	alloc_fail(ta, err ? err : ECONNRESET, 0);
+}
+
+static void ctrl_estab_handler(void *arg)
+{
+	struct tcpalloc *ta = arg;
+	int err;
+
+	err = request(ta, ta->ctrl, STUN_METHOD_ALLOCATE);
+	if (err)
+		alloc_fail(ta, err, 0);
+}
+
+/* writes until the socket buffer is full, then waits for the drain */
+static void data_send_handler(void *arg)
+{
+	struct tcpalloc *ta = arg;
+	struct tcprelay *tr = ta->tr;
+
+	while (tr->sending && ta->state == TA_READY) {
+
+		tr->chunk->pos = 0;
+
+		if (tcp_send(ta->data, tr->chunk))
+			break;
+
+		ta->tx_bytes += tr->chunk->end;
+		tr->tx_bytes += tr->chunk->end;
+
+		if (tcp_conn_txqsz(ta->data))
+			break;
+	}
+}
+
+static int alloc_start(struct tcprelay *tr, unsigned ix)
+{
+	struct tcpalloc *ta;
+	int err;
+
+	ta = mem_zalloc(sizeof(*ta), alloc_destructor);
+	if (!ta)
+		return ENOMEM;
+
+	ta->tr      = tr;
+	ta->ix      = ix;
+	ta->srv     = tr->servers->srvv[srvlist_pick(tr->servers, ix)].addr;
+	ta->t_start = tperf_clock_ns();
+	tmr_init(&ta->tmr);
+	list_append(&tr->allocl, &ta->le, ta);
+
+	err  = framer_alloc(&ta->fr_ctrl);
+	err |= framer_alloc(&ta->fr_data);
+	if (err)
+		goto out;
+
+	err = tcp_connect(&ta->ctrl, &ta->srv, ctrl_estab_handler,
+			  ctrl_recv_handler, conn_close_handler, ta);
+	if (err)
+		goto out;
+
+	++tr->started;
+
+ out:
+	if (err)
+		mem_deref(ta);
+
+	return err;
+}
+
+static void peer_recv_handler(struct mbuf *mb, void *arg)
+{
+	struct tcppeer *tp = arg;
+	uint64_t now = tperf_clock_ns();
+
+	if (!tp->t_first)
+		tp->t_first = now;
+	tp->t_last = now;
+
+	tp->bytes += mbuf_get_left(mb);
+	tp->tr->rx_bytes += mbuf_get_left(mb);
+}
+
+static void peer_close_handler(int err, void *arg)
+{
+	struct tcppeer *tp = arg;
+	(void)err;
+
+	tp->tc = mem_deref(tp->tc);
+}
+
+static void peer_conn_handler(const struct sa *peer, void *arg)
+{
+	struct tcprelay *tr = arg;
+	struct tcppeer *tp;
+	int err;
+	(void)peer;
+
+	tp = mem_zalloc(sizeof(*tp), peer_destructor);
+	if (!tp) {
+		tcp_reject(tr->ts);
+		return;
+	}
+
+	tp->tr = tr;
+
+	err = tcp_accept(&tp->tc, tr->ts, NULL, peer_recv_handler,
+			 peer_close_handler, tp);
+	if (err) {
+		mem_deref(tp);
+		tcp_reject(tr->ts);
+		return;
+	}
+
+	list_append(&tr->peerl, &tp->le, tp);
+	++tr->accepted;
+}
+
+static void tmr_end_handler(void *arg)
+{
+	struct tcprelay *tr = arg;
+
+	mem_sample(&tr->loaded);
+	tcprelay_stop(tr);
+}
+
+static void send_start(struct tcprelay *tr)
+{
+	struct le *le;
+
+	mem_sample(&tr->idle);
+
+	re_printf("tcp relay: %u of %u allocations up, sending for %u ms\n",
+		  tr->ready, tr->conf.num, tr->conf.duration_ms);
+
+	tr->sending = true;
+	tr->t_send  = tr->t_prev = tperf_clock_ns();
+	tr->rx_prev = tr->rx_bytes;
+
+	for (le = tr->allocl.head; le; le = le->next)
+		data_send_handler(le->data);
+
+	tmr_start(&tr->tmr, tr->conf.duration_ms, tmr_end_handler, tr);
+}
+
+static void tmr_stats_handler(void *arg)
+{
+	struct tcprelay *tr = arg;
+	uint64_t now = tperf_clock_ns();
+	double rx;
+
+	tmr_start(&tr->tmr_stats, TCPRELAY_STATS_MS, tmr_stats_handler, tr);
+
+	rx = 8.0 * (tr->rx_bytes - tr->rx_prev) * 1e9 / (now - tr->t_prev);
+	tr->rx_prev = tr->rx_bytes;
+	tr->t_prev  = now;
+
+	re_printf("tcp relay: %u up, %u failed, %u dropped, %llu peer"
+		  " connections; relayed %.1f Mbit/s\n",
+		  tr->ready, tr->failed, tr->dropped, tr->accepted, rx / 1e6);
+}
+
+static void tmr_launch_handler(void *arg)
+{
+	struct tcprelay *tr = arg;
+	int err;
+
+	if (tr->started >= tr->conf.num)
+		return;
+
+	err = alloc_start(tr, tr->started);
+	if (err) {
+		re_fprintf(stderr, "tcp relay: could not start allocation"
+			   " %u (%m)\n", tr->started, err);
+		++tr->started;
+		++tr->failed;
+		setup_check(tr);
+	}
+
+	tmr_start(&tr->tmr, rand_u16() & 3, tmr_launch_handler, tr);
+}
+
+int tcprelay_init(struct tcprelay *tr, const struct tcprelay_conf *conf,
+		  const struct srvlist *servers,
+		  tcprelay_done_h *doneh, void *arg)
+{
+	if (!tr || !conf || !servers || !conf->num)
+		return EINVAL;
+
+	memset(tr, 0, sizeof(*tr));
+
+	tr->conf    = *conf;
+	tr->servers = servers;
+	tr->doneh   = doneh;
+	tr->arg     = arg;
+
+	if (!tr->conf.duration_ms)
+		tr->conf.duration_ms = TCPRELAY_DURATION_MS;
+
+	list_init(&tr->allocl);
+	list_init(&tr->peerl);
+	tmr_init(&tr->tmr);
+	tmr_init(&tr->tmr_stats);
+
+	hist_reset(&tr->setup.allocate);
+	hist_reset(&tr->setup.perm);
+	hist_reset(&tr->setup.connect);
+	hist_reset(&tr->setup.bind);
+	hist_reset(&tr->setup.ready);
+
+	return 0;
+}
+
+int tcprelay_start(struct tcprelay *tr)
+{
+	struct sa laddr;
+	int err;
+
+	if (!tr || !tr->servers->n)
+		return EINVAL;
+
+	if (tr->running)
+		return EALREADY;
+
+	tr->chunk = mbuf_alloc(TCPRELAY_CHUNK);
+	if (!tr->chunk)
+		return ENOMEM;
+
+	err = mbuf_fill(tr->chunk, PATTERN, TCPRELAY_CHUNK);
+	if (err)
+		return err;
+
+	sa_init(&laddr, sa_af(&tr->servers->srvv[0].addr));
+
+	err = tcp_listen(&tr->ts, &laddr, peer_conn_handler, tr);
+	if (err) {
+		re_fprintf(stderr, "tcp relay: no peer listener (%m)\n", err);
+		return err;
+	}
+
+	err = tcp_sock_local_get(tr->ts, &laddr);
+	if (err)
+		return err;
+
+	tr->peer_port = sa_port(&laddr);
+
+	re_printf("tcp relay: %u TURN-TCP allocations, peer listener on"
+		  " port %u\n", tr->conf.num, tr->peer_port);
+
+	mem_sample(&tr->base);
+
+	tr->running = true;
+	tr->t_start = tr->t_prev = tperf_clock_ns();
+
+	tmr_start(&tr->tmr, 0, tmr_launch_handler, tr);
+	tmr_start(&tr->tmr_stats, TCPRELAY_STATS_MS, tmr_stats_handler, tr);
+
+	return 0;
+}
+
+/* stops the transfer; the connections stay until tcprelay_close() */
+void tcprelay_stop(struct tcprelay *tr)
+{
+	if (!tr || !tr->running)
+		return;
+
+	if (tr->sending && !tr->loaded.rss)
+		mem_sample(&tr->loaded);
+
+	tr->running = false;
+	tr->sending = false;
+	tmr_cancel(&tr->tmr);
+	tmr_cancel(&tr->tmr_stats);
+
+	if (tr->doneh)
+		tr->doneh(tr->arg);
+}
+
+void tcprelay_close(struct tcprelay *tr)
+{
+	if (!tr)
+		return;
+
+	tmr_cancel(&tr->tmr);
+	tmr_cancel(&tr->tmr_stats);
+	tr->running = false;
+	tr->sending = false;
+
+	list_flush(&tr->allocl);
+	list_flush(&tr->peerl);
+	tr->ts    = mem_deref(tr->ts);
+	tr->chunk = mem_deref(tr->chunk);
+}
+
+static int mem_print(struct re_printf *pf, const struct tcprelay_mem *m,
+		     const struct tcprelay_mem *base, unsigned n)
+{
+	long pagesz = sysconf(_SC_PAGESIZE);
+
+	if (!n || !m->rss)
+		return re_hprintf(pf, "-");
+
+	return re_hprintf(pf, "%.2f fds, %.0f bytes RSS, %.0f bytes kernel"
+			  " TCP memory per allocation",
+			  (double)(m->fds - base->fds) / n,
+			  ((double)m->rss - (double)base->rss) / n,
+			  (double)(m->tcp_pages - base->tcp_pages)
+			  * pagesz / n);
+}
+
+int tcprelay_print(struct re_printf *pf, const struct tcprelay *tr)
+{
+	const struct tcprelay_setup *s;
+	double secs, bps_min = 0, bps_max = 0, bps_sum = 0;
+	unsigned n = 0;
+	struct le *le;
+	int err = 0;
+
+	if (!tr)
+		return 0;
+
+	s = &tr->setup;
+
+	err |= re_hprintf(pf, "%u started, %u up, %u failed, %u dropped,"
+			  " %llu peer connections\n",
+			  tr->started, tr->ready, tr->failed, tr->dropped,
+			  tr->accepted);
+
+	err |= re_hprintf(pf, "allocate: %H\n", hist_print_us, &s->allocate);
+	err |= re_hprintf(pf, "perm:     %H\n", hist_print_us, &s->perm);
+	err |= re_hprintf(pf, "connect:  %H\n", hist_print_us, &s->connect);
+	err |= re_hprintf(pf, "bind:     %H\n", hist_print_us, &s->bind);
+	err |= re_hprintf(pf, "ready:    %H\n", hist_print_us, &s->ready);
+
+	for (le = tr->peerl.head; le; le = le->next) {
+
+		const struct tcppeer *tp = le->data;
+		double bps;
+
+		if (tp->t_last <= tp->t_first)
+			continue;
+
+		bps = 8.0 * tp->bytes * 1e9 / (tp->t_last - tp->t_first);
+
+		if (!n || bps < bps_min)
+			bps_min = bps;
+		if (!n || bps > bps_max)
+			bps_max = bps;
+
+		bps_sum += bps;
+		++n;
+	}
+
+	if (tr->t_send) {
+		secs = (tperf_clock_ns() - tr->t_send) / 1e9;
+
+		err |= re_hprintf(pf, "bulk:     %llu bytes sent, %llu"
+				  " relayed in %.1f s (%.1f Mbit/s)\n",
+				  tr->tx_bytes, tr->rx_bytes, secs,
+				  8.0 * tr->rx_bytes / secs / 1e6);
+	}
+
+	if (n) {
+		err |= re_hprintf(pf, "per connection: %.1f / %.1f / %.1f"
+				  " Mbit/s (min/avg/max over %u)\n",
+				  bps_min / 1e6, bps_sum / n / 1e6,
+				  bps_max / 1e6, n);
+	}
+
+	err |= re_hprintf(pf, "memory, idle:   %H\n", mem_print, &tr->idle,
+			  &tr->base, tr->ready);
+	err |= re_hprintf(pf, "memory, loaded: %H\n", mem_print, &tr->loaded,
+			  &tr->base, tr->ready);
+
+	return err;
+}
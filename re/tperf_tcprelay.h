@@ -0,0 +1,90 @@
+#ifndef MY_TPERF_TCPRELAY_H_INCLUIDO
+#define MY_TPERF_TCPRELAY_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+#include "tperf_util.h"
+#include "tperf_srv.h"
+
+/* bytes per write of the bulk transfer */
+#define TCPRELAY_CHUNK 16384
+#define TCPRELAY_DURATION_MS 10000
+
+struct tcprelay_conf {
+	unsigned num;              /* allocations, one data connection each */
+	unsigned duration_ms;      /* of the bulk transfer */
+	uint32_t lifetime;         /* requested [s], 0 for the default */
+	const char *user;
+	const char *pass;
+};
+
+typedef void (tcprelay_done_h)(void *arg);
+
+/* setup steps of RFC 6062 allocations [ns] */
+struct tcprelay_setup {
+	struct hist allocate;      /* TCP connect and Allocate, with the 401 */
+	struct hist perm;          /* CreatePermission */
+	struct hist connect;       /* Connect, the server dials the peer */
+	struct hist bind;          /* data connection and ConnectionBind */
+	struct hist ready;         /* start until the data connection is up */
+};
+
+/* memory and descriptors of the process and the kernel TCP stack */
+struct tcprelay_mem {
+	int fds;
+	size_t rss;
+	long tcp_pages;            /* "mem" in /proc/net/sockstat */
+};
+
+/*
+ * TURN-TCP relay benchmark (RFC 6062). Each allocation has a control
+ * connection with REQUESTED-TRANSPORT TCP, and after Connect a data
+ * connection that is bound to the peer connection of the server with
+ * ConnectionBind. The peer side is one local TCP listener. When all
+ * allocations are up, every data connection sends as fast as TCP lets
+ * it for `duration_ms'.
+ */
+struct tcprelay {
+	struct tcprelay_conf conf;
+	const struct srvlist *servers;
+	tcprelay_done_h *doneh;
+	void *arg;
+
+	struct tcp_sock *ts;       /* peer side */
+	uint16_t peer_port;
+	struct list allocl;
+	struct list peerl;         /* accepted peer connections */
+	struct mbuf *chunk;
+	struct tmr tmr;            /* end of the transfer */
+	struct tmr tmr_stats;
+	bool running;
+	bool sending;
+
+	uint64_t t_start;
+	uint64_t t_send;
+	uint64_t t_prev;
+	unsigned started;
+	unsigned ready;
+	unsigned failed;
+	unsigned dropped;          /* closed after they were up */
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint64_t rx_prev;
+	uint64_t accepted;
+
+	struct tcprelay_setup setup;
+	struct tcprelay_mem base;  /* before the first allocation */
+	struct tcprelay_mem idle;  /* all up, nothing sent */
+	struct tcprelay_mem loaded;  /* at the end of the transfer */
+};
+
+int  tcprelay_init(struct tcprelay *tr, const struct tcprelay_conf *conf,
+		   const struct srvlist *servers,
+		   tcprelay_done_h *doneh, void *arg);
+int  tcprelay_start(struct tcprelay *tr);
+void tcprelay_stop(struct tcprelay *tr);
+void tcprelay_close(struct tcprelay *tr);
+int  tcprelay_print(struct re_printf *pf, const struct tcprelay *tr);
+
+#endif
@@ -0,0 +1,170 @@
+#include "tperf_tlsres.h"
+#include "tperf_util.h"
+
+#include <string.h>
+#include <openssl/ssl.h>
+
+/* SSL ex-data of a connection whose handshake is over */
+#define HS_DONE ((void *)1)
+
+static int ctx_ix = -1;            /* struct tlsres of the context */
+static int ssl_ix = -1;            /* handshake start [ns], or HS_DONE */
+
+static int new_session_handler(SSL *ssl, SSL_SESSION *sess)
+{
+	struct tlsres *tr = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctx_ix);
+	SSL_SESSION *old;
+
+	if (!tr)
+		return 0;
+
+	pthread_mutex_lock(&tr->mtx);
+	old = tr->sess;
+	tr->sess = sess;
+	pthread_mutex_unlock(&tr->mtx);
+
+	if (old)
+		SSL_SESSION_free(old);
+
+	/* the reference is kept */
+	return 1;
+}
+
+static void info_handler(const SSL *cssl, int where, int ret)
+{
+	SSL *ssl = (SSL *)cssl;
+	struct tlsres *tr = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctx_ix);
+	void *hs = SSL_get_ex_data(ssl, ssl_ix);
+	uint64_t t;
+	(void)ret;
+
+	if (!tr || SSL_is_server(ssl))
+		return;
+
+	/* TLS 1.3 tickets after the handshake start it again, skip those */
+	if (where & SSL_CB_HANDSHAKE_START) {
+
+		if (hs)
+			return;
+
+		(void)SSL_set_ex_data(ssl, ssl_ix,
+				      (void *)(uintptr_t)tperf_clock_ns());
+
+		if (!tr->resume)
+			return;
+
+		/* before the ClientHello is written */
+		pthread_mutex_lock(&tr->mtx);
+		if (tr->sess && SSL_set_session(ssl, tr->sess) == 1)
+			++tr->offered;
+		pthread_mutex_unlock(&tr->mtx);
+	}
+	else if (where & SSL_CB_HANDSHAKE_DONE) {
+
+		if (!hs || hs == HS_DONE)
+			return;
+
+		t = tperf_clock_ns() - (uint64_t)(uintptr_t)hs;
+		(void)SSL_set_ex_data(ssl, ssl_ix, HS_DONE);
+
+		pthread_mutex_lock(&tr->mtx);
+		hist_record(SSL_session_reused(ssl) ? &tr->resumed : &tr->full,
+			    t);
+		pthread_mutex_unlock(&tr->mtx);
+	}
+}
+
+/* from the main thread, before any connection on tls */
+int tlsres_attach(struct tlsres *tr, struct tls *tls, bool resume)
+{
+	SSL_CTX *ctx;
+	int err;
+
+	if (!tr || !tls)
+		return EINVAL;
+
+	ctx = tls_openssl_context(tls);
+	if (!ctx)
+		return EINVAL;
+
+	if (ctx_ix < 0)
+		ctx_ix = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	if (ssl_ix < 0)
+		ssl_ix = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	if (ctx_ix < 0 || ssl_ix < 0)
+		return ENOMEM;
+
+	memset(tr, 0, sizeof(*tr));
+
+	err = pthread_mutex_init(&tr->mtx, NULL);
+	if (err)
+		return err;
+
+	tr->tls    = tls;
+	tr->resume = resume;
+
+	if (!SSL_CTX_set_ex_data(ctx, ctx_ix, tr)) {
+		pthread_mutex_destroy(&tr->mtx);
+		tr->tls = NULL;
+		return ENOMEM;
+	}
+
+	SSL_CTX_set_info_callback(ctx, info_handler);
+
+	if (resume) {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+					       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, new_session_handler);
+	}
+
+	return 0;
+}
+
+void tlsres_detach(struct tlsres *tr)
+{
+	SSL_CTX *ctx;
+
+	if (!tr || !tr->tls)
+		return;
+
+	ctx = tls_openssl_context(tr->tls);
+	if (ctx) {
+		SSL_CTX_sess_set_new_cb(ctx, NULL);
+		SSL_CTX_set_info_callback(ctx, NULL);
+		(void)SSL_CTX_set_ex_data(ctx, ctx_ix, NULL);
+	}
+
+	if (tr->sess)
+		SSL_SESSION_free(tr->sess);
+
+	pthread_mutex_destroy(&tr->mtx);
+
+	tr->sess = NULL;
+	tr->tls  = NULL;
+}
+
+int tlsres_print(struct re_printf *pf, struct tlsres *tr)
+{
+	int err = 0;
+
+	if (!tr || !tr->tls)
+		return 0;
+
+	pthread_mutex_lock(&tr->mtx);
+
+	if (tr->full.n)
+		err |= re_hprintf(pf, "  %-17s %8llu  %H\n", "full",
+				  tr->full.n, hist_print_us, &tr->full);
+	if (tr->resumed.n)
+		err |= re_hprintf(pf, "  %-17s %8llu  %H\n", "resumed",
+				  tr->resumed.n, hist_print_us, &tr->resumed);
+
+	err |= re_hprintf(pf, "  session resumption %s, %llu offered,"
+			  " %llu accepted\n",
+			  tr->resume ? "on" : "off",
+			  tr->offered, tr->resumed.n);
+
+	pthread_mutex_unlock(&tr->mtx);
+
+	return err;
+}
@@ -0,0 +1,34 @@
+#ifndef MY_TPERF_TLSRES_H_INCLUIDO
+#define MY_TPERF_TLSRES_H_INCLUIDO
+
+#include <stdint.h>
+#include <pthread.h>
+#include <re.h>
+
+#include "tperf_hist.h"
+
+/*
+ * Session resumption and handshake timing of a TLS or DTLS client
+ * context. The latest session the server issued (ID or ticket) is
+ * offered by every later handshake on the context. Handshakes are
+ * timed from the ClientHello to the Finished and split into full and
+ * resumed ones. The context is shared by the worker threads, so the
+ * session and the histograms are behind a mutex; handshakes are rare
+ * next to packets.
+ */
+struct tlsres {
+	struct tls *tls;           /* pointer */
+	bool resume;
+	pthread_mutex_t mtx;
+	void *sess;                /* SSL_SESSION, the latest one */
+
+	struct hist full;          /* handshake time [ns] */
+	struct hist resumed;
+	uint64_t offered;          /* handshakes that offered a session */
+};
+
+int  tlsres_attach(struct tlsres *tr, struct tls *tls, bool resume);
+void tlsres_detach(struct tlsres *tr);
+int  tlsres_print(struct re_printf *pf, struct tlsres *tr);
+
+#endif
@@ -0,0 +1,617 @@
+#include "tperf_traffic.h"
+#include "tperf_util.h"
+#include "tperf_pcap.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+/* an RTSP message that long without a header end means lost sync */
+#define RTSP_MSG_MAX 65536
+
+struct stream {
+	int proto;
+	struct sa src;
+	struct sa dst;
+	int chan;                  /* -1 for UDP */
+	uint32_t *sizev;
+	uint64_t *tsv;             /* capture time [ns] */
+	size_t n;
+	size_t size;
+	uint64_t bytes;
+};
+
+/* one direction of a TCP connection, read as RTSP interleaved */
+struct tcpflow {
+	struct sa src;
+	struct sa dst;
+	uint32_t next_seq;
+	bool synced;
+	bool resync;               /* after a hole, wait for a '$' */
+	struct mbuf *mb;
+};
+
+struct extract {
+	const struct traffic_flow *sel;
+	struct stream streamv[TRAFFIC_STREAMS_MAX];
+	unsigned streamc;
+	struct tcpflow flowv[TRAFFIC_STREAMS_MAX];
+	unsigned flowc;
+};
+
+static void traffic_destructor(void *arg)
+{
+	struct traffic *tr = arg;
+
+	mem_deref(tr->sizev);
+	mem_deref(tr->gapv);
+}
+
+static int traffic_alloc(struct traffic **trp, enum traffic_model model)
+{
+	struct traffic *tr;
+
+	tr = mem_zalloc(sizeof(*tr), traffic_destructor);
+	if (!tr)
+		return ENOMEM;
+
+	tr->model = model;
+	tr->chan  = -1;
+
+	*trp = tr;
+
+	return 0;
+}
+
+static int traffic_push(struct traffic *tr, size_t psize, uint64_t gap)
+{
+	if (tr->n == tr->size) {
+		size_t size = tr->size ? tr->size * 2 : 1024;
+		uint32_t *sizev;
+		uint64_t *gapv;
+
+		sizev = mem_realloc(tr->sizev, size * sizeof(*sizev));
+		if (!sizev)
+			return ENOMEM;
+		tr->sizev = sizev;
+
+		gapv = mem_realloc(tr->gapv, size * sizeof(*gapv));
+		if (!gapv)
+			return ENOMEM;
+		tr->gapv = gapv;
+
+		tr->size = size;
+	}
+
+	psize = max(psize, (size_t)HDR_SIZE);
+
+	tr->sizev[tr->n] = (uint32_t)psize;
+	tr->gapv[tr->n]  = gap;
+	++tr->n;
+
+	tr->bytes    += psize;
+	tr->duration += gap;
+
+	tr->burst += psize;
+	if (tr->burst > tr->burst_max)
+		tr->burst_max = tr->burst;
+	if (gap)
+		tr->burst = 0;
+
+	return 0;
+}
+
+/* a frame, or a packet too large to send, split into equal packets */
+static int frame_push(struct traffic *tr, size_t bytes, uint64_t gap)
+{
+	size_t k = (bytes + TRAFFIC_PSIZE_MAX - 1) / TRAFFIC_PSIZE_MAX;
+	size_t i;
+	int err = 0;
+
+	if (!k)
+		k = 1;
+
+	for (i = 0; i < k && !err; i++) {
+
+		size_t psize = bytes * (i + 1) / k - bytes * i / k;
+
+		err = traffic_push(tr, psize, i + 1 == k ? gap : 0);
+	}
+
+	return err;
+}
+
+/* log-normal factor with mean 1 */
+static double lognormal(double sigma)
+{
+	double u1 = (rand_u32() + 1.0) / 4294967297.0;
+	double u2 = rand_u32() / 4294967296.0;
+	double z  = sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+
+	return exp(sigma * z - sigma * sigma / 2);
+}
+
+int traffic_vbr(struct traffic **trp, unsigned bitrate)
+{
+	const uint64_t ptime = 1000000000ULL / TRAFFIC_FPS;
+	double mean = bitrate / 8.0 / TRAFFIC_FPS;
+	struct traffic *tr;
+	unsigned i;
+	int err;
+
+	if (!trp || !bitrate)
+		return EINVAL;
+
+	err = traffic_alloc(&tr, TRAFFIC_VBR);
+	if (err)
+		return err;
+
+	for (i = 0; i < TRAFFIC_LOOP_S * TRAFFIC_FPS && !err; i++) {
+
+		double bytes = mean * lognormal(TRAFFIC_VBR_SIGMA);
+
+		err = frame_push(tr, (size_t)bytes, ptime);
+	}
+
+	if (err)
+		mem_deref(tr);
+	else
+		*trp = tr;
+
+	return err;
+}
+
+/*
+ * Delta frames around a mean size, and every gop frames a keyframe that
+ * is ratio times larger; the average bitrate is the given one.
+ */
+int traffic_keyframe(struct traffic **trp, unsigned bitrate, unsigned gop,
+		     double ratio)
+{
+	const uint64_t ptime = 1000000000ULL / TRAFFIC_FPS;
+	unsigned frames, i;
+	struct traffic *tr;
+	double delta;
+	int err;
+
+	if (!trp || !bitrate || !gop || ratio < 1)
+		return EINVAL;
+
+	delta = bitrate / 8.0 / TRAFFIC_FPS * gop / (gop - 1 + ratio);
+
+	/* whole GOPs, at least one loop length */
+	frames = (TRAFFIC_LOOP_S * TRAFFIC_FPS + gop - 1) / gop * gop;
+
+	err = traffic_alloc(&tr, TRAFFIC_KEYFRAME);
+	if (err)
+		return err;
+
+	for (i = 0; i < frames && !err; i++) {
+
+		double bytes = delta * lognormal(TRAFFIC_VBR_SIGMA / 4);
+
+		if (i % gop == 0)
+			bytes = delta * ratio;
+
+		err = frame_push(tr, (size_t)bytes, ptime);
+	}
+
+	if (err)
+		mem_deref(tr);
+	else
+		*trp = tr;
+
+	return err;
+}
+
+static bool flow_match(const struct traffic_flow *sel, const struct sa *src,
+		       const struct sa *dst)
+{
+	if (!sel->port)
+		return true;
+
+	return sa_port(src) == sel->port || sa_port(dst) == sel->port;
+}
+
+static void stream_add(struct extract *ex, int proto, const struct sa *src,
+		       const struct sa *dst, int chan, size_t len,
+		       uint64_t ts)
+{
+	struct stream *st = NULL;
+	unsigned i;
+
+	if (ex->sel->chan >= 0 && chan != ex->sel->chan)
+		return;
+
+	for (i = 0; i < ex->streamc; i++) {
+
+		struct stream *s = &ex->streamv[i];
+
+		if (s->proto == proto && s->chan == chan &&
+		    sa_cmp(&s->src, src, SA_ALL) &&
+		    sa_cmp(&s->dst, dst, SA_ALL)) {
+			st = s;
+			break;
+		}
+	}
+
+	if (!st) {
+		if (ex->streamc == ARRAY_SIZE(ex->streamv))
+			return;
+
+		st = &ex->streamv[ex->streamc++];
+		st->proto = proto;
+		st->src   = *src;
+		st->dst   = *dst;
+		st->chan  = chan;
+	}
+
+	if (st->n == st->size) {
+		size_t size = st->size ? st->size * 2 : 1024;
+		uint32_t *sizev;
+		uint64_t *tsv;
+
+		sizev = mem_realloc(st->sizev, size * sizeof(*sizev));
+		if (!sizev)
+			return;
+		st->sizev = sizev;
+
+		tsv = mem_realloc(st->tsv, size * sizeof(*tsv));
+		if (!tsv)
+			return;
+		st->tsv = tsv;
+
+		st->size = size;
+	}
+
+	st->sizev[st->n] = (uint32_t)len;
+	st->tsv[st->n]   = ts;
+	++st->n;
+
+	st->bytes += len;
+}
+
+/* length of a complete RTSP message at p, 0 if incomplete */
+static size_t rtsp_msg_len(const uint8_t *p, size_t n)
+{
+	size_t i, hdr = 0, body = 0, line = 0;
+
+	for (i = 0; i + 1 < n; i++) {
+
+		if (p[i] != '\r' || p[i + 1] != '\n')
+			continue;
+
+		if (i == line) {
+			hdr = i + 2;
+			break;
+		}
+
+		if (i - line > 15 &&
+		    0 == strncasecmp((const char *)p + line,
+				     "Content-Length:", 15)) {
+			body = strtoul((const char *)p + line + 15, NULL, 10);
+		}
+
+		line = i + 2;
+	}
+
+	if (!hdr || n - hdr < body)
+		return 0;
+
+	return hdr + body;
+}
+
+static void rtsp_parse(struct extract *ex, struct tcpflow *fl, uint64_t ts)
+{
+	struct mbuf *mb = fl->mb;
+	size_t left;
+
+	while ((left = mbuf_get_left(mb)) >= 4) {
+
+		const uint8_t *p = mbuf_buf(mb);
+		size_t len;
+
+		if (p[0] == '$') {
+			len = 4 + (p[2] << 8 | p[3]);
+			if (left < len)
+				break;
+
+			stream_add(ex, IPPROTO_TCP, &fl->src, &fl->dst, p[1],
+				   len - 4, ts);
+		}
+		else {
+			len = rtsp_msg_len(p, left);
+			if (!len) {
+				if (left > RTSP_MSG_MAX) {
+					mbuf_rewind(mb);
+					fl->resync = true;
+				}
+				break;
+			}
+		}
+
+		mbuf_advance(mb, len);
+	}
+
+	/* keep the incomplete tail at the start */
+	left = mbuf_get_left(mb);
+	memmove(mb->buf, mbuf_buf(mb), left);
+	mb->pos = 0;
+	mb->end = left;
+}
+
+static void tcp_input(struct extract *ex, const struct pcap_l4 *l4,
+		      uint64_t ts)
+{
+	struct tcpflow *fl = NULL;
+	const uint8_t *p = l4->payload;
+	size_t n = l4->len;
+	unsigned i;
+
+	if (!n)
+		return;
+
+	for (i = 0; i < ex->flowc; i++) {
+
+		if (sa_cmp(&ex->flowv[i].src, &l4->src, SA_ALL) &&
+		    sa_cmp(&ex->flowv[i].dst, &l4->dst, SA_ALL)) {
+			fl = &ex->flowv[i];
+			break;
+		}
+	}
+
+	if (!fl) {
+		if (ex->flowc == ARRAY_SIZE(ex->flowv))
+			return;
+
+		fl = &ex->flowv[ex->flowc++];
+		fl->src = l4->src;
+		fl->dst = l4->dst;
+		fl->mb  = mbuf_alloc(8192);
+		if (!fl->mb)
+			return;
+	}
+
+	if (!fl->synced) {
+		fl->synced   = true;
+		fl->next_seq = l4->seq;
+	}
+
+	/* retransmission, or the part of it that is new */
+	if ((int32_t)(l4->seq - fl->next_seq) < 0) {
+		uint32_t old = fl->next_seq - l4->seq;
+
+		if (old >= n)
+			return;
+
+		p += old;
+		n -= old;
+	}
+	else if (l4->seq != fl->next_seq) {
+		mbuf_rewind(fl->mb);
+		fl->resync = true;
+	}
+
+	fl->next_seq = l4->seq + (uint32_t)l4->len;
+
+	/* cut by the snap length */
+	if (l4->caplen < l4->len) {
+		mbuf_rewind(fl->mb);
+		fl->resync = true;
+		return;
+	}
+
+	if (fl->resync) {
+		if (p[0] != '$')
+			return;
+		fl->resync = false;
+	}
+
+	mbuf_set_pos(fl->mb, fl->mb->end);
+	if (mbuf_write_mem(fl->mb, p, n))
+		return;
+	mbuf_set_pos(fl->mb, 0);
+
+	rtsp_parse(ex, fl, ts);
+}
+
+/* a capture need not be in time order, a step back is no gap */
+static inline uint64_t ts_gap(uint64_t from, uint64_t to)
+{
+	return to > from ? to - from : 0;
+}
+
+static int stream_convert(struct traffic *tr, const struct stream *st)
+{
+	uint64_t last;
+	size_t i, back = 0;
+	int err = 0;
+
+	/* the loop closes with the mean gap */
+	last = ts_gap(st->tsv[0], st->tsv[st->n - 1]) / (st->n - 1);
+
+	for (i = 0; i < st->n && !err; i++) {
+
+		uint64_t gap = last;
+
+		if (i + 1 < st->n) {
+			gap = ts_gap(st->tsv[i], st->tsv[i + 1]);
+			if (st->tsv[i + 1] < st->tsv[i])
+				++back;
+		}
+
+		err = frame_push(tr, st->sizev[i], gap);
+	}
+
+	if (back)
+		re_fprintf(stderr, "traffic: %zu packets of the capture are"
+			   " not in time order, sent without a gap\n", back);
+
+	if (!err && !tr->duration) {
+		re_fprintf(stderr, "traffic: the stream of the capture takes"
+			   " no time\n");
+		err = EINVAL;
+	}
+
+	tr->proto = st->proto;
+	tr->src   = st->src;
+	tr->dst   = st->dst;
+	tr->chan  = st->chan;
+
+	return err;
+}
+
+/*
+ * Packet sizes and inter-arrival times of one stream of a capture: a
+ * UDP flow, or one RTSP interleaved channel of a TCP connection.
+ */
+int traffic_pcap(struct traffic **trp, const char *path,
+		 const struct traffic_flow *flow)
+{
+	struct pcap_file *pf = NULL;
+	struct traffic *tr = NULL;
+	struct extract *ex;
+	const struct stream *best = NULL;
+	struct pcap_pkt pkt;
+	unsigned i;
+	int err;
+
+	if (!trp || !path || !flow)
+		return EINVAL;
+
+	ex = mem_zalloc(sizeof(*ex), NULL);
+	if (!ex)
+		return ENOMEM;
+
+	ex->sel = flow;
+
+	err = pcap_open(&pf, path);
+	if (err) {
+		re_fprintf(stderr, "traffic: cannot read %s (%m)\n",
+			   path, err);
+		goto out;
+	}
+
+	while (pcap_next(pf, &pkt)) {
+
+		struct pcap_l4 l4;
+
+		if (pcap_decode(pf, &pkt, &l4))
+			continue;
+
+		if (!flow_match(flow, &l4.src, &l4.dst))
+			continue;
+
+		if (l4.proto == IPPROTO_UDP)
+			stream_add(ex, IPPROTO_UDP, &l4.src, &l4.dst, -1,
+				   l4.len, pkt.ts);
+		else
+			tcp_input(ex, &l4, pkt.ts);
+	}
+
+	for (i = 0; i < ex->streamc; i++) {
+
+		const struct stream *st = &ex->streamv[i];
+
+		if (st->n < 2)
+			continue;
+
+		if (!best || st->bytes > best->bytes)
+			best = st;
+	}
+
+	if (!best) {
+		re_fprintf(stderr, "traffic: no matching stream in %s\n",
+			   path);
+		err = ENOENT;
+		goto out;
+	}
+
+	err = traffic_alloc(&tr, TRAFFIC_PCAP);
+	if (err)
+		goto out;
+
+	err = stream_convert(tr, best);
+
+ out:
+	for (i = 0; i < ex->streamc; i++) {
+		mem_deref(ex->streamv[i].sizev);
+		mem_deref(ex->streamv[i].tsv);
+	}
+	for (i = 0; i < ex->flowc; i++)
+		mem_deref(ex->flowv[i].mb);
+
+	mem_deref(ex);
+	mem_deref(pf);
+
+	if (err)
+		mem_deref(tr);
+	else
+		*trp = tr;
+
+	return err;
+}
+
+/* "<port>[/<channel>]" */
+int traffic_flow_parse(struct traffic_flow *flow, const char *str)
+{
+	unsigned port;
+	int chan = -1;
+
+	if (!flow || !str)
+		return EINVAL;
+
+	if (1 > sscanf(str, "%u/%d", &port, &chan) || port > 65535)
+		return EINVAL;
+
+	flow->port = (uint16_t)port;
+	flow->chan = chan;
+
+	return 0;
+}
+
+/* mean packet interval [ns] */
+uint64_t traffic_interval(const struct traffic *tr)
+{
+	if (!tr || !tr->n)
+		return 0;
+
+	return max(tr->duration / tr->n, (uint64_t)1);
+}
+
+/* mean bitrate [bit/s] */
+unsigned traffic_bitrate(const struct traffic *tr)
+{
+	if (!tr || !tr->duration)
+		return 0;
+
+	return (unsigned)(8000000000ULL * tr->bytes / tr->duration);
+}
+
+int traffic_print(struct re_printf *pf, const struct traffic *tr)
+{
+	static const char *namev[] = {"vbr", "keyframe", "pcap"};
+	double bps;
+	int err;
+
+	if (!tr)
+		return 0;
+
+	bps = traffic_bitrate(tr);
+
+	err = re_hprintf(pf, "%s, %zu packets in a %.1f s loop,"
+			 " %.0f bit/s average, bursts up to %zu bytes",
+			 namev[tr->model], tr->n, tr->duration / 1e9, bps,
+			 tr->burst_max);
+
+	if (tr->model == TRAFFIC_PCAP) {
+		err |= re_hprintf(pf, " (%s %J -> %J",
+				  tr->proto == IPPROTO_UDP ? "udp" : "tcp",
+				  &tr->src, &tr->dst);
+		if (tr->chan >= 0)
+			err |= re_hprintf(pf, " channel %d", tr->chan);
+		err |= re_hprintf(pf, ")");
+	}
+
+	return err;
+}
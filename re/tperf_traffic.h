@@ -0,0 +1,63 @@
+#ifndef MY_TPERF_TRAFFIC_H_INCLUIDO
+#define MY_TPERF_TRAFFIC_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+/* larger packets and video frames are split [bytes] */
+#define TRAFFIC_PSIZE_MAX 1400
+
+#define TRAFFIC_FPS 30
+#define TRAFFIC_LOOP_S 10          /* length of a synthetic loop */
+#define TRAFFIC_GOP 60             /* frames from keyframe to keyframe */
+#define TRAFFIC_KEYFRAME_RATIO 10  /* keyframe size over delta frame size */
+#define TRAFFIC_VBR_SIGMA 0.4      /* log-normal spread of frame sizes */
+#define TRAFFIC_STREAMS_MAX 64     /* pcap streams considered */
+
+enum traffic_model {
+	TRAFFIC_VBR,
+	TRAFFIC_KEYFRAME,
+	TRAFFIC_PCAP,
+};
+
+/* selects a pcap stream, the one with the most bytes by default */
+struct traffic_flow {
+	uint16_t port;             /* on either side, 0 for any */
+	int chan;                  /* RTSP interleaved channel, -1 for any */
+};
+
+/*
+ * Packet sequence that every sender replays in a loop, starting at a
+ * random position: the size of each packet and the gap to the next
+ * one. The packets of a video frame have a gap of 0 and are sent
+ * back-to-back.
+ */
+struct traffic {
+	enum traffic_model model;
+	uint32_t *sizev;           /* [bytes], HDR_SIZE..TRAFFIC_PSIZE_MAX */
+	uint64_t *gapv;            /* [ns] */
+	size_t n;
+	size_t size;
+	uint64_t bytes;
+	uint64_t duration;         /* one loop [ns] */
+	size_t burst;              /* back-to-back bytes, while building */
+	size_t burst_max;
+
+	/* the stream a pcap model was taken from */
+	int proto;
+	struct sa src;
+	struct sa dst;
+	int chan;
+};
+
+int      traffic_vbr(struct traffic **trp, unsigned bitrate);
+int      traffic_keyframe(struct traffic **trp, unsigned bitrate,
+			  unsigned gop, double ratio);
+int      traffic_pcap(struct traffic **trp, const char *path,
+		      const struct traffic_flow *flow);
+int      traffic_flow_parse(struct traffic_flow *flow, const char *str);
+uint64_t traffic_interval(const struct traffic *tr);
+unsigned traffic_bitrate(const struct traffic *tr);
+int      traffic_print(struct re_printf *pf, const struct traffic *tr);
+
+#endif
@@ -0,0 +1,277 @@
+#include "tperf_tstamp.h"
+
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+
+static uint64_t ts_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + (uint64_t)ts->tv_nsec;
+}
+
+/* kernel timestamps are CLOCK_REALTIME, tperf runs on CLOCK_MONOTONIC */
+static uint64_t rt_to_mono(const struct timespec *ts)
+{
+	struct timespec rt, mono;
+
+	(void)clock_gettime(CLOCK_REALTIME, &rt);
+	(void)clock_gettime(CLOCK_MONOTONIC, &mono);
+
+	return ts_ns(ts) - (int64_t)(ts_ns(&rt) - ts_ns(&mono));
+}
+
+/*
+ * Only TX timestamps are reported on this socket; with the software
+ * reporting flag the kernel stops updating the stamp that
+ * tstamp_rx_last() reads.
+ */
+int tstamp_tx_alloc(struct tstamp_tx **txp, int fd)
+{
+	const int flags = SOF_TIMESTAMPING_TX_SOFTWARE
+		| SOF_TIMESTAMPING_SOFTWARE
+		| SOF_TIMESTAMPING_OPT_ID
+		| SOF_TIMESTAMPING_OPT_TSONLY;
+	struct tstamp_tx *tx;
+
+	if (!txp || fd < 0)
+		return EINVAL;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+		       sizeof(flags)))
+		return errno;
+
+	tx = mem_zalloc(sizeof(*tx), NULL);
+	if (!tx)
+		return ENOMEM;
+
+	tx->fd = fd;
+
+	*txp = tx;
+
+	return 0;
+}
+
+/* after every datagram that was sent successfully */
+void tstamp_tx_sent(struct tstamp_tx *tx, uint32_t alloc_id, uint32_t seq,
+		    uint64_t ts)
+{
+	uint32_t id;
+
+	if (!tx)
+		return;
+
+	id = tx->next_id++;
+
+	tx->ringv[id % TSTAMP_RING].id       = id;
+	tx->ringv[id % TSTAMP_RING].alloc_id = alloc_id;
+	tx->ringv[id % TSTAMP_RING].seq      = seq;
+	tx->ringv[id % TSTAMP_RING].ts       = ts;
+}
+
+/* the stamp was taken in the send call of entry id */
+static bool tx_fits(const struct tstamp_tx *tx, uint32_t id, uint64_t ktx)
+{
+	unsigned i = id % TSTAMP_RING, next = (id + 1) % TSTAMP_RING;
+
+	if (tx->ringv[i].id != id || ktx + TSTAMP_SLACK_NS < tx->ringv[i].ts)
+		return false;
+
+	/* the next packet went out after that send call had returned */
+	if (tx->ringv[next].id == id + 1 &&
+	    ktx > tx->ringv[next].ts + TSTAMP_SLACK_NS)
+		return false;
+
+	return true;
+}
+
+/* the nearest packet that the stamp fits, the counters are realigned */
+static bool tx_resync(struct tstamp_tx *tx, uint32_t key, uint64_t ktx,
+		      uint32_t *idp)
+{
+	uint32_t id = key - tx->skew;
+	unsigned d;
+
+	for (d = 1; d <= TSTAMP_RESYNC; d++) {
+
+		uint32_t cand;
+
+		if (tx_fits(tx, id - d, ktx))
+			cand = id - d;
+		else if (tx_fits(tx, id + d, ktx))
+			cand = id + d;
+		else
+			continue;
+
+		tx->skew = key - cand;
+		*idp = cand;
+
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Reads the error queue. Software TX timestamps are taken in the send
+ * call on most paths, so draining right after the send finds them; a
+ * pending one keeps the socket signalling an error until then.
+ */
+void tstamp_tx_drain(struct tstamp_tx *tx, tstamp_lookup_h *lookuph,
+		     void *arg, struct tstampstat *st)
+{
+	char ctrl[256];
+
+	if (!tx || !lookuph || !st)
+		return;
+
+	for (;;) {
+		const struct scm_timestamping *tss = NULL;
+		const struct sock_extended_err *serr = NULL;
+		struct msghdr msg;
+		struct cmsghdr *cm;
+		struct tstamp_seq *seqs;
+		uint64_t ktx;
+		uint32_t id;
+		unsigned i;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control    = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+
+		if (recvmsg(tx->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+
+			if (cm->cmsg_level == SOL_SOCKET &&
+			    cm->cmsg_type == SO_TIMESTAMPING)
+				tss = (void *)CMSG_DATA(cm);
+			else if ((cm->cmsg_level == IPPROTO_IP &&
+				  cm->cmsg_type == IP_RECVERR) ||
+				 (cm->cmsg_level == IPPROTO_IPV6 &&
+				  cm->cmsg_type == IPV6_RECVERR))
+				serr = (void *)CMSG_DATA(cm);
+		}
+
+		if (!tss || !serr ||
+		    serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ||
+		    serr->ee_info != SCM_TSTAMP_SND)
+			continue;
+
+		ktx = rt_to_mono(&tss->ts[0]);
+		id  = serr->ee_data - tx->skew;
+
+		/* sent too long ago, the slot was reused */
+		if (tx->next_id - id > TSTAMP_RING && id - tx->next_id >
+		    TSTAMP_RESYNC)
+			continue;
+
+		if (!tx_fits(tx, id, ktx)) {
+			++st->tx_mismatched;
+
+			if (!tx_resync(tx, serr->ee_data, ktx, &id))
+				continue;
+
+			++st->tx_resynced;
+		}
+
+		i = id % TSTAMP_RING;
+
+		++st->tx_stamped;
+
+		if (ktx > tx->ringv[i].ts)
+			hist_record(&st->tx_stack, ktx - tx->ringv[i].ts);
+
+		seqs = lookuph(tx->ringv[i].alloc_id, arg);
+		if (!seqs)
+			continue;
+
+		seqs->seqv[tx->ringv[i].seq % TSTAMP_RING] = tx->ringv[i].seq;
+		seqs->ktxv[tx->ringv[i].seq % TSTAMP_RING] = ktx;
+	}
+}
+
+/*
+ * RX timestamps of a socket that libre reads with recvfrom(2): the
+ * first SIOCGSTAMPNS turns them on, after that it returns the kernel
+ * arrival time of the datagram read last.
+ */
+int tstamp_rx_enable(int fd)
+{
+	struct timespec ts;
+
+	if (fd < 0)
+		return EINVAL;
+
+	if (ioctl(fd, SIOCGSTAMPNS, &ts) && errno != ENOENT)
+		return errno;
+
+	return 0;
+}
+
+/* [ns] monotonic, 0 if not known */
+uint64_t tstamp_rx_last(int fd)
+{
+	struct timespec ts;
+
+	if (ioctl(fd, SIOCGSTAMPNS, &ts))
+		return 0;
+
+	return rt_to_mono(&ts);
+}
+
+/* kernel TX time of a packet [ns], 0 if not known */
+uint64_t tstamp_seq_get(const struct tstamp_seq *ts, uint32_t seq)
+{
+	if (!ts || ts->seqv[seq % TSTAMP_RING] != seq)
+		return 0;
+
+	return ts->ktxv[seq % TSTAMP_RING];
+}
+
+void tstampstat_reset(struct tstampstat *st)
+{
+	if (!st)
+		return;
+
+	memset(st, 0, sizeof(*st));
+
+	hist_reset(&st->tx_stack);
+	hist_reset(&st->path);
+	hist_reset(&st->rx_stack);
+}
+
+int tstampstat_print(struct re_printf *pf, const struct tstampstat *st)
+{
+	int err = 0;
+
+	if (!st)
+		return 0;
+
+	err |= re_hprintf(pf, "%llu tx, %llu rx stamped, %llu with both",
+			  st->tx_stamped, st->rx_stamped, st->matched);
+
+	if (st->tx_mismatched)
+		err |= re_hprintf(pf, "; %llu tx stamps out of step with the"
+				  " packets, %llu matched again",
+				  st->tx_mismatched, st->tx_resynced);
+
+	err |= re_hprintf(pf, "\n");
+
+	if (st->tx_stack.n)
+		err |= re_hprintf(pf, "  tx stack: %H\n",
+				  hist_print_us, &st->tx_stack);
+	if (st->path.n)
+		err |= re_hprintf(pf, "  path:     %H\n",
+				  hist_print_us, &st->path);
+	if (st->rx_stack.n)
+		err |= re_hprintf(pf, "  rx stack: %H\n",
+				  hist_print_us, &st->rx_stack);
+
+	return err;
+}
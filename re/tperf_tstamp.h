@@ -0,0 +1,79 @@
+#ifndef MY_TPERF_TSTAMP_H_INCLUIDO
+#define MY_TPERF_TSTAMP_H_INCLUIDO
+
+#include <stdint.h>
+#include <re.h>
+
+#include "tperf_hist.h"
+
+enum tstamp_mode {
+	TSTAMP_OFF = 0,
+	TSTAMP_DOWNSTREAM,         /* peer sockets send, client receives */
+	TSTAMP_UPSTREAM,           /* peer sockets receive */
+};
+
+/* packets in flight that a kernel timestamp can be matched to */
+#define TSTAMP_RING 64
+/* how far the counter of the kernel is searched when out of step */
+#define TSTAMP_RESYNC 8
+/* error of the clock conversion [ns] */
+#define TSTAMP_SLACK_NS 500
+
+/*
+ * Kernel software TX timestamps of one socket, from the error queue
+ * (SO_TIMESTAMPING with OPT_ID). The ring maps the datagram counter
+ * of the kernel to the packet that was sent.
+ *
+ * The kernel may count a send that failed, which tperf does not. So a
+ * stamp is only taken for its packet if it falls between the send of
+ * that packet and the send of the next one; if not, the packets nearby
+ * are tried, and the offset of the counters is corrected.
+ */
+struct tstamp_tx {
+	int fd;
+	uint32_t next_id;
+	uint32_t skew;             /* counter of the kernel minus ours */
+	struct {
+		uint32_t id;
+		uint32_t alloc_id;
+		uint32_t seq;
+		uint64_t ts;               /* user-space send time [ns] */
+	} ringv[TSTAMP_RING];
+};
+
+/* kernel TX times of the packets of one allocation, by sequence */
+struct tstamp_seq {
+	uint32_t seqv[TSTAMP_RING];
+	uint64_t ktxv[TSTAMP_RING];        /* [ns], monotonic */
+};
+
+/*
+ * One-way latency split at the kernel timestamps: the sending stack,
+ * the path through the network and the TURN server, and the receiving
+ * stack up to the receiver, event-loop delay included.
+ */
+struct tstampstat {
+	struct hist tx_stack;
+	struct hist path;
+	struct hist rx_stack;
+	uint64_t tx_stamped;
+	uint64_t rx_stamped;
+	uint64_t matched;                  /* with both timestamps */
+	uint64_t tx_mismatched;            /* not for the expected packet */
+	uint64_t tx_resynced;              /* then found for another one */
+};
+
+typedef struct tstamp_seq *(tstamp_lookup_h)(uint32_t alloc_id, void *arg);
+
+int      tstamp_tx_alloc(struct tstamp_tx **txp, int fd);
+void     tstamp_tx_sent(struct tstamp_tx *tx, uint32_t alloc_id,
+			uint32_t seq, uint64_t ts);
+void     tstamp_tx_drain(struct tstamp_tx *tx, tstamp_lookup_h *lookuph,
+			 void *arg, struct tstampstat *st);
+int      tstamp_rx_enable(int fd);
+uint64_t tstamp_rx_last(int fd);
+uint64_t tstamp_seq_get(const struct tstamp_seq *ts, uint32_t seq);
+void     tstampstat_reset(struct tstampstat *st);
+int      tstampstat_print(struct re_printf *pf, const struct tstampstat *st);
+
+#endif
@@ -1,41 +1,302 @@
 #include "tperf_util.h"
+#include "tperf_verify.h"
+#include "tperf_srv.h"
 
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
 
 enum {
 	TURN_LAYER = 0,
 	DTLS_LAYER = -100,
+	PROBE_UDP_LAYER = -10,     /* sees responses before the TURN client */
+	PROBE_TCP_LAYER = 10,      /* sees requests before TLS */
+	BATCH_TCP_LAYER = 20,      /* above the probe and TLS */
 };
 
 enum {
 	PING_INTERVAL = 5000,
 	REDIRC_MAX = 16,
+	PEERPOOL_SOCKBUF = 4194304,
 };
 
-const uint32_t proto_magic = 'T'<<24 | 'P'<<16 | 'R'<<8 | 'F';
-
 void destructor(void *arg)
 {
 	struct allocation *alloc = arg;
 
 	list_unlink(&alloc->le);
+	hash_unlink(&alloc->he);
 
 	tmr_cancel(&alloc->tmr_ping);
 
-	mem_deref(alloc->sender);
+	sender_free(alloc->sender);
 
 	/* note: order matters */
  	mem_deref(alloc->turnc);     /* close TURN client, to de-allocate */
+	mem_deref(alloc->probe);     /* helpers go before their sockets */
+	mem_deref(alloc->rxs);
+	mem_deref(alloc->batch);
 	mem_deref(alloc->dtls_sock);
 	mem_deref(alloc->us);        /* must be closed after TURN client */
 
 	mem_deref(alloc->tlsc);
 	mem_deref(alloc->tc);
-	mem_deref(alloc->mb);
+	mem_deref(alloc->framer);
 	mem_deref(alloc->us_tx);
+	mem_deref(alloc->tstx);
+	mem_deref(alloc->tseq);
+	mem_deref(alloc->recv.lat_own);
+}
+
+uint64_t tperf_clock_ns(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* user and system time of the process [ns] */
+uint64_t tperf_cpu_ns(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)
+		* 1000000000ULL
+		+ (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec)
+		* 1000ULL;
+}
+
+static bool alloc_id_cmp(struct le *le, void *arg)
+{
+	const struct allocation *alloc = le->data;
+
+	return alloc->ix == *(uint32_t *)arg;
+}
+
+int allocator_init_table(struct allocator *allocator)
+{
+	uint32_t bsize = 16;
+
+	if (!allocator)
+		return EINVAL;
+
+	if (allocator->ht)
+		return 0;
+
+	hist_reset(&allocator->lat);
+	setupstat_reset(&allocator->setup);
+	tstampstat_reset(&allocator->tstat);
+
+	while (bsize < allocator->num_allocations && bsize < 65536)
+		bsize *= 2;
+
+	return hash_alloc(&allocator->ht, bsize);
+}
+
+struct allocation *allocator_find(const struct allocator *allocator,
+				  uint32_t alloc_id)
+{
+	if (!allocator)
+		return NULL;
+
+	return list_ledata(hash_lookup(allocator->ht, alloc_id,
+				       alloc_id_cmp, &alloc_id));
+}
+
+/* tstamp_lookup_h */
+struct tstamp_seq *allocator_tstamp_seq(uint32_t alloc_id, void *arg)
+{
+	struct allocation *alloc = allocator_find(arg, alloc_id);
+
+	return alloc ? alloc->tseq : NULL;
+}
+
+static bool is_turnperf(const struct mbuf *mb)
+{
+	uint32_t v;
+
+	if (mbuf_get_left(mb) < HDR_SIZE)
+		return false;
+
+	memcpy(&v, mbuf_buf(mb), 4);
+
+	return ntohl(v) == proto_magic;
+}
+
+/* the peer socket of one allocation */
+static void peer_udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
+{
+	struct allocation *alloc = arg;
+
+	if (!is_turnperf(mb))
+		return;
+
+	++alloc->peer_rx;
+
+	if (alloc->allocator->tstamp == TSTAMP_UPSTREAM) {
+		alloc->recv.krx = tstamp_rx_last(udp_sock_fd(alloc->us_tx,
+						sa_af(&alloc->laddr_tx)));
+	}
+
+	(void)receiver_recv(&alloc->recv, src, mb);
+}
+
+static void peer_recv(const struct sa *src, struct mbuf *mb, void *arg)
+{
+	struct peerpool *pool = arg;
+	struct allocation *alloc;
+	uint32_t v;
+
+	if (!is_turnperf(mb))
+		goto other;
+
+	memcpy(&v, mbuf_buf(mb) + HDR_ALLOCID_OFS, 4);
+
+	alloc = allocator_find(pool->allocator, ntohl(v));
+	if (!alloc) {
+		++pool->rx_unknown;
+		return;
+	}
+
+	++pool->rx_packets;
+	++alloc->peer_rx;
+
+	/* upstream traffic */
+	(void)receiver_recv(&alloc->recv, src, mb);
+	return;
+
+ other:
+	++pool->rx_other;
+}
+
+static void peerpool_destructor(void *arg)
+{
+	struct peerpool *pool = arg;
+	unsigned i;
+
+	for (i = 0; i < pool->n; i++) {
+		if (pool->tstxv)
+			mem_deref(pool->tstxv[i]);
+		mem_deref(pool->usv[i]);
+	}
 
-	mem_deref(alloc->tls);
+	mem_deref(pool->tstxv);
+	mem_deref(pool->usv);
+	mem_deref(pool->laddrv);
+}
+
+int peerpool_alloc(struct peerpool **poolp, struct allocator *allocator,
+		   unsigned n, int af)
+{
+	struct peerpool *pool;
+	struct sa laddr;
+	unsigned i;
+	int err = 0;
+
+	if (!poolp || !allocator || !n)
+		return EINVAL;
+
+	pool = mem_zalloc(sizeof(*pool), peerpool_destructor);
+	if (!pool)
+		return ENOMEM;
+
+	pool->allocator = allocator;
+	pool->usv    = mem_zalloc(n * sizeof(*pool->usv), NULL);
+	pool->laddrv = mem_zalloc(n * sizeof(*pool->laddrv), NULL);
+	if (!pool->usv || !pool->laddrv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (allocator->tstamp == TSTAMP_DOWNSTREAM) {
+		pool->tstxv = mem_zalloc(n * sizeof(*pool->tstxv), NULL);
+		if (!pool->tstxv) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
+	sa_init(&laddr, af);
+
+	for (pool->n = 0; pool->n < n; pool->n++) {
+
+		i = pool->n;
+
+		err = udp_listen(&pool->usv[i], &laddr, peer_recv, pool);
+		if (err) {
+			re_fprintf(stderr, "peerpool: failed to create"
+				   " UDP socket (%m)\n", err);
+			goto out;
+		}
+
+		udp_sockbuf_set(pool->usv[i], PEERPOOL_SOCKBUF);
+		udp_local_get(pool->usv[i], &pool->laddrv[i]);
+
+		if (pool->tstxv) {
+			err = tstamp_tx_alloc(&pool->tstxv[i],
+					      udp_sock_fd(pool->usv[i],
+						  sa_af(&pool->laddrv[i])));
+			if (err) {
+				re_fprintf(stderr, "peerpool: no kernel TX"
+					   " timestamps (%m)\n", err);
+				goto out;
+			}
+		}
+	}
+
+ out:
+	if (err)
+		mem_deref(pool);
+	else
+		*poolp = pool;
+
+	return err;
+}
+
+int proc_fd_count(void)
+{
+	struct dirent *de;
+	DIR *dir;
+	int n = 0;
+
+	dir = opendir("/proc/self/fd");
+	if (!dir)
+		return -1;
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] != '.')
+			++n;
+	}
+
+	(void)closedir(dir);
+
+	return n - 1;  /* the directory itself */
+}
+
+/* resident set size [bytes] */
+size_t proc_rss(void)
+{
+	unsigned long size, resident = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+
+	(void)fclose(f);
+
+	return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
 }
 
 void receiver_init(struct receiver *recvr,
@@ -50,10 +311,30 @@ void receiver_init(struct receiver *recvr,
 	recvr->allocid = exp_allocid;
 }
 
-int allocation_create(struct allocator *allocator, unsigned ix, int proto,
+/* the peer socket stamps what it sends downstream, or receives upstream */
+static int allocation_tstamp_peer(struct allocation *alloc)
+{
+	int fd = udp_sock_fd(alloc->us_tx, sa_af(&alloc->laddr_tx));
+
+	switch (alloc->allocator->tstamp) {
+
+	case TSTAMP_DOWNSTREAM:
+		return tstamp_tx_alloc(&alloc->tstx, fd);
+
+	case TSTAMP_UPSTREAM:
+		return tstamp_rx_enable(fd);
+
+	default:
+		return 0;
+	}
+}
+
+int allocation_create(struct allocation **allocp,
+		      struct allocator *allocator, unsigned ix, int proto,
 		      const struct sa *srv,
 		      const char *username, const char *password,
 		      struct tls *tls, bool turn_ind,
+		      struct srvstat *srvstat,
 		      allocation_h *alloch, void *arg)
 {
 	struct allocation *alloc;
@@ -70,6 +351,7 @@ int allocation_create(struct allocator *allocator, unsigned ix, int proto,
 		return ENOMEM;
 
 	list_append(&allocator->allocl, &alloc->le, alloc);
+	hash_append(allocator->ht, ix, &alloc->he, alloc);
 
 	(void)gettimeofday(&alloc->sent, NULL);
 
@@ -84,18 +366,61 @@ int allocation_create(struct allocator *allocator, unsigned ix, int proto,
 	alloc->turn_ind  = turn_ind;
 	alloc->alloch    = alloch;
 	alloc->arg       = arg;
-	alloc->tls       = mem_ref(tls);
+	alloc->tls       = tls;
+	alloc->srvstat   = srvstat;
 
 	receiver_init(&alloc->recv, allocator->session_cookie, alloc->ix);
+	alloc->recv.lat = &allocator->lat;
 
-	err = udp_listen(&alloc->us_tx, &laddr, NULL, NULL);
-	if (err) {
-		re_fprintf(stderr, "allocation: failed to create UDP tx socket"
-			   " (%m)\n", err);
+	if (srvstat)
+		alloc->recv.lat_srv = &srvstat->lat;
+
+	if (allocator->tstamp) {
+		alloc->recv.tstat = &allocator->tstat;
+
+		if (allocator->tstamp == TSTAMP_DOWNSTREAM) {
+			alloc->tseq = mem_zalloc(sizeof(*alloc->tseq), NULL);
+			if (!alloc->tseq) {
+				err = ENOMEM;
+				goto out;
+			}
+
+			alloc->recv.ktx = alloc->tseq;
+		}
+	}
+
+	err = stunprobe_alloc(&alloc->probe, &allocator->setup);
+	if (err)
 		goto out;
+
+	alloc->probe->win = &alloc->recv.win;
+
+	if (allocator->pool) {
+		struct peerpool *pool = allocator->pool;
+
+		alloc->us_tx    = mem_ref(pool->usv[ix % pool->n]);
+		alloc->laddr_tx = pool->laddrv[ix % pool->n];
+
+		if (pool->tstxv)
+			alloc->tstx = mem_ref(pool->tstxv[ix % pool->n]);
 	}
+	else {
+		err = udp_listen(&alloc->us_tx, &laddr, peer_udp_recv, alloc);
+		if (err) {
+			re_fprintf(stderr, "allocation: failed to create"
+				   " UDP tx socket (%m)\n", err);
+			goto out;
+		}
 
-	udp_local_get(alloc->us_tx, &alloc->laddr_tx);
+		udp_local_get(alloc->us_tx, &alloc->laddr_tx);
+
+		err = allocation_tstamp_peer(alloc);
+		if (err) {
+			re_fprintf(stderr, "allocation: no kernel"
+				   " timestamps (%m)\n", err);
+			goto out;
+		}
+	}
 
 	err = start(alloc);
 	if (err)
@@ -104,10 +429,34 @@ int allocation_create(struct allocator *allocator, unsigned ix, int proto,
  out:
 	if (err)
 		mem_deref(alloc);
+	else if (allocp)
+		*allocp = alloc;
 
 	return err;
 }
 
+/*
+ * Deletes the allocation on the server; the TURN client sends a Refresh
+ * with lifetime 0. The sockets stay open, so that the probe sees the
+ * response, until the allocation itself is freed.
+ */
+void allocation_release(struct allocation *alloc)
+{
+	if (!alloc || !alloc->turnc)
+		return;
+
+	tmr_cancel(&alloc->tmr_ping);
+	sender_free(alloc->sender);
+	alloc->sender = NULL;
+
+	alloc->ok    = false;
+	alloc->ready = false;
+	if (alloc->probe)
+		alloc->probe->releasing = true;
+
+	alloc->turnc = mem_deref(alloc->turnc);
+}
+
 
 void tmr_ping_handler(void *arg)
 {
@@ -129,21 +478,72 @@ void tmr_ping_handler(void *arg)
 	mem_deref(mb);
 }
 
+static uint32_t alloc_lifetime(const struct allocation *alloc)
+{
+	uint32_t lifetime = alloc->allocator->lifetime_req;
+
+	return lifetime ? lifetime : TURN_DEFAULT_LIFETIME;
+}
+
 bool is_connection_oriented(const struct allocation *alloc)
 {
 	return alloc->proto == IPPROTO_TCP ||
 		(alloc->proto == IPPROTO_UDP && alloc->secure);
 }
 
+/* counted against the TURN server, then reported to the owner */
+static void allocation_error(struct allocation *alloc, int err,
+			     uint16_t scode, const char *reason)
+{
+	if (alloc->srvstat) {
+		if (alloc->ok)
+			++alloc->srvstat->dropped;
+		else
+			++alloc->srvstat->failed;
+	}
+
+	/* a setup fails once, whatever its other transactions report */
+	if (!alloc->ready) {
+		if (alloc->failed)
+			return;
+
+		alloc->failed = true;
+		alloc->alloch(err, scode, reason, NULL, NULL, alloc->arg);
+		return;
+	}
+
+	alloc->alloch(err, scode, reason, &alloc->srv, &alloc->relay,
+		      alloc->arg);
+}
+
 void perm_handler(void *arg)
 {
 	struct allocation *alloc = arg;
+	struct timeval now;
+	double ms;
+
+	(void)gettimeofday(&now, NULL);
+
+	ms  = (double)(now.tv_sec - alloc->sent.tv_sec) * 1000;
+	ms += (double)(now.tv_usec - alloc->sent.tv_usec) / 1000;
+
+	hist_record(&alloc->allocator->setup.ready, (uint64_t)(ms * 1000000));
+
+	if (alloc->srvstat) {
+		++alloc->srvstat->allocations;
+		hist_record(&alloc->srvstat->setup, (uint64_t)(ms * 1000000));
+	}
+
 	re_printf("perm_handler: %s\n", alloc->turn_ind ? "Permission" : "Channel");
 
 	re_printf("%s to %J added.\n",
 		  alloc->turn_ind ? "Permission" : "Channel",
 		  &alloc->peer);
 
+	alloc->ready = true;
+	if (alloc->probe)
+		alloc->probe->ready = true;
+
 	alloc->alloch(0, 0, "OK", &alloc->srv, &alloc->relay, alloc->arg);
 }
 
@@ -185,6 +585,8 @@ void turnc_handler(int err, uint16_t scode, const char *reason,
 				  alloc->ix, &alt->v.alt_server);
 			alloc->srv = alt->v.alt_server;
 			alloc->turnc = mem_deref(alloc->turnc);
+			stunprobe_detach(alloc->probe);
+			alloc->batch = mem_deref(alloc->batch);
 			alloc->tlsc  = mem_deref(alloc->tlsc);
 			alloc->tc    = mem_deref(alloc->tc);
 			alloc->dtls_sock = mem_deref(alloc->dtls_sock);
@@ -216,6 +618,9 @@ void turnc_handler(int err, uint16_t scode, const char *reason,
 	alloc->atime  = (double)(now.tv_sec - alloc->sent.tv_sec) * 1000;
 	alloc->atime += (double)(now.tv_usec - alloc->sent.tv_usec) / 1000;
 
+	hist_record(&allocator->setup.allocated,
+		    (uint64_t)(alloc->atime * 1000000));
+
 	/* save information from the TURN server */
 	if (!allocator->server_info) {
 
@@ -252,7 +657,7 @@ void turnc_handler(int err, uint16_t scode, const char *reason,
 	return;
 
  term:
-	alloc->alloch(err, scode, reason, NULL, NULL, alloc->arg);
+	allocation_error(alloc, err, scode, reason);
 }
 
 void dtls_estab_handler(void *arg)
@@ -265,7 +670,7 @@ void dtls_estab_handler(void *arg)
 	err = turnc_alloc(&alloc->turnc, NULL, STUN_TRANSP_DTLS,
 			  alloc->tlsc, TURN_LAYER,
 			  &alloc->srv, alloc->user, alloc->pass,
-			  TURN_DEFAULT_LIFETIME, turnc_handler, alloc);
+			  alloc_lifetime(alloc), turnc_handler, alloc);
 	if (err) {
 		re_fprintf(stderr, "allocation: failed to"
 			   " create TURN client"
@@ -275,7 +680,7 @@ void dtls_estab_handler(void *arg)
 
  out:
 	if (err)
-		alloc->alloch(err, 0, NULL, NULL, NULL, alloc->arg);
+		allocation_error(alloc, err, 0, NULL);
 }
 
 int dns_init(struct dnsc **dnsc)
@@ -322,7 +727,7 @@ void sender_stop(struct sender *snd)
 	if (!snd)
 		return;
 
-	snd->ts_stop = tmr_jiffies();
+	snd->ts_stop = tperf_clock_ns();
 }
 
 void allocator_stop_senders(struct allocator *allocator)
@@ -333,72 +738,233 @@ void allocator_stop_senders(struct allocator *allocator)
 		return;
 
 	tmr_cancel(&allocator->tmr_ui);
-	tmr_cancel(&allocator->tmr_pace);
+	pacer_stop(&allocator->pacer);
+	batcher_close(&allocator->batcher);
+	(void)gso_flush(&allocator->gso);
+	tmr_cancel(&allocator->tmr_stats);
 	for (le = allocator->allocl.head; le; le = le->next) {
 		struct allocation *alloc = le->data;
 		sender_stop(alloc->sender);
 	}
 }
 
-int protocol_decode(struct hdr *hdr, struct mbuf *mb)
+/* frees the allocations, then the slab their senders came from */
+void allocator_close(struct allocator *allocator)
 {
-	uint32_t magic;
-	size_t start;
-	int err = 0;
+	if (!allocator)
+		return;
 
-	if (!hdr || !mb)
-		return EINVAL;
+	allocator_stop_senders(allocator);
+	list_flush(&allocator->allocl);
+	pacer_close(&allocator->pacer);
+	slab_close(&allocator->sendslab);
+	allocator->pool = mem_deref(allocator->pool);
+}
 
-	start = mb->pos;
 
-	if (mbuf_get_left(mb) < HDR_SIZE)
-		return EBADMSG;
+static inline bool seqwin_test(const struct seqwin *win, uint32_t seq)
+{
+	return (win->bits[(seq / 64) % ARRAY_SIZE(win->bits)] >> (seq % 64)) & 1;
+}
 
-	magic = ntohl(mbuf_read_u32(mb));
-	if (magic != proto_magic) {
-		err = EBADMSG;
-		goto out;
+static inline void seqwin_set(struct seqwin *win, uint32_t seq)
+{
+	win->bits[(seq / 64) % ARRAY_SIZE(win->bits)] |= 1ULL << (seq % 64);
+}
+
+static inline void seqwin_clear(struct seqwin *win, uint32_t seq)
+{
+	win->bits[(seq / 64) % ARRAY_SIZE(win->bits)] &= ~(1ULL << (seq % 64));
+}
+
+void seqwin_update(struct seqwin *win, uint32_t seq)
+{
+	int32_t delta;
+
+	if (!win)
+		return;
+
+	if (!win->started) {
+		win->started   = true;
+		win->base      = seq;
+		win->max_seq   = seq;
+		seqwin_set(win, seq);
+		++win->received;
+		return;
 	}
 
-	hdr->session_cookie = ntohl(mbuf_read_u32(mb));
-	hdr->alloc_id       = ntohl(mbuf_read_u32(mb));
-	hdr->seq            = ntohl(mbuf_read_u32(mb));
-	hdr->payload_len    = ntohl(mbuf_read_u32(mb));
+	delta = (int32_t)(seq - win->max_seq);
 
-	if (mbuf_get_left(mb) < hdr->payload_len) {
-		re_fprintf(stderr, "receiver: header said %zu bytes,"
-			   " but payload is only %zu bytes\n",
-			   hdr->payload_len, mbuf_get_left(mb));
-		err = EPROTO;
-		goto out;
+	if (delta > SEQWIN_SIZE) {
+
+		/* the whole window slides out, and the gap was never seen */
+		win->lost += seqwin_pending(win) + (uint32_t)delta - 1;
+		memset(win->bits, 0, sizeof(win->bits));
+
+		seqwin_set(win, seq);
+		win->base    = seq;
+		win->max_seq = seq;
+		++win->received;
 	}
+	else if (delta > 0) {
+		uint32_t s;
 
-	/* save portions of the packet */
-	memcpy(hdr->payload, mbuf_buf(mb),
-	       min (mbuf_get_left(mb), sizeof(hdr->payload)));
+		/* slide the window, every slot reused by s held s-SIZE */
+		for (s = win->max_seq + 1; s != seq + 1; s++) {
 
-	/* important, so that the TURN TCP-framing works */
-	mbuf_advance(mb, hdr->payload_len);
+			uint32_t old = s - SEQWIN_SIZE;
 
- out:
-	if(err) {
-		mb->pos = start;
+			if ((int32_t)(old - win->base) >= 0 &&
+			    !seqwin_test(win, old))
+				++win->lost;
+
+			seqwin_clear(win, s);
+		}
+
+		seqwin_set(win, seq);
+		win->max_seq = seq;
+		++win->received;
 	}
-	return 0;
+	else if (win->max_seq - seq < SEQWIN_SIZE &&
+		 (int32_t)(seq - win->base) >= 0) {
+
+		if (seqwin_test(win, seq)) {
+			++win->duplicate;
+		}
+		else {
+			seqwin_set(win, seq);
+			++win->received;
+			++win->reordered;
+		}
+	}
+	else {
+		++win->late;
+	}
+}
+
+/* holes that are still inside the window */
+uint64_t seqwin_pending(const struct seqwin *win)
+{
+	uint64_t span, set = 0;
+	size_t i;
+
+	if (!win || !win->started)
+		return 0;
+
+	span = (uint64_t)(win->max_seq - win->base) + 1;
+	if (span > SEQWIN_SIZE)
+		span = SEQWIN_SIZE;
+
+	for (i = 0; i < ARRAY_SIZE(win->bits); i++)
+		set += __builtin_popcountll(win->bits[i]);
+
+	return span > set ? span - set : 0;
+}
+
+void allocator_rxstat(const struct allocator *allocator, struct rxstat *st)
+{
+	struct le *le;
+
+	if (!allocator || !st)
+		return;
+
+	memset(st, 0, sizeof(*st));
+
+	for (le = allocator->allocl.head; le; le = le->next) {
+
+		const struct allocation *alloc = le->data;
+		const struct receiver *recvr = &alloc->recv;
+
+		st->packets   += recvr->total_packets;
+		st->bytes     += recvr->total_bytes;
+		st->received  += recvr->win.received;
+		st->lost      += recvr->win.lost + seqwin_pending(&recvr->win);
+		st->reordered += recvr->win.reordered;
+		st->duplicate += recvr->win.duplicate;
+		st->late      += recvr->win.late;
+		st->corrupt   += recvr->corrupt;
+	}
+}
+
+/* called from the owning thread */
+void allocator_publish(struct allocator *allocator)
+{
+	struct rxstat st;
+
+	if (!allocator)
+		return;
+
+	allocator_rxstat(allocator, &st);
+
+	COUNTER_SET(allocator->ctr.rx.packets,   st.packets);
+	COUNTER_SET(allocator->ctr.rx.bytes,     st.bytes);
+	COUNTER_SET(allocator->ctr.rx.received,  st.received);
+	COUNTER_SET(allocator->ctr.rx.lost,      st.lost);
+	COUNTER_SET(allocator->ctr.rx.reordered, st.reordered);
+	COUNTER_SET(allocator->ctr.rx.duplicate, st.duplicate);
+	COUNTER_SET(allocator->ctr.rx.late,      st.late);
+	COUNTER_SET(allocator->ctr.rx.corrupt,   st.corrupt);
 }
 
-void protocol_packet_dump(const struct hdr *hdr) {
-	if (!hdr) {
+/* may be called from any thread */
+void counters_add(struct counters *sum, const struct counters *ctr)
+{
+	if (!sum || !ctr)
 		return;
+
+	sum->tx_packets   += COUNTER_GET(ctr->tx_packets);
+	sum->tx_bytes     += COUNTER_GET(ctr->tx_bytes);
+	sum->allocations  += COUNTER_GET(ctr->allocations);
+	sum->failed       += COUNTER_GET(ctr->failed);
+	sum->rx.packets   += COUNTER_GET(ctr->rx.packets);
+	sum->rx.bytes     += COUNTER_GET(ctr->rx.bytes);
+	sum->rx.received  += COUNTER_GET(ctr->rx.received);
+	sum->rx.lost      += COUNTER_GET(ctr->rx.lost);
+	sum->rx.reordered += COUNTER_GET(ctr->rx.reordered);
+	sum->rx.duplicate += COUNTER_GET(ctr->rx.duplicate);
+	sum->rx.late      += COUNTER_GET(ctr->rx.late);
+	sum->rx.corrupt   += COUNTER_GET(ctr->rx.corrupt);
+}
+
+int rxstat_print(struct re_printf *pf, const struct rxstat *st)
+{
+	uint64_t expected;
+	double loss = 0;
+
+	if (!st)
+		return 0;
+
+	expected = st->received + st->lost;
+	if (expected)
+		loss = 100.0 * st->lost / expected;
+
+	return re_hprintf(pf, "%llu packets, %llu lost (%.3f%%),"
+			  " %llu reordered, %llu duplicate, %llu late,"
+			  " %llu corrupt",
+			  st->packets, st->lost, loss, st->reordered,
+			  st->duplicate, st->late, st->corrupt);
+}
+
+/* splits the one-way latency at the kernel timestamps */
+static void receiver_tstamp(struct receiver *recvr, const struct hdr *hdr,
+			    uint64_t now)
+{
+	struct tstampstat *st = recvr->tstat;
+	uint64_t ktx = tstamp_seq_get(recvr->ktx, hdr->seq);
+
+	++st->rx_stamped;
+
+	if (now > recvr->krx)
+		hist_record(&st->rx_stack, now - recvr->krx);
+
+	if (ktx) {
+		++st->matched;
+
+		if (recvr->krx > ktx)
+			hist_record(&st->path, recvr->krx - ktx);
 	}
-	re_fprintf(stderr, "--- protocol packet: ---\n");
-	re_fprintf(stderr, "session_cookie: 0x%08x\n", hdr->session_cookie);
-	re_fprintf(stderr, "alloc_id:       %u\n", hdr->alloc_id);
-	re_fprintf(stderr, "seq:            %u\n", hdr->seq);
-	re_fprintf(stderr, "payload_len:    %u\n", hdr->payload_len);
-	re_fprintf(stderr, "payload:        %w\n",
-		   hdr->payload, hdr->payload_len);
-	re_fprintf(stderr, "\n");
+
+	recvr->krx = 0;
 }
 
 int receiver_recv(struct receiver *recvr,
@@ -406,7 +972,7 @@ int receiver_recv(struct receiver *recvr,
 {
 	struct hdr hdr;
 	uint64_t now = tmr_jiffies();
-	size_t start, sz;
+	size_t start, sz, ofs;
 	int err;
 
 	if (!recvr || !mb)
@@ -420,6 +986,7 @@ int receiver_recv(struct receiver *recvr,
 	sz = mbuf_get_left(mb);
 
 	/* decode packet */
+	memset(&hdr, 0, sizeof(hdr));
 	err = protocol_decode(&hdr, mb);
 	if (err) {
 		if (err == EBADMSG) {
@@ -452,16 +1019,39 @@ int receiver_recv(struct receiver *recvr,
 		return EPROTO;
 	}
 
-	if (recvr->last_seq) {
-		if (hdr.seq <= recvr->last_seq) {
-			re_fprintf(stderr, "receiver[%u]: late or "
-				   " out-of-order packet from %J"
-				   " (last_seq=%u, seq=%u)\n",
-				   recvr->allocid, src,
-				   recvr->last_seq, hdr.seq);
+	ofs = payload_verify(hdr.payload, hdr.payload_len,
+			     payload_word(hdr.alloc_id, hdr.seq));
+	if (ofs < hdr.payload_len) {
+
+		/* report the first one only, the counter has the rest */
+		if (!recvr->corrupt++) {
+			re_fprintf(stderr, "[%u] corrupt payload from %J"
+				   " (seq=%u, first bad byte at %zu"
+				   " of %u)\n", recvr->allocid, src,
+				   hdr.seq, ofs, hdr.payload_len);
+			protocol_packet_dump(&hdr);
 		}
 	}
 
+	seqwin_update(&recvr->win, hdr.seq);
+
+	/* sender and receiver share the clock */
+	if (recvr->lat) {
+		uint64_t t = tperf_clock_ns();
+
+		if (t > hdr.ts) {
+			hist_record(recvr->lat, t - hdr.ts);
+
+			if (recvr->lat_srv)
+				hist_record(recvr->lat_srv, t - hdr.ts);
+			if (recvr->lat_own)
+				hist_record(recvr->lat_own, t - hdr.ts);
+		}
+
+		if (recvr->tstat && recvr->krx)
+			receiver_tstamp(recvr, &hdr, t);
+	}
+
 #if 0
 	protocol_packet_dump(&hdr);
 #endif
@@ -469,8 +1059,6 @@ int receiver_recv(struct receiver *recvr,
 	recvr->total_bytes   += sz;
 	recvr->total_packets += 1;
 
-	recvr->last_seq = hdr.seq;
-
 	return 0;
 }
 
@@ -513,7 +1101,7 @@ void dtls_recv_handler(struct mbuf *mb, void *arg) {
 	/* forward packet to TURN-client */
 	err = turnc_recv(alloc->turnc, &src, mb);
 	if (err) {
-		alloc->alloch(err, 0, NULL, NULL, NULL, alloc->arg);
+		allocation_error(alloc, err, 0, NULL);
 		return;
 	}
 
@@ -527,15 +1115,50 @@ void dtls_close_handler(int err, void *arg)
 {
 	struct allocation *alloc = arg;
 	re_fprintf(stderr, "dtls: close (%m)\n", err);
-	alloc->alloch(err ? err : ECONNRESET, 0, NULL, NULL, NULL, alloc->arg);
+	allocation_error(alloc, err ? err : ECONNRESET, 0, NULL);
 }
 
 void udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
 {
 	struct allocation *alloc = arg;
+
+	/* released, waiting for the socket to close */
+	if (!alloc->turnc)
+		return;
+
+	if (alloc->allocator->tstamp == TSTAMP_DOWNSTREAM) {
+		alloc->recv.krx = tstamp_rx_last(udp_sock_fd(alloc->us,
+							     sa_af(&alloc->srv)));
+	}
+
 	data_handler(alloc, src, mb);
 }
 
+/* from the batched reads, in place of the helpers of the socket */
+static void udp_batch_recv(const struct sa *src, struct mbuf *mb, void *arg)
+{
+	struct allocation *alloc = arg;
+	struct sa peer;
+
+	/* nobody is left to take the response to the release */
+	if (stunprobe_recv(alloc->probe, mb) && alloc->probe->releasing)
+		return;
+
+	/* released, waiting for the socket to close */
+	if (!alloc->turnc)
+		return;
+
+	/* only the TURN server talks to this socket */
+	if (!sa_cmp(src, &alloc->srv, SA_ALL))
+		return;
+
+	if (turnc_recv(alloc->turnc, &peer, mb))
+		return;
+
+	if (mbuf_get_left(mb))
+		data_handler(alloc, &peer, mb);
+}
+
 void tcp_estab_handler(void *arg)
 {
 	struct allocation *alloc = arg;
@@ -543,96 +1166,47 @@ void tcp_estab_handler(void *arg)
 
 	re_printf("allocation: TCP established\n");
 
-	alloc->mb = mem_deref(alloc->mb);
+	framer_reset(alloc->framer);
 
 	err = turnc_alloc(&alloc->turnc, NULL, IPPROTO_TCP, alloc->tc, 0,
 			  &alloc->srv, alloc->user, alloc->pass,
-			  TURN_DEFAULT_LIFETIME, turnc_handler, alloc);
+			  alloc_lifetime(alloc), turnc_handler, alloc);
 	if (err)
-		alloc->alloch(err, 0, NULL, NULL, NULL, alloc->arg);
+		allocation_error(alloc, err, 0, NULL);
 }
 
-void tcp_recv_handler(struct mbuf *mb_pkt, void *arg)
+static int tcp_frame_handler(struct mbuf *mb, void *arg)
 {
 	struct allocation *alloc = arg;
-	int err = 0;
-
-	//re_printf("TCP received\n");
-	/* re-assembly of fragments */
-	if (alloc->mb) {
-		size_t pos;
+	struct sa src;
+	int err;
 
-		pos = alloc->mb->pos;
+	(void)stunprobe_recv(alloc->probe, mb);
 
-		alloc->mb->pos = alloc->mb->end;
+	/* released, waiting for the connection to close */
+	if (!alloc->turnc)
+		return 0;
 
-		err = mbuf_write_mem(alloc->mb,
-				     mbuf_buf(mb_pkt), mbuf_get_left(mb_pkt));
-		if (err)
-			goto out;
+	/* forward packet to TURN client */
+	err = turnc_recv(alloc->turnc, &src, mb);
+	if (err)
+		return err;
 
-		alloc->mb->pos = pos;
-	}
-	else {
-		alloc->mb = mem_ref(mb_pkt);
+	if (mbuf_get_left(mb)) {
+		data_handler(alloc, &src, mb);
 	}
 
-	for (;;) {
-
-		size_t len, pos, end;
-		struct sa src;
-		uint16_t typ;
-
-		if (mbuf_get_left(alloc->mb) < 4)
-			break;
-
-		typ = ntohs(mbuf_read_u16(alloc->mb));
-		len = ntohs(mbuf_read_u16(alloc->mb));
-
-		if (typ < 0x4000)
-			len += STUN_HEADER_SIZE;
-		else if (typ < 0x8000)
-			len += 4;
-		else {
-			err = EBADMSG;
-			goto out;
-		}
-
-		alloc->mb->pos -= 4;
-
-		if (mbuf_get_left(alloc->mb) < len)
-			break;
-
-		pos = alloc->mb->pos;
-		end = alloc->mb->end;
-
-		alloc->mb->end = pos + len;
-
-		/* forward packet to TURN client */
-		err = turnc_recv(alloc->turnc, &src, alloc->mb);
-		if (err)
-			goto out;
-
-		if (mbuf_get_left(alloc->mb)) {
-			data_handler(alloc, &src, alloc->mb);
-		}
-
-		/* 4 byte alignment */
-		while (len & 0x03)
-			++len;
-
-		alloc->mb->pos = pos + len;
-		alloc->mb->end = end;
+	return 0;
+}
 
-		if (alloc->mb->pos >= alloc->mb->end) {
-			alloc->mb = mem_deref(alloc->mb);
-			break;
-		}
-	}
+void tcp_recv_handler(struct mbuf *mb_pkt, void *arg)
+{
+	struct allocation *alloc = arg;
+	int err;
 
- out:
+	err = framer_input(alloc->framer, mb_pkt, tcp_frame_handler, alloc);
 	if (err) {
-		alloc->alloch(err, 0, NULL, NULL, NULL, alloc->arg);
+		allocation_error(alloc, err, 0, NULL);
 	}
 }
 
@@ -640,7 +1214,7 @@ void tcp_close_handler(int err, void *arg)
 {
 	struct allocation *alloc = arg;
 
-	alloc->alloch(err ? err : ECONNRESET, 0, NULL, NULL, NULL, alloc->arg);
+	allocation_error(alloc, err ? err : ECONNRESET, 0, NULL);
 }
 
 int start(struct allocation *alloc)
@@ -666,6 +1240,10 @@ int start(struct allocation *alloc)
 
 		udp_sockbuf_set(alloc->us, 524288);
 
+		if (alloc->allocator->tstamp == TSTAMP_DOWNSTREAM)
+			(void)tstamp_rx_enable(udp_sock_fd(alloc->us,
+							   sa_af(&alloc->srv)));
+
 		if (alloc->secure) {
 
 			/* note: re-using UDP socket for DTLS-traffic */
@@ -689,10 +1267,16 @@ int start(struct allocation *alloc)
 			}
 		}
 		else {
+			/* before the client, that sends the first request */
+			err = stunprobe_attach_udp(alloc->probe, alloc->us,
+						   PROBE_UDP_LAYER);
+			if (err)
+				goto out;
+
 			err = turnc_alloc(&alloc->turnc, NULL, IPPROTO_UDP,
 					  alloc->us, TURN_LAYER, &alloc->srv,
 					  alloc->user, alloc->pass,
-					  TURN_DEFAULT_LIFETIME,
+					  alloc_lifetime(alloc),
 					  turnc_handler, alloc);
 			if (err) {
 				re_fprintf(stderr, "allocation: failed to"
@@ -700,15 +1284,42 @@ int start(struct allocation *alloc)
 					   " (%m)\n", err);
 				goto out;
 			}
+
+			if (alloc->allocator->rxbatch.n) {
+				err = rxbatch_attach(&alloc->rxs,
+						     &alloc->allocator->rxbatch,
+						     alloc->us,
+						     sa_af(&alloc->srv),
+						     udp_batch_recv, alloc);
+				if (err)
+					goto out;
+			}
 		}
 		break;
 
 	case IPPROTO_TCP:
+		if (!alloc->framer) {
+			err = framer_alloc(&alloc->framer);
+			if (err)
+				break;
+		}
+
 		err = tcp_connect(&alloc->tc, &alloc->srv, tcp_estab_handler,
 				  tcp_recv_handler, tcp_close_handler, alloc);
 		if (err)
 			break;
 
+		err = stunprobe_attach_tcp(alloc->probe, alloc->tc,
+					   PROBE_TCP_LAYER);
+		if (err)
+			break;
+
+		err = tcpbatch_attach(&alloc->batch,
+				      &alloc->allocator->batcher, alloc->tc,
+				      BATCH_TCP_LAYER);
+		if (err)
+			break;
+
 		if (alloc->secure) {
 			err = tls_start_tcp(&alloc->tlsc, alloc->tls, alloc->tc, 0);
 			if (err)
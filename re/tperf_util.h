@@ -4,61 +4,194 @@
 #include <stdint.h>
 #include <re.h>
 
-#define HDR_SIZE 20
-#define PATTERN 0xa5
+#include "tperf_proto.h"
+#include "tperf_pace.h"
+#include "tperf_framer.h"
+#include "tperf_hist.h"
+#include "tperf_probe.h"
+#include "tperf_batch.h"
+#include "tperf_tstamp.h"
+#include "tperf_slab.h"
+#include "tperf_rxbatch.h"
+#include "tperf_gso.h"
 
-struct hdr {
-	uint32_t session_cookie;
-	uint32_t alloc_id;
-	uint32_t seq;
-	uint32_t payload_len;
+/* number of preformatted packets per sender */
+#define SENDER_RING_SIZE 16
 
-	uint8_t payload[256];
-};
+/* size of the receiver sequence window [packets], power of two */
+#define SEQWIN_SIZE 1024
 
-extern const uint32_t proto_magic;
+struct traffic;
+struct srvstat;
 
+/*
+ * Called once when the allocation is ready, or once when its setup
+ * failed; after that on every error of an allocation that was ready,
+ * with the relay it had.
+ */
 typedef void (allocation_h)(int err, uint16_t scode, const char *reason,
 			    const struct sa *srv,  const struct sa *relay,
 			    void *arg);
 
+/*
+ * Senders come from a slab of their allocator. The fields a send
+ * touches come first, so one packet costs one or two cache lines of
+ * the sender. A send works on one sender at a time, so these stay
+ * together; only the deadline, which the heap compares across all
+ * senders, sits apart in the pacer heap.
+ */
+struct sender {
+	struct allocation *alloc;  /* pointer */
+	uint64_t ts;               /* next deadline [ns] */
+	uint64_t gap_ns;           /* after the packet just sent [ns] */
+	uint64_t ptime_ns;         /* packet interval [ns], mean with traffic */
+	unsigned heap_pos;         /* 1-based, 0 if not paced */
+	uint32_t alloc_id;
+	uint32_t seq;
+	unsigned ring_ix;
+	size_t psize;              /* largest packet with traffic */
+	const struct traffic *traffic;  /* optional packet sequence */
+	size_t traffic_ix;
+	uint64_t total_bytes;
+	uint64_t total_packets;
+
+	struct mbuf *ring[SENDER_RING_SIZE];  /* preformatted packets */
+
+	uint32_t session_cookie;
+	unsigned bitrate;          /* target bitrate [bit/s] */
+	uint64_t ts_start;
+	uint64_t ts_stop;
+};
+
+/*
+ * Sliding sequence window. One bit per sequence number in the last
+ * SEQWIN_SIZE packets; a hole that slides out of the window is counted
+ * as lost. A packet that arrives after its hole slid out is counted as
+ * late (and stays counted as lost).
+ */
+struct seqwin {
+	uint64_t bits[SEQWIN_SIZE / 64];
+	uint32_t base;             /* oldest sequence number accounted */
+	uint32_t max_seq;          /* highest sequence number seen */
+	bool started;
+
+	uint64_t received;         /* unique packets */
+	uint64_t lost;             /* holes that slid out of the window */
+	uint64_t reordered;        /* packets that filled a hole */
+	uint64_t duplicate;
+	uint64_t late;
+};
+
+struct rxstat {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t received;
+	uint64_t lost;
+	uint64_t reordered;
+	uint64_t duplicate;
+	uint64_t late;
+	uint64_t corrupt;
+};
+
+/*
+ * Difference of two samples of a counter that may go down. The lost
+ * count of rxstat includes the pending holes, and a late packet that
+ * fills one takes it back.
+ */
+static inline uint64_t rxstat_delta(uint64_t cur, uint64_t prev)
+{
+	return cur > prev ? cur - prev : 0;
+}
+
+/*
+ * Counters owned by one allocator, and so by one thread. The owner
+ * updates them with relaxed atomic stores; other threads read them
+ * with COUNTER_GET and never take a lock.
+ */
+struct counters {
+	uint64_t tx_packets;
+	uint64_t tx_bytes;
+	uint64_t allocations;
+	uint64_t failed;
+	struct rxstat rx;          /* published by allocator_publish() */
+};
+
+#define COUNTER_ADD(c, v) \
+	__atomic_store_n(&(c), (c) + (v), __ATOMIC_RELAXED)
+#define COUNTER_SET(c, v) \
+	__atomic_store_n(&(c), (v), __ATOMIC_RELAXED)
+#define COUNTER_GET(c) \
+	__atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+/*
+ * Shared peer-side sockets. Allocations are spread over the pool and
+ * received packets are demultiplexed by the alloc_id in the header.
+ */
+struct peerpool {
+	struct udp_sock **usv;
+	struct sa *laddrv;
+	struct tstamp_tx **tstxv;  /* optional kernel TX timestamps */
+	unsigned n;
+	struct allocator *allocator;
+
+	uint64_t rx_packets;
+	uint64_t rx_unknown;       /* unknown allocation-ID */
+	uint64_t rx_other;         /* not a Turnperf packet, i.e. PING */
+};
+
 struct allocator {
 	struct list allocl;
+	struct hash *ht;           /* allocations by allocation-ID */
+	struct peerpool *pool;     /* optional shared peer sockets */
 	struct tmr tmr;
 	struct tmr tmr_ui;
 	unsigned num_allocations;
+	unsigned ix_base;          /* first allocation-ID of this allocator */
 	unsigned num_sent;
 	unsigned num_received;
+	unsigned num_failed;       /* setups given up on, with a window */
+
+	unsigned setup_window;     /* setups in flight at most, 0: serial */
+	unsigned setup_rate;       /* setups started per second, 0: no pace */
+	unsigned inflight_max;
+	uint64_t setup_t0;         /* start of the setup [ns] */
+	unsigned setup_sent0;      /* num_sent at setup_t0 */
 
 	bool server_info;
 	bool server_auth;
 	char server_software[256];
 	struct sa mapped_addr;
 	uint32_t lifetime;
+	uint32_t lifetime_req;     /* requested [s], 0 for the default */
 
 	uint64_t tick, tock;
 	uint32_t session_cookie;
 	time_t traf_start_time;
 
-	struct tmr tmr_pace;
-};
-
-struct sender {
-	struct allocation *alloc;  /* pointer */
-	uint32_t session_cookie;
-	uint32_t alloc_id;
-	uint32_t seq;
-
-	unsigned bitrate;          /* target bitrate [bit/s] */
-	unsigned ptime;
-	size_t psize;
+	struct pacer pacer;
+	struct slab sendslab;      /* struct sender */
+	struct tmr tmr_stats;
+	struct hist lat;           /* one-way latency [ns] */
+	struct setupstat setup;
+	struct batcher batcher;    /* TURN-over-TCP writes */
+	struct rxbatch rxbatch;    /* TURN UDP reads */
+	struct gso gso;            /* peer-side UDP sends */
+	enum tstamp_mode tstamp;   /* kernel timestamps */
+	struct tstampstat tstat;
+	struct srvstat *srvstatv;  /* per TURN server */
+	unsigned srvc;
 
-	uint64_t ts;               /* running timestamp */
-	uint64_t ts_start;
-	uint64_t ts_stop;
+	struct counters ctr;
+};
 
-	uint64_t total_bytes;
-	uint64_t total_packets;
+/* traffic counters of one allocation, for per-interval rates */
+struct trafsnap {
+	uint64_t tx_bytes;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t rx_packets;
+	uint64_t received;
+	uint64_t lost;
 };
 
 struct receiver {
@@ -68,11 +201,19 @@ struct receiver {
 	uint64_t ts_last;
 	uint64_t total_bytes;
 	uint64_t total_packets;
-	uint32_t last_seq;
+	uint64_t corrupt;          /* payload does not match the header */
+	struct hist *lat;          /* optional, shared per allocator */
+	struct hist *lat_srv;      /* optional, per TURN server */
+	struct hist *lat_own;      /* optional, this allocation only */
+	struct tstampstat *tstat;  /* optional, shared per allocator */
+	const struct tstamp_seq *ktx;  /* kernel TX times, by sequence */
+	uint64_t krx;              /* kernel RX time of this packet [ns] */
+	struct seqwin win;
 };
 
 struct allocation {
 	struct le le;
+	struct le he;                 /* allocator hash-table entry */
 	struct allocator *allocator;  /* pointer to container */
 	struct udp_sock *us;
 	struct turnc *turnc;
@@ -86,17 +227,27 @@ struct allocation {
 	struct sa peer;
 	struct tcp_conn *tc;
 	struct tls_conn *tlsc;
-	struct tls *tls;
+	struct tls *tls;              /* pointer, main holds it for all loops */
 	struct dtls_sock *dtls_sock;
-	struct mbuf *mb;              /* TCP re-assembly buffer */
+	struct framer *framer;        /* TCP re-assembly */
+	struct stunprobe *probe;      /* STUN transaction timing */
+	struct tcpbatch *batch;       /* TCP write batching */
+	struct rxsock *rxs;           /* batched UDP reads */
 	struct sender *sender;
+	struct srvstat *srvstat;      /* optional, of the TURN server */
 	struct receiver recv;
 	struct udp_sock *us_tx;
 	struct sa laddr_tx;
+	struct tstamp_tx *tstx;       /* kernel TX timestamps of us_tx */
+	struct tstamp_seq *tseq;
+	uint64_t peer_rx;             /* packets seen on the peer side */
+	struct trafsnap snap;         /* at the last results record */
 	struct tmr tmr_ping;
 	double atime;                 /* ms */
 	unsigned ix;
 	bool ok;
+	bool ready;                   /* the permission or channel is up */
+	bool failed;                  /* the setup failure was reported */
 	bool turn_ind;
 	unsigned redirc;
 	int err;
@@ -104,15 +255,38 @@ struct allocation {
 	void *arg;
 };
 
+uint64_t tperf_clock_ns(void);
+uint64_t tperf_cpu_ns(void);
 int dns_init(struct dnsc **dnsc);
 const char *protocol_name(int proto, bool secure);
 void allocator_stop_senders(struct allocator *allocator);
+void allocator_close(struct allocator *allocator);
+void sender_free(struct sender *snd);
+void seqwin_update(struct seqwin *win, uint32_t seq);
+uint64_t seqwin_pending(const struct seqwin *win);
+int receiver_recv(struct receiver *recvr,
+		  const struct sa *src, struct mbuf *mb);
+void allocator_rxstat(const struct allocator *allocator, struct rxstat *st);
+int rxstat_print(struct re_printf *pf, const struct rxstat *st);
+void allocator_publish(struct allocator *allocator);
+void counters_add(struct counters *sum, const struct counters *ctr);
 int start(struct allocation *alloc);
-int allocation_create(struct allocator *allocator, unsigned ix, int proto,
+int peerpool_alloc(struct peerpool **poolp, struct allocator *allocator,
+		   unsigned n, int af);
+int allocator_init_table(struct allocator *allocator);
+struct allocation *allocator_find(const struct allocator *allocator,
+				  uint32_t alloc_id);
+struct tstamp_seq *allocator_tstamp_seq(uint32_t alloc_id, void *arg);
+int proc_fd_count(void);
+size_t proc_rss(void);
+int allocation_create(struct allocation **allocp,
+		      struct allocator *allocator, unsigned ix, int proto,
 		      const struct sa *srv,
 		      const char *username, const char *password,
 		      struct tls *tls, bool turn_ind,
+		      struct srvstat *srvstat,
 		      allocation_h *alloch, void *arg);
+void allocation_release(struct allocation *alloc);
 
 void destructor(void *arg);
 #endif
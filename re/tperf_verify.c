@@ -0,0 +1,189 @@
+#include "tperf_verify.h"
+#include "tperf_proto.h"
+
+#include <errno.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+/* returns the offset of the first bad byte, or n if all bytes match */
+typedef size_t (verify_h)(const uint8_t *p, size_t n, uint32_t word);
+
+static size_t verify_tail(const uint8_t *p, size_t i, size_t n,
+			  uint32_t word)
+{
+	for (; i < n; i++) {
+		if (p[i] != (uint8_t)(word >> (8 * (i & 3))))
+			return i;
+	}
+
+	return n;
+}
+
+static size_t verify_scalar(const uint8_t *p, size_t n, uint32_t word)
+{
+	const uint64_t w = (uint64_t)word << 32 | word;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		uint64_t v;
+
+		memcpy(&v, p + i, 8);
+		if (v != w)
+			break;
+	}
+
+	return verify_tail(p, i, n, word);
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse2")))
+static size_t verify_sse2(const uint8_t *p, size_t n, uint32_t word)
+{
+	const __m128i w = _mm_set1_epi32((int)word);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, w)) != 0xffff)
+			break;
+	}
+
+	return verify_tail(p, i, n, word);
+}
+
+__attribute__((target("avx2")))
+static size_t verify_avx2(const uint8_t *p, size_t n, uint32_t word)
+{
+	const __m256i w = _mm256_set1_epi32((int)word);
+	size_t i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+		__m256i x = _mm256_or_si256(_mm256_xor_si256(a, w),
+					    _mm256_xor_si256(b, w));
+
+		if (!_mm256_testz_si256(x, x))
+			break;
+	}
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i x = _mm256_xor_si256(v, w);
+
+		if (!_mm256_testz_si256(x, x))
+			break;
+	}
+
+	return verify_tail(p, i, n, word);
+}
+#endif
+
+static verify_h *verifyh;
+static const char *verify_name;
+
+static void verify_select(void)
+{
+	verifyh     = verify_scalar;
+	verify_name = "scalar";
+
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		verifyh     = verify_avx2;
+		verify_name = "avx2";
+	}
+	else if (__builtin_cpu_supports("sse2")) {
+		verifyh     = verify_sse2;
+		verify_name = "sse2";
+	}
+#endif
+}
+
+uint32_t payload_word(uint32_t alloc_id, uint32_t seq)
+{
+	uint32_t h = seq * 0x9e3779b1u ^ alloc_id * 0x85ebca6bu;
+
+	h ^= h >> 15;
+
+	return h ^ PATTERN * 0x01010101u;
+}
+
+/* the word is laid out little-endian, independent of the host */
+void payload_fill(uint8_t *p, size_t n, uint32_t word)
+{
+	uint8_t b[8];
+	size_t i;
+
+	for (i = 0; i < 8; i++)
+		b[i] = (uint8_t)(word >> (8 * (i & 3)));
+
+	for (i = 0; i + 8 <= n; i += 8)
+		memcpy(p + i, b, 8);
+
+	for (; i < n; i++)
+		p[i] = b[i & 3];
+}
+
+size_t payload_verify(const uint8_t *p, size_t n, uint32_t word)
+{
+	/* main() selects the kernel before any worker thread starts */
+	if (!verifyh)
+		verify_select();
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+	return verify_tail(p, 0, n, word);
+#else
+	return verifyh(p, n, word);
+#endif
+}
+
+const char *payload_verify_name(void)
+{
+	if (!verifyh)
+		verify_select();
+
+	return verify_name;
+}
+
+/*
+ * Selects a kernel by name, for the tests and the benchmark; ENOTSUP
+ * if this CPU does not have it. Not while workers are running.
+ */
+int payload_verify_use(const char *name)
+{
+	if (!name)
+		return EINVAL;
+
+	if (!strcmp(name, "scalar")) {
+		verifyh     = verify_scalar;
+		verify_name = "scalar";
+	}
+#ifdef HAVE_X86
+	else if (!strcmp(name, "sse2")) {
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("sse2"))
+			return ENOTSUP;
+		verifyh     = verify_sse2;
+		verify_name = "sse2";
+	}
+	else if (!strcmp(name, "avx2")) {
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("avx2"))
+			return ENOTSUP;
+		verifyh     = verify_avx2;
+		verify_name = "avx2";
+	}
+#endif
+	else {
+		return ENOENT;
+	}
+
+	return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef MY_TPERF_VERIFY_H_INCLUIDO
+#define MY_TPERF_VERIFY_H_INCLUIDO
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Payload pattern. Every packet carries a 4-byte word, derived from
+ * PATTERN, the allocation-ID and the sequence number, repeated over the
+ * whole payload. A payload that was corrupted, or that belongs to an
+ * older packet or another allocation, does not match its header.
+ */
+uint32_t    payload_word(uint32_t alloc_id, uint32_t seq);
+void        payload_fill(uint8_t *p, size_t n, uint32_t word);
+size_t      payload_verify(const uint8_t *p, size_t n, uint32_t word);
+const char *payload_verify_name(void);
+int         payload_verify_use(const char *name);
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * Microbenchmark for the payload check. One payload is checked over
+ * and over with every kernel this CPU has, as the receiver does for
+ * each packet.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <re.h>
+
+#include "tperf_verify.h"
+
+static struct {
+	size_t size;
+	unsigned rounds;
+} conf = {
+	.size   = 1400,
+	.rounds = 2000000,
+};
+
+static const char *kernelv[] = {"scalar", "sse2", "avx2"};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* false if a check did not pass the whole payload */
+static bool run(const uint8_t *p, uint32_t word, double *secs)
+{
+	uint64_t t0 = now_ns();
+	size_t sum = 0;
+	unsigned i;
+
+	for (i = 0; i < conf.rounds; i++)
+		sum += payload_verify(p, conf.size, word);
+
+	*secs = (now_ns() - t0) / 1e9;
+
+	return sum == (size_t)conf.rounds * conf.size;
+}
+
+static void usage(void)
+{
+	(void)re_fprintf(stderr,
+			 "usage: tperf_verifybench [options]\n"
+			 "\t-n <bytes>    Payload size (%zu)\n"
+			 "\t-r <rounds>   Checks per kernel (%u)\n",
+			 conf.size, conf.rounds);
+}
+
+int main(int argc, char *argv[])
+{
+	const uint32_t word = payload_word(1, 1);
+	uint8_t *p;
+	size_t k;
+	int err = 0;
+
+	for (;;) {
+		const int c = getopt(argc, argv, "n:r:h");
+		if (0 > c)
+			break;
+
+		switch (c) {
+
+		case 'n':
+			conf.size = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'r':
+			conf.rounds = strtoul(optarg, NULL, 10);
+			break;
+
+		default:
+			usage();
+			return EINVAL;
+		}
+	}
+
+	if (!conf.size || !conf.rounds) {
+		usage();
+		return EINVAL;
+	}
+
+	p = malloc(conf.size);
+	if (!p)
+		return ENOMEM;
+
+	payload_fill(p, conf.size, word);
+
+	for (k = 0; k < ARRAY_SIZE(kernelv); k++) {
+
+		double secs;
+		bool ok;
+
+		if (payload_verify_use(kernelv[k]))
+			continue;
+
+		ok = run(p, word, &secs);
+
+		re_printf("%-8s %8.1f GB/s  %7.1f ns/payload  %s\n",
+			  kernelv[k], conf.size * (double)conf.rounds
+			  / secs / 1e9, secs * 1e9 / conf.rounds,
+			  ok ? "ok" : "MISMATCH");
+		if (!ok)
+			err = EPROTO;
+	}
+
+	free(p);
+
+	return err;
+}
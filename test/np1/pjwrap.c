@@ -84,6 +84,12 @@ pj_status_t handle_events(app_t* _app, unsigned max_msec, unsigned *p_count)
 
     max_timeout.msec = max_msec;
 
+    /* Back from the last poll; late if it was the timeout that woke us.
+     * The run time covers the timers only, ioqueue callbacks run inside
+     * the poll below and count as part of the wait.
+     */
+    looplag_begin(&_app->lag);
+
     /* Poll the timer to run it and also to retrieve the earliest entry. */
     timeout.sec = timeout.msec = 0;
     c = pj_timer_heap_poll( _app->ice_cfg.stun_cfg.timer_heap, &timeout );
@@ -102,6 +108,9 @@ pj_status_t handle_events(app_t* _app, unsigned max_msec, unsigned *p_count)
     if (PJ_TIME_VAL_GT(timeout, max_timeout))
 	timeout = max_timeout;
 
+    looplag_end(&_app->lag);
+    looplag_arm_in(&_app->lag, PJ_TIME_VAL_MSEC(timeout) * 1000000ULL);
+
     /* Poll ioqueue. 
      * Repeat polling the ioqueue while we have immediate events, because
      * timer heap may process more than one events, so if we only process
@@ -148,6 +157,8 @@ int app_worker_thread(void *arg)
 		handle_events(app, 500, NULL);
     }
 
+    app_show_loop(app);
+
     return 0;
 }
 
@@ -181,6 +192,8 @@ pj_status_t app_init(app_t* _app)
 		pj_log_set_log_func(&static_log_func);
     }
 
+    looplag_reset(&_app->lag);
+
     /* Initialize the libraries before anything else */
     CHECK( pj_init() );
     CHECK( pjlib_util_init() );
@@ -479,6 +492,16 @@ int encode_session(app_t* _app, char buffer[], unsigned maxlen) {
 }
 
 
+/* Wakeup lag and run time of the worker thread, up to now */
+void app_show_loop(app_t* _app) {
+   char buffer[256];
+
+   if (looplag_snprint(buffer, sizeof(buffer), &_app->lag) < 0)
+      return;
+
+   printf("Event loop         : %s\n", buffer);
+}
+
 /* Show information contained in the ICE stream transport. This is */
 void app_show_ice(app_t* _app) {
    static char buffer[1000];
@@ -511,6 +534,7 @@ void app_show_ice(app_t* _app) {
 	pj_ice_strans_get_running_comp_cnt(_app->icest));
 	printf("Role               : %s\n",
 	pj_ice_strans_get_role(_app->icest)==PJ_ICE_SESS_ROLE_CONTROLLED ?  "controlled" : "controlling");
+	app_show_loop(_app);
 	
 	len = encode_session(_app, buffer, sizeof(buffer));
 	if (len < 0) {
@@ -5,6 +5,7 @@
 #include <pjlib.h>
 #include <pjlib-util.h>
 #include <pjnath.h>
+#include <looplag.h>
 
 
 /* For this demo app, configure longer STUN keep-alive time
@@ -44,6 +45,9 @@ typedef struct
 	pj_ice_strans	*icest;
 	FILE		*log_fhnd;
 
+	/* Lateness of the worker thread's poll, see handle_events() */
+	struct looplag	 lag;
+
 	/* Variables to store parsed remote ICE info */
 	struct rem_info {
 		char		 ufrag[80];
@@ -60,6 +64,7 @@ typedef struct
 pj_status_t app_init(app_t* _app);
 void app_start(app_t* _app, char _role);
 void app_show_ice(app_t* _app);
+void app_show_loop(app_t* _app);
 void app_start_nego(app_t* _app);
 void app_stop(app_t* _app);
 void err_exit(app_t* _app, const char *title, pj_status_t status);